@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>      // printf
+#include <stdlib.h>     // malloc, free, qsort
+#include <string.h>     // memset, strcmp
+#include <unistd.h>     // pipe, close
+#include <time.h>       // clock_gettime
+#include <pthread.h>
+#include <sys/socket.h> // socketpair
+
+#include "protocol.h"
+
+/*
+ * Framing layer microbenchmark.
+ *
+ * For every transport (socketpair, pipe), API variant and payload size a
+ * writer thread pushes a fixed number of TLVs while the main thread
+ * receives them. One run gives ns/frame for the whole transfer; the run
+ * is repeated and percentiles over the runs are reported, so a single
+ * noisy run does not decide the result.
+ *
+ *   bench_protocol [--format text|csv|json] [--runs N] [--frames N] [--quick]
+ */
+
+#define BENCH_BYTES_PER_RUN ( 32u * 1024 * 1024 )  /* volume of one run */
+#define BENCH_MIN_FRAMES    256
+#define BENCH_MAX_RUNS      64
+
+typedef enum {
+    FMT_TEXT = 0,
+    FMT_CSV,
+    FMT_JSON
+} bench_format_t;
+
+typedef enum {
+    T_SOCKETPAIR = 0,
+    T_PIPE
+} bench_transport_t;
+
+/* one way of sending and receiving a TLV */
+typedef struct {
+    const char * name;
+    int  ( * send )( int fd, const uint8_t * payload, uint32_t len, size_t frames );
+    int  ( * recv )( int fd, size_t frames );
+    uint32_t max_len;                   /* largest payload the variant handles */
+} bench_variant_t;
+
+typedef struct {
+    const bench_variant_t * variant;
+    int       fd;
+    const uint8_t * payload;
+    uint32_t  len;
+    size_t    frames;
+    int       result;
+} bench_writer_t;
+
+static uint64_t now_ns( void ) {
+
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t ) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                  Variants                                  */
+/* -------------------------------------------------------------------------- */
+
+static int send_single( int fd, const uint8_t * payload, uint32_t len, size_t frames ) {
+
+    for ( size_t i = 0; i < frames; ++i ) {
+        if ( send_tlv( fd, TLV_MESSAGE, payload, ( uint16_t ) len ) < 0 ){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int send_vec( int fd, const uint8_t * payload, uint32_t len, size_t frames ) {
+
+    tlv_vec_t tlv = { TLV_MESSAGE, payload, len };
+
+    for ( size_t i = 0; i < frames; ++i ) {
+        if ( send_tlvv( fd, &tlv, 1 ) < 0 ){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int send_batch( int fd, const uint8_t * payload, uint32_t len, size_t frames ) {
+
+    tlv_batch_t batch;
+
+    tlv_batch_begin( &batch, fd );
+    for ( size_t i = 0; i < frames; ++i ) {
+        tlv_batch_add( &batch, TLV_MESSAGE, payload, len );     // flushes itself when full
+    }
+    return tlv_batch_flush( &batch );
+}
+
+static int send_frame( int fd, const uint8_t * payload, uint32_t len, size_t frames ) {
+
+    /* command with two fields, payload split between them */
+    tlv_vec_t fields[] = {
+        { TLV_LOGIN,   payload,           len / 2 },
+        { TLV_MESSAGE, payload + len / 2, len - len / 2 }
+    };
+
+    for ( size_t i = 0; i < frames; ++i ) {
+        if ( send_cmd_frame( fd, CMD_SEND_TO_USER, ( uint32_t ) i + 1, fields, 2 ) < 0 ){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int recv_malloc( int fd, size_t frames ) {
+
+    for ( size_t i = 0; i < frames; ++i ) {
+        uint16_t type, len;
+        void * data = NULL;
+        if ( recv_tlv( fd, &type, &data, &len ) < 0 ){
+            return -1;
+        }
+        free( data );
+    }
+    return 0;
+}
+
+static int recv_into( int fd, size_t frames ) {
+
+    static uint8_t buf[ UINT16_MAX ];
+
+    for ( size_t i = 0; i < frames; ++i ) {
+        uint16_t type, len;
+        if ( recv_tlv_into( fd, &type, buf, sizeof( buf ), &len ) < 0 ){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int recv_reader( int fd, size_t frames ) {
+
+    tlv_reader_t reader;
+    tlv_view_t view;
+    int rc = 0;
+
+    if ( tlv_reader_init( &reader, fd ) < 0 ){
+        return -1;
+    }
+
+    for ( size_t i = 0; i < frames && rc == 0; ++i ) {
+        rc = tlv_reader_next( &reader, &view );
+    }
+
+    tlv_reader_free( &reader );
+    return rc;
+}
+
+static int recv_frame( int fd, size_t frames ) {
+
+    tlv_reader_t reader;
+    tlv_view_t view;
+    cmd_frame_t frame;
+    int rc = 0;
+
+    if ( tlv_reader_init( &reader, fd ) < 0 ){
+        return -1;
+    }
+
+    for ( size_t i = 0; i < frames && rc == 0; ++i ) {
+        rc = tlv_reader_next( &reader, &view );
+        if ( rc == 0 ){
+            rc = cmd_frame_parse( view.data, view.len, &frame );
+        }
+    }
+
+    tlv_reader_free( &reader );
+    return rc;
+}
+
+static const bench_variant_t variants[] = {
+    { "send_tlv/recv_tlv",      send_single, recv_malloc, UINT16_MAX },
+    { "send_tlv/recv_tlv_into", send_single, recv_into,   UINT16_MAX },
+    { "send_tlvv/reader",       send_vec,    recv_reader, UINT32_MAX },
+    { "batch/reader",           send_batch,  recv_reader, UINT32_MAX },
+    { "cmd_frame/parse",        send_frame,  recv_frame,  UINT16_MAX - 64 }
+};
+
+static const uint32_t sizes[] = { 0, 16, 64, 256, 1024, 4096, 16384, 65535, 65536 };
+
+/* -------------------------------------------------------------------------- */
+/*                                   Runner                                   */
+/* -------------------------------------------------------------------------- */
+
+static void * writer_thread( void * arg ) {
+
+    bench_writer_t * w = arg;
+
+    w->result = w->variant->send( w->fd, w->payload, w->len, w->frames );
+    return NULL;
+}
+
+static int open_transport( bench_transport_t t, int fds[2] ) {
+
+    if ( t == T_PIPE ) {
+        int p[2];
+        if ( pipe( p ) < 0 ){
+            return -1;
+        }
+        fds[0] = p[1];              // write end
+        fds[1] = p[0];              // read end
+        return 0;
+    }
+
+    return socketpair( AF_UNIX, SOCK_STREAM, 0, fds );
+}
+
+/*
+ * @brief  One timed transfer of `frames` TLVs.
+ *
+ * @return int64_t Duration in ns, -1 on error.
+ */
+static int64_t bench_run(
+    bench_transport_t transport,
+    const bench_variant_t * v,
+    const uint8_t * payload,
+    uint32_t len,
+    size_t frames
+) {
+    int fds[2];
+    pthread_t tid;
+
+    if ( open_transport( transport, fds ) < 0 ){
+        return -1;
+    }
+
+    bench_writer_t w = { v, fds[0], payload, len, frames, 0 };
+
+    uint64_t start = now_ns();
+    pthread_create( &tid, NULL, writer_thread, &w );
+    int rc = v->recv( fds[1], frames );
+    pthread_join( tid, NULL );
+    uint64_t end = now_ns();
+
+    close( fds[0] );
+    close( fds[1] );
+
+    return ( rc < 0 || w.result < 0 ) ? -1 : ( int64_t ) ( end - start );
+}
+
+static int cmp_double( const void * a, const void * b ) {
+
+    double x = *( const double * ) a;
+    double y = *( const double * ) b;
+    return ( x > y ) - ( x < y );
+}
+
+/* nearest rank percentile of a sorted array */
+static double percentile( const double * v, int n, double p ) {
+
+    int rank = ( int ) ( p / 100.0 * n + 0.5 );
+    if ( rank < 1 ){
+        rank = 1;
+    }
+    if ( rank > n ){
+        rank = n;
+    }
+    return v[ rank - 1 ];
+}
+
+static void usage( const char * prog ) {
+
+    fprintf( stderr,
+        "usage: %s [--format text|csv|json] [--runs N] [--frames N] [--quick]\n",
+        prog );
+}
+
+int main( int argc, char ** argv ) {
+
+    bench_format_t fmt = FMT_TEXT;
+    int runs = 9;
+    size_t max_frames = 100000;
+
+    for ( int i = 1; i < argc; ++i ) {
+        if ( strcmp( argv[i], "--format" ) == 0 && i + 1 < argc ) {
+            i++;
+            if ( strcmp( argv[i], "csv" ) == 0 ){
+                fmt = FMT_CSV;
+            } else if ( strcmp( argv[i], "json" ) == 0 ){
+                fmt = FMT_JSON;
+            } else if ( strcmp( argv[i], "text" ) != 0 ) {
+                usage( argv[0] );
+                return 1;
+            }
+        } else if ( strcmp( argv[i], "--runs" ) == 0 && i + 1 < argc ) {
+            runs = atoi( argv[++i] );
+        } else if ( strcmp( argv[i], "--frames" ) == 0 && i + 1 < argc ) {
+            max_frames = ( size_t ) atol( argv[++i] );
+        } else if ( strcmp( argv[i], "--quick" ) == 0 ) {
+            runs = 3;
+            max_frames = 5000;
+        } else {
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if ( runs < 1 || runs > BENCH_MAX_RUNS || max_frames < 1 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    uint8_t * payload = malloc( sizes[ sizeof( sizes ) / sizeof( sizes[0] ) - 1 ] );
+    if ( payload == NULL ){
+        return 1;
+    }
+    for ( uint32_t i = 0; i < sizes[ sizeof( sizes ) / sizeof( sizes[0] ) - 1 ]; ++i ) {
+        payload[i] = ( uint8_t ) ( 'a' + i % 26 );
+    }
+
+    const char * transports[] = { "socketpair", "pipe" };
+    int first = 1;
+
+    if ( fmt == FMT_CSV ){
+        printf( "transport,variant,payload,frames,runs,ns_per_frame_p50,ns_per_frame_p90,"
+                "ns_per_frame_p99,ns_per_frame_min,frames_per_sec_p50,mib_per_sec_p50\n" );
+    } else if ( fmt == FMT_JSON ){
+        printf( "[\n" );
+    } else {
+        printf( "%-10s %-24s %8s %8s %10s %10s %10s %12s %10s\n",
+                "transport", "variant", "payload", "frames",
+                "p50 ns", "p90 ns", "p99 ns", "frames/s", "MiB/s" );
+    }
+
+    for ( int t = 0; t < 2; ++t ) {
+        for ( size_t vi = 0; vi < sizeof( variants ) / sizeof( variants[0] ); ++vi ) {
+            for ( size_t si = 0; si < sizeof( sizes ) / sizeof( sizes[0] ); ++si ) {
+
+                const bench_variant_t * v = &variants[ vi ];
+                uint32_t len = sizes[ si ];
+                double ns[ BENCH_MAX_RUNS ];
+
+                if ( len > v->max_len ){
+                    continue;
+                }
+
+                /* same data volume per run for every size */
+                size_t frames = BENCH_BYTES_PER_RUN / ( len + TLV_HEADER_LENGTH );
+                if ( frames > max_frames ){
+                    frames = max_frames;
+                }
+                if ( frames < BENCH_MIN_FRAMES ){
+                    frames = BENCH_MIN_FRAMES;
+                }
+
+                /* warm up (page faults, allocator) */
+                if ( bench_run( t, v, payload, len, frames / 10 + 1 ) < 0 ) {
+                    fprintf( stderr, "%s %s %u: transfer failed\n", transports[t], v->name, len );
+                    continue;
+                }
+
+                int ok = 1;
+                for ( int r = 0; r < runs && ok; ++r ) {
+                    int64_t d = bench_run( t, v, payload, len, frames );
+                    ok = d >= 0;
+                    ns[r] = ( double ) d / frames;
+                }
+                if ( !ok ) {
+                    fprintf( stderr, "%s %s %u: transfer failed\n", transports[t], v->name, len );
+                    continue;
+                }
+
+                qsort( ns, runs, sizeof( ns[0] ), cmp_double );
+
+                double p50 = percentile( ns, runs, 50 );
+                double p90 = percentile( ns, runs, 90 );
+                double p99 = percentile( ns, runs, 99 );
+                double fps = 1e9 / p50;
+                double mib = fps * len / ( 1024.0 * 1024.0 );
+
+                if ( fmt == FMT_CSV ) {
+                    printf( "%s,%s,%u,%zu,%d,%.1f,%.1f,%.1f,%.1f,%.0f,%.1f\n",
+                            transports[t], v->name, len, frames, runs,
+                            p50, p90, p99, ns[0], fps, mib );
+                } else if ( fmt == FMT_JSON ) {
+                    printf( "%s  {\"transport\": \"%s\", \"variant\": \"%s\", \"payload\": %u, "
+                            "\"frames\": %zu, \"runs\": %d, \"ns_per_frame\": {\"p50\": %.1f, "
+                            "\"p90\": %.1f, \"p99\": %.1f, \"min\": %.1f}, "
+                            "\"frames_per_sec\": %.0f, \"mib_per_sec\": %.1f}",
+                            first ? "" : ",\n", transports[t], v->name, len, frames, runs,
+                            p50, p90, p99, ns[0], fps, mib );
+                } else {
+                    printf( "%-10s %-24s %8u %8zu %10.1f %10.1f %10.1f %12.0f %10.1f\n",
+                            transports[t], v->name, len, frames,
+                            p50, p90, p99, fps, mib );
+                }
+                fflush( stdout );
+                first = 0;
+            }
+        }
+    }
+
+    if ( fmt == FMT_JSON ){
+        printf( "\n]\n" );
+    }
+
+    free( payload );
+    return 0;
+}
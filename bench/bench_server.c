@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>      // printf
+#include <stdlib.h>     // malloc, free, qsort
+#include <string.h>     // memset, strcmp
+#include <unistd.h>     // close, rmdir
+#include <time.h>       // clock_gettime
+#include <signal.h>     // SIGPIPE
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h>  // inet_pton
+
+#include "protocol.h"
+#include "chat_server.h"
+
+/*
+ * Server model benchmark.
+ *
+ * Starts a server inside this process once per connection model
+ * (threads, epoll, uring; chat_server.h) on a free port with a scratch
+ * data directory, connects N clients and lets every client keep `pipeline`
+ * CMD_HELLO requests in flight until it has done its share. CMD_HELLO is
+ * answered from memory, so the numbers show the cost of the I/O path -
+ * syscalls, wakeups, copies - and not the disk.
+ *
+ * Throughput is requests/s over all clients, latency is request to reply
+ * per request. Nothing outside the scratch directory is touched and a
+ * running chat server is not in the way.
+ *
+ *   bench_server [--modes LIST] [--clients N] [--requests N]
+ *                [--pipeline N] [--threads N] [--format text|csv|json] [--quick]
+ */
+
+#define BENCH_MAX_PIPELINE  256
+#define BENCH_DATA_TEMPLATE "/tmp/bench_server.XXXXXX"
+
+typedef enum {
+    FMT_TEXT = 0,
+    FMT_CSV,
+    FMT_JSON
+} bench_format_t;
+
+typedef struct {
+    int        fd;
+    int        requests;
+    int        pipeline;
+    uint64_t * lat;                     /* ns per request, `requests` entries */
+    pthread_barrier_t * start;
+    int        result;
+} bench_client_t;
+
+static uint64_t now_ns( void ) {
+
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t ) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                   Server                                   */
+/* -------------------------------------------------------------------------- */
+
+static uint16_t bench_port;            /* of the server being measured */
+
+static int connect_server( void ) {
+
+    struct sockaddr_in addr;
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 ){
+        return -1;
+    }
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons( bench_port );
+    inet_pton( AF_INET, "127.0.0.1", &addr.sin_addr );
+
+    if ( connect( fd, ( struct sockaddr * ) &addr, sizeof( addr ) ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    return fd;
+}
+
+/*
+ * @brief  Starts a server for one model on a free port.
+ *
+ * @return chat_server_t* Running server, NULL on failure.
+ */
+static chat_server_t * server_start( const char * data, const char * mode, int threads ) {
+
+    server_config_t cfg = {
+        .mode       = SERVER_MODE_THREADS,
+        .threads    = threads,
+        .outq       = { .policy = OUTQ_DISCONNECT },
+        .admit      = { .max_pending = -1 },         // bench clients never log in
+        .login_timeout = SESSION_LOGIN_TIMEOUT,
+        .cmd_timeout = SESSION_CMD_TIMEOUT,
+        .port       = 0,
+        .data_dir   = data
+    };
+
+    if ( strcmp( mode, "epoll" ) == 0 ){
+        cfg.mode = SERVER_MODE_EPOLL;
+    } else if ( strcmp( mode, "uring" ) == 0 ){
+        cfg.mode = SERVER_MODE_URING;
+    } else if ( strcmp( mode, "threads" ) != 0 ){
+        return NULL;
+    }
+
+    chat_server_t * srv = chat_server_start( &cfg );
+    if ( srv ){
+        bench_port = chat_server_port( srv );
+    }
+    return srv;
+}
+
+/*
+ * @brief  Removes the scratch data directory (HELLO writes no files).
+ */
+static void scratch_remove( const char * data ) {
+
+    static const char * const subdirs[] = { "users", "history", "groups" };
+    char path[ 64 ];
+
+    for ( size_t i = 0; i < sizeof( subdirs ) / sizeof( subdirs[0] ); ++i ) {
+        snprintf( path, sizeof( path ), "%s/%s", data, subdirs[i] );
+        rmdir( path );
+    }
+    rmdir( data );
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                   Clients                                  */
+/* -------------------------------------------------------------------------- */
+
+static int send_hello( int fd, uint32_t id ) {
+
+    proto_caps_t caps = { PROTO_VERSION, TLV_EXT_MAX_LENGTH, PROTO_FEAT_FRAME_V2 };
+    hello_t hello;
+
+    hello_init( &hello, &caps );
+    tlv_vec_t field = { TLV_HELLO, &hello, sizeof( hello ) };
+    return send_cmd_frame( fd, CMD_HELLO, id, &field, 1 );
+}
+
+static void * bench_client( void * arg ) {
+
+    bench_client_t * c = arg;
+    uint64_t sent[ BENCH_MAX_PIPELINE ];
+    tlv_reader_t reader;
+    tlv_view_t tlv;
+    int next = 0;
+
+    c->result = -1;
+    if ( tlv_reader_init( &reader, c->fd ) < 0 ){
+        return NULL;
+    }
+
+    pthread_barrier_wait( c->start );
+
+    /* fill the pipeline, then one new request per reply */
+    for ( ; next < c->pipeline && next < c->requests; ++next ) {
+        sent[ next % c->pipeline ] = now_ns();
+        if ( send_hello( c->fd, next + 1 ) < 0 ){
+            goto out;
+        }
+    }
+
+    for ( int done = 0; done < c->requests; ++done ) {
+
+        if ( tlv_reader_next( &reader, &tlv ) < 0 || tlv.type != TLV_RESPONSE ){
+            goto out;
+        }
+        c->lat[ done ] = now_ns() - sent[ done % c->pipeline ];
+
+        if ( next < c->requests ) {
+            sent[ next % c->pipeline ] = now_ns();
+            if ( send_hello( c->fd, next + 1 ) < 0 ){
+                goto out;
+            }
+            next++;
+        }
+    }
+    c->result = 0;
+
+out:
+    tlv_reader_free( &reader );
+    return NULL;
+}
+
+static int cmp_u64( const void * a, const void * b ) {
+
+    uint64_t x = *( const uint64_t * ) a;
+    uint64_t y = *( const uint64_t * ) b;
+    return ( x > y ) - ( x < y );
+}
+
+/* nearest rank percentile of a sorted array */
+static uint64_t percentile( const uint64_t * v, size_t n, double p ) {
+
+    size_t rank = ( size_t ) ( p / 100.0 * n + 0.5 );
+    if ( rank < 1 ){
+        rank = 1;
+    }
+    if ( rank > n ){
+        rank = n;
+    }
+    return v[ rank - 1 ];
+}
+
+typedef struct {
+    double   rps;
+    uint64_t p50, p90, p99, max;
+} bench_result_t;
+
+/*
+ * @brief  One measured run against a running server.
+ *
+ * @return int 0 on success, -1 if a client failed.
+ */
+static int bench_run( int clients, int requests, int pipeline, bench_result_t * out ) {
+
+    bench_client_t * c = calloc( clients, sizeof( *c ) );
+    pthread_t * tids   = calloc( clients, sizeof( *tids ) );
+    uint64_t * lat     = malloc( ( size_t ) clients * requests * sizeof( *lat ) );
+    pthread_barrier_t start;
+    int ok = c && tids && lat;
+    int connected = 0;
+
+    /* connections are set up before the clock starts */
+    for ( ; ok && connected < clients; ++connected ) {
+        c[ connected ].fd = connect_server();
+        ok = c[ connected ].fd >= 0;
+    }
+
+    int started = 0;
+    if ( ok ) {
+        pthread_barrier_init( &start, NULL, clients + 1 );
+        for ( ; started < clients; ++started ) {
+            c[ started ].requests = requests;
+            c[ started ].pipeline = pipeline;
+            c[ started ].lat      = lat + ( size_t ) started * requests;
+            c[ started ].start    = &start;
+            if ( pthread_create( &tids[ started ], NULL, bench_client, &c[ started ] ) != 0 ){
+                break;
+            }
+        }
+        ok = started == clients;
+    }
+
+    if ( ok ) {
+        pthread_barrier_wait( &start );
+        uint64_t t0 = now_ns();
+        for ( int i = 0; i < clients; ++i ) {
+            pthread_join( tids[i], NULL );
+            ok = ok && c[i].result == 0;
+        }
+        uint64_t t1 = now_ns();
+        pthread_barrier_destroy( &start );
+
+        size_t n = ( size_t ) clients * requests;
+        qsort( lat, n, sizeof( *lat ), cmp_u64 );
+        out->rps = n * 1e9 / ( double ) ( t1 - t0 );
+        out->p50 = percentile( lat, n, 50 );
+        out->p90 = percentile( lat, n, 90 );
+        out->p99 = percentile( lat, n, 99 );
+        out->max = lat[ n - 1 ];
+    } else if ( started > 0 ) {
+        /* cannot release a partial barrier - give up on the process */
+        fprintf( stderr, "could not start %d client threads\n", clients );
+        exit( 1 );
+    }
+
+    for ( int i = 0; i < connected; ++i ) {
+        if ( c[i].fd >= 0 ){
+            close( c[i].fd );
+        }
+    }
+    free( c );
+    free( tids );
+    free( lat );
+    return ok ? 0 : -1;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                    Main                                    */
+/* -------------------------------------------------------------------------- */
+
+static void usage( const char * prog ) {
+
+    fprintf( stderr,
+        "usage: %s [--modes threads,epoll,uring] [--clients N]\n"
+        "          [--requests N] [--pipeline N] [--threads N]\n"
+        "          [--format text|csv|json] [--quick]\n",
+        prog );
+}
+
+int main( int argc, char ** argv ) {
+
+    bench_format_t fmt = FMT_TEXT;
+    char data[] = BENCH_DATA_TEMPLATE;
+    char modes_buf[ 64 ] = "threads,epoll,uring";
+    int clients  = 64;
+    int requests = 2000;
+    int pipeline = 1;
+    int threads  = 0;
+
+    for ( int i = 1; i < argc; ++i ) {
+        if ( strcmp( argv[i], "--format" ) == 0 && i + 1 < argc ) {
+            i++;
+            if ( strcmp( argv[i], "csv" ) == 0 ){
+                fmt = FMT_CSV;
+            } else if ( strcmp( argv[i], "json" ) == 0 ){
+                fmt = FMT_JSON;
+            } else if ( strcmp( argv[i], "text" ) != 0 ) {
+                usage( argv[0] );
+                return 1;
+            }
+        } else if ( strcmp( argv[i], "--modes" ) == 0 && i + 1 < argc ) {
+            snprintf( modes_buf, sizeof( modes_buf ), "%s", argv[++i] );
+        } else if ( strcmp( argv[i], "--clients" ) == 0 && i + 1 < argc ) {
+            clients = atoi( argv[++i] );
+        } else if ( strcmp( argv[i], "--requests" ) == 0 && i + 1 < argc ) {
+            requests = atoi( argv[++i] );
+        } else if ( strcmp( argv[i], "--pipeline" ) == 0 && i + 1 < argc ) {
+            pipeline = atoi( argv[++i] );
+        } else if ( strcmp( argv[i], "--threads" ) == 0 && i + 1 < argc ) {
+            threads = atoi( argv[++i] );
+        } else if ( strcmp( argv[i], "--quick" ) == 0 ) {
+            clients  = 16;
+            requests = 500;
+        } else {
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if ( clients < 1 || requests < 1 || pipeline < 1 || pipeline > BENCH_MAX_PIPELINE ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+
+    if ( !mkdtemp( data ) ) {
+        perror( "mkdtemp" );
+        return 1;
+    }
+
+    if ( fmt == FMT_CSV ){
+        printf( "mode,clients,pipeline,requests,req_per_sec,lat_us_p50,lat_us_p90,"
+                "lat_us_p99,lat_us_max\n" );
+    } else if ( fmt == FMT_JSON ){
+        printf( "[\n" );
+    } else {
+        printf( "%-8s %8s %8s %9s %12s %10s %10s %10s %10s\n",
+                "mode", "clients", "pipeline", "requests",
+                "req/s", "p50 us", "p90 us", "p99 us", "max us" );
+    }
+
+    int first = 1;
+    int failed = 0;
+    char * save = NULL;
+
+    for ( char * mode = strtok_r( modes_buf, ",", &save ); mode;
+          mode = strtok_r( NULL, ",", &save ) ) {
+
+        bench_result_t r;
+
+        chat_server_t * srv = server_start( data, mode, threads );
+        if ( !srv ) {
+            fprintf( stderr, "%s: server did not start\n", mode );
+            failed = 1;
+            continue;
+        }
+
+        /* warm up (accept path, allocator, page cache) */
+        int rc = bench_run( clients, requests / 10 + 1, pipeline, &r );
+        if ( rc == 0 ){
+            rc = bench_run( clients, requests, pipeline, &r );
+        }
+        chat_server_stop( srv );
+
+        if ( rc < 0 ) {
+            fprintf( stderr, "%s: run failed\n", mode );
+            failed = 1;
+            continue;
+        }
+
+        if ( fmt == FMT_CSV ) {
+            printf( "%s,%d,%d,%d,%.0f,%.1f,%.1f,%.1f,%.1f\n",
+                    mode, clients, pipeline, requests, r.rps,
+                    r.p50 / 1e3, r.p90 / 1e3, r.p99 / 1e3, r.max / 1e3 );
+        } else if ( fmt == FMT_JSON ) {
+            printf( "%s  {\"mode\": \"%s\", \"clients\": %d, \"pipeline\": %d, "
+                    "\"requests\": %d, \"req_per_sec\": %.0f, \"lat_us\": {\"p50\": %.1f, "
+                    "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}",
+                    first ? "" : ",\n", mode, clients, pipeline, requests, r.rps,
+                    r.p50 / 1e3, r.p90 / 1e3, r.p99 / 1e3, r.max / 1e3 );
+        } else {
+            printf( "%-8s %8d %8d %9d %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+                    mode, clients, pipeline, requests, r.rps,
+                    r.p50 / 1e3, r.p90 / 1e3, r.p99 / 1e3, r.max / 1e3 );
+        }
+        fflush( stdout );
+        first = 0;
+    }
+
+    if ( fmt == FMT_JSON ){
+        printf( "\n]\n" );
+    }
+
+    scratch_remove( data );
+    return failed;
+}
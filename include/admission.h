@@ -0,0 +1,93 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+/*              Admission control - connection budgets of the server          */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Every accepted socket is checked before anything is allocated for it
+ * (session, thread, event loop slot). Three budgets apply:
+ *   connections - all open client connections;
+ *   per source  - connections from one IPv4 address;
+ *   pending     - connections that have not logged in yet, so a flood of
+ *                 idle sockets cannot take the room of real users.
+ * A rejected client gets a bare TLV_STATUS with STATUS_BUSY and is closed.
+ * Counters are plain atomics; the per-source table is split over
+ * ADMIT_IP_STRIPES mutexes and only used when that budget is set.
+ */
+
+#define ADMIT_FD_RESERVE        64      /* descriptors left for files, listeners, epoll... */
+#define ADMIT_DEFAULT_PENDING   1024    /* connections waiting for CMD_LOGIN */
+#define ADMIT_IP_STRIPES        64      /* locks of the per-source table */
+
+typedef struct {
+    int max_conns;      /* 0 = RLIMIT_NOFILE - ADMIT_FD_RESERVE, -1 = no limit */
+    int max_per_ip;     /* 0 = no limit */
+    int max_pending;    /* 0 = ADMIT_DEFAULT_PENDING, -1 = no limit */
+} admission_config_t;
+
+typedef enum {
+    ADMIT_OK = 0,
+    ADMIT_FULL,         /* connection budget used up */
+    ADMIT_PER_IP,       /* too many connections from this address */
+    ADMIT_PENDING       /* too many connections not logged in */
+} admit_result_t;
+
+typedef struct {
+    uint64_t admitted;
+    uint64_t rejected_full;
+    uint64_t rejected_per_ip;
+    uint64_t rejected_pending;
+    int      connections;   /* open now */
+    int      pending;       /* open and not logged in */
+    int      max_conns;     /* effective limits, -1 = none */
+    int      max_per_ip;
+    int      max_pending;
+} admission_stats_t;
+
+/**
+ * @brief Sets the budgets. Without it nothing is limited.
+ *
+ * @details Call after raise_fd_limit(), the default connection budget
+ * follows RLIMIT_NOFILE.
+ */
+void admission_init( const admission_config_t * cfg );
+
+/**
+ * @brief Takes a connection (and a pending login) from the budgets.
+ *
+ * @param ip Peer address, network byte order.
+ * @return admit_result_t ADMIT_OK, or why the connection must be refused
+ * (nothing is taken then; the rejection is counted).
+ */
+admit_result_t admission_enter( uint32_t ip );
+
+/**
+ * @brief Counts a connection taken over from the previous server
+ * (handoff.h) - it was admitted there, so no budget refuses it.
+ *
+ * @param logged_in It will not count as pending.
+ */
+void admission_adopt( uint32_t ip, int logged_in );
+
+/**
+ * @brief The connection logged in - it no longer counts as pending.
+ */
+void admission_login( void );
+
+/**
+ * @brief Gives back what admission_enter() took.
+ *
+ * @param logged_in admission_login() was called for the connection.
+ */
+void admission_leave( uint32_t ip, int logged_in );
+
+/**
+ * @brief Current counters and limits.
+ */
+void admission_stats( admission_stats_t * out );
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,67 @@
+#ifndef CHAT_SERVER_H
+#define CHAT_SERVER_H
+
+#include <stdint.h>
+
+#include "tcp_server.h"
+
+/* -------------------------------------------------------------------------- */
+/*            Chat server core - embeddable start / stop (libchat_server_core) */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Everything the server does, without the daemon around it: data root,
+ * listening socket (a fixed port or any free one), discovery, connection
+ * model, live restart. `server` (server.c) only parses options,
+ * daemonizes and waits for a signal; benchmarks and tests start a server
+ * inside their own process on port 0 with a scratch data directory.
+ *
+ * Sessions, outbound queues, budgets and the active user table are
+ * process wide - one server runs at a time, but it may be started and
+ * stopped again (each time with its own port and data root).
+ */
+
+#define CHAT_DEFAULT_PORT   6000            /* --port of the daemon */
+#define CHAT_MCAST_ADDR     "239.0.0.1"     /* discovery group */
+#define CHAT_MCAST_PORT     5000
+#define CHAT_CLOSE_MS       2000            /* for client threads to leave on stop */
+
+typedef struct chat_server chat_server_t;
+
+/**
+ * @brief Starts a server in the background.
+ *
+ * @details Prepares the data root (cfg->data_dir), the outbound queues,
+ * budgets and deadlines, takes over from a running server when
+ * cfg->handoff_path leads to one (handoff.h) or opens cfg->port, and runs
+ * the connection model on its own thread. When it returns, clients can
+ * connect.
+ *
+ * @return chat_server_t* Server, NULL on failure (logged).
+ */
+chat_server_t * chat_server_start( const server_config_t * cfg );
+
+/**
+ * @brief Port the server listens on (the one picked when cfg->port was 0).
+ */
+uint16_t chat_server_port( const chat_server_t * srv );
+
+/**
+ * @brief Asks the server to stop. Only sets a flag - safe in a signal handler.
+ */
+void chat_server_shutdown( chat_server_t * srv );
+
+/**
+ * @brief Waits until the server stopped (chat_server_shutdown() or a
+ * successor took over), closes what is left and frees it.
+ *
+ * @return int 0 after a clean stop, -1 if the connection model failed.
+ */
+int chat_server_wait( chat_server_t * srv );
+
+/**
+ * @brief chat_server_shutdown() and chat_server_wait().
+ */
+int chat_server_stop( chat_server_t * srv );
+
+#endif /* CHAT_SERVER_H */
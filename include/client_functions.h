@@ -4,6 +4,40 @@
 #include <stdint.h>
 #include <netinet/in.h>
 
+/* Request ids of the blocking calls. They run before the receiving thread
+ * starts; each has its own id, so a late answer to one (a HELLO answered
+ * after its timeout) is never taken for another's. Async ids start after
+ * CLIENT_SYNC_REQUEST_ID. */
+#define CLIENT_HELLO_REQUEST_ID  1
+#define CLIENT_LOGIN_REQUEST_ID  2
+#define CLIENT_CREATE_REQUEST_ID 3
+#define CLIENT_SYNC_REQUEST_ID   CLIENT_CREATE_REQUEST_ID   /* the last one */
+
+/* Servers from before CMD_HELLO do not answer it - wait this long (seconds) */
+#define CLIENT_HELLO_TIMEOUT 2
+
+#include "protocol.h"
+
+/* everything this client can handle, offered in CMD_HELLO */
+#define CLIENT_FEATURES ( PROTO_FEAT_LZ | PROTO_FEAT_BATCH | PROTO_FEAT_REQUEST_ID | \
+                          PROTO_FEAT_STREAM | PROTO_FEAT_DELIVERY | PROTO_FEAT_EXT_LEN )
+
+/**
+ * @brief Sends one command frame with the flags of this client.
+ *
+ * @details Wrapper over the protocol batch used by every client_* request;
+ * it announces that compressed answers (CMD_FRAME_FLAG_LZ) are accepted.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int client_send_cmd(
+    int sock,
+    uint16_t command,
+    uint32_t request_id,
+    const tlv_vec_t * fields,
+    size_t count
+);
+
 /**
  * @brief Performs server discovery via UDP Multicast.
  *
@@ -51,17 +85,36 @@ int client_connect_tcp(
 );
 
 
+/**
+ * @brief Negotiates the protocol mode right after client_connect_tcp().
+ *
+ * @details Sends `CMD_HELLO` with the version, max frame size and
+ * CLIENT_FEATURES of this client and waits for the server's `TLV_HELLO`
+ * with the common mode. A server that does not know the command (an error
+ * status, or no answer within CLIENT_HELLO_TIMEOUT) gets the mode version 2
+ * frames had before the handshake (PROTO_FEAT_FRAME_V2 and compression),
+ * so a mixed fleet keeps working.
+ *
+ * @param sock   Freshly connected socket (nothing else sent yet).
+ * @param agreed [OUT] Mode the connection runs in.
+ *
+ * @return int 0 on success (also after a fallback), -1 on network error or
+ * an answer that stalled halfway - the stream is out of step then and the
+ * caller has to close the socket.
+ */
+int client_hello( int sock, proto_caps_t * agreed );
+
 /**
  * @brief Authenticates the user with the server using the TLV protocol.
  *
- * @details This function performs a sequential 4-step handshake:
- * 1. Sends a `TLV_COMMAND` packet with `CMD_LOGIN` to initiate the process.
- * 2. Sends a `TLV_LOGIN` packet containing the username string.
- * 3. Sends a `TLV_PASSWORD` packet containing the password string.
- * 4. Blocks and waits for a `TLV_STATUS` response from the server.
+ * @details This function performs a request-response exchange:
+ * 1. Sends one `TLV_FRAME` with `CMD_LOGIN` carrying the `TLV_LOGIN`
+ *    and `TLV_PASSWORD` fields.
+ * 2. Blocks and waits for the `TLV_RESPONSE` (with `TLV_STATUS`) carrying
+ *    CLIENT_LOGIN_REQUEST_ID (answers to other ids are skipped). A bare
+ *    `TLV_STATUS` from an older server is accepted as well.
  *
- * @note This function handles the dynamic memory allocated by `recv_tlv` 
- * internally (frees the response payload before returning).
+ * @note The response is received into a stack buffer, nothing is allocated.
  *
  * @param sock     The open TCP socket descriptor connected to the server.
  * @param login    The username string (null-terminated).
@@ -80,12 +133,11 @@ int client_login(
 /**
  * @brief Registers a new user account on the server using the TLV protocol.
  *
- * @details This function executes a multi-stage registration handshake:
- * 1. Sends `TLV_COMMAND` with `CMD_CREATE_ACCOUNT`.
- * 2. Sends `TLV_LOGIN` (the unique account ID).
- * 3. Sends `TLV_PASSWORD` (the raw password).
- * 4. Sends `TLV_USERNAME` (the friendly display name).
- * 5. Blocks and waits for a `TLV_STATUS` confirmation from the server.
+ * @details This function executes the registration exchange:
+ * 1. Sends one `TLV_FRAME` with `CMD_CREATE_ACCOUNT` carrying
+ *    `TLV_LOGIN` (the unique account ID), `TLV_PASSWORD` (the raw password)
+ *    and `TLV_USERNAME` (the friendly display name).
+ * 2. Blocks and waits for the `TLV_RESPONSE` / `TLV_STATUS` confirmation.
  *
  * @note The server typically returns a non-OK status if the login is already taken
  * or if the password violates policy.
@@ -109,13 +161,12 @@ int client_create_account(
 /**
  * @brief Requests a password change for the currently logged-in user.
  *
- * @details This function implements a secure password update sequence:
- * 1. Sends `TLV_COMMAND` with `CMD_CHANGE_PASSWORD`.
- * 2. Sends `TLV_PASSWORD` containing the **old** password (for verification).
- * 3. Sends `TLV_PASSWORD` containing the **new** password.
- * 4. Blocks and waits for the server's `TLV_STATUS` response.
+ * @details Sends one `TLV_FRAME` with `CMD_CHANGE_PASSWORD` carrying two
+ * `TLV_PASSWORD` fields: the **old** password (for verification) and the
+ * **new** one. The server's `TLV_RESPONSE` is handled by the receiving thread.
  *
  * @param sock         The open TCP socket descriptor.
+ * @param request_id   Correlation id from client_request_begin() (0 = none).
  * @param old_password The current password (must match what is in the database).
  * @param new_password The desired new password.
  *
@@ -124,6 +175,7 @@ int client_create_account(
  */
 int client_change_password( 
     int sock, 
+    uint32_t request_id,
     const char * old_password,
     const char * new_password 
 );
@@ -135,6 +187,7 @@ int client_change_password(
  * This updates the name other users see in the chat room active list.
  *
  * @param sock         The open TCP socket descriptor.
+ * @param request_id   Correlation id from client_request_begin() (0 = none).
  * @param new_username The new display name string.
  *
  * @return int Returns 0 on success.
@@ -142,35 +195,48 @@ int client_change_password(
  */
 int client_change_username( 
     int sock, 
+    uint32_t request_id,
     const char * new_username 
 );
 
 /**
  * @brief Retrieves and displays the list of currently connected users.
  *
- * @details This function implements a synchronous request-response cycle:
- * 1. Sends a `TLV_COMMAND` with the value `CMD_GET_ACTIVE_USERS` to the server.
- * 2. Blocks and waits for a response packet.
- * 3. Verifies that the response type is `TLV_ACTIVE_USERS`.
- * 4. Writes the payload directly to standard output (stdout).
+ * @details Sends a `CMD_GET_ACTIVE_USERS` frame and returns at once. The
+ * `TLV_ACTIVE_USERS` answer (a text block, one user per line) arrives in a
+ * `TLV_RESPONSE` and is printed by the receiving thread.
+ *
+ * @param sock       The open TCP socket descriptor connected to the server.
+ * @param request_id Correlation id from client_request_begin() (0 = none).
+ * @return int Returns 0 when the request was sent, -1 on network error.
+ */
+int client_get_active_users( int sock, uint32_t request_id );
+
+/**
+ * @brief Asks for the server metrics (counters, latency percentiles).
  *
- * @note This function expects the server to format the user list as a 
- * text block (string) within the payload.
+ * @details Sends a `CMD_GET_STATS` frame and returns at once. The
+ * `TLV_STATS` text is printed by the receiving thread. Only clients
+ * connected over the loopback get it, others a STATUS_ERROR.
  *
- * @param sock The open TCP socket descriptor connected to the server.
- * @return int Returns 0 on success (list received and printed).
- * Returns -1 on network error or if the server response was unexpected.
+ * @param sock       The open TCP socket descriptor connected to the server.
+ * @param request_id Correlation id from client_request_begin() (0 = none).
+ * @return int Returns 0 when the request was sent, -1 on network error.
  */
-int client_get_active_users( int sock );
+int client_get_stats( int sock, uint32_t request_id );
 
+/* Asynchronous like the calls above - many may be in flight at once,
+ * answers are matched by request_id in the receiving thread. */
 int client_send_message(
     int sock,
+    uint32_t request_id,
     const char * target,
     const char * message
 );
 
 int client_get_history(
     int sock,
+    uint32_t request_id,
     const char * with_user,
     int lines
 );
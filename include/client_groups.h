@@ -28,11 +28,12 @@
 /* forward declaration */
 typedef struct client_ctx client_ctx_t;
 
-int client_group_create(int sock,  const char *groupname);
+/* request_id: correlation id from client_request_begin() (0 = none) */
+int client_group_create(int sock, uint32_t request_id, const char *groupname);
 
-int client_group_list(int sock);
+int client_group_list(int sock, uint32_t request_id);
 
-int client_group_join(int sock, const char *name);
+int client_group_join(int sock, uint32_t request_id, const char *name);
 
 int join_multicast(
     group_ctx_t *ctx,
@@ -49,6 +50,7 @@ void leave_all_groups(client_ctx_t *ctx);
 
 int client_send_group_message(
     int sock,
+    uint32_t request_id,
     const char *groupname,
     const char *msg
 );
@@ -18,6 +18,7 @@
 extern pthread_mutex_t print_mutex;
 
 #define MAX_GROUPS 16
+#define MAX_PENDING 32      // requests in flight at once
 
 typedef enum {
     PENDING_NONE = 0,
@@ -27,11 +28,22 @@ typedef enum {
     PENDING_CHANGE_USERNAME
 } pending_action_t;
 
+/* Request waiting for its TLV_RESPONSE (id 0 = free slot). */
+typedef struct {
+    uint32_t id;
+    pending_action_t action;
+} pending_request_t;
+
 typedef struct client_ctx {
     int sock;
     int running;
 
-    pending_action_t pending;
+    /* outstanding requests - matched by request id, not arrival order */
+    pending_request_t pending[ MAX_PENDING ];
+    uint32_t next_request_id;
+
+    /* mode negotiated by client_hello() */
+    proto_caps_t caps;
     //pthread_mutex_t print_mutex;
 
     /* chat state */
@@ -108,6 +120,33 @@ const char * status_to_string( status_t status );
 void read_command( char * buf, size_t size );
 
 
+/**
+ * @brief Registers a request before it is sent.
+ *
+ * @details Allocates the next request id and remembers what to do when the
+ * answer comes. Pass the id to the client_* sender; the receiving thread
+ * takes the entry out again when the matching `TLV_RESPONSE` arrives, so
+ * any number of requests (up to MAX_PENDING) can be pipelined.
+ *
+ * @param ctx    Client context.
+ * @param action What the answer means to the UI (PENDING_NONE = just print).
+ * @return uint32_t Request id, 0 if MAX_PENDING requests are already
+ * in flight or the server has no PROTO_FEAT_REQUEST_ID (the request is
+ * then sent uncorrelated and its bare answer taken in order).
+ */
+uint32_t client_request_begin( client_ctx_t * ctx, pending_action_t action );
+
+/**
+ * @brief Removes a request from the pending table.
+ *
+ * @param ctx Client context.
+ * @param id  Request id from the response, 0 = the oldest request (bare
+ *            answers from servers without request ids come in order).
+ * @return pending_action_t Action registered for the request,
+ * PENDING_NONE if it is not known.
+ */
+pending_action_t client_request_end( client_ctx_t * ctx, uint32_t id );
+
 void * client_recv_thread( void * arg );
 
 
@@ -0,0 +1,43 @@
+#ifndef DATA_DIR_H
+#define DATA_DIR_H
+
+/* -------------------------------------------------------------------------- */
+/*                    Data root - where the server keeps its files            */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Accounts, histories and groups live under one root directory chosen at
+ * runtime (--data-dir, server_config_t.data_dir), so benchmarks and tests
+ * can give every server its own scratch tree.
+ *   <root>/users/<login>
+ *   <root>/history/<login>_<login> and <root>/history/<group>
+ *   <root>/groups/<group>
+ * The paths are set before the server starts and only read afterwards.
+ */
+
+#define DATA_DIR_DEFAULT "/var/lib/chat_server"
+#define DATA_PATH_MAX    256    /* longest root accepted */
+#define DATA_SUBDIR_LEN  16     /* room for "/history/" after the root */
+
+/**
+ * @brief Sets the data root and creates it with its subdirectories.
+ *
+ * @param root Directory, NULL = DATA_DIR_DEFAULT. Missing parents are created.
+ * @return int 0 on success, -1 if the path is too long or cannot be created.
+ */
+int data_dir_set( const char * root );
+
+/**
+ * @brief The data root (no trailing slash).
+ */
+const char * data_dir( void );
+
+/**
+ * @brief Subdirectories of the data root, with a trailing slash - file
+ * names are appended directly.
+ */
+const char * users_dir( void );
+const char * history_dir( void );
+const char * groups_dir( void );
+
+#endif /* DATA_DIR_H */
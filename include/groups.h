@@ -5,6 +5,7 @@
 #include <stddef.h>
 
 #include "protocol.h"
+#include "msg_buf.h"
 
 
 typedef struct {
@@ -15,9 +16,12 @@ typedef struct {
 } group_info_t;
 
 
-int group_exists( const char *groupname );
+/* Reads the groups directory into memory - every other call is answered
+ * from there and only a change writes (the one file of its group). Called
+ * once the data root is set. Returns number of groups, -1 on error. */
+int groups_load( void );
 
-int groups_next_id(void);
+int group_exists( const char *groupname );
 
 int group_has_user(const char *groupname, const char *login);
 
@@ -39,19 +43,28 @@ int group_add_user(
 
 int group_list(char *out);
 
-int group_send_user_groups(int client_fd, const char *login);
+/* Adds TLV_GROUP_INFO of every group of the user to the batch and
+ * flushes it (the infos are a copy that lives only until then).
+ * Returns number of groups sent, -1 on error. */
+int group_send_user_groups(
+    tlv_batch_t *batch,
+    const char *login
+);
 
+/* Sends "[group] <login> username : msg" to the group's multicast address.
+ * The prefix and the message bytes leave as one datagram (sendmsg with two
+ * iovecs), the message is not copied. */
 int group_multicast_send(
     group_info_t *g,
     const char *author_login,
     const char * author_username,
-    const char *msg
+    const msg_buf_t *msg
 );
 
 int group_history_append(
     const char *group,
     const char *author_login,
     const char * author_username,
-    const char *msg
+    const msg_buf_t *msg
 );
 #endif //GROUPS_H
\ No newline at end of file
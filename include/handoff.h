@@ -0,0 +1,87 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/* -------------------------------------------------------------------------- */
+/*              Live restart - sockets handed to the next server              */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A server started with --handoff PATH listens on the UNIX socket PATH.
+ * A new server started with the same option connects there first: the old
+ * one stops accepting and reading, writes out what its clients are still
+ * owed and sends the listening socket and every client socket (SCM_RIGHTS)
+ * together with its session - login, negotiated protocol and the bytes of
+ * a TLV received only in part. Then it exits; clients keep their
+ * connection and their login, nobody reconnects.
+ *
+ * SOCK_SEQPACKET: one record per message, followed by its input bytes,
+ * with at most one descriptor attached. Both sides run the same layout,
+ * HANDOFF_VERSION is checked before the old server stops anything.
+ */
+
+#define HANDOFF_MAGIC       0x43484f46u         /* "CHOF" */
+#define HANDOFF_VERSION     1
+#define HANDOFF_MAX_INPUT   ( 64u * 1024 )      /* partial TLV carried over, more = closed */
+#define HANDOFF_QUIESCE_MS  2000                /* for client threads to stop reading */
+#define HANDOFF_DRAIN_MS    2000                /* for queued output to be written */
+
+typedef enum {
+    HANDOFF_HELLO = 1,      /* new -> old: take over, please */
+    HANDOFF_LISTENER,       /* fd = listening socket */
+    HANDOFF_SESSION,        /* fd = client socket */
+    HANDOFF_END             /* everything was sent */
+} handoff_kind_t;
+
+typedef struct {
+    uint32_t     magic;
+    uint32_t     version;
+    uint32_t     kind;                          /* handoff_kind_t */
+    uint32_t     peer_ip;                       /* network order */
+    char         login[ MAX_USERNAME_LEN ];     /* empty = not logged in */
+    char         username[ MAX_USERNAME_LEN ];
+    uint32_t     features;                      /* of the active user */
+    proto_caps_t caps;
+    int32_t      negotiated;
+    uint32_t     input_len;                     /* bytes following the record */
+} handoff_record_t;
+
+/**
+ * @brief Listens on `path` for the next server (replaces a stale socket).
+ *
+ * @details A thread waits for a connection with a valid HANDOFF_HELLO and
+ * calls request(ctl) once, with the connected control socket.
+ *
+ * @return int 0 on success, -1 on failure (no live restart then).
+ */
+int handoff_listen( const char * path, void ( * request )( int ctl ) );
+
+/**
+ * @brief Connects to the server listening on `path` and asks it to hand over.
+ *
+ * @return int Control socket, -1 if there is no server to take over from.
+ */
+int handoff_connect( const char * path );
+
+/**
+ * @brief Sends one record (magic and version are filled in).
+ *
+ * @param fd    Descriptor to pass along, -1 = none.
+ * @param input rec->input_len bytes, may be NULL when 0.
+ * @return int 0 on success, -1 on failure.
+ */
+int handoff_send( int ctl, handoff_record_t * rec, int fd, const void * input );
+
+/**
+ * @brief Receives one record.
+ *
+ * @param fd    Received descriptor, -1 if none came.
+ * @param input Room for HANDOFF_MAX_INPUT bytes.
+ * @return int Kind of the record, -1 on a broken or closed channel.
+ */
+int handoff_recv( int ctl, handoff_record_t * rec, int * fd, void * input );
+
+#endif /* HANDOFF_H */
@@ -3,10 +3,15 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
 #include "protocol.h"
+#include "msg_buf.h"
 
 //#define HISTORY_DIR "data/history/"
 
+#define HISTORY_LOCKS 64    /* mutexes shared out over history files by name */
+
 
 void make_history_filename(
     char * out,
@@ -15,11 +20,31 @@ void make_history_filename(
     const char * login2
 );
 
+/*
+ * Lock of the history file `filename` (a name from make_history_filename()
+ * or a group name). Appends hold it for the whole line and readers around
+ * each read, so nobody sees half a line. Conversations hash over
+ * HISTORY_LOCKS mutexes - two chats rarely wait for each other.
+ */
+pthread_mutex_t * history_lock( const char * filename );
+
+/*
+ * Appends one line "<time> <login> username : message" to the 1vs1 history.
+ * The message bytes are written straight from the relayed buffer.
+ * Takes the file's history_lock() itself.
+ */
 int history_append_message(
     const char * login_src,
     const char * username_src,
     const char * login_dst,
-    const char * message
+    const msg_buf_t * message
 );
 
+/*
+ * Positions an open history file at the start of its last `max_lines`
+ * lines (max_lines <= 0 -> whole file). Two passes over the file, nothing
+ * is kept in memory.
+ */
+void history_seek_tail( FILE * f, int max_lines );
+
 #endif //HISTORY_H
\ No newline at end of file
@@ -0,0 +1,126 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <syslog.h>     // LOG_ERR ... LOG_DEBUG
+
+/* -------------------------------------------------------------------------- */
+/*                 Asynchronous logging - syslog off the hot paths            */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * log_msg() formats the line in the calling thread into a slot of a
+ * bounded lock-free ring and returns - no lock, no system call. One
+ * thread drains the rings into syslog every LOG_DRAIN_MS. A full ring
+ * drops the line and counts it; the count is logged once it drains.
+ *
+ * Threads are spread over LOG_SHARDS rings (round robin, once per thread)
+ * rather than one ring each: the thread per connection model would
+ * otherwise hold a ring per client. Lines of one thread stay in order.
+ *
+ * Before log_start() (client programs, early startup) lines go straight
+ * to syslog.
+ *
+ * Filters, cheapest first:
+ *   level  - lines less severe than log_set_level() cost one load;
+ *   rate   - each call site writes at most `rate` lines a second, the
+ *            rest is counted and reported;
+ *   sample - log_sampled() keeps one line in `sample` of its call site;
+ *   frames - log_frame() (one line per TLV) is compiled in only with
+ *            CHAT_LOG_FRAMES and then is a sampled LOG_DEBUG line.
+ */
+
+#define LOG_SHARDS          8
+#define LOG_SHARD_SLOTS     512             /* lines per ring (power of two) */
+#define LOG_LINE_MAX        200             /* longer lines are cut */
+#define LOG_DRAIN_MS        50
+#define LOG_DEFAULT_RATE    100             /* lines a second of one call site */
+
+typedef struct {
+    int      level;         /* syslog priority, less severe lines are skipped; 0 = LOG_INFO */
+    unsigned rate;          /* lines a second of one call site, 0 = LOG_DEFAULT_RATE */
+    unsigned sample;        /* log_sampled() keeps 1 of `sample`, 0 = every one */
+    int      sync;          /* no ring - write in the calling thread (debugging) */
+} log_config_t;
+
+/* state of one call site (static in the macros) */
+typedef struct {
+    atomic_llong window;    /* second the count belongs to */
+    atomic_uint  count;     /* lines written in that second */
+    atomic_uint  calls;     /* log_sampled() calls */
+} log_site_t;
+
+extern atomic_int log_threshold;            /* current level, read by the macros */
+
+/**
+ * @brief Sets the filters and starts the drain thread (once; called again
+ * it only takes the new filters).
+ *
+ * @return int 0 on success, -1 if the thread did not start (lines are then
+ * written synchronously).
+ */
+int log_start( const log_config_t * cfg );
+
+/**
+ * @brief Changes the level at run time. Async-signal-safe.
+ */
+void log_set_level( int level );
+
+/**
+ * @brief Level named err, warning, notice, info or debug.
+ *
+ * @return int syslog priority, -1 for an unknown name.
+ */
+int log_level_parse( const char * name );
+
+/**
+ * @brief Writes out every queued line (before exit).
+ */
+void log_flush( void );
+
+/**
+ * @brief Lines dropped because a ring was full and lines held back by
+ * the rate limit, since the start.
+ */
+void log_counters( uint64_t * dropped, uint64_t * limited );
+
+/* used by the macros */
+int  log_site_allow( log_site_t * site );
+int  log_site_sample( log_site_t * site );
+void log_write( int prio, const char * fmt, ... ) __attribute__(( format( printf, 2, 3 ) ));
+
+#define log_enabled( prio ) \
+    ( ( prio ) <= atomic_load_explicit( &log_threshold, memory_order_relaxed ) )
+
+/**
+ * @brief syslog() replacement: filtered by level and by the rate of the call site.
+ */
+#define log_msg( prio, ... ) do {                                           \
+        static log_site_t log_site_;                                        \
+        if ( log_enabled( prio ) && log_site_allow( &log_site_ ) ){         \
+            log_write( ( prio ), __VA_ARGS__ );                             \
+        }                                                                   \
+    } while ( 0 )
+
+/**
+ * @brief log_msg() of which only 1 call in log_config_t.sample is kept.
+ */
+#define log_sampled( prio, ... ) do {                                       \
+        static log_site_t log_site_;                                        \
+        if ( log_enabled( prio ) && log_site_sample( &log_site_ ) &&        \
+             log_site_allow( &log_site_ ) ){                                \
+            log_write( ( prio ), __VA_ARGS__ );                             \
+        }                                                                   \
+    } while ( 0 )
+
+/**
+ * @brief Per frame trace - nothing at all unless built with CHAT_LOG_FRAMES.
+ */
+#ifdef CHAT_LOG_FRAMES
+#define log_frame( ... ) log_sampled( LOG_DEBUG, __VA_ARGS__ )
+#else
+#define log_frame( ... ) do { } while ( 0 )
+#endif
+
+#endif /* LOG_H */
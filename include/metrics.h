@@ -0,0 +1,156 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/* -------------------------------------------------------------------------- */
+/*               Metrics - counters and latency histograms                    */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Counters and histograms are written with relaxed atomic adds into one
+ * of METRICS_SHARDS slabs (picked round robin, once per thread) and
+ * merged when they are read - writers never share a cache line with
+ * most other threads and never take a lock.
+ *
+ * Histograms are HDR style: log-linear buckets of nanoseconds, 16 per
+ * power of two (about 6 % resolution) up to 2^METRICS_HIST_MAX_BITS ns
+ * (~17 s, longer values land in the last bucket). Percentiles are taken
+ * from the merged buckets.
+ *
+ * While the thread handles a traced request (trace.h) metrics_record()
+ * also adds the value as a span named after the histogram.
+ *
+ * Read through CMD_GET_STATS (loopback clients) or the local text
+ * endpoint (--stats-port): metrics_format() writes one metric per line,
+ *   <name> <value>
+ *   <name> count=<n> p50=<us> p99=<us> p999=<us> max=<us>
+ * followed by what the registered sources (admission, worker pool...)
+ * add.
+ */
+
+#define METRICS_SHARDS          8
+#define METRICS_HIST_SUB_BITS   4
+#define METRICS_HIST_SUB        ( 1 << METRICS_HIST_SUB_BITS )
+#define METRICS_HIST_MAX_BITS   34
+#define METRICS_HIST_BUCKETS    ( ( METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 1 ) * METRICS_HIST_SUB )
+#define METRICS_MAX_SOURCES     8
+#define METRICS_TEXT_MAX        16384   /* whole metrics_format() output */
+#define METRICS_CMDS            ( CMD_GET_STATS + 1 )
+
+typedef enum {
+    METRIC_ACCEPTED = 0,        /* sessions created */
+    METRIC_CLOSED,              /* sessions destroyed */
+    METRIC_REAPED,              /* closed by a deadline (timer wheel) */
+    METRIC_FRAMES,              /* TLVs received */
+    METRIC_COMMANDS,            /* commands dispatched */
+    METRIC_BAD_COMMANDS,        /* unsupported or malformed */
+    METRIC_LOGINS,
+    METRIC_LOGIN_FAILURES,
+    METRIC_MESSAGES,            /* direct messages delivered */
+    METRIC_GROUP_MESSAGES,
+    METRIC_OUTQ_SLOW,           /* clients that went over the high watermark */
+    METRIC_OUTQ_DROPPED,        /* frames dropped (OUTQ_DROP) */
+    METRIC_OUTQ_DISCONNECTED,   /* slow consumers disconnected */
+    METRIC_OUTQ_SPILLED,        /* bytes written to spill files */
+    METRIC_COUNTERS
+} metric_counter_t;
+
+typedef enum {
+    /* handler time per command_t (0 = unknown command) */
+    METRIC_HIST_CMD = 0,
+    /* waiting for a lock */
+    METRIC_LOCK_ACCOUNT = METRIC_HIST_CMD + METRICS_CMDS,
+    METRIC_LOCK_USERS,          /* active user table shard */
+    METRIC_LOCK_GROUPS,         /* groups_lock (the in-memory group index) */
+    METRIC_LOCK_HISTORY,        /* history file stripe */
+    METRIC_LOCK_OUTQ,           /* outbound queue of a connection */
+    /* I/O paths */
+    METRIC_IO_WRITE,            /* direct write to a client socket */
+    METRIC_IO_FLUSH,            /* flusher writing a backlog out */
+    METRIC_IO_HISTORY,          /* appending to a history file */
+    METRIC_IO_ACCOUNT,          /* reading an account file (login) */
+    METRIC_IO_POOL_WAIT,        /* command queued until a worker ran it (epoll) */
+    METRIC_HISTS
+} metric_hist_t;
+
+#define METRIC_HIST_OF_CMD( cmd ) \
+    ( ( unsigned ) ( cmd ) < METRICS_CMDS ? ( metric_hist_t ) ( cmd ) : METRIC_HIST_CMD )
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;               /* ns */
+    uint64_t max;
+    uint64_t p50, p99, p999;    /* ns, bucket midpoints */
+} metrics_summary_t;
+
+/* output of metrics_format() and of the sources */
+typedef struct {
+    char * buf;
+    size_t cap;
+    size_t len;
+} metrics_text_t;
+
+typedef void ( * metrics_source_t )( metrics_text_t * out, void * arg );
+
+/**
+ * @brief Monotonic nanoseconds - the clock of every histogram.
+ */
+uint64_t metrics_now( void );
+
+void metrics_add( metric_counter_t c, uint64_t n );
+
+/**
+ * @brief Adds one value (ns) to a histogram.
+ */
+void metrics_record( metric_hist_t h, uint64_t ns );
+
+#define metrics_inc( c ) metrics_add( ( c ), 1 )
+
+/**
+ * @brief Takes a lock and records how long that took.
+ */
+#define metrics_lock( h, lock_call ) do {                                   \
+        uint64_t metrics_t0_ = metrics_now();                               \
+        lock_call;                                                          \
+        metrics_record( ( h ), metrics_now() - metrics_t0_ );               \
+    } while ( 0 )
+
+/**
+ * @brief Counter merged over every shard.
+ */
+uint64_t metrics_counter( metric_counter_t c );
+
+/**
+ * @brief Histogram merged over every shard.
+ */
+void metrics_summary( metric_hist_t h, metrics_summary_t * out );
+
+/**
+ * @brief Adds a source of lines to metrics_format() (gauges of a module).
+ *
+ * @return int 0 on success, -1 if METRICS_MAX_SOURCES are registered.
+ */
+int metrics_add_source( metrics_source_t fn, void * arg );
+
+/**
+ * @brief Removes a source; when it returns the source is no longer called.
+ */
+void metrics_remove_source( metrics_source_t fn, void * arg );
+
+/**
+ * @brief Appends to the output (silently cut at its capacity).
+ */
+void metrics_printf( metrics_text_t * out, const char * fmt, ... ) __attribute__(( format( printf, 2, 3 ) ));
+
+/**
+ * @brief Every metric as text (see above).
+ *
+ * @return size_t Bytes written, without the terminating NUL.
+ */
+size_t metrics_format( char * buf, size_t cap );
+
+#endif /* METRICS_H */
@@ -0,0 +1,51 @@
+#ifndef MSG_BUF_H
+#define MSG_BUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* -------------------------------------------------------------------------- */
+/*                     Refcounted message payload buffers                     */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A relayed message is taken out of the sender's receive buffer once and
+ * then only referenced: the recipient socket(s), the group multicast and
+ * the history writer all read the same bytes (writev / sendmsg / fwrite),
+ * nothing is formatted around them or copied again.
+ *
+ * Anyone who keeps the buffer past the call that got it (a send queue, a
+ * background writer) takes a reference with msg_buf_ref() and drops it
+ * with msg_buf_unref(); the last unref frees it.
+ *
+ * Data is not null-terminated - always use `len`.
+ */
+typedef struct {
+    atomic_uint refs;
+    uint32_t    len;
+    uint8_t     data[];
+} msg_buf_t;
+
+/**
+ * @brief Creates a buffer holding a copy of `len` bytes (refcount 1).
+ *
+ * @return msg_buf_t* New buffer, NULL if malloc fails.
+ */
+msg_buf_t * msg_buf_new( const void * data, uint32_t len );
+
+/**
+ * @brief Takes one more reference.
+ *
+ * @return msg_buf_t* The same buffer (for `q->msg = msg_buf_ref( m )`).
+ */
+msg_buf_t * msg_buf_ref( msg_buf_t * buf );
+
+/**
+ * @brief Drops a reference, frees the buffer with the last one.
+ *
+ * @param buf Buffer, NULL is ignored.
+ */
+void msg_buf_unref( msg_buf_t * buf );
+
+#endif /* MSG_BUF_H */
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#define MCAST_TICK_MS 500       /* how often the thread looks at `running` */
+
 /**
  * @brief Context structure for the multicast handling thread.
  *
@@ -18,6 +20,7 @@ typedef struct {
     const char * mcast_addr;
     uint16_t     mcast_port;
     uint16_t     tcp_port;
+    volatile int * running;     /* stop once it is 0 (checked every MCAST_TICK_MS), NULL = never */
 } multicast_ctx_t;
 
 /**
@@ -32,7 +35,7 @@ typedef struct {
  * @param arg Pointer to a `multicast_ctx_t` structure containing configuration.
  * NOTE: The thread is expected to cast this to `multicast_ctx_t*`.
  * Memory management of `arg` depends on implementation (usually malloc'd in main).
- * * @return void* Returns NULL upon thread termination (usually runs indefinitely).
+ * * @return void* Returns NULL upon thread termination (once *ctx->running is 0).
  */
 void * multicast_thread( void * arg );
 
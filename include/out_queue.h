@@ -0,0 +1,151 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "msg_buf.h"
+
+/* -------------------------------------------------------------------------- */
+/*                 Outbound queues - one per client connection                */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Every byte for a client goes through its queue, so nobody ever blocks
+ * on somebody else's socket and frames of different writers never mix.
+ *
+ * A send first tries the socket directly (MSG_DONTWAIT). Whatever does not
+ * fit is queued - headers copied, a relayed payload (outq_send_buf()) only
+ * referenced until it is written - and the shared flusher thread takes over: it
+ * waits for EPOLLOUT and writes the queued frames combined, up to
+ * OUTQ_IOV_MAX per sendmsg(). With an owner (io_uring loop) the owner
+ * drains the queue itself and is only woken.
+ *
+ * Above the high watermark a consumer is slow and the policy decides what
+ * happens to further frames for it, until the backlog is back at the low
+ * watermark:
+ *   OUTQ_DROP       - frames are dropped (and counted),
+ *   OUTQ_DISCONNECT - the connection is shut down,
+ *   OUTQ_SPILL      - frames go to an unlinked temporary file and are read
+ *                     back in order; past spill_limit the client is
+ *                     disconnected.
+ * The connection's own replies (OUTQ_REPLY) are never dropped. A sender
+ * that may block (OUTQ_WAIT, a client's own thread) first waits up to
+ * OUTQ_REPLY_WAIT_MS for the backlog to fall to the low watermark -
+ * backpressure on the only client that asked for the data. Without
+ * OUTQ_WAIT (event loops, pool workers), or when the wait times out, a
+ * reply above the high watermark is spilled, or the connection shut down
+ * under OUTQ_DISCONNECT: a client that pipelines requests and never reads
+ * its replies is a slow consumer too.
+ */
+
+#define OUTQ_DEFAULT_HIGH   ( 1024u * 1024 )        /* backlog making a consumer slow */
+#define OUTQ_DEFAULT_LOW    ( 256u * 1024 )         /* backlog back to normal */
+#define OUTQ_DEFAULT_SPILL  ( 64u * 1024 * 1024 )   /* spill file size before disconnect */
+#define OUTQ_IOV_MAX        64                      /* frames combined into one write */
+#define OUTQ_REFILL_CHUNK   ( 64u * 1024 )          /* spilled bytes read back at once */
+#define OUTQ_REPLY_WAIT_MS  5000                    /* longest wait of an OUTQ_WAIT reply */
+
+#define OUTQ_REPLY 0x01     /* own reply - never dropped */
+#define OUTQ_WAIT  0x02     /* with OUTQ_REPLY: the caller may block for the backlog */
+
+typedef enum {
+    OUTQ_DROP = 0,
+    OUTQ_DISCONNECT,
+    OUTQ_SPILL
+} outq_policy_t;
+
+typedef struct {
+    size_t        high;             /* bytes, 0 = OUTQ_DEFAULT_HIGH */
+    size_t        low;              /* bytes, 0 = OUTQ_DEFAULT_LOW */
+    size_t        spill_limit;      /* bytes, 0 = OUTQ_DEFAULT_SPILL */
+    outq_policy_t policy;
+} outq_config_t;
+
+typedef struct out_queue out_queue_t;
+
+/**
+ * @brief Starts the flusher thread and sizes the descriptor table.
+ *
+ * @details Called again (a server restarted in the same process) it only
+ * takes the new watermarks and policy.
+ *
+ * @return int 0 on success, -1 on failure (queues are then not used and
+ * writes stay blocking).
+ */
+int outq_init( const outq_config_t * cfg );
+
+/**
+ * @brief Creates the queue of a connection and registers it under `fd`.
+ *
+ * @return out_queue_t* Queue, NULL if outq_init() was not called or on
+ * allocation failure.
+ */
+out_queue_t * outq_create( int fd );
+
+/**
+ * @brief Unregisters and frees the queue, pending data is dropped.
+ *
+ * @details Call before the socket is closed. NULL is ignored.
+ */
+void outq_destroy( out_queue_t * q );
+
+/**
+ * @brief Queue registered under `fd`, NULL if none.
+ *
+ * @details The queue is only valid while its connection is known to stay
+ * open (e.g. inside active_user_with() for that user).
+ */
+out_queue_t * outq_lookup( int fd );
+
+/**
+ * @brief Sends (or queues) one frame.
+ *
+ * @param flags OUTQ_REPLY for the connection's own replies, plus OUTQ_WAIT
+ * if the caller's thread serves only this connection.
+ * @return int 0 sent, queued, spilled or dropped by policy; -1 if the
+ * connection is closed or failed (or disconnected by policy).
+ */
+int outq_send( out_queue_t * q, const struct iovec * iov, int cnt, int flags );
+
+/**
+ * @brief outq_send() of a frame carrying (part of) `buf`.
+ *
+ * @details Queued iovecs inside buf->data are not copied: the queue takes
+ * a reference and drops it once those bytes are written. NULL = outq_send().
+ */
+int outq_send_buf( out_queue_t * q, const struct iovec * iov, int cnt, int flags, msg_buf_t * buf );
+
+/**
+ * @brief Makes the caller the only writer of the socket.
+ *
+ * @details Sends never write directly any more; wake(arg) is called
+ * (without locks held) when the queue gets data. The owner writes what
+ * outq_peek() returns and reports it with outq_consume().
+ */
+void outq_set_owner( out_queue_t * q, void ( * wake )( void * ), void * arg );
+
+/**
+ * @brief Queued data from the head, at most `max` buffers.
+ *
+ * @details The buffers stay valid until they are consumed.
+ * @return int Number of buffers, 0 if the queue is empty.
+ */
+int outq_peek( out_queue_t * q, struct iovec * iov, int max );
+
+/**
+ * @brief Removes `n` written bytes from the head of the queue.
+ */
+void outq_consume( out_queue_t * q, size_t n );
+
+/**
+ * @brief Writes the whole backlog (memory and spill file) now, waiting for
+ * the socket up to `timeout_ms` (live restart, nothing else writes then).
+ *
+ * @details An owner is dropped first - the caller has stopped it.
+ * @return int 0 when nothing is left, -1 on timeout or a closed connection.
+ */
+int outq_drain( out_queue_t * q, int timeout_ms );
+
+#endif /* OUT_QUEUE_H */
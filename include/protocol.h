@@ -2,6 +2,9 @@
 #define PROTOCOL_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/types.h>  /* ssize_t */
 
 /* Maximum buffer sizes (subject to change) */
 #define MAX_USERNAME_LEN    32     
@@ -9,11 +12,39 @@
 #define MAX_MESSAGE_LEN     1024
 #define MAX_GROUP_NAME_LEN  32  
 #define TLV_HEADER_LENGTH   4
+#define TLV_EXT_FLAG        0x8000 /* type bit: 32 bit length follows the header */
+#define TLV_EXT_HEADER_LENGTH 8    /* header + 32 bit length */
+#define TLV_EXT_MAX_LENGTH  ( 16u * 1024 * 1024 ) /* largest TLV a reader accepts */
+#define TLV_STREAM_CHUNK_SIZE 4096 /* payload of one TLV_STREAM_CHUNK sent by the server */
+#define TLV_LZ_FLAG         0x4000 /* type bit: payload is compressed (see tlv_lz.h) */
+#define TLV_LZ_PREFIX_LENGTH 4     /* original length in front of compressed data */
+#define TLV_LZ_THRESHOLD    256    /* smaller payloads are never compressed */
+#define TLV_BATCH_MAX       16     /* TLVs coalesced into a single writev() */
+#define TLV_READER_INIT_SIZE 4096  /* initial receive buffer of tlv_reader_t */
+#define TLV_ARENA_SIZE      4096   /* per-connection scratch memory for one command */
 
-#define BASE_DIR "/var/lib/chat_server"
-#define USER_DIR BASE_DIR "/users/"
-#define HISTORY_DIR BASE_DIR "/history/"
-#define GROUPS_DIR BASE_DIR "/groups/"
+#define CMD_FRAME_VERSION       2  /* current compound frame version */
+#define CMD_FRAME_HEADER_LENGTH 8  /* version + flags + command + request id */
+#define CMD_FRAME_V1_HEADER_LENGTH 4  /* version 1 had no request id */
+#define CMD_FRAME_MAX_FIELDS    8
+
+#define CMD_FRAME_FLAG_LZ       0x01 /* client accepts compressed answers */
+
+/* Capability handshake (CMD_HELLO, see hello_t) */
+#define PROTO_VERSION           1  /* handshake version, 0 = peer never said hello */
+#define PROTO_MIN_FRAME_SIZE    2048 /* smallest max_frame a peer may announce */
+
+#define PROTO_FEAT_LZ           0x01 /* compressed answers (TLV_LZ_FLAG) */
+#define PROTO_FEAT_BATCH        0x02 /* many commands in flight, coalesced writes */
+#define PROTO_FEAT_REQUEST_ID   0x04 /* answers come as TLV_RESPONSE with the request id */
+#define PROTO_FEAT_STREAM       0x08 /* large answers as TLV_STREAM_* */
+#define PROTO_FEAT_DELIVERY     0x10 /* direct messages as one TLV_DELIVERY */
+#define PROTO_FEAT_EXT_LEN      0x20 /* TLVs over 64 KiB (TLV_EXT_FLAG) */
+
+/* features a version 2 frame implies when no handshake was made
+   (compression is then asked for per frame with CMD_FRAME_FLAG_LZ) */
+#define PROTO_FEAT_FRAME_V2     ( PROTO_FEAT_BATCH | PROTO_FEAT_REQUEST_ID | \
+                                  PROTO_FEAT_STREAM | PROTO_FEAT_DELIVERY | PROTO_FEAT_EXT_LEN )
 
 
 /* -------------------------------------------------------------------------- */
@@ -30,6 +61,24 @@
  * TLV_HISTORY     -> Contains chat history data.
  * TLV_ACTIVE_USERS -> Contains user lists.
  * TLV_STATUS      -> Contains a status code (see status_t).
+ * TLV_FRAME       -> Compound command: command id and all its fields in one
+ *                    record (see cmd_frame_t).
+ * TLV_RESPONSE    -> Answer to a TLV_FRAME: same layout, carries the request
+ *                    id of the command and the reply TLVs as fields.
+ * TLV_STREAM_BEGIN -> Start of a streamed answer (see tlv_stream_header_t).
+ * TLV_STREAM_CHUNK -> One piece of a streamed answer.
+ * TLV_STREAM_END   -> Last record of a streamed answer.
+ * TLV_DELIVERY     -> Direct message pushed to its recipient: sender, server
+ *                     time and text in one record (see delivery_header_t).
+ * TLV_HELLO        -> Capabilities of one side (see hello_t); field of
+ *                     CMD_HELLO and of its answer.
+ * TLV_STATS        -> Server metrics as text, answer to CMD_GET_STATS.
+ *
+ * Any type may be sent with TLV_EXT_FLAG set: the 16 bit length is then 0
+ * and the real length follows as a 32 bit value (tlv_ext_header_t).
+ * Answers to frames with CMD_FRAME_FLAG_LZ may have TLV_LZ_FLAG set: the
+ * payload is then the original length (32 bit, network order) followed by
+ * the tlv_lz block. Use tlv_view_inflate() before looking at the type.
  */
 typedef enum {
     TLV_LOGIN       = 1,
@@ -43,7 +92,15 @@ typedef enum {
     TLV_HISTORY,
     TLV_ACTIVE_USERS,
     TLV_STATUS,
-    TLV_UINT16
+    TLV_UINT16,
+    TLV_FRAME,
+    TLV_RESPONSE,
+    TLV_STREAM_BEGIN,
+    TLV_STREAM_CHUNK,
+    TLV_STREAM_END,
+    TLV_DELIVERY,
+    TLV_HELLO,
+    TLV_STATS
 } tlv_type_t;
 
 typedef enum {
@@ -68,7 +125,9 @@ typedef enum {
     CMD_CREATE_GROUP,
     CMD_LIST_GROUPS,
     CMD_JOIN_GROUP,
-    CMD_GET_HISTORY
+    CMD_GET_HISTORY,
+    CMD_HELLO,                   /* Capability handshake, first command after connect */
+    CMD_GET_STATS                /* Server metrics as text (metrics.h), loopback clients only */
 } command_t;
 
 /* -------------------------------------------------------------------------- */
@@ -83,7 +142,8 @@ typedef enum {
     STATUS_ALREADY_LOGGED_IN,
     STATUS_USER_NOT_FOUND,
     STATUS_ALREADY_IN_GROUP,
-    STATUS_GROUP_NOT_FOUND
+    STATUS_GROUP_NOT_FOUND,
+    STATUS_BUSY                   /* Server at its connection limits, try again later */
 } status_t;
 
 /* -------------------------------------------------------------------------- */
@@ -110,6 +170,79 @@ typedef struct {
 } tlv_t;
 #pragma pack(pop)
 
+/* * Extended header for payloads over 64 KiB.
+ *  header.type has TLV_EXT_FLAG set and header.length is 0.
+ *  Senders pick it automatically when the payload does not fit 16 bits.
+ */
+#pragma pack(push, 1)
+typedef struct {
+    tlv_header_t header;
+    uint32_t     length;    // network byte order
+} tlv_ext_header_t;
+#pragma pack(pop)
+
+/* * Prefix of every TLV_STREAM_BEGIN / CHUNK / END payload.
+ *  A large answer (history, user list) is sent as BEGIN, any number of
+ *  CHUNKs and END, all tagged with the request id of the command, so the
+ *  server never holds the whole answer and the client can show it as it
+ *  arrives. Chunks of text answers always end on a line boundary unless
+ *  a single line is longer than a chunk.
+ */
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t request_id;    // network byte order
+    uint16_t type;          // type of the streamed data, e.g. TLV_HISTORY
+    uint16_t reserved;      // 0
+} tlv_stream_header_t;
+#pragma pack(pop)
+
+/* * Header of a compound command frame (TLV_FRAME / TLV_RESPONSE payload).
+ *  It is followed by the command fields encoded as nested TLVs
+ *  (same 4 byte header as the outer TLV), e.g. for CMD_LOGIN:
+ *  [TLV_FRAME][ver|flags|CMD_LOGIN|id][TLV_LOGIN ..][TLV_PASSWORD ..]
+ *
+ *  Request id is chosen by the client and copied into the TLV_RESPONSE,
+ *  so many commands can be in flight and answered in any order.
+ *  Version 1 frames end after `command` (no request id).
+ */
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t  version;    // CMD_FRAME_VERSION
+    uint8_t  flags;      // CMD_FRAME_FLAG_*
+    uint16_t command;    // command_t, network byte order
+    uint32_t request_id; // network byte order, 0 = not correlated
+} cmd_frame_header_t;
+#pragma pack(pop)
+
+/* * Fixed part of a TLV_DELIVERY payload, followed by the message bytes
+ *  (not terminated, length = TLV length - sizeof header).
+ *  Replaces the LOGIN / USERNAME / MESSAGE triplet: one record cannot be
+ *  split by other TLVs and is parsed without any further reads.
+ */
+#pragma pack(push, 1)
+typedef struct {
+    char     login[ MAX_USERNAME_LEN ];     // sender login, zero padded
+    char     username[ MAX_USERNAME_LEN ];  // sender display name, zero padded
+    uint64_t timestamp_ms;                  // server time (unix ms), network byte order
+} delivery_header_t;
+#pragma pack(pop)
+
+/* * Payload of TLV_HELLO.
+ *  The client sends its own capabilities in CMD_HELLO right after the
+ *  connect; the server answers STATUS_OK and a TLV_HELLO with what both
+ *  sides support (lower version, smaller max_frame, common features).
+ *  Receivers accept longer payloads and ignore the rest, so fields can be
+ *  added at the end without a version bump.
+ */
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t version;       // PROTO_VERSION, network byte order
+    uint16_t reserved;      // 0
+    uint32_t max_frame;     // largest TLV payload the sender accepts, network byte order
+    uint32_t features;      // PROTO_FEAT_*, network byte order
+} hello_t;
+#pragma pack(pop)
+
 /* * Answer on TLV_DISCOVERY message.
  *  Contains ip address and port for client
  */
@@ -120,22 +253,319 @@ typedef struct {
 } server_info_t;
 #pragma pack(pop)
 
+/* * One element of a vectored send (see send_tlvv()).
+ *  Payload is not copied - it has to stay valid until the send returns.
+ */
+typedef struct {
+    uint16_t     type;
+    const void * data;
+    uint32_t     len;       // > UINT16_MAX -> extended header
+} tlv_vec_t;
+
+/* * Cork/flush builder for TLV batches.
+ *  TLVs and frames added between tlv_batch_begin() and tlv_batch_flush()
+ *  are written with a single writev() call. Headers are encoded inside the
+ *  batch, payloads are only referenced (no copy) and must stay valid until
+ *  the flush. A batch without room for the next item is flushed first.
+ */
+typedef struct {
+    int          fd;
+    int          iov_count;
+    int          error;                         /* sticky - set on failed auto flush */
+    size_t       hdr_used;
+    uint8_t      hdr[ TLV_BATCH_MAX * ( TLV_HEADER_LENGTH + CMD_FRAME_HEADER_LENGTH ) ];
+    struct iovec iov[ 2 * TLV_BATCH_MAX ];
+} tlv_batch_t;
+
+/* * Incremental (push) TLV parser.
+ *  Takes whatever bytes are available - from a non-blocking read(), an
+ *  event loop, a test buffer - and hands out zero or more complete TLVs.
+ *  A partial header or payload simply stays in the buffer until the rest
+ *  arrives; the parser never reads and never blocks by itself.
+ *  The buffer grows when a single TLV does not fit in it.
+ */
+typedef struct {
+    uint8_t * buf;
+    size_t    cap;                              /* allocated size */
+    size_t    head;                             /* first unparsed byte */
+    size_t    tail;                             /* end of received data */
+    size_t    need;                             /* size of the incomplete TLV, 0 = unknown */
+} tlv_parser_t;
+
+/* * Per-connection buffered TLV reader (blocking).
+ *  Thin wrapper over tlv_parser_t: one read() fills the buffer with as
+ *  much as the socket has, and following TLVs are handed out from memory
+ *  without touching the kernel.
+ *  NOTE: once a reader is used on a socket, every read from that socket
+ *  has to go through it (bytes may already sit in the buffer).
+ */
+typedef struct {
+    int          fd;
+    tlv_parser_t parser;
+} tlv_reader_t;
+
+/* * Borrowed view of a received TLV.
+ *  `data` points straight into the reader buffer (no copy, no malloc) and
+ *  is valid only until the next call on the same reader.
+ */
+typedef struct {
+    uint16_t        type;                       /* without TLV_EXT_FLAG */
+    uint32_t        len;
+    const uint8_t * data;
+} tlv_view_t;
+
+/* * Per-connection scratch arena.
+ *  Fields of one command are copied here so they survive following reads;
+ *  the whole arena is reset (not freed) once the command is handled.
+ */
+typedef struct {
+    size_t  used;
+    uint8_t buf[ TLV_ARENA_SIZE ];
+} tlv_arena_t;
+
+/* * Decoded compound frame.
+ *  Field views point into the buffer the frame was parsed from.
+ */
+typedef struct {
+    uint8_t    version;
+    uint8_t    flags;
+    uint16_t   command;
+    uint32_t   request_id;                      /* 0 for version 1 frames */
+    int        count;                           /* number of fields */
+    tlv_view_t fields[ CMD_FRAME_MAX_FIELDS ];
+} cmd_frame_t;
+
+/* * Decoded TLV_DELIVERY. Strings are terminated copies, `message` points
+ *  into the received TLV.
+ */
+typedef struct {
+    char         login[ MAX_USERNAME_LEN ];
+    char         username[ MAX_USERNAME_LEN ];
+    uint64_t     timestamp_ms;
+    const char * message;
+    uint32_t     len;
+} delivery_t;
+
+/* * Capabilities of a connection, host byte order (decoded hello_t). */
+typedef struct {
+    uint16_t version;
+    uint32_t max_frame;
+    uint32_t features;
+} proto_caps_t;
+
+/* * Sending side of a streamed answer (see tlv_stream_header_t). */
+typedef struct {
+    int      fd;
+    uint32_t request_id;
+    uint16_t type;
+    int      compress;  /* chunks may be sent with TLV_LZ_FLAG */
+} tlv_stream_t;
+
+/* * Decoded TLV_STREAM_* record. `data` points into the received TLV. */
+typedef struct {
+    uint32_t        request_id;
+    uint16_t        type;
+    uint32_t        len;
+    const uint8_t * data;
+} tlv_stream_view_t;
+
 /* -------------------------------------------------------------------------- */
 /*                         Communication Functions                            */
 /* -------------------------------------------------------------------------- */
 
+/* * Write hook of the calling thread. Every send below ends in one
+ * vectored write; with a hook installed it is offered to the hook first
+ * (an I/O backend that queues writes, e.g. io_uring). The hook copies
+ * what it takes - the iovecs are gone after it returns.
+ * Returns 0 = taken, 1 = not for this hook (written normally), -1 = error.
+ */
+typedef int (*tlv_send_hook_t)(void *arg, int fd, const struct iovec *iov, int cnt);
+
+/* * Installs (or with NULL removes) the write hook of the calling thread. */
+void tlv_set_send_hook(tlv_send_hook_t hook, void *arg);
+
 /* * Sends a TLV packet.
  * Returns 0 on success, -1 on failure.
  */
 int send_tlv(int fd, uint16_t type, const void *data, uint16_t len);
 
+/* * Sends several TLV packets with one writev() (headers and payloads together).
+ * Returns 0 on success, -1 on failure.
+ */
+int send_tlvv(int fd, const tlv_vec_t *tlvs, size_t count);
+
+/* * Starts (corks) a new batch for the given descriptor. */
+void tlv_batch_begin(tlv_batch_t *batch, int fd);
+
+/* * Appends a TLV to the batch. A full batch is flushed automatically.
+ * Returns 0 on success, -1 on failure.
+ */
+int tlv_batch_add(tlv_batch_t *batch, uint16_t type, const void *data, uint32_t len);
+
+/* * Appends a compound frame (TLV_FRAME or TLV_RESPONSE) with its fields.
+ * Returns 0 on success, -1 on failure.
+ */
+int tlv_batch_add_frame(tlv_batch_t *batch, uint16_t type, uint16_t command,
+                        uint32_t request_id, uint8_t flags,
+                        const tlv_vec_t *fields, size_t count);
+
+/* * Writes out everything collected in the batch (one writev()) and empties it.
+ * Returns 0 on success, -1 if this or any earlier automatic flush failed.
+ */
+int tlv_batch_flush(tlv_batch_t *batch);
+
 /* * Receives a TLV packet.
  *!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
  * NOTE: This function allocates memory for *data. The caller is responsible 
  * for freeing this memory using free(*data).
  * !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+ * Legacy API - hot paths use recv_tlv_into() or tlv_reader_next() instead.
+ * Extended (over 64 KiB) TLVs are not supported here.
  * Returns 0 on success, -1 on failure.
  */
 int recv_tlv(int fd, uint16_t *type, void **data, uint16_t *len);
 
+/* * Receives a TLV packet into a caller supplied buffer (no allocation).
+ * At most `cap` bytes are stored, the rest of a longer payload is read and
+ * dropped so the stream stays in sync (extended TLVs included).
+ * *len is set to the stored length.
+ * Returns 0 on success, -1 on failure.
+ */
+int recv_tlv_into(int fd, uint16_t *type, void *buf, size_t cap, uint16_t *len);
+
+/* * Prepares an empty parser. Returns 0 on success, -1 on failure (malloc). */
+int tlv_parser_init(tlv_parser_t *parser);
+
+/* * Releases the parser buffer. */
+void tlv_parser_free(tlv_parser_t *parser);
+
+/* * Returns free space for incoming bytes (at least enough for the TLV being
+ * assembled). Write into it and call tlv_parser_commit() with the count.
+ * Views handed out earlier are invalid after this call.
+ * Returns NULL on allocation failure.
+ */
+uint8_t *tlv_parser_space(tlv_parser_t *parser, size_t *avail);
+
+/* * Marks `n` bytes written into tlv_parser_space() as received. */
+void tlv_parser_commit(tlv_parser_t *parser, size_t n);
+
+/* * Copies received bytes into the parser (space + memcpy + commit).
+ * Returns 0 on success, -1 on allocation failure.
+ */
+int tlv_parser_feed(tlv_parser_t *parser, const void *data, size_t len);
+
+/* * One read() from fd straight into the parser buffer.
+ * Returns bytes read, 0 on end of stream, -1 on error (errno is kept, so
+ * EAGAIN on a non-blocking descriptor can be told apart).
+ */
+ssize_t tlv_parser_read(tlv_parser_t *parser, int fd);
+
+/* * Takes the next complete TLV out of the buffer as a borrowed view.
+ * The view stays valid until the next space/feed/read call.
+ * Returns 1 if a TLV was returned, 0 if more bytes are needed,
+ * -1 on protocol error (TLV over TLV_EXT_MAX_LENGTH).
+ */
+int tlv_parser_next(tlv_parser_t *parser, tlv_view_t *view);
+
+/* * Prepares a buffered reader for the socket.
+ * Returns 0 on success, -1 on failure (malloc).
+ */
+int tlv_reader_init(tlv_reader_t *reader, int fd);
+
+/* * Releases the reader buffer (the socket is not closed). */
+void tlv_reader_free(tlv_reader_t *reader);
+
+/* * Returns the next TLV as a borrowed view into the reader buffer.
+ * No allocation and no copy - the view is valid until the next call.
+ * Returns 0 on success, -1 on failure or disconnect.
+ */
+int tlv_reader_next(tlv_reader_t *reader, tlv_view_t *view);
+
+/* * Sends a compound command frame: command and all fields in one TLV
+ * and one writev(). At most CMD_FRAME_MAX_FIELDS fields.
+ * Returns 0 on success, -1 on failure.
+ */
+int send_cmd_frame(int fd, uint16_t command, uint32_t request_id,
+                   const tlv_vec_t *fields, size_t count);
+
+/* * Parses a TLV_FRAME / TLV_RESPONSE payload in one pass. Every field offset is checked
+ * against the payload length before it is used.
+ * Returns 0 on success, -1 on malformed frame or unsupported version.
+ */
+int cmd_frame_parse(const void *payload, size_t len, cmd_frame_t *frame);
+
+/* * Sends TLV_STREAM_BEGIN for an answer of the given type. With `compress`
+ * set, large chunks are sent compressed (peer asked for CMD_FRAME_FLAG_LZ).
+ * Returns 0 on success, -1 on failure.
+ */
+int tlv_stream_begin(tlv_stream_t *stream, int fd, uint32_t request_id,
+                     uint16_t type, int compress);
+
+/* * Sends one TLV_STREAM_CHUNK (header and data in one writev()).
+ * Returns 0 on success, -1 on failure.
+ */
+int tlv_stream_write(tlv_stream_t *stream, const void *data, size_t len);
+
+/* * Sends TLV_STREAM_END. Returns 0 on success, -1 on failure. */
+int tlv_stream_end(tlv_stream_t *stream);
+
+/* * Decodes a received TLV_STREAM_* record.
+ * Returns 0 on success, -1 if the payload is too short.
+ */
+int tlv_stream_parse(const tlv_view_t *tlv, tlv_stream_view_t *out);
+
+/* * Fills the fixed part of a TLV_DELIVERY (strings truncated and padded). */
+void delivery_header_init(delivery_header_t *hdr, const char *login,
+                          const char *username, uint64_t timestamp_ms);
+
+/* * Sends a direct message as one TLV_DELIVERY: TLV header, delivery header
+ * and message bytes in a single writev().
+ * Returns 0 on success, -1 on failure.
+ */
+int send_delivery(int fd, const delivery_header_t *hdr, const void *message, uint32_t len);
+
+/* * Decodes a received TLV_DELIVERY.
+ * Returns 0 on success, -1 if the payload is shorter than the header.
+ */
+int delivery_parse(const tlv_view_t *tlv, delivery_t *out);
+
+/* * Encodes capabilities for a TLV_HELLO. */
+void hello_init(hello_t *hello, const proto_caps_t *caps);
+
+/* * Decodes a received TLV_HELLO.
+ * Returns 0 on success, -1 if the payload is shorter than hello_t.
+ */
+int hello_parse(const tlv_view_t *tlv, proto_caps_t *out);
+
+/* * Mode a connection runs in: lower version, smaller max_frame and the
+ * features both sides have.
+ */
+void proto_negotiate(const proto_caps_t *a, const proto_caps_t *b, proto_caps_t *out);
+
+/* * Compresses a TLV about to be sent, if it is large enough and it pays off.
+ * The compressed payload is written to `scratch` and `tlv` is pointed at it
+ * (type gets TLV_LZ_FLAG). Returns bytes of scratch used, 0 = left as is.
+ */
+size_t tlv_lz_pack(tlv_vec_t *tlv, void *scratch, size_t cap);
+
+/* * Decompresses a received TLV with TLV_LZ_FLAG in place of the view.
+ * The output goes to *buf, which is (re)allocated to fit; the view is
+ * valid until the next call with the same buffer. Views without the flag
+ * are left as they are.
+ * Returns 0 on success, -1 on malformed data or allocation failure.
+ */
+int tlv_view_inflate(tlv_view_t *tlv, uint8_t **buf, size_t *cap);
+
+/* * Forgets everything allocated from the arena. */
+void tlv_arena_reset(tlv_arena_t *arena);
+
+/* * Takes `size` bytes from the arena. Returns NULL when it is exhausted. */
+void *tlv_arena_alloc(tlv_arena_t *arena, size_t size);
+
+/* * Copies TLV payload into the arena as a null-terminated string,
+ * truncated to max - 1 characters (max is the size of the target field).
+ * Returns NULL when the arena is exhausted.
+ */
+const char *tlv_arena_str(tlv_arena_t *arena, const tlv_view_t *view, size_t max);
+
 #endif /* PROTOCOL_H */
\ No newline at end of file
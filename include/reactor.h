@@ -0,0 +1,55 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "tcp_server.h"
+
+/* -------------------------------------------------------------------------- */
+/*                    epoll reactor (alternative server model)                */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Instead of a thread per connection, a few event loop threads each own an
+ * epoll set (edge-triggered) and the connections they accepted. Idle
+ * connections cost only their session (context + receive buffer), no
+ * stack, so tens of thousands of them fit in a handful of threads.
+ *
+ * Bytes are read with MSG_DONTWAIT into the session's tlv_parser_t and
+ * every complete TLV goes through session_handle_tlv() - the same command
+ * semantics as client_thread(). Sockets stay blocking for writes, so
+ * handlers and the send helpers are shared unchanged.
+ *
+ * With --reuse-port every loop has its own listening socket (a
+ * SO_REUSEPORT shard of the same port) and the kernel spreads incoming
+ * connections over them; otherwise the loops share one socket. With
+ * --pin loop i runs on CPU i, so a connection stays on one core from
+ * accept to reply.
+ *
+ * With a worker pool (work_pool.h) the loops only do I/O: each TLV is
+ * copied into a job and queued on the connection's strand, which runs on
+ * a worker. A strand is queued on the pool at most once, so the commands
+ * of one client still run one at a time and in order, while a slow
+ * command (history, login) of one client does not hold up the others.
+ */
+
+#define REACTOR_MAX_EVENTS  64      /* events taken per epoll_wait() */
+#define REACTOR_TICK_MS     500     /* how often loops look at the running flag */
+#define REACTOR_STRAND_BATCH 8      /* commands a strand runs before it yields its worker */
+
+/**
+ * @brief Runs the event loops until *running becomes 0.
+ *
+ * @details The listening socket is made non-blocking and added to every
+ * loop with EPOLLEXCLUSIVE, so one loop is woken per incoming connection
+ * and keeps it for its whole life. With cfg->reuse_port it serves only
+ * the first loop, the others open their own shards. The soft
+ * RLIMIT_NOFILE is raised to the hard limit first.
+ *
+ * @param listen_fd Listening socket from start_tcp_server() (with
+ *                  reuse_port set when cfg->reuse_port is).
+ * @param cfg       Loops (threads), listeners and worker pool settings.
+ * @param running   Flag cleared by the signal handler.
+ * @return int 0 after a clean stop, -1 if the loops could not be started.
+ */
+int reactor_run( int listen_fd, const server_config_t * cfg, volatile int * running );
+
+#endif /* REACTOR_H */
@@ -5,12 +5,66 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <netinet/in.h> // struct sockaddr_in
 
-#define BACKLOG 10      //number of waiting TCP clients
-#define HISTORY_OUT_MAX 8192
+#include "protocol.h"
+#include "out_queue.h"
+#include "admission.h"
+#include "timer_wheel.h"
+#include "log.h"
+#include "trace.h"
 
-/* global mutex for shared resources */
-extern pthread_mutex_t server_mutex;
+#define BACKLOG 1024    //default number of waiting TCP clients (--backlog)
+#define HISTORY_OUT_MAX 8192   //single TLV_HISTORY answer - streamed answers have no limit
+
+/* session deadlines in seconds (--login-timeout, --command-timeout, --idle-timeout) */
+#define SESSION_LOGIN_TIMEOUT   300     /* connected without logging in */
+#define SESSION_CMD_TIMEOUT     15      /* rest of a started command (legacy fields, partial frame) */
+#define SESSION_IDLE_TIMEOUT    0       /* logged in and silent, 0 = never */
+
+/* interrupts a client thread blocked in read() (live restart, sessions_quiesce()) */
+#define SESSION_KICK_SIGNAL     SIGUSR2
+
+/* everything this server can do, offered in the CMD_HELLO answer */
+#define SERVER_FEATURES ( PROTO_FEAT_LZ | PROTO_FEAT_BATCH | PROTO_FEAT_REQUEST_ID | \
+                          PROTO_FEAT_STREAM | PROTO_FEAT_DELIVERY | PROTO_FEAT_EXT_LEN )
+
+/* connection handling model, chosen at startup (--mode) */
+typedef enum {
+    SERVER_MODE_THREADS = 0,    /* one blocking thread per client (client_thread) */
+    SERVER_MODE_EPOLL,          /* few event loops (reactor.h) */
+    SERVER_MODE_URING           /* few io_uring loops (uring.h) */
+} server_mode_t;
+
+/* startup options of the server (see usage in server.c, chat_server.h) */
+typedef struct {
+    server_mode_t mode;
+    int threads;                /* event loops in SERVER_MODE_EPOLL, 0 = one per CPU */
+    int foreground;             /* do not daemonize */
+    int workers;                /* command workers in SERVER_MODE_EPOLL, 0 = one per CPU,
+                                   -1 = run commands on the event loop */
+    size_t queue_depth;         /* worker pool injector slots, 0 = default */
+    size_t deque_depth;         /* per-worker deque slots, 0 = default */
+    int stats_interval;         /* seconds between pool statistics in syslog, 0 = off */
+    int backlog;                /* listen() queue of every listening socket, 0 = BACKLOG */
+    int reuse_port;             /* one SO_REUSEPORT listener per event loop / acceptor */
+    int pin;                    /* pin event loops / acceptors to CPUs (index % CPUs) */
+    outq_config_t outq;         /* outbound queue watermarks and slow consumer policy */
+    admission_config_t admit;   /* connection budgets */
+    int login_timeout;          /* seconds, 0 = never (SESSION_*_TIMEOUT) */
+    int cmd_timeout;
+    int idle_timeout;
+    int keepalive;              /* seconds of silence before TCP keepalive probes, 0 = off */
+    const char * handoff_path;  /* UNIX socket for live restart (handoff.h), NULL = off */
+    uint16_t port;              /* TCP port, 0 = any free one (chat_server_port()) */
+    const char * data_dir;      /* data root (data_dir.h), NULL = DATA_DIR_DEFAULT */
+    int discovery;              /* answer multicast discovery (multicast_server.h) */
+    log_config_t log;           /* level, rate limit and sampling of the log (log.h) */
+    uint16_t stats_port;        /* metrics as text on 127.0.0.1 (metrics.h), 0 = off */
+    trace_config_t trace;       /* request tracing (trace.h), off without a path */
+} server_config_t;
 
 /**
  * @brief Structure containing the context for a specific client connection.
@@ -18,13 +72,38 @@ extern pthread_mutex_t server_mutex;
  * @details This structure is used to pass arguments to the client handling thread.
  * Since pthread_create accepts only a single argument, we wrap all necessary
  * data (socket descriptor, address, etc.) into this structure.
- * * NOTE: This structure should be dynamically allocated in the main thread
- * and freed inside the client_thread to avoid memory leaks.
+ * * NOTE: Created with session_create() and freed with session_destroy()
+ * by whoever drives the connection (client_thread or the reactor).
  */
-typedef struct {
+typedef struct client_ctx {
     int client_fd;
+    char login[ MAX_USERNAME_LEN ];     /* set by a successful CMD_LOGIN */
+    tlv_reader_t reader;                /* every TLV from the client goes through it */
+    tlv_arena_t arena;                  /* fields of the command being handled */
+    proto_caps_t caps;                  /* mode of the connection (CMD_HELLO or implied) */
+    int negotiated;                     /* CMD_HELLO done - caps are no longer guessed per frame */
+    cmd_frame_t legacy;                 /* TLV_COMMAND whose loose fields are being collected */
+    int legacy_left;                    /* fields still missing, 0 = none */
+    out_queue_t * outq;                 /* every write to client_fd, NULL = blocking writes */
+    uint32_t peer_ip;                   /* source address (admission budgets), network order */
+    wheel_timer_t timer;                /* reaps the session once `deadline` passes */
+    atomic_ullong deadline;             /* timer_now_ms() to be reached, 0 = none */
+    atomic_ullong armed_for;            /* deadline the timer was last armed for */
+    atomic_int    waiting_for;          /* what the deadline is for (log line) */
+    atomic_int    input_pending;        /* parser holds unhandled bytes (session_next_tlv) */
+    struct client_ctx * prev;           /* every live session (live restart) */
+    struct client_ctx * next;
+    pthread_t     thread;               /* client_thread() serving it */
+    atomic_int    thread_state;         /* SESSION_THREAD_*, NONE in the event loop models */
 } client_ctx_t;
 
+enum {
+    SESSION_THREAD_NONE = 0,
+    SESSION_THREAD_STARTING,            /* created, `thread` not known yet */
+    SESSION_THREAD_RUNNING,
+    SESSION_THREAD_PARKED               /* stopped reading for a handoff */
+};
+
 
 /**
  * @brief  Initializes and starts a TCP server socket.
@@ -32,15 +111,38 @@ typedef struct {
  * @details This function performs the standard sequence of operations required
  * to accept incoming TCP connections:
  * 1. Creates a socket (IPv4, TCP).
- * 2. Sets the SO_REUSEADDR option (allows immediate restart of the server).
+ * 2. Sets the SO_REUSEADDR option (allows immediate restart of the server),
+ *    and SO_REUSEPORT when the port is going to be shared by several listeners.
  * 3. Binds the socket to the specified port on all available network interfaces (INADDR_ANY).
- * 4. Puts the socket in listening mode using the global BACKLOG limit.
+ * 4. Puts the socket in listening mode.
  *
- * @param  port The port number to bind the server to (e.g., 8080).
+ * @param  port       The port number to bind the server to (e.g., 8080).
+ * @param  backlog    Length of the accept queue, <= 0 = BACKLOG.
+ * @param  reuse_port Allow more sockets on this port (start_tcp_shard()).
  * @return int  Returns the file descriptor of the listening socket on success.
  * Returns -1 on failure (and prints the error to stderr).
  */
-int start_tcp_server( uint16_t port ); 
+int start_tcp_server( uint16_t port, int backlog, int reuse_port ); 
+
+/**
+ * @brief  Opens one more listening socket on the port of `listen_fd`.
+ *
+ * @details `listen_fd` must have been started with reuse_port. Each shard
+ * has its own accept queue and the kernel hashes incoming connections
+ * over all of them, so N acceptors never contend on one socket.
+ *
+ * @return int Listening socket, -1 on failure.
+ */
+int start_tcp_shard( int listen_fd, int backlog );
+
+/**
+ * @brief  Pins a thread to CPU `index` modulo the number of online CPUs.
+ *
+ * @details Threads created later by a pinned thread inherit its CPU.
+ *
+ * @return int 0 on success, -1 on failure (logged, the thread keeps running).
+ */
+int pin_thread( pthread_t tid, int index );
 
 
 /**
@@ -59,6 +161,156 @@ int start_tcp_server( uint16_t port );
  */
 // void handle_tcp_client( int client_fd );
 
+/**
+ * @brief Allocates the state of a new client connection.
+ *
+ * @details Used by every server model. The connection is checked against
+ * the admission budgets (admission.h) before anything is allocated; a
+ * refused client is sent STATUS_BUSY. The socket stays blocking; event
+ * loops read with MSG_DONTWAIT.
+ *
+ * @param client_fd Accepted socket, owned by the session from now on.
+ * @return client_ctx_t* Session, NULL if refused or on allocation failure
+ * (fd not closed).
+ */
+client_ctx_t * session_create( int client_fd );
+
+/**
+ * @brief Handles one TLV received from the client.
+ *
+ * @details Runs the command semantics of the server: compound frames are
+ * dispatched at once, legacy TLV_COMMANDs once all their loose fields have
+ * arrived. Never reads from the socket, so it can be driven by blocking
+ * reads (client_thread) or by an event loop feeding a tlv_parser_t.
+ * Never blocks on another client's socket either: while it runs, writes
+ * go through the outbound queues (out_queue.h) of their connections.
+ *
+ * @return int 0 to keep the connection, -1 to drop it.
+ */
+int session_handle_tlv( client_ctx_t * ctx, const tlv_view_t * tlv );
+
+/**
+ * @brief tlv_parser_next() on the session's reader that also records
+ * whether bytes are left in the parser after it.
+ *
+ * @details The command deadline covers a half received TLV. With a worker
+ * pool session_handle_tlv() runs on another thread than the one feeding
+ * the parser, so it looks at this record and never at the parser. Only
+ * the thread that feeds the parser calls it.
+ *
+ * @return int As tlv_parser_next().
+ */
+int session_next_tlv( client_ctx_t * ctx, tlv_view_t * tlv );
+
+/**
+ * @brief Logs the user out, closes the socket and frees the session.
+ */
+void session_destroy( client_ctx_t * ctx );
+
+/**
+ * @brief Accepts one connection and prepares the socket (TCP_NODELAY).
+ *
+ * @return int Client socket, -1 on error (errno kept, EAGAIN on a
+ * non-blocking listening socket with nothing to accept).
+ */
+int accept_client( int listen_fd );
+
+/**
+ * @brief Prepares a socket accepted elsewhere (io_uring): TCP_NODELAY,
+ * keepalive (sessions_init()) and a log line.
+ *
+ * @param addr Peer address, NULL = ask the socket (getpeername).
+ */
+void client_socket_init( int client_fd, const struct sockaddr_in * addr );
+
+/**
+ * @brief Sets session deadlines and keepalive, starts the timer wheel.
+ *
+ * @details Every session has one timer. Each handled TLV moves its
+ * deadline (a single atomic store); the timer re-checks it lazily and only
+ * re-arms early when the new deadline is sooner (a command started). When
+ * it passes, the socket is shut down - the blocking reader of the thread
+ * model and the event loops all see end of file and clean up as usual.
+ *
+ * @return int 0 on success, -1 if the wheel did not start (no deadlines).
+ */
+int sessions_init( const server_config_t * cfg );
+
+/**
+ * @brief Serves the session on its own client_thread() (thread model).
+ *
+ * @return int 0 on success, -1 if no thread could be started (session
+ * destroyed).
+ */
+int session_start_thread( client_ctx_t * ctx );
+
+/**
+ * @brief Closes every session left once the connection model stopped
+ * (not after a handoff).
+ *
+ * @details The sockets are shut down, their client threads see end of
+ * file and clean up; waits up to `timeout_ms` for the last one.
+ *
+ * @return int Sessions still open after the timeout.
+ */
+int sessions_close( int timeout_ms );
+
+/**
+ * @brief First step of a live restart: client threads stop reading, the
+ * io_uring loops keep their connections open when they stop.
+ */
+void sessions_freeze( void );
+
+/**
+ * @brief sessions_freeze() was called.
+ */
+int sessions_frozen( void );
+
+/**
+ * @brief Waits until every client thread parked (SESSION_KICK_SIGNAL
+ * gets it out of a blocking read).
+ *
+ * @return int Threads still busy after `timeout_ms` - their sessions are
+ * not handed over.
+ */
+int sessions_quiesce( int timeout_ms );
+
+/**
+ * @brief Sends the listening socket and every quiet session to the next
+ * server (handoff.h), once the connection model has stopped.
+ *
+ * @details Queued output is written first; a session in the middle of a
+ * legacy command, with too much unparsed input or with output that cannot
+ * be written in time is left behind and closed when this process exits.
+ *
+ * @return int Sessions handed over, -1 if the channel broke.
+ */
+int sessions_handoff( int ctl, int listen_fd );
+
+/**
+ * @brief Takes over from the previous server: receives its listening
+ * socket and its sessions (logins and budgets restored).
+ *
+ * @return int Listening socket, -1 if none came (start a fresh one).
+ */
+int sessions_adopt( int ctl );
+
+/**
+ * @brief Hands the sessions taken over by sessions_adopt() to the
+ * connection model (once).
+ *
+ * @return client_ctx_t** Array of *count sessions to free(), NULL if none.
+ */
+client_ctx_t ** sessions_adopted( int * count );
+
+/**
+ * @brief Raises the soft descriptor limit as far as allowed.
+ *
+ * @details The default of 1024 would cap the event loop models long
+ * before memory does; the hard limit is what the administrator allows.
+ */
+void raise_fd_limit( void );
+
 /**
  * @brief Thread entry point for handling an individual TCP client.
  *
@@ -68,7 +320,7 @@ int start_tcp_server( uint16_t port );
  * 2. Running the main communication loop (receive/process/send).
  * 3. Cleaning up resources (closing socket, freeing memory) upon disconnection.
  *
- * @param arg Pointer to `client_ctx_t` structure (needs casting).
+ * @param arg Session from session_create() (needs casting).
  * @return void* Always returns NULL when the thread finishes.
  */
 void * client_thread( void * arg );
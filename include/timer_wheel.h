@@ -0,0 +1,68 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+/*                  Timer wheel - deadlines of many connections               */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * One hierarchical wheel for the whole server, driven by its own thread.
+ * TIMER_LEVELS levels of TIMER_SLOTS slots, level 0 advancing every
+ * TIMER_TICK_MS: arming, re-arming and cancelling unlink/link one node
+ * (O(1)); a slot of a higher level is spread over the level below when
+ * the lower one wraps. 4 x 64 slots of 100 ms reach about 19 days, later
+ * timers wait in the last slot and are re-spread.
+ *
+ * Timers are embedded in their owner (no allocation). The callback runs on
+ * the wheel thread without the wheel lock held and returns the delay of
+ * its next run, 0 to stop - an owner can keep its real deadline elsewhere
+ * and have the timer re-check it lazily.
+ */
+
+#define TIMER_TICK_MS   100
+#define TIMER_LEVELS    4
+#define TIMER_BITS      6
+#define TIMER_SLOTS     ( 1 << TIMER_BITS )
+
+typedef struct wheel_timer {
+    struct wheel_timer * next;
+    struct wheel_timer * prev;
+    uint64_t             expires;               /* tick */
+    unsigned          ( * fn )( void * arg );   /* ms until the next run, 0 = done */
+    void *               arg;
+    int                  linked;                /* in a slot */
+} wheel_timer_t;
+
+/**
+ * @brief Starts the wheel thread (once). Until then timer_arm() does nothing.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int timer_wheel_start( void );
+
+/**
+ * @brief Prepares a timer, it is not armed yet.
+ */
+void timer_init( wheel_timer_t * t, unsigned ( * fn )( void * ), void * arg );
+
+/**
+ * @brief (Re)arms the timer to run `ms` from now (at least one tick).
+ */
+void timer_arm( wheel_timer_t * t, unsigned ms );
+
+/**
+ * @brief Disarms the timer.
+ *
+ * @details When it returns the callback is not running and will not run
+ * again, so the owner may be freed.
+ */
+void timer_cancel( wheel_timer_t * t );
+
+/**
+ * @brief Monotonic milliseconds (coarse clock - cheap enough per command).
+ */
+uint64_t timer_now_ms( void );
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,53 @@
+#ifndef TLV_LZ_H
+#define TLV_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+/*                      Small LZ77 codec for TLV payloads                     */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Byte oriented LZ77 in the spirit of LZ4 - no entropy stage, so it is fast
+ * enough to run on every large answer and still removes most of the
+ * repetition of chat text (timestamps, "<login> username :" prefixes).
+ *
+ * Compressed block is a list of sequences:
+ *   token       - high nibble literal count, low nibble match length - 4
+ *                 (15 = more length bytes follow, each 255 = keep adding)
+ *   literals    - copied as they are
+ *   offset      - 2 bytes little endian, distance back to the match
+ *                 (missing in the last sequence, which has literals only)
+ */
+
+#define TLV_LZ_MIN_MATCH  4
+#define TLV_LZ_MAX_OFFSET 65535
+
+/**
+ * @brief Compresses a buffer.
+ *
+ * @param src Input data.
+ * @param n   Input length.
+ * @param dst Output buffer.
+ * @param cap Size of the output buffer.
+ * @return size_t Compressed length, 0 if the result does not fit in `cap`
+ * (pass cap < n to get 0 whenever compression does not pay off).
+ */
+size_t tlv_lz_compress( const void * src, size_t n, void * dst, size_t cap );
+
+/**
+ * @brief Decompresses a block produced by tlv_lz_compress().
+ *
+ * @details Every length and offset is checked, a corrupted or hostile
+ * block can never write outside `dst` or read outside `src`.
+ *
+ * @param src Compressed block.
+ * @param n   Block length.
+ * @param dst Output buffer.
+ * @param cap Size of the output buffer.
+ * @return long Decompressed length, -1 on malformed input or small `cap`.
+ */
+long tlv_lz_decompress( const void * src, size_t n, void * dst, size_t cap );
+
+#endif /* TLV_LZ_H */
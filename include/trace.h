@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+/*              Request tracing - spans in Chrome trace format                */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Off unless trace_start() got a path. Then one TLV in `sample` is
+ * traced: trace_sample() marks the handling thread, and for as long as it
+ * is marked every span it closes (the command, lock waits, socket writes,
+ * history file I/O - see metrics_record()) lands in the thread's buffer.
+ * Untraced requests pay one thread local load per span.
+ *
+ * A buffer is a ring of TRACE_BUF_EVENTS spans with a lock only the
+ * owner and a dump ever take. It outlives its thread and is handed to
+ * the next one (client threads come and go), so old spans stay until
+ * they are overwritten.
+ *
+ * trace_write() puts every buffered span out as Chrome trace / Perfetto
+ * JSON ("X" events, microseconds of CLOCK_MONOTONIC): open it in
+ * chrome://tracing or ui.perfetto.dev.
+ */
+
+#define TRACE_BUF_EVENTS        2048    /* spans kept per thread */
+#define TRACE_DEFAULT_SAMPLE    1       /* every request */
+
+typedef struct {
+    const char * path;      /* JSON file written by trace_dump(), NULL = tracing off */
+    unsigned     sample;    /* trace 1 TLV in `sample`, 0 = TRACE_DEFAULT_SAMPLE */
+} trace_config_t;
+
+/* request of the current thread: 1 traced, -1 not traced, 0 not decided yet */
+extern _Thread_local int trace_on;
+
+/**
+ * @brief Starts tracing (once; called again it only takes the new sampling).
+ *
+ * @return int 0 on success or with tracing off, -1 if the dump thread did
+ * not start (trace_dump() still works).
+ */
+int trace_start( const trace_config_t * cfg );
+
+/**
+ * @brief Decides whether the request about to be handled is traced,
+ * unless an outer caller on this thread already did (the event loop
+ * before the session, for the queueing span).
+ *
+ * @return int 1 if this call decided - the caller ends the request with
+ * trace_done().
+ */
+int trace_sample( void );
+
+void trace_done( void );
+
+/**
+ * @brief Adds a finished span of the current thread (only while marked).
+ *
+ * @param name  Static string, shown as the span name.
+ * @param start metrics_now() at the start.
+ * @param dur   Nanoseconds.
+ * @param arg   Shown as args.fd, -1 = none.
+ */
+void trace_event( const char * name, uint64_t start, uint64_t dur, int arg );
+
+/**
+ * @brief Writes every buffered span as a Chrome trace JSON document.
+ *
+ * @return int 0 on success, -1 on a write error.
+ */
+int trace_write( FILE * f );
+
+/**
+ * @brief Writes the trace to the configured file (through a temporary
+ * file, readers never see half of it).
+ *
+ * @return int 0 on success, -1 if tracing is off or the file failed.
+ */
+int trace_dump( void );
+
+/**
+ * @brief Has the dump thread call trace_dump(). Async-signal-safe.
+ */
+void trace_dump_async( void );
+
+#define trace_active() ( trace_on > 0 )
+
+#endif /* TRACE_H */
@@ -0,0 +1,55 @@
+#ifndef URING_H
+#define URING_H
+
+#include "tcp_server.h"
+
+/* -------------------------------------------------------------------------- */
+/*                io_uring backend (alternative server model)                 */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Same shape as the epoll reactor - a few loop threads, each owning its
+ * connections - but every socket operation goes through one io_uring per
+ * loop and one io_uring_enter() submits and reaps work of all its
+ * connections at once:
+ *
+ *   accept  - one multishot accept per loop, re-armed only when the
+ *             kernel ends it;
+ *   recv    - one multishot recv per connection, bytes land in a ring of
+ *             provided buffers shared by the loop (no buffer per idle
+ *             connection) and are fed into the session's tlv_parser_t;
+ *   send    - the loop owns the outbound queue of each connection
+ *             (outq_set_owner()): replies and deliveries from any thread
+ *             are queued, and the loop submits the queued frames as a
+ *             chain of linked sends, so they keep their order without
+ *             waiting for the socket. Other threads wake the loop through
+ *             an eventfd watched by a multishot poll.
+ *
+ * Commands run on the loop, the worker pool is an epoll mode option.
+ * Needs Linux 6.0 (multishot recv, provided buffer rings), talks to the
+ * kernel with raw syscalls - no liburing.
+ */
+
+#define URING_ENTRIES     256       /* submission queue slots per loop */
+#define URING_CQ_ENTRIES  4096      /* completion queue slots per loop */
+#define URING_BUF_COUNT   256       /* provided receive buffers per loop (power of 2) */
+#define URING_BUF_SIZE    8192      /* size of one receive buffer */
+#define URING_MAX_CHAIN   32        /* linked sends of one connection in flight */
+#define URING_TICK_MS     500       /* how often loops look at the running flag */
+#define URING_DRAIN_TICKS 4         /* ticks given to connections to finish at stop */
+
+/**
+ * @brief Runs the io_uring loops until *running becomes 0.
+ *
+ * @details Loops and listeners follow cfg exactly as in reactor_run():
+ * cfg->threads loops (0 = one per CPU), one SO_REUSEPORT shard per loop
+ * with cfg->reuse_port, pinned with cfg->pin.
+ *
+ * @param listen_fd Listening socket from start_tcp_server().
+ * @param cfg       Server options.
+ * @param running   Flag cleared by the signal handler.
+ * @return int 0 after a clean stop, -1 if io_uring is not usable here.
+ */
+int uring_run( int listen_fd, const server_config_t * cfg, volatile int * running );
+
+#endif /* URING_H */
@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include "protocol.h"
 
+#define ACTIVE_USER_SHARDS   64     /* buckets of the active user table, one RW lock each */
+#define ACCOUNT_LOCK_STRIPES 64     /* mutexes serializing account file updates by login */
+
 /* -------------------------------------------------------------------------- */
 /* Data Structures                                                            */
 /* -------------------------------------------------------------------------- */
@@ -27,6 +30,7 @@ typedef struct active_user {
     char login[ MAX_USERNAME_LEN ];    /**< Login of the connected user. */
     char username[ MAX_USERNAME_LEN ]; /**< Display name of the connected user. */
     int  client_fd;                    /**< The socket file descriptor associated with this session. */
+    uint32_t features;                 /**< PROTO_FEAT_* of the session (0 = legacy TLV_COMMAND client). */
     struct active_user * next;         /**< Pointer to the next active user in the list (or NULL). */
 } active_user_t;
 
@@ -70,7 +74,7 @@ int user_create(
  * @details This function performs the registration process:
  * 1. Validates input lengths to prevent buffer overflows.
  * 2. Checks if the user already exists (using the login as the filename).
- * 3. Creates a new file `USER_DIR/<login>` and writes the credentials.
+ * 3. Creates a new file `users_dir()<login>` and writes the credentials.
  *
  * The file format is text-based:
  * - Line 1: `password=<value>`
@@ -138,90 +142,131 @@ int user_change_username(
 /* -------------------------------------------------------------------------- */
 
 /**
- * @brief Adds a newly connected user to the global list of active sessions.
+ * @brief Serializes file operations on the account `login`.
  *
- * @details Allocates memory for a new `active_user_t` node and inserts it
- * at the head of the `active_users` linked list.
+ * @details The account file is rewritten in place (truncate + write), so a
+ * login reading it during a password change could see it empty. One of
+ * ACCOUNT_LOCK_STRIPES mutexes, chosen by the login, covers the whole
+ * read-modify-write; different accounts almost never share it and no
+ * global lock is held during the disk I/O.
  *
- * @warning **Thread Safety:** This function modifies a global shared list.
- * It must be called within a critical section (protected by `server_mutex`)
- * to prevent race conditions.
+ * @param login Account to lock; account_unlock() takes the same login.
+ */
+void account_lock( const char * login );
+
+void account_unlock( const char * login );
+
+/* -------------------------------------------------------------------------- */
+/* Active Session API (In-Memory Hash Table)                                  */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Online users live in ACTIVE_USER_SHARDS buckets keyed by a hash of the
+ * login, each a linked list under its own pthread_rwlock_t. Lookups (DM
+ * relay, presence checks) take one bucket for reading, so they run in
+ * parallel with each other and only collide with a login/logout hashing
+ * to the same bucket. All functions below lock internally; nodes are never
+ * handed out - callers get copies or run under the lock (active_user_with()).
+ */
+
+/**
+ * @brief Adds a newly logged in user to the active sessions.
+ *
+ * @details The check for an existing session of `login` and the insertion
+ * happen under one write lock of its bucket, so a login can never be
+ * active twice.
  *
  * @param login     The user's unique login ID.
  * @param username  The user's display name.
  * @param client_fd The socket file descriptor associated with this connection.
+ * @param features  PROTO_FEAT_* of the session.
+ * @return int 0 added, 1 already logged in, -1 out of memory.
  */
-void add_active_user(
+int add_active_user(
     const char * login,
     const char * username,
-    int client_fd
+    int client_fd,
+    uint32_t features
 );
 
 /**
- * @brief Removes a user from the active list based on their socket descriptor.
- *
- * @details Traverses the singly linked list to find the node with the matching
- * `client_fd`. Once found, it unlinks the node from the list and frees the memory.
- * This is typically called when a client disconnects.
- *
- * @note Uses a double-pointer strategy (`**pp`) to handle removal elegantly,
- * whether the node is at the head, middle, or tail.
+ * @brief Removes the session of `login` on `client_fd` from the active users.
  *
- * @warning **Thread Safety:** Access to the global list must be protected
- * by `server_mutex`.
- *
- * @param client_fd The socket descriptor of the user to remove.
+ * @details Both must match, so a connection that only tried to log in
+ * as somebody else cannot log that user out. Unknown pairs are ignored.
+ * When it returns, no active_user_with() callback can still be using the
+ * session.
  */
-void remove_active_user_by_fd( int client_fd );
+void remove_active_user( const char * login, int client_fd );
 
 /**
  * @brief Checks if a specific user login is currently online.
  *
- * @details Performs a linear search through the `active_users` linked list
- * to see if any session matches the provided `login` ID. This is typically used
- * to prevent the same user from logging in twice simultaneously.
- *
- * @warning **Thread Safety:** Must be called within a critical section (mutex locked).
- *
  * @param login The login ID string to search for.
- * @return int Returns 1 (true) if the user is found in the list.
- * Returns 0 (false) if the user is not currently logged in.
+ * @return int Returns 1 (true) if the user is logged in, 0 (false) otherwise.
  */
 int is_user_logged_in( const char * login );
 
 /**
- * @brief Serializes the active user list and sends it to a client.
+ * @brief Copies the session of `login` (on `client_fd`, < 0 = any).
  *
- * @details This function iterates through the `active_users` list and creates
- * a single text buffer containing the **display usernames** of all online users,
- * separated by newlines (e.g., "Alice\nBob\nCharlie\n").
+ * @return int 0 and *out filled in, -1 if not logged in.
+ */
+int active_user_get( const char * login, int client_fd, active_user_t * out );
+
+/**
+ * @brief Changes the display name and/or features of a session.
  *
- * This buffer is then encapsulated in a `TLV_ACTIVE_USERS` packet and sent
- * to the requesting client.
+ * @param username New display name, NULL = keep.
+ * @param features New PROTO_FEAT_* set, NULL = keep.
+ * @return int 0 on success, -1 if `login` is not logged in on `client_fd`.
+ */
+int active_user_update(
+    const char * login,
+    int client_fd,
+    const char * username,
+    const uint32_t * features
+);
+
+/**
+ * @brief Runs fn on the session of `login` while it cannot log out.
  *
- * @warning **Thread Safety:** Must be called within a critical section (mutex locked).
- * @note If the list is too long to fit in `MAX_MESSAGE_LEN`, it will be truncated.
+ * @details The bucket is read locked for the call - fn must not block
+ * (queue writes only, see out_queue.h) nor touch the active users again.
  *
- * @param client_fd The socket descriptor of the client requesting the list.
+ * @return int 0 if fn was called, -1 if `login` is not logged in.
  */
-void send_active_users( int client_fd );
+int active_user_with(
+    const char * login,
+    void ( * fn )( const active_user_t * user, void * arg ),
+    void * arg
+);
 
 /**
- * @brief Prints the list of currently active users to the server's console.
+ * @brief Serializes (a part of) the active user list into a text buffer.
  *
- * @details This is a server-side debugging utility that iterates through the
- * `active_users` linked list and prints details (login, display name, socket FD)
- * to standard output.
+ * @details Writes one line per online user ("<login> username\n") into
+ * `buf`, starting with the user number `*cursor`. Only whole lines are
+ * written; `*cursor` is advanced past them, so repeated calls hand out the
+ * list piece by piece for a streamed answer. Buckets are read locked one
+ * at a time, never during the socket write.
  *
- * @warning **Thread Safety:** This function accesses a shared global list.
- * Ensure `server_mutex` is locked before calling to prevent race conditions.
+ * @note Users joining or leaving between two calls may be missed or listed twice.
+ *
+ * @param buf    Output buffer.
+ * @param cap    Size of the output buffer.
+ * @param cursor In/out - number of users already written (start with 0).
+ * @return size_t Number of bytes written, 0 when the list is exhausted.
  */
-void dump_active_users( void );
-
-active_user_t * find_active_user_by_login( const char * login );
-
-active_user_t * find_active_user_by_fd( int fd );
+size_t format_active_users( char * buf, size_t cap, size_t * cursor );
 
+/**
+ * @brief Prints the list of currently active users to the server's console.
+ *
+ * @details Server-side debugging utility printing login, display name and
+ * socket FD of every session to standard output.
+ */
+void dump_active_users( void );
 
 
 #endif /* USER_ACCOUNT_H */
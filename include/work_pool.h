@@ -0,0 +1,81 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+/*                         Work-stealing worker pool                          */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Fixed number of workers, each with its own bounded Chase-Lev deque.
+ * Tasks submitted from outside the pool (event loops) go to a shared,
+ * bounded injector queue; tasks submitted by a worker go to its own deque.
+ * A worker runs its own tasks newest first, then takes a few from the
+ * injector, and when both are empty steals the oldest task of another
+ * worker - a long task (history read, login) only holds up its own worker.
+ *
+ * Tasks are not allocated by the pool: work_task_t is embedded in the
+ * caller's structure and must stay valid until its function has run.
+ * One task may be queued at most once at a time.
+ */
+
+#define WORK_POOL_DEFAULT_DEQUE   256   /* per-worker deque slots */
+#define WORK_POOL_DEFAULT_INJECT  1024  /* shared injector slots */
+#define WORK_POOL_INJECT_BATCH    4     /* injector tasks moved to a deque at once */
+
+typedef struct work_task {
+    void ( * fn )( struct work_task * task );  /* use container_of-style cast to reach the owner */
+} work_task_t;
+
+typedef struct {
+    int    workers;         /* threads, <= 0 -> one per online CPU */
+    size_t deque_depth;     /* per-worker deque size, rounded up to a power of two */
+    size_t inject_depth;    /* injector size */
+    int    stats_interval;  /* seconds between statistic lines in syslog, 0 = never */
+} work_pool_config_t;
+
+/* Counters since creation; `queued` and `inject_depth` are current values. */
+typedef struct {
+    int      workers;
+    uint64_t submitted;     /* accepted by work_pool_submit() */
+    uint64_t rejected;      /* queues full - caller ran or dropped the task */
+    uint64_t executed;
+    uint64_t stolen;        /* taken from another worker's deque */
+    uint64_t injected;      /* taken from the injector */
+    size_t   queued;        /* waiting right now (all queues) */
+    size_t   inject_depth;  /* waiting in the injector right now */
+    size_t   inject_high;   /* highest injector depth seen */
+} work_pool_stats_t;
+
+typedef struct work_pool work_pool_t;
+
+/**
+ * @brief Starts the workers.
+ *
+ * @return work_pool_t* Pool, NULL on allocation / thread failure.
+ */
+work_pool_t * work_pool_create( const work_pool_config_t * cfg );
+
+/**
+ * @brief Queues a task.
+ *
+ * @details From a worker of this pool the task goes to the worker's own
+ * deque (no lock), otherwise to the injector. Idle workers are woken.
+ *
+ * @return int 0 on success, -1 if the queue is full (task not queued).
+ */
+int work_pool_submit( work_pool_t * pool, work_task_t * task );
+
+/**
+ * @brief Snapshot of the counters (summed over workers).
+ */
+void work_pool_stats( work_pool_t * pool, work_pool_stats_t * out );
+
+/**
+ * @brief Runs every queued task, stops the workers and frees the pool.
+ */
+void work_pool_destroy( work_pool_t * pool );
+
+#endif /* WORK_POOL_H */
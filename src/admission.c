@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#include "admission.h"
+#include "log.h"
+
+/* connections from one address */
+typedef struct ip_count {
+    struct ip_count * next;
+    uint32_t          ip;
+    int               count;
+} ip_count_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    ip_count_t *    head;
+} ip_stripe_t;
+
+static struct {
+    int              max_conns;         /* -1 = no limit */
+    int              max_per_ip;        /* 0 = no limit */
+    int              max_pending;       /* -1 = no limit */
+    atomic_int       connections;
+    atomic_int       pending;
+    atomic_ullong    admitted;
+    atomic_ullong    rejected[ ADMIT_PENDING + 1 ];
+    atomic_llong     last_log;          /* second of the last rejection line */
+    ip_stripe_t      ips[ ADMIT_IP_STRIPES ];
+    int              ready;             /* stripes initialized */
+} adm = { .max_conns = -1, .max_per_ip = 0, .max_pending = -1 };
+
+/*
+ * @brief  Takes one from `counter` unless that passes `max` (-1 = no limit).
+ */
+static int take( atomic_int * counter, int max ) {
+
+    int now = atomic_fetch_add_explicit( counter, 1, memory_order_relaxed ) + 1;
+
+    if ( max >= 0 && now > max ) {
+        atomic_fetch_sub_explicit( counter, 1, memory_order_relaxed );
+        return -1;
+    }
+    return 0;
+}
+
+static ip_stripe_t * stripe_of( uint32_t ip ) {
+
+    return &adm.ips[ ( ip * 2654435761u ) >> 26 ];    // 64 stripes
+}
+
+/*
+ * @brief  One more connection from `ip`, -1 if it already has max_per_ip.
+ */
+static int ip_take( uint32_t ip ) {
+
+    ip_stripe_t * st = stripe_of( ip );
+    ip_count_t * c;
+    int rc = 0;
+
+    pthread_mutex_lock( &st->lock );
+
+    for ( c = st->head; c && c->ip != ip; c = c->next )
+        ;
+
+    if ( !c ) {
+        c = malloc( sizeof( *c ) );
+        if ( c ) {
+            c->ip    = ip;
+            c->count = 0;
+            c->next  = st->head;
+            st->head = c;
+        }
+    }
+
+    if ( !c || c->count >= adm.max_per_ip ){
+        rc = -1;
+    } else {
+        c->count++;
+    }
+
+    pthread_mutex_unlock( &st->lock );
+    return rc;
+}
+
+static void ip_put( uint32_t ip ) {
+
+    ip_stripe_t * st = stripe_of( ip );
+    ip_count_t ** pp;
+
+    pthread_mutex_lock( &st->lock );
+
+    for ( pp = &st->head; *pp; pp = &( *pp )->next ) {
+        ip_count_t * c = *pp;
+        if ( c->ip == ip ) {
+            if ( --c->count <= 0 ) {
+                *pp = c->next;
+                free( c );
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock( &st->lock );
+}
+
+/*
+ * @brief  Counts a rejection, logs the totals at most once a second.
+ */
+static admit_result_t reject( admit_result_t why ) {
+
+    atomic_fetch_add_explicit( &adm.rejected[ why ], 1, memory_order_relaxed );
+
+    long long now  = ( long long ) time( NULL );
+    long long last = atomic_load_explicit( &adm.last_log, memory_order_relaxed );
+
+    if ( now != last &&
+         atomic_compare_exchange_strong( &adm.last_log, &last, now ) ) {
+        admission_stats_t st;
+        admission_stats( &st );
+        log_msg( LOG_WARNING,
+            "[admit] rejecting: full=%llu per_ip=%llu pending=%llu (open %d, pending %d)\n",
+            ( unsigned long long ) st.rejected_full,
+            ( unsigned long long ) st.rejected_per_ip,
+            ( unsigned long long ) st.rejected_pending,
+            st.connections,
+            st.pending
+        );
+    }
+    return why;
+}
+
+void admission_init( const admission_config_t * cfg ) {
+
+    struct rlimit rl;
+
+    adm.max_conns = cfg->max_conns;
+    if ( adm.max_conns == 0 ) {
+        adm.max_conns = -1;
+        if ( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+             rl.rlim_cur > ADMIT_FD_RESERVE ){
+            adm.max_conns = rl.rlim_cur - ADMIT_FD_RESERVE > 0x7fffffff
+                          ? 0x7fffffff : ( int ) ( rl.rlim_cur - ADMIT_FD_RESERVE );
+        }
+    }
+
+    adm.max_per_ip  = cfg->max_per_ip > 0 ? cfg->max_per_ip : 0;
+    adm.max_pending = cfg->max_pending == 0 ? ADMIT_DEFAULT_PENDING : cfg->max_pending;
+
+    /* once per process - a server started again keeps the stripes */
+    if ( !adm.ready ) {
+        for ( int i = 0; i < ADMIT_IP_STRIPES; ++i ){
+            pthread_mutex_init( &adm.ips[i].lock, NULL );
+        }
+        adm.ready = 1;
+    }
+
+    log_msg( LOG_INFO, "[admit] connections %d, per source %d, pending logins %d (-1/0 = no limit)\n",
+            adm.max_conns, adm.max_per_ip, adm.max_pending );
+}
+
+admit_result_t admission_enter( uint32_t ip ) {
+
+    if ( take( &adm.connections, adm.max_conns ) < 0 ){
+        return reject( ADMIT_FULL );
+    }
+
+    if ( take( &adm.pending, adm.max_pending ) < 0 ) {
+        atomic_fetch_sub_explicit( &adm.connections, 1, memory_order_relaxed );
+        return reject( ADMIT_PENDING );
+    }
+
+    if ( adm.max_per_ip > 0 && ip_take( ip ) < 0 ) {
+        atomic_fetch_sub_explicit( &adm.pending, 1, memory_order_relaxed );
+        atomic_fetch_sub_explicit( &adm.connections, 1, memory_order_relaxed );
+        return reject( ADMIT_PER_IP );
+    }
+
+    atomic_fetch_add_explicit( &adm.admitted, 1, memory_order_relaxed );
+    return ADMIT_OK;
+}
+
+void admission_adopt( uint32_t ip, int logged_in ) {
+
+    atomic_fetch_add_explicit( &adm.connections, 1, memory_order_relaxed );
+    if ( !logged_in ){
+        atomic_fetch_add_explicit( &adm.pending, 1, memory_order_relaxed );
+    }
+    if ( adm.max_per_ip > 0 && ip_take( ip ) < 0 ) {
+        /* over the per source budget (or no memory) - admission_leave() must still balance */
+        ip_stripe_t * st = stripe_of( ip );
+        pthread_mutex_lock( &st->lock );
+        for ( ip_count_t * c = st->head; c; c = c->next ) {
+            if ( c->ip == ip ) {
+                c->count++;
+                break;
+            }
+        }
+        pthread_mutex_unlock( &st->lock );
+    }
+}
+
+void admission_login( void ) {
+
+    atomic_fetch_sub_explicit( &adm.pending, 1, memory_order_relaxed );
+}
+
+void admission_leave( uint32_t ip, int logged_in ) {
+
+    if ( adm.max_per_ip > 0 ){
+        ip_put( ip );
+    }
+    if ( !logged_in ){
+        atomic_fetch_sub_explicit( &adm.pending, 1, memory_order_relaxed );
+    }
+    atomic_fetch_sub_explicit( &adm.connections, 1, memory_order_relaxed );
+}
+
+void admission_stats( admission_stats_t * out ) {
+
+    out->admitted         = atomic_load_explicit( &adm.admitted, memory_order_relaxed );
+    out->rejected_full    = atomic_load_explicit( &adm.rejected[ ADMIT_FULL ], memory_order_relaxed );
+    out->rejected_per_ip  = atomic_load_explicit( &adm.rejected[ ADMIT_PER_IP ], memory_order_relaxed );
+    out->rejected_pending = atomic_load_explicit( &adm.rejected[ ADMIT_PENDING ], memory_order_relaxed );
+    out->connections      = atomic_load_explicit( &adm.connections, memory_order_relaxed );
+    out->pending          = atomic_load_explicit( &adm.pending, memory_order_relaxed );
+    out->max_conns        = adm.max_conns;
+    out->max_per_ip       = adm.max_per_ip;
+    out->max_pending      = adm.max_pending;
+}
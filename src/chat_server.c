@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <poll.h>       // poll (accept loop tick)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "tcp_server.h"
+#include "multicast_server.h"
+#include "reactor.h"
+#include "uring.h"
+#include "handoff.h"
+#include "data_dir.h"
+#include "groups.h"
+#include "chat_server.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "admission.h"
+
+#define ACCEPT_TICK_MS      500             // how often acceptors look at `running`
+#define STATS_READ_MS       200             // request of a stats endpoint client
+
+struct chat_server {
+    server_config_t  cfg;
+    volatile int     running;               /* the connection model runs while set */
+    int              tcp_sock;
+    uint16_t         port;
+    pthread_t        model;                 /* runs the connection model */
+    int              model_rc;
+    int              handoff_ctl;           /* successor's control socket (handoff.h), -1 = none */
+    multicast_ctx_t  mcast;
+    pthread_t        mcast_tid;
+    int              mcast_started;
+    int              stats_sock;            /* local text endpoint (--stats-port), -1 = off */
+    pthread_t        stats_tid;
+    uint64_t         started_at;            /* metrics_now() */
+};
+
+/* one acceptor of the thread model (the first one is the model thread) */
+typedef struct {
+    chat_server_t * srv;
+    int             listen_fd;
+    pthread_t       tid;
+} acceptor_t;
+
+/* the running server - the handoff listener has no other way to find it */
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+static chat_server_t * current;
+
+/*
+ * @brief  Thread per connection model - the accept loop.
+ */
+static void accept_loop( chat_server_t * srv, int tcp_sock ) {
+
+    struct pollfd pfd = { .fd = tcp_sock, .events = POLLIN };
+
+    while ( srv->running ) {
+
+        /* never blocked in accept() - stopping waits for every acceptor */
+        if ( poll( &pfd, 1, ACCEPT_TICK_MS ) <= 0 ) {
+            continue;
+        }
+
+        int client_fd = accept_client( tcp_sock );
+
+        if ( client_fd < 0 ) {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ){
+                log_msg( LOG_ERR, "accept: %s\n", strerror( errno ) );
+            }
+            continue;
+        }
+
+        /* Create a thread to deal with client and retun to listening. */
+        client_ctx_t * ctx = session_create( client_fd );
+        if ( !ctx ) {
+            close( client_fd );
+            continue;
+        }
+
+        session_start_thread( ctx );
+    }
+}
+
+static void * acceptor_thread( void * arg ) {
+
+    acceptor_t * a = arg;
+
+    accept_loop( a->srv, a->listen_fd );
+    return NULL;
+}
+
+/*
+ * @brief  Thread per connection model.
+ *
+ * @details With --reuse-port every acceptor owns a SO_REUSEPORT shard, the
+ * model thread serves the first one. Client threads inherit the CPU of
+ * a pinned acceptor.
+ */
+static void serve_threads( chat_server_t * srv ) {
+
+    const server_config_t * cfg = &srv->cfg;
+    int acceptors = 1;
+    int started = 1;
+
+    if ( cfg->reuse_port ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        acceptors = cfg->threads > 0 ? cfg->threads : ( cpus > 0 ? ( int ) cpus : 1 );
+    }
+
+    acceptor_t * acc = calloc( acceptors, sizeof( *acc ) );
+
+    for ( int i = 1; acc && i < acceptors; ++i, ++started ) {
+
+        acc[i].srv       = srv;
+        acc[i].listen_fd = start_tcp_shard( srv->tcp_sock, cfg->backlog );
+        if ( acc[i].listen_fd < 0 ){
+            break;                                  // the ones already running keep going
+        }
+
+        if ( pthread_create( &acc[i].tid, NULL, acceptor_thread, &acc[i] ) != 0 ) {
+            log_msg( LOG_ERR, "pthread_create acceptor: %s\n", strerror( errno ) );
+            close( acc[i].listen_fd );
+            break;
+        }
+        if ( cfg->pin ){
+            pin_thread( acc[i].tid, i );
+        }
+    }
+
+    if ( cfg->pin ){
+        pin_thread( pthread_self(), 0 );
+    }
+    log_msg( LOG_INFO, "%d acceptor(s) running\n", started );
+
+    /* clients taken over from the previous server */
+    int count;
+    client_ctx_t ** adopted = sessions_adopted( &count );
+    for ( int i = 0; i < count; ++i ){
+        session_start_thread( adopted[i] );
+    }
+    free( adopted );
+
+    accept_loop( srv, srv->tcp_sock );
+
+    for ( int i = 1; i < started; ++i ){
+        pthread_join( acc[i].tid, NULL );
+        close( acc[i].listen_fd );
+    }
+    free( acc );
+}
+
+static void * model_thread( void * arg ) {
+
+    chat_server_t * srv = arg;
+
+    if ( srv->cfg.mode == SERVER_MODE_EPOLL ) {
+        srv->model_rc = reactor_run( srv->tcp_sock, &srv->cfg, &srv->running );
+    } else if ( srv->cfg.mode == SERVER_MODE_URING ) {
+        srv->model_rc = uring_run( srv->tcp_sock, &srv->cfg, &srv->running );
+    } else {
+        serve_threads( srv );
+    }
+    return NULL;
+}
+
+/* gauges of the running server for metrics_format() */
+static void server_metrics( metrics_text_t * out, void * arg ) {
+
+    static const char * const mode_names[] = { "threads", "epoll", "uring" };
+    chat_server_t * srv = arg;
+    admission_stats_t st;
+
+    admission_stats( &st );
+    metrics_printf( out, "server_port %u\nserver_mode %s\nserver_uptime_s %llu\n",
+                    srv->port, mode_names[ srv->cfg.mode ],
+                    ( unsigned long long ) ( ( metrics_now() - srv->started_at ) / 1000000000u ) );
+    metrics_printf( out, "connections %d\nconnections_pending %d\nadmitted %llu\n"
+                    "rejected_full %llu\nrejected_per_ip %llu\nrejected_pending %llu\n",
+                    st.connections, st.pending, ( unsigned long long ) st.admitted,
+                    ( unsigned long long ) st.rejected_full,
+                    ( unsigned long long ) st.rejected_per_ip,
+                    ( unsigned long long ) st.rejected_pending );
+}
+
+/*
+ * @brief  Local metrics endpoint - every connection gets metrics_format().
+ *
+ * @details Answers like a minimal HTTP/1.0 server (curl, a scraper) and
+ * just as well to a bare `nc`: the request is read for at most
+ * STATS_READ_MS. Only `GET /trace` is told apart - it gets the request
+ * trace (trace_write()) instead. Bound to 127.0.0.1 only.
+ */
+static void * stats_thread( void * arg ) {
+
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+    static const char json[]   = "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\n\r\n";
+    chat_server_t * srv = arg;
+    struct pollfd pfd = { .fd = srv->stats_sock, .events = POLLIN };
+    char * text = malloc( METRICS_TEXT_MAX );
+
+    while ( text && srv->running ) {
+
+        if ( poll( &pfd, 1, ACCEPT_TICK_MS ) <= 0 ) {
+            continue;
+        }
+
+        int fd = accept4( srv->stats_sock, NULL, NULL, SOCK_CLOEXEC );
+        if ( fd < 0 ) {
+            continue;
+        }
+
+        char req[ 512 ];
+        ssize_t got = 0;
+        struct pollfd cfd = { .fd = fd, .events = POLLIN };
+        if ( poll( &cfd, 1, STATS_READ_MS ) > 0 &&
+             ( got = recv( fd, req, sizeof( req ), MSG_DONTWAIT ) ) < 0 ){
+            log_msg( LOG_DEBUG, "[stats] recv: %s\n", strerror( errno ) );
+        }
+
+        if ( got >= 10 && memcmp( req, "GET /trace", 10 ) == 0 ) {
+            FILE * out = fdopen( fd, "w" );
+            if ( !out ) {
+                close( fd );
+                continue;
+            }
+            fputs( json, out );
+            trace_write( out );
+            fclose( out );                          // closes fd
+            continue;
+        }
+
+        size_t len = metrics_format( text, METRICS_TEXT_MAX );
+        if ( send( fd, header, sizeof( header ) - 1, MSG_NOSIGNAL ) < 0 ||
+             send( fd, text, len, MSG_NOSIGNAL ) < 0 ){
+            log_msg( LOG_DEBUG, "[stats] send: %s\n", strerror( errno ) );
+        }
+        close( fd );
+    }
+
+    free( text );
+    return NULL;
+}
+
+/*
+ * @brief  Opens the local metrics endpoint on 127.0.0.1:port.
+ *
+ * @return int Listening socket, -1 on failure.
+ */
+static int stats_listen( uint16_t port ) {
+
+    struct sockaddr_in addr;
+    int reuse = 1;
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+    if ( fd < 0 ){
+        return -1;
+    }
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );  // live restart: both servers bind it for a moment
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    if ( bind( fd, ( struct sockaddr * ) &addr, sizeof( addr ) ) < 0 || listen( fd, 16 ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * @brief  A successor connected (handoff_listen()) - stop and hand over.
+ */
+static void handoff_requested( int ctl ) {
+
+    pthread_mutex_lock( &current_lock );
+    if ( !current ) {
+        pthread_mutex_unlock( &current_lock );
+        close( ctl );                               // stopped meanwhile, nothing to hand over
+        return;
+    }
+    current->handoff_ctl = ctl;
+    sessions_freeze();
+    current->running = 0;
+    pthread_mutex_unlock( &current_lock );
+}
+
+/*
+ * @brief  Sessions taken over but never given to a connection model.
+ */
+static void drop_adopted( void ) {
+
+    int count;
+    client_ctx_t ** adopted = sessions_adopted( &count );
+
+    for ( int i = 0; i < count; ++i ){
+        session_destroy( adopted[i] );
+    }
+    free( adopted );
+}
+
+chat_server_t * chat_server_start( const server_config_t * cfg ) {
+
+    pthread_mutex_lock( &current_lock );
+    int busy = current != NULL;
+    pthread_mutex_unlock( &current_lock );
+    if ( busy ) {
+        log_msg( LOG_ERR, "[server] a server is already running in this process\n" );
+        return NULL;
+    }
+
+    chat_server_t * srv = calloc( 1, sizeof( *srv ) );
+    if ( !srv ){
+        return NULL;
+    }
+    srv->cfg         = *cfg;
+    srv->running     = 1;
+    srv->tcp_sock    = -1;
+    srv->handoff_ctl = -1;
+    srv->stats_sock  = -1;
+    srv->started_at  = metrics_now();
+
+    log_start( &cfg->log );             // failure only means synchronous syslog
+    trace_start( &cfg->trace );         // failure only means no dump on SIGHUP
+
+    if ( data_dir_set( cfg->data_dir ) < 0 ) {
+        free( srv );
+        return NULL;
+    }
+    if ( groups_load() < 0 ){
+        log_msg( LOG_WARNING, "[groups] %s not readable, starting without groups\n", groups_dir() );
+    }
+
+    raise_fd_limit();                   // before outq_init() sizes its table
+    outq_init( &srv->cfg.outq );        // failure only means blocking writes
+    admission_init( &srv->cfg.admit );  // connection budget follows the descriptor limit
+    sessions_init( &srv->cfg );         // without the wheel sessions just never expire
+
+    /* live restart - the running server hands over its sockets */
+    if ( cfg->handoff_path ) {
+        int ctl = handoff_connect( cfg->handoff_path );
+        if ( ctl >= 0 ) {
+            srv->tcp_sock = sessions_adopt( ctl );
+            close( ctl );
+        }
+    }
+
+    if ( srv->tcp_sock < 0 ) {
+        srv->tcp_sock = start_tcp_server( cfg->port, cfg->backlog, cfg->reuse_port );
+    }
+    if ( srv->tcp_sock < 0 ) {
+        drop_adopted();
+        free( srv );
+        return NULL;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof( addr );
+    srv->port = cfg->port;
+    if ( getsockname( srv->tcp_sock, ( struct sockaddr * ) &addr, &len ) == 0 ){
+        srv->port = ntohs( addr.sin_port );         // taken over or picked by the kernel
+    }
+
+    if ( cfg->discovery ) {
+        srv->mcast.mcast_addr = CHAT_MCAST_ADDR;    //configuration for multicast server
+        srv->mcast.mcast_port = CHAT_MCAST_PORT;
+        srv->mcast.tcp_port   = srv->port;
+        srv->mcast.running    = &srv->running;
+
+        if ( pthread_create( &srv->mcast_tid, NULL, multicast_thread, &srv->mcast ) != 0 ) {
+            log_msg( LOG_WARNING, "[server] no multicast discovery: %s\n", strerror( errno ) );
+        } else {
+            srv->mcast_started = 1;
+        }
+    }
+
+    if ( cfg->stats_port ) {
+        srv->stats_sock = stats_listen( cfg->stats_port );
+        if ( srv->stats_sock < 0 ) {
+            log_msg( LOG_WARNING, "[server] no stats endpoint on port %u: %s\n",
+                     cfg->stats_port, strerror( errno ) );
+        } else if ( pthread_create( &srv->stats_tid, NULL, stats_thread, srv ) != 0 ) {
+            log_msg( LOG_WARNING, "[server] no stats endpoint: %s\n", strerror( errno ) );
+            close( srv->stats_sock );
+            srv->stats_sock = -1;
+        } else {
+            log_msg( LOG_INFO, "[server] metrics on 127.0.0.1:%u\n", cfg->stats_port );
+        }
+    }
+    metrics_add_source( server_metrics, srv );
+
+    pthread_mutex_lock( &current_lock );
+    current = srv;
+    pthread_mutex_unlock( &current_lock );
+
+    if ( cfg->handoff_path ) {
+        handoff_listen( cfg->handoff_path, handoff_requested );
+    }
+
+    static const char * const mode_names[] = { "threads", "epoll", "uring" };
+    log_msg( LOG_INFO, "Connection model: %s, port %u\n", mode_names[ cfg->mode ], srv->port );
+
+    if ( pthread_create( &srv->model, NULL, model_thread, srv ) != 0 ) {
+        log_msg( LOG_ERR, "[server] connection model not started: %s\n", strerror( errno ) );
+        srv->running = 0;
+        pthread_mutex_lock( &current_lock );
+        current = NULL;
+        pthread_mutex_unlock( &current_lock );
+        if ( srv->mcast_started ){
+            pthread_join( srv->mcast_tid, NULL );
+        }
+        if ( srv->stats_sock >= 0 ) {
+            pthread_join( srv->stats_tid, NULL );
+            close( srv->stats_sock );
+        }
+        metrics_remove_source( server_metrics, srv );
+        drop_adopted();
+        close( srv->tcp_sock );
+        free( srv );
+        return NULL;
+    }
+
+    return srv;
+}
+
+uint16_t chat_server_port( const chat_server_t * srv ) {
+
+    return srv->port;
+}
+
+void chat_server_shutdown( chat_server_t * srv ) {
+
+    srv->running = 0;
+}
+
+int chat_server_wait( chat_server_t * srv ) {
+
+    pthread_join( srv->model, NULL );
+    srv->running = 0;                               // a failed model stops discovery too
+
+    /* from here on a successor is turned away */
+    pthread_mutex_lock( &current_lock );
+    current = NULL;
+    pthread_mutex_unlock( &current_lock );
+
+    if ( srv->handoff_ctl >= 0 ) {
+        sessions_quiesce( HANDOFF_QUIESCE_MS );
+        sessions_handoff( srv->handoff_ctl, srv->tcp_sock );
+        close( srv->handoff_ctl );
+    } else {
+        sessions_close( CHAT_CLOSE_MS );
+    }
+
+    if ( srv->mcast_started ){
+        pthread_join( srv->mcast_tid, NULL );
+    }
+    if ( srv->stats_sock >= 0 ) {
+        pthread_join( srv->stats_tid, NULL );
+        close( srv->stats_sock );
+    }
+    metrics_remove_source( server_metrics, srv );
+    close( srv->tcp_sock );
+
+    if ( srv->cfg.trace.path ){
+        trace_dump();                               // what the last requests did
+    }
+
+    int rc = srv->model_rc;
+    log_msg( LOG_INFO, "[server] stopped (port %u)\n", srv->port );
+    log_flush();                                    // the process may exit right away
+    free( srv );
+    return rc;
+}
+
+int chat_server_stop( chat_server_t * srv ) {
+
+    chat_server_shutdown( srv );
+    return chat_server_wait( srv );
+}
@@ -42,6 +42,14 @@ int main( void ) {
         return 1;
     }
 
+    /* agree on the wire mode before anything else is sent */
+    proto_caps_t caps;
+    if ( client_hello( sock, &caps ) < 0 ) {
+        fprintf( stderr, "Handshake failed\n" );
+        close( sock );
+        return 1;
+    }
+
     /* User interface begins - start menu*/
     char input[ 128 ];
     char login[ MAX_USERNAME_LEN ];
@@ -134,7 +142,9 @@ int main( void ) {
     client_ctx_t ctx = {
         .sock = sock,
         .running = 1,
-        .in_chat = 0
+        .in_chat = 0,
+        .next_request_id = CLIENT_SYNC_REQUEST_ID,  // async ids start after it
+        .caps = caps
     };
 
     pthread_mutex_init( &print_mutex, NULL );
@@ -182,9 +192,9 @@ int main( void ) {
 
                 int lines = 0;   // whole history
                 if (ctx.in_chat){
-                    client_get_history( sock, ctx.chat_user, lines );
+                    client_get_history( sock, client_request_begin( &ctx, PENDING_NONE ), ctx.chat_user, lines );
                 } else if (ctx.in_group_chat){
-                    client_get_history( sock, ctx.chat_group, lines);
+                    client_get_history( sock, client_request_begin( &ctx, PENDING_NONE ), ctx.chat_group, lines);
                 }
                 continue;
             } else if ( strncmp( cmd, "/history", 8 ) == 0 ) {
@@ -198,9 +208,9 @@ int main( void ) {
                 }
             
                 if (ctx.in_chat){
-                    client_get_history( sock, ctx.chat_user, n );
+                    client_get_history( sock, client_request_begin( &ctx, PENDING_NONE ), ctx.chat_user, n );
                 } else if (ctx.in_group_chat){
-                    client_get_history( sock, ctx.chat_group, n);
+                    client_get_history( sock, client_request_begin( &ctx, PENDING_NONE ), ctx.chat_group, n);
                 }
                 continue;
             } 
@@ -210,6 +220,7 @@ int main( void ) {
 
                 client_send_message(
                     ctx.sock,
+                    client_request_begin( &ctx, PENDING_NONE ),
                     ctx.chat_user,
                     cmd
                 );
@@ -218,6 +229,7 @@ int main( void ) {
 
                 client_send_group_message(
                     ctx.sock,
+                    client_request_begin( &ctx, PENDING_NONE ),
                     ctx.chat_group,
                     cmd
                 );
@@ -237,6 +249,7 @@ int main( void ) {
                 "  /group_join <name>\n"
                 "  /users\n"
                 "  /groups\n"
+                "  /stats\n"
                 "  /change_password\n"
                 "  /change_username\n"
                 "  /group_create\n"
@@ -245,7 +258,11 @@ int main( void ) {
 
         } else if ( strcmp( cmd, "/users" ) == 0 ) {
 
-            client_get_active_users( sock );        //corrected
+            client_get_active_users( sock, client_request_begin( &ctx, PENDING_NONE ) );        //corrected
+
+        } else if ( strcmp( cmd, "/stats" ) == 0 ) {
+
+            client_get_stats( sock, client_request_begin( &ctx, PENDING_NONE ) );
 
         } else if ( strcmp( cmd, "/change_password" ) == 0 ) {
 
@@ -255,32 +272,37 @@ int main( void ) {
             read_line(ANSI_COLOR_CYAN "Current password: ", old_pass, sizeof( old_pass ) );
             read_line(ANSI_COLOR_CYAN "New password: "ANSI_COLOR_RESET, new_pass, sizeof( new_pass ) );
 
-            ctx.pending = PENDING_CHANGE_PASSWORD;
-            client_change_password( sock, old_pass, new_pass ); //corrected
+            client_change_password(
+                sock,
+                client_request_begin( &ctx, PENDING_CHANGE_PASSWORD ),
+                old_pass,
+                new_pass
+            );
 
         } else if ( strcmp( cmd, "/change_username" ) == 0 ) {
 
             char new_name[ MAX_USERNAME_LEN ];
             read_line(ANSI_COLOR_CYAN "New username: "ANSI_COLOR_RESET, new_name, sizeof( new_name ) );
 
-            ctx.pending = PENDING_CHANGE_USERNAME;
-            client_change_username( sock, new_name );   //corrected
+            client_change_username(
+                sock,
+                client_request_begin( &ctx, PENDING_CHANGE_USERNAME ),
+                new_name
+            );
 
         } else if (strcmp(cmd, "/group_create") == 0) {
 
             char groupname[MAX_GROUP_NAME_LEN];
             read_line("Group name: ", groupname, sizeof(groupname));
             
-            ctx.pending = PENDING_GROUP_CREATE;
-            client_group_create(sock, groupname);
+            client_group_create(sock, client_request_begin(&ctx, PENDING_GROUP_CREATE), groupname);
 
         } else if (strcmp(cmd, "/groups") == 0) {
 
-            client_group_list(sock);
+            client_group_list(sock, client_request_begin(&ctx, PENDING_NONE));
 
         } else if (strncmp(cmd, "/group_join ", 12) == 0) {
-            ctx.pending = PENDING_GROUP_JOIN;
-            client_group_join(sock, cmd + 12);
+            client_group_join(sock, client_request_begin(&ctx, PENDING_GROUP_JOIN), cmd + 12);
 
         } else if ( strncmp( cmd, "/msg ", 5 ) == 0 ) {
 
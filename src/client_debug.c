@@ -64,11 +64,11 @@ int main( void ) {
         if ( client_login( sock, login, password ) == 0 ) {
             printf("Login successful\n");
             //getchar();   // debug  
-            client_get_active_users( sock );        //debug
+            client_get_active_users( sock, 0 );     //debug - no receiving thread, uncorrelated
             printf("Press Enter to logout...\n");   //debug
             getchar();                              //debug
             //client_change_password( sock, "sekret123" );
-            client_change_username( sock, "Nowe miano");
+            client_change_username( sock, 0, "Nowe miano");
         } else {
             printf("Login failed\n");
         }
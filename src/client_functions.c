@@ -5,10 +5,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <sys/types.h>
+#include <sys/time.h>     // struct timeval (SO_RCVTIMEO)
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "protocol.h"
@@ -138,74 +141,198 @@ int client_connect_tcp(
         return -1;
     }
 
+    /* every request is written at once (send_tlvv) -> Nagle only adds delay */
+    int one = 1;
+    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+
     return sock;
 }
 
-int client_login(
+/*
+ * @brief  Sends a command frame the way this client wants its answers.
+ *
+ * @details Every request says it accepts compressed answers
+ * (CMD_FRAME_FLAG_LZ); the receiving side inflates them transparently.
+ */
+int client_send_cmd(
     int sock,
-    const char * login,
-    const char * password
+    uint16_t command,
+    uint32_t request_id,
+    const tlv_vec_t * fields,
+    size_t count
+) {
+    tlv_batch_t batch;
+
+    tlv_batch_begin( &batch, sock );
+
+    if ( tlv_batch_add_frame( &batch, TLV_FRAME, command, request_id,
+                              CMD_FRAME_FLAG_LZ, fields, count ) < 0 ){
+        return -1;
+    }
+
+    return tlv_batch_flush( &batch );
+}
+
+/*
+ * @brief  Waits for the answer to a synchronous request.
+ *
+ * @details Used before the receiving thread runs (hello, login, account
+ * creation). The answer is a TLV_RESPONSE with our request id - answers
+ * to other ids (a late HELLO) are skipped - or a bare TLV from an older
+ * server, which is returned as a frame with that single field.
+ *
+ * @param  buf Receive buffer, the fields of `frame` point into it.
+ * @return int 0 when an answer was received, -1 on error (errno is kept).
+ */
+static int recv_sync_reply(
+    int sock,
+    uint32_t request_id,
+    uint8_t * buf,
+    size_t cap,
+    cmd_frame_t * frame
 ) {
     uint16_t type;
     uint16_t len;
-    void * data = NULL;
 
-    command_t cmd = CMD_LOGIN;
+    for (;;) {
+
+        if ( recv_tlv_into( sock, &type, buf, cap, &len ) < 0 ) {
+            return -1;
+        }
+
+        if ( type != TLV_RESPONSE ) {
+            frame->request_id = 0;
+            frame->count      = 1;
+            frame->fields[0]  = ( tlv_view_t ){ type, len, buf };
+            return 0;
+        }
+
+        if ( cmd_frame_parse( buf, len, frame ) < 0 ) {
+            return -1;
+        }
+        if ( frame->request_id == request_id ) {
+            return 0;
+        }
+    }
+}
 
-    /* 1. send command */
-    if ( send_tlv(
-            sock,
-            TLV_COMMAND,
-            &cmd,
-            sizeof( cmd )
-        ) < 0 ) {
-        perror( "send_tlv COMMAND" );
-        return -1;
+/* first TLV_STATUS field of an answer */
+static int frame_status( const cmd_frame_t * frame, status_t * status ) {
+
+    for ( int i = 0; i < frame->count; ++i ) {
+        if ( frame->fields[i].type == TLV_STATUS &&
+             frame->fields[i].len == sizeof( status_t ) ) {
+            memcpy( status, frame->fields[i].data, sizeof( status_t ) );
+            return 0;
+        }
     }
 
-    /* 2. send login */
-    if ( send_tlv(
-            sock,
-            TLV_LOGIN,
-            login,
-            strlen( login )
-        ) < 0 ) {
-        perror( "send_tlv LOGIN" );
+    return -1;
+}
+
+/*
+ * @brief  Waits for the status answer to a synchronous request.
+ *
+ * @return int 0 when a status was received, -1 on error.
+ */
+static int recv_status_reply( int sock, uint32_t request_id, status_t * status ) {
+
+    uint8_t buf[ 256 ];
+    cmd_frame_t frame;
+
+    if ( recv_sync_reply( sock, request_id, buf, sizeof( buf ), &frame ) < 0 ) {
+        perror( "recv_tlv STATUS" );
         return -1;
     }
 
-    /* 3. send password */
-    if ( send_tlv(
-            sock,
-            TLV_PASSWORD,
-            password,
-            strlen( password )
-        ) < 0 ) {
-        perror( "send_tlv PASSWORD" );
+    return frame_status( &frame, status );
+}
+
+int client_hello( int sock, proto_caps_t * agreed ) {
+
+    proto_caps_t self = { PROTO_VERSION, TLV_EXT_MAX_LENGTH, CLIENT_FEATURES };
+    hello_t hello;
+    uint8_t buf[ 256 ];
+    cmd_frame_t frame;
+    status_t status = STATUS_ERROR;
+
+    /* mode of a server without the handshake */
+    agreed->version   = 0;
+    agreed->max_frame = TLV_EXT_MAX_LENGTH;
+    agreed->features  = PROTO_FEAT_FRAME_V2 | PROTO_FEAT_LZ;
+
+    hello_init( &hello, &self );
+    tlv_vec_t req[] = {
+        { TLV_HELLO, &hello, sizeof( hello ) }
+    };
+
+    if ( client_send_cmd( sock, CMD_HELLO, CLIENT_HELLO_REQUEST_ID, req, 1 ) < 0 ) {
+        perror( "send_cmd_frame HELLO" );
         return -1;
     }
 
-    /* 4. receive status */
-    if ( recv_tlv(
-            sock,
-            &type,
-            &data,
-            &len
-        ) < 0 ) {
-        perror( "recv_tlv STATUS" );
-        return -1;
+    /* old servers ignore unknown commands - do not wait forever for an answer */
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    int ready;
+    while ( ( ready = poll( &pfd, 1, CLIENT_HELLO_TIMEOUT * 1000 ) ) < 0 && errno == EINTR ){
+        ;
+    }
+    if ( ready == 0 ) {
+        return 0;                               // fallback mode, a late answer has its own id
     }
 
-    if ( type != TLV_STATUS || len != sizeof( status_t ) ) {
-        fprintf( stderr, "client_login: unexpected TLV\n" );
-        free( data );
+    /* the answer has started - a stall inside a TLV leaves the stream out of step */
+    struct timeval tv = { CLIENT_HELLO_TIMEOUT, 0 };
+    setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+
+    int rc = ready < 0 ? -1 : recv_sync_reply( sock, CLIENT_HELLO_REQUEST_ID, buf, sizeof( buf ), &frame );
+
+    tv.tv_sec = 0;
+    setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+
+    if ( rc < 0 ) {
+        perror( "recv_tlv HELLO" );
+        return -1;                              // caller closes the connection
+    }
+
+    if ( frame_status( &frame, &status ) < 0 || status != STATUS_OK ) {
+        return 0;                               // server does not know CMD_HELLO
+    }
+
+    for ( int i = 0; i < frame.count; ++i ) {
+        if ( frame.fields[i].type == TLV_HELLO ) {
+            return hello_parse( &frame.fields[i], agreed ) < 0 ? -1 : 0;
+        }
+    }
+
+    return -1;
+}
+
+int client_login(
+    int sock,
+    const char * login,
+    const char * password
+) {
+    command_t cmd = CMD_LOGIN;
+
+    /* 1-3. command, login and password in one compound frame */
+    tlv_vec_t req[] = {
+        { TLV_LOGIN,    login,    strlen( login ) },
+        { TLV_PASSWORD, password, strlen( password ) }
+    };
+
+    if ( client_send_cmd( sock, cmd, CLIENT_LOGIN_REQUEST_ID, req, 2 ) < 0 ) {
+        perror( "send_cmd_frame LOGIN" );
         return -1;
     }
 
+    /* 4. receive status - no allocation */
     status_t status;
 
-    memcpy( &status, data, sizeof( status ) );
-    free( data );
+    if ( recv_status_reply( sock, CLIENT_LOGIN_REQUEST_ID, &status ) < 0 ) {
+        fprintf( stderr, "client_login: unexpected TLV\n" );
+        return -1;
+    }
 
     if ( status != STATUS_OK ) {
         printf( "Login failed: %s\n", status_to_string( status ) );
@@ -222,91 +349,48 @@ int client_create_account(
     const char * password,
     const char * username
 ) {
-    uint16_t type;
-    uint16_t len;
-    void * data = NULL;
-
     command_t cmd = CMD_CREATE_ACCOUNT;
 
-    /* 1. send command */
-    if ( send_tlv(
-            sock,
-            TLV_COMMAND,
-            &cmd,
-            sizeof( cmd )
-        ) < 0 ) {
-        perror( "send_tlv COMMAND" );
-        return -1;
-    }
-
-    /* 2. send login */
-    if ( send_tlv(
-            sock,
-            TLV_LOGIN,
-            login,
-            strlen( login )
-        ) < 0 ) {
-        perror( "send_tlv LOGIN" );
-        return -1;
-    }
-
-    /* 3. send password */
-    if ( send_tlv(
-            sock,
-            TLV_PASSWORD,
-            password,
-            strlen( password )
-        ) < 0 ) {
-        perror( "send_tlv PASSWORD" );
-        return -1;
-    }
+    /* 1-4. command, login, password and username in one compound frame */
+    tlv_vec_t req[] = {
+        { TLV_LOGIN,    login,    strlen( login ) },
+        { TLV_PASSWORD, password, strlen( password ) },
+        { TLV_USERNAME, username, strlen( username ) }
+    };
 
-    /* 4. send username */
-    if ( send_tlv(
-            sock,
-            TLV_USERNAME,
-            username,
-            strlen( username )
-        ) < 0 ) {
-        perror( "send_tlv USERNAME" );
+    if ( client_send_cmd( sock, cmd, CLIENT_CREATE_REQUEST_ID, req, 3 ) < 0 ) {
+        perror( "send_cmd_frame CREATE_ACCOUNT" );
         return -1;
     }
 
     /* 5. receive status */
-    if ( recv_tlv(
-            sock,
-            &type,
-            &data,
-            &len
-        ) < 0 ) {
-        perror( "recv_tlv STATUS" );
-        return -1;
-    }
+    status_t status;
 
-    if ( type != TLV_STATUS || len != sizeof( status_t ) ) {
+    if ( recv_status_reply( sock, CLIENT_CREATE_REQUEST_ID, &status ) < 0 ) {
         fprintf( stderr, "client_create_account: unexpected TLV\n" );
-        free( data );
         return -1;
     }
 
-    status_t status;
-    memcpy( &status, data, sizeof( status ) );
-    free( data );
-
     return ( status == STATUS_OK ) ? 0 : -1;
 }
 
 int client_change_password(
     int sock,
+    uint32_t request_id,
     const char * old_password,
     const char * new_password
 ) {
     
     command_t cmd = CMD_CHANGE_PASSWORD;
 
-    send_tlv( sock, TLV_COMMAND, &cmd, sizeof( cmd ) );
-    send_tlv( sock, TLV_PASSWORD, old_password, strlen( old_password ) );
-    send_tlv( sock, TLV_PASSWORD, new_password, strlen( new_password ) );
+    tlv_vec_t req[] = {
+        { TLV_PASSWORD, old_password, strlen( old_password ) },
+        { TLV_PASSWORD, new_password, strlen( new_password ) }
+    };
+
+    if ( client_send_cmd( sock, cmd, request_id, req, 2 ) < 0 ){
+        return -1;
+    }
 
     
    
@@ -315,13 +399,19 @@ int client_change_password(
 
 int client_change_username(
     int sock,
+    uint32_t request_id,
     const char * new_username
 ) {
     
     command_t cmd = CMD_CHANGE_USERNAME;
 
-    send_tlv( sock, TLV_COMMAND, &cmd, sizeof( cmd ) );
-    send_tlv( sock, TLV_USERNAME, new_username, strlen( new_username ) );
+    tlv_vec_t req[] = {
+        { TLV_USERNAME, new_username, strlen( new_username ) }
+    };
+
+    if ( client_send_cmd( sock, cmd, request_id, req, 1 ) < 0 ){
+        return -1;
+    }
 
     
 
@@ -330,19 +420,20 @@ int client_change_username(
 }
 
 
-int client_get_active_users( int sock ) {
+int client_get_active_users( int sock, uint32_t request_id ) {
     // uint16_t type, len;  //old
     // void * data = NULL;
     command_t cmd = CMD_GET_ACTIVE_USERS;
 
     /* send command */
-    if ( send_tlv(
+    if ( client_send_cmd(
             sock,
-            TLV_COMMAND,
-            &cmd,
-            sizeof( cmd )
+            cmd,
+            request_id,
+            NULL,
+            0
         ) < 0 ) {
-        perror( "send_tlv COMMAND" );
+        perror( "send_cmd_frame COMMAND" );
         return -1;
     }
 
@@ -350,10 +441,20 @@ int client_get_active_users( int sock ) {
      return 0;
 }
 
+int client_get_stats( int sock, uint32_t request_id ) {
+
+    if ( client_send_cmd( sock, CMD_GET_STATS, request_id, NULL, 0 ) < 0 ) {
+        perror( "send_cmd_frame COMMAND" );
+        return -1;
+    }
+    return 0;
+}
+
 
 
 int client_send_message(
     int sock,
+    uint32_t request_id,
     const char * target,
     const char * message
 ) {
@@ -361,9 +462,14 @@ int client_send_message(
     // uint16_t type, len;  old
     // void * data = NULL;
 
-    send_tlv( sock, TLV_COMMAND, &cmd, sizeof( cmd ) );
-    send_tlv( sock, TLV_LOGIN, target, strlen( target ) );
-    send_tlv( sock, TLV_MESSAGE, message, strlen( message ) );
+    tlv_vec_t req[] = {
+        { TLV_LOGIN,   target,  strlen( target ) },
+        { TLV_MESSAGE, message, strlen( message ) }
+    };
+
+    if ( client_send_cmd( sock, cmd, request_id, req, 2 ) < 0 ){
+        return -1;
+    }
 
     /* wait for status in receiving thread */
     
@@ -373,18 +479,22 @@ int client_send_message(
 
 int client_get_history(
     int sock,
+    uint32_t request_id,
     const char * with_user,
     int lines
 ) {
     command_t cmd = CMD_GET_HISTORY;
 
-    send_tlv( sock, TLV_COMMAND, &cmd, sizeof( cmd ) );
-    send_tlv( sock, TLV_LOGIN, with_user, strlen( with_user ) );
-
-    
     uint16_t n = htons( lines );
-    send_tlv( sock, TLV_UINT16, &n, sizeof( n ) );
-    
+
+    tlv_vec_t req[] = {
+        { TLV_LOGIN,   with_user, strlen( with_user ) },
+        { TLV_UINT16,  &n,        sizeof( n ) }
+    };
+
+    if ( client_send_cmd( sock, cmd, request_id, req, 2 ) < 0 ){
+        return -1;
+    }
 
     return 0;
 }
@@ -13,27 +13,37 @@
 
 #include "client_groups.h"
 #include "client_ui.h"
+#include "client_functions.h"
 
-int client_group_create(int sock,  const char *groupname)
+int client_group_create(int sock, uint32_t request_id, const char *groupname)
 {
     command_t cmd = CMD_CREATE_GROUP;
    
-    send_tlv(sock, TLV_COMMAND, &cmd, sizeof(cmd));
-    send_tlv(sock, TLV_GROUPNAME, groupname, strlen(groupname));
+    tlv_vec_t req[] = {
+        { TLV_GROUPNAME, groupname, strlen(groupname) }
+    };
+
+    if (client_send_cmd(sock, cmd, request_id, req, 1) < 0)
+        return -1;
 
     return 0;   
 }
 
-int client_group_list(int sock) {
+int client_group_list(int sock, uint32_t request_id) {
     command_t cmd = CMD_LIST_GROUPS;
-    send_tlv(sock, TLV_COMMAND, &cmd, sizeof(cmd));
+    if (client_send_cmd(sock, cmd, request_id, NULL, 0) < 0)
+        return -1;
     return 0;   
 }
 
-int client_group_join(int sock, const char *name) {
+int client_group_join(int sock, uint32_t request_id, const char *name) {
     command_t cmd = CMD_JOIN_GROUP;
-    send_tlv(sock, TLV_COMMAND, &cmd, sizeof(cmd));
-    send_tlv(sock, TLV_GROUPNAME, name, strlen(name));
+    tlv_vec_t req[] = {
+        { TLV_GROUPNAME, name, strlen(name) }
+    };
+
+    if (client_send_cmd(sock, cmd, request_id, req, 1) < 0)
+        return -1;
     return 0;
 }
 
@@ -196,6 +206,7 @@ void leave_all_groups(client_ctx_t *ctx)
 
 int client_send_group_message(
     int sock,
+    uint32_t request_id,
     const char *groupname,
     const char *msg
 ) {
@@ -205,26 +216,13 @@ int client_send_group_message(
     if (!groupname || !msg || msg[0] == '\0')
         return -1;
 
-    /* ---- COMMAND ---- */
-    if (send_tlv(sock, TLV_COMMAND, &cmd, sizeof(cmd)) < 0)
-        return -1;
-
-    /* ---- GROUP NAME ---- */
-    if (send_tlv(
-            sock,
-            TLV_GROUPNAME,
-            groupname,
-            strlen(groupname)
-        ) < 0)
-        return -1;
+    /* ---- COMMAND + GROUP NAME + MESSAGE in one compound frame ---- */
+    tlv_vec_t req[] = {
+        { TLV_GROUPNAME, groupname, strlen(groupname) },
+        { TLV_MESSAGE,   msg,       strlen(msg) }
+    };
 
-    /* ---- MESSAGE ---- */
-    if (send_tlv(
-            sock,
-            TLV_MESSAGE,
-            msg,
-            strlen(msg)
-        ) < 0)
+    if (client_send_cmd(sock, cmd, request_id, req, 2) < 0)
         return -1;
 
     return 0;
@@ -4,12 +4,14 @@
 #include <unistd.h>     // close
 #include <stdint.h>     // uint16_t
 #include <pthread.h>
+#include <time.h>       // localtime_r, strftime
 
 
 #include "client_ui.h"
 #include "client_groups.h"
 
 pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int menu_start( void ) {
     int choice;
@@ -68,6 +70,9 @@ const char * status_to_string( status_t status ) {
     case STATUS_ALREADY_IN_GROUP:
         return "Already in group";
 
+    case STATUS_BUSY:
+        return "Server busy, try again later";
+
     case STATUS_ERROR:
     default:
         return "Operation failed";
@@ -152,64 +157,321 @@ void print_colored_history( const char * buf, size_t len ) {
 }
 
 
+uint32_t client_request_begin( client_ctx_t * ctx, pending_action_t action ) {
+
+    uint32_t id = 0;
+
+    pthread_mutex_lock( &pending_mutex );
+
+    for ( int i = 0; i < MAX_PENDING; ++i ) {
+        if ( ctx->pending[i].id == 0 ) {
+            if ( ++ctx->next_request_id == 0 ) {    // 0 means "no id"
+                ++ctx->next_request_id;
+            }
+            id = ctx->next_request_id;
+            ctx->pending[i].id     = id;
+            ctx->pending[i].action = action;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock( &pending_mutex );
+
+    /* the slot stays taken either way - a bare answer pops the oldest one */
+    return ( ctx->caps.features & PROTO_FEAT_REQUEST_ID ) ? id : 0;
+}
+
+pending_action_t client_request_end( client_ctx_t * ctx, uint32_t id ) {
+
+    pending_action_t action = PENDING_NONE;
+    int found = -1;
+
+    pthread_mutex_lock( &pending_mutex );
+
+    for ( int i = 0; i < MAX_PENDING; ++i ) {
+        if ( ctx->pending[i].id == 0 ) {
+            continue;
+        }
+        if ( id != 0 ) {
+            if ( ctx->pending[i].id == id ) {
+                found = i;
+                break;
+            }
+        } else if ( found < 0 ||
+                    /* oldest = furthest behind next_request_id (wrap safe) */
+                    ctx->pending[i].id - ctx->next_request_id <
+                    ctx->pending[found].id - ctx->next_request_id ) {
+            found = i;
+        }
+    }
+
+    if ( found >= 0 ) {
+        action = ctx->pending[found].action;
+        ctx->pending[found].id = 0;
+    }
+
+    pthread_mutex_unlock( &pending_mutex );
+    return action;
+}
+
+/*
+ * @brief  Shows one record of a streamed answer as soon as it arrives.
+ *
+ * @details History and user lists come in line aligned chunks, so every
+ * chunk can be printed on its own. END closes the request.
+ */
+static void handle_stream( client_ctx_t * ctx, const tlv_view_t * tlv ) {
+
+    tlv_stream_view_t sv;
+
+    if ( tlv_stream_parse( tlv, &sv ) < 0 ) {
+        return;
+    }
+
+    pthread_mutex_lock( &print_mutex );
+
+    if ( tlv->type == TLV_STREAM_BEGIN ) {
+
+        if ( sv.type == TLV_HISTORY ) {
+            printf(ANSI_COLOR_RED "\n  ======================= Chat history =======================\n" ANSI_COLOR_RESET);
+        } else if ( sv.type == TLV_ACTIVE_USERS ) {
+            printf(ANSI_COLOR_MAGENTA "\nActive users:\n" ANSI_COLOR_RESET);
+        } else if ( sv.type == TLV_STATS ) {
+            printf(ANSI_COLOR_MAGENTA "\nServer stats:\n" ANSI_COLOR_RESET);
+        }
+
+    } else if ( tlv->type == TLV_STREAM_CHUNK ) {
+
+        if ( sv.type == TLV_HISTORY ) {
+            print_colored_history( (const char *)sv.data, sv.len );
+        } else {
+            printf( ANSI_COLOR_CYAN );
+            fwrite( sv.data, 1, sv.len, stdout );
+            printf( ANSI_COLOR_RESET );
+        }
+
+    } else {
+
+        client_request_end( ctx, sv.request_id );
+
+        if ( sv.type == TLV_HISTORY ) {
+            printf(ANSI_COLOR_RED "============================================================\n"ANSI_COLOR_RESET"> " );
+        } else {
+            printf( "\n> " );
+        }
+    }
+
+    fflush( stdout );
+    pthread_mutex_unlock( &print_mutex );
+}
+
+/*
+ * @brief  Shows one answer TLV.
+ *
+ * @details Called for each field of a TLV_RESPONSE (with the action of the
+ * matched request) and for bare TLVs pushed by the server.
+ *
+ * @return int 0 to go on, -1 to stop receiving (protocol error).
+ */
+static int handle_reply( client_ctx_t * ctx, pending_action_t action, const tlv_view_t * tlv ) {
+
+    uint16_t type = tlv->type;
+    uint32_t len  = tlv->len;
+    const void * data = tlv->data;
+
+    if ( type == TLV_STATUS ) {
+
+        status_t st = STATUS_ERROR;
+        if ( len == sizeof( status_t ) ) {
+            memcpy( &st, data, sizeof( st ) );
+        }
+
+        pthread_mutex_lock( &print_mutex );
+        
+        if ( st == STATUS_OK ) {
+
+            if ( action == PENDING_CHANGE_PASSWORD ) {
+                printf( ANSI_COLOR_GREEN"\n[server] Password changed successfully\n" ANSI_COLOR_RESET"> " );
+            }
+            else if ( action == PENDING_CHANGE_USERNAME ) {
+                printf(ANSI_COLOR_GREEN "\n[server] Username changed successfully\n"ANSI_COLOR_RESET"> " );
+            }
+            else if ( action == PENDING_GROUP_CREATE ) {
+                printf(ANSI_COLOR_GREEN "\n[server] Group created successfully\n"ANSI_COLOR_RESET"> " );
+            }
+            else if ( action == PENDING_GROUP_JOIN ) {
+                printf(ANSI_COLOR_GREEN "\n[server] Group joined successfully\n"ANSI_COLOR_RESET"> " );
+            }
+            else {
+                //printf(ANSI_COLOR_GREEN "\n[server] Unknown OK\n"ANSI_COLOR_RESET"> " );
+            }
+        
+        } else {
+            printf(ANSI_COLOR_YELLOW
+                "\n[server] %s\n> "ANSI_COLOR_RESET,
+                status_to_string( st )
+            );
+        }
+
+        fflush( stdout );
+        pthread_mutex_unlock( &print_mutex );
+
+    } else if ( type == TLV_ACTIVE_USERS ) {
+
+        pthread_mutex_lock( &print_mutex );
+
+        printf(ANSI_COLOR_MAGENTA "\nActive users:\n" ANSI_COLOR_RESET ANSI_COLOR_CYAN);
+        fwrite( data, 1, len, stdout );
+        printf( "\n>" ANSI_COLOR_RESET);
+        fflush( stdout );
+
+        pthread_mutex_unlock( &print_mutex );
+
+    } else if ( type == TLV_STATS ) {
+
+        pthread_mutex_lock( &print_mutex );
+
+        printf(ANSI_COLOR_MAGENTA "\nServer stats:\n" ANSI_COLOR_RESET ANSI_COLOR_CYAN);
+        fwrite( data, 1, len, stdout );
+        printf( "\n>" ANSI_COLOR_RESET);
+        fflush( stdout );
+
+        pthread_mutex_unlock( &print_mutex );
+
+    } else if ( type == TLV_HISTORY ) {
+
+        pthread_mutex_lock( &print_mutex );
+        printf(ANSI_COLOR_RED "\n  ======================= Chat history =======================\n" ANSI_COLOR_RESET);
+        print_colored_history( (const char *)data, len );
+        printf(ANSI_COLOR_RED "============================================================\n"ANSI_COLOR_RESET"> " );
+        fflush( stdout );
+        pthread_mutex_unlock( &print_mutex );
+
+    } 
+    
+    else if (type == TLV_GROUP_LIST) {
+        pthread_mutex_lock(&print_mutex);
+        printf(ANSI_COLOR_MAGENTA"\nAvailable groups:\n"ANSI_COLOR_RESET ANSI_COLOR_CYAN);
+        fwrite(data, 1, len, stdout);
+        printf(ANSI_COLOR_RESET"> ");
+        fflush(stdout);
+        pthread_mutex_unlock(&print_mutex);
+    }
+    else if (type == TLV_GROUP_INFO) {
+
+         if (len != sizeof(group_info_t)) {
+            return -1;
+        }
+        
+        memcpy(&ctx->last_group, data, sizeof(group_info_t));
+    
+        pthread_mutex_lock(&print_mutex);
+    
+        
+        
+            if (!find_group_ctx(ctx, ctx->last_group.name)) {
+
+            if (ctx->group_count >= MAX_GROUPS) {
+                printf(ANSI_COLOR_RED"\n[group] too many groups\n> "ANSI_COLOR_RESET);
+            } else {
+                group_ctx_t *g = &ctx->groups[ctx->group_count++];
+                // printf( "DEBUG: \n %s, %s, %d\n",
+                //     ctx->last_group.name,
+                //     ctx->last_group.mcast_ip,
+                //     ctx->last_group.mcast_port);
+                join_multicast(
+                    g,
+                    ctx->last_group.name,
+                    ctx->last_group.mcast_ip,
+                    ctx->last_group.mcast_port
+                );
+            }
+        }
+            
+        
+        
+        fflush(stdout);
+        pthread_mutex_unlock(&print_mutex);
+    }
+
+    else {
+
+        pthread_mutex_lock( &print_mutex );
+        printf(ANSI_COLOR_RED "Unknown TLV!" ANSI_COLOR_RESET);
+        pthread_mutex_unlock( &print_mutex );
+
+    }
+
+    return 0;
+}
+
 // Thread that allows printing messeges.
 void * client_recv_thread( void * arg ) {
 
     client_ctx_t * ctx = arg;
-    uint16_t type, len;
-    void * data = NULL;
+    uint16_t type;
+    uint32_t len;
+    const void * data = NULL;   // borrowed from the reader - never freed
+    tlv_view_t tlv;
+    tlv_reader_t reader;        // buffered - many TLVs per read()
+    uint8_t * zbuf = NULL;      // inflated TLVs (compressed answers)
+    size_t zcap = 0;
+    uint8_t * zfield = NULL;    // inflated fields of a TLV_RESPONSE
+    size_t zfield_cap = 0;
+
+    if ( tlv_reader_init( &reader, ctx->sock ) < 0 ) {
+        ctx->running = 0;
+        return NULL;
+    }
 
     while ( ctx->running ) {
 
-        if ( recv_tlv( ctx->sock, &type, &data, &len ) < 0 ) {
+        if ( tlv_reader_next( &reader, &tlv ) < 0 ) {
             pthread_mutex_lock( &print_mutex );
             printf(ANSI_COLOR_RED "\n[disconnected from server]\n" ANSI_COLOR_RESET);
             pthread_mutex_unlock( &print_mutex );
             break;
         }
+        if ( tlv_view_inflate( &tlv, &zbuf, &zcap ) < 0 ) {
+            break;
+        }
+        type = tlv.type;
+        len  = tlv.len;
+        data = tlv.data;
 
         if ( type == TLV_LOGIN ) {
 
+            /* DM triplet of a server without TLV_DELIVERY */
             char login[ MAX_USERNAME_LEN ] = {0};
             char username[ MAX_USERNAME_LEN ] = {0};
 
-            if ( data && len > 0 ) {
-                size_t n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
-                memcpy( login, data, n );
-                login[n] = '\0';
-            }
-
-            free( data );
-            data = NULL;
+            /* copy - the view dies with the next read */
+            size_t n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
+            memcpy( login, data, n );
+            login[n] = '\0';
 
             /* expect USERNAME */
-            if ( recv_tlv( ctx->sock, &type, &data, &len ) < 0 )
+            if ( tlv_reader_next( &reader, &tlv ) < 0 )
                 break;
 
-            if ( type != TLV_USERNAME ) {
-                if ( data ) {
-                    free( data );
-                }
+            if ( tlv.type != TLV_USERNAME ) {
                 continue;
             }
         
-            if ( data && len > 0 ) {
-                strncpy( username, data, MAX_USERNAME_LEN - 1 );
-            }
-            free( data );
-            data = NULL;
+            n = tlv.len < MAX_USERNAME_LEN - 1 ? tlv.len : MAX_USERNAME_LEN - 1;
+            memcpy( username, tlv.data, n );
+            username[n] = '\0';
         
             /* expect MESSAGE */
-            if ( recv_tlv( ctx->sock, &type, &data, &len ) < 0 ){
+            if ( tlv_reader_next( &reader, &tlv ) < 0 ){
                 break;
             }
         
-            if ( type != TLV_MESSAGE ) {
-                if ( data ) {
-                    free( data );
-                }
+            if ( tlv.type != TLV_MESSAGE ) {
                 continue;
             }
+            len  = tlv.len;
+            data = tlv.data;
         
             pthread_mutex_lock( &print_mutex );
             printf(
@@ -221,141 +483,74 @@ void * client_recv_thread( void * arg ) {
             );
             fflush( stdout );
             pthread_mutex_unlock( &print_mutex );
-            
-        
-            free( data );
-            data = NULL;
 
-        } else if ( type == TLV_STATUS ) {
+        } else if ( type == TLV_DELIVERY ) {
 
-            status_t st = STATUS_ERROR;
-            if ( len == sizeof( status_t ) ) {
-                memcpy( &st, data, sizeof( st ) );
+            /* direct message - everything in one record */
+            delivery_t dm;
+            if ( delivery_parse( &tlv, &dm ) < 0 ) {
+                continue;
             }
-            free( data );
 
-            pthread_mutex_lock( &print_mutex );
-            
-            if ( st == STATUS_OK ) {
-
-                if ( ctx->pending == PENDING_CHANGE_PASSWORD ) {
-                    printf( ANSI_COLOR_GREEN"\n[server] Password changed successfully\n" ANSI_COLOR_RESET"> " );
-                }
-                else if ( ctx->pending == PENDING_CHANGE_USERNAME ) {
-                    printf(ANSI_COLOR_GREEN "\n[server] Username changed successfully\n"ANSI_COLOR_RESET"> " );
-                }
-                else if ( ctx->pending == PENDING_GROUP_CREATE ) {
-                    printf(ANSI_COLOR_GREEN "\n[server] Group created successfully\n"ANSI_COLOR_RESET"> " );
-                }
-                else if ( ctx->pending == PENDING_GROUP_JOIN ) {
-                    printf(ANSI_COLOR_GREEN "\n[server] Group joined successfully\n"ANSI_COLOR_RESET"> " );
-                }
-                else {
-                    //printf(ANSI_COLOR_GREEN "\n[server] Unknown OK\n"ANSI_COLOR_RESET"> " );
-                }
-            
-            } else {
-                printf(ANSI_COLOR_YELLOW
-                    "\n[server] %s\n> "ANSI_COLOR_RESET,
-                    status_to_string( st )
-                );
-            }
-            
-                ctx->pending = PENDING_NONE;
-            
+            time_t sec = ( time_t ) ( dm.timestamp_ms / 1000 );
+            struct tm tm;
+            char when[ 16 ];
+            localtime_r( &sec, &tm );
+            strftime( when, sizeof( when ), "%H:%M", &tm );
 
+            pthread_mutex_lock( &print_mutex );
+            printf(
+                ANSI_COLOR_YELLOW "\n  %s" ANSI_COLOR_RESET ANSI_COLOR_CYAN " <%s>"ANSI_COLOR_RESET ANSI_COLOR_GREEN"%s"ANSI_COLOR_RESET": %.*s\n> ",
+                when,
+                dm.login,
+                dm.username,
+                (int)dm.len,
+                dm.message
+            );
             fflush( stdout );
             pthread_mutex_unlock( &print_mutex );
 
-        } else if ( type == TLV_ACTIVE_USERS ) {
-
-            pthread_mutex_lock( &print_mutex );
+        } else if ( type == TLV_RESPONSE ) {
 
-            printf(ANSI_COLOR_MAGENTA "\nActive users:\n" ANSI_COLOR_RESET ANSI_COLOR_CYAN);
-            fwrite( data, 1, len, stdout );
-            printf( "\n>" ANSI_COLOR_RESET);
-            fflush( stdout );
+            /* answer to one of our requests - may come in any order */
+            cmd_frame_t frame;
+            if ( cmd_frame_parse( data, len, &frame ) < 0 ) {
+                continue;
+            }
 
-            pthread_mutex_unlock( &print_mutex );
+            pending_action_t action = client_request_end( ctx, frame.request_id );
 
-            free( data );
-            data = NULL;
+            int i = 0;
+            while ( i < frame.count &&
+                    tlv_view_inflate( &frame.fields[i], &zfield, &zfield_cap ) == 0 &&
+                    handle_reply( ctx, action, &frame.fields[i] ) == 0 ) {
+                i++;
+            }
+            if ( i < frame.count ) {
+                break;
+            }
 
-        } else if ( type == TLV_HISTORY ) {
+        } else if ( type == TLV_STREAM_BEGIN ||
+                    type == TLV_STREAM_CHUNK ||
+                    type == TLV_STREAM_END ) {
 
-            pthread_mutex_lock( &print_mutex );
-            printf(ANSI_COLOR_RED "\n  ======================= Chat history =======================\n" ANSI_COLOR_RESET);
-            print_colored_history( (char *)data, len );
-            printf(ANSI_COLOR_RED "============================================================\n"ANSI_COLOR_RESET"> " );
-            fflush( stdout );
-            pthread_mutex_unlock( &print_mutex );
+            handle_stream( ctx, &tlv );
 
-            free( data );
+        } else {
 
-        } 
-        
-        else if (type == TLV_GROUP_LIST) {
-            pthread_mutex_lock(&print_mutex);
-            printf(ANSI_COLOR_MAGENTA"\nAvailable groups:\n"ANSI_COLOR_RESET ANSI_COLOR_CYAN);
-            fwrite(data, 1, len, stdout);
-            printf(ANSI_COLOR_RESET"> ");
-            fflush(stdout);
-            pthread_mutex_unlock(&print_mutex);
-            free(data);
-        }
-        else if (type == TLV_GROUP_INFO) {
+            /* pushed TLV, or a bare status of a server without request ids */
+            pending_action_t action =
+                type == TLV_STATUS ? client_request_end( ctx, 0 ) : PENDING_NONE;
 
-             if (len != sizeof(group_info_t)) {
-                free(data);
+            if ( handle_reply( ctx, action, &tlv ) < 0 ) {
                 break;
             }
-            
-            memcpy(&ctx->last_group, data, sizeof(group_info_t));
-            
-        
-            free(data);
-        
-            pthread_mutex_lock(&print_mutex);
-        
-            
-            
-                if (!find_group_ctx(ctx, ctx->last_group.name)) {
-
-                if (ctx->group_count >= MAX_GROUPS) {
-                    printf(ANSI_COLOR_RED"\n[group] too many groups\n> "ANSI_COLOR_RESET);
-                } else {
-                    group_ctx_t *g = &ctx->groups[ctx->group_count++];
-                    // printf( "DEBUG: \n %s, %s, %d\n",
-                    //     ctx->last_group.name,
-                    //     ctx->last_group.mcast_ip,
-                    //     ctx->last_group.mcast_port);
-                    join_multicast(
-                        g,
-                        ctx->last_group.name,
-                        ctx->last_group.mcast_ip,
-                        ctx->last_group.mcast_port
-                    );
-                }
-            }
-                
-            
-            
-            fflush(stdout);
-            pthread_mutex_unlock(&print_mutex);
         }
-
-        else {
-
-            pthread_mutex_lock( &print_mutex );
-            printf(ANSI_COLOR_RED "Unknown TLV!" ANSI_COLOR_RESET);
-            pthread_mutex_unlock( &print_mutex );
-            free( data );
-
-        }
-
-        data = NULL;
     }
 
+    tlv_reader_free( &reader );
+    free( zbuf );
+    free( zfield );
     ctx->running = 0;
     return NULL;
 }
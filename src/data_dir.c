@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "data_dir.h"
+#include "log.h"
+
+static char root_dir[ DATA_PATH_MAX ]                = DATA_DIR_DEFAULT;
+static char users_path[ DATA_PATH_MAX + DATA_SUBDIR_LEN ]         = DATA_DIR_DEFAULT "/users/";
+static char history_path[ DATA_PATH_MAX + DATA_SUBDIR_LEN ]       = DATA_DIR_DEFAULT "/history/";
+static char groups_path[ DATA_PATH_MAX + DATA_SUBDIR_LEN ]        = DATA_DIR_DEFAULT "/groups/";
+
+/*
+ * @brief  mkdir -p
+ */
+static int make_dirs( const char * path ) {
+
+    char tmp[ DATA_PATH_MAX + DATA_SUBDIR_LEN ];
+
+    snprintf( tmp, sizeof( tmp ), "%s", path );
+
+    for ( char * p = tmp + 1; *p; ++p ) {
+        if ( *p == '/' ) {
+            *p = '\0';
+            if ( mkdir( tmp, 0755 ) < 0 && errno != EEXIST ){
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if ( mkdir( tmp, 0755 ) < 0 && errno != EEXIST ){
+        return -1;
+    }
+    return 0;
+}
+
+int data_dir_set( const char * root ) {
+
+    if ( !root ){
+        root = DATA_DIR_DEFAULT;
+    }
+
+    size_t len = strlen( root );
+    while ( len > 1 && root[ len - 1 ] == '/' ){
+        len--;                                      // "dir/" -> "dir"
+    }
+    if ( len == 0 || len >= sizeof( root_dir ) ) {
+        log_msg( LOG_ERR, "[data] bad data directory '%s'\n", root );
+        return -1;
+    }
+
+    memcpy( root_dir, root, len );
+    root_dir[ len ] = '\0';
+    snprintf( users_path, sizeof( users_path ), "%s/users/", root_dir );
+    snprintf( history_path, sizeof( history_path ), "%s/history/", root_dir );
+    snprintf( groups_path, sizeof( groups_path ), "%s/groups/", root_dir );
+
+    if ( make_dirs( users_path ) < 0 || make_dirs( history_path ) < 0 ||
+         make_dirs( groups_path ) < 0 ) {
+        log_msg( LOG_ERR, "[data] cannot create %s: %s\n", root_dir, strerror( errno ) );
+        return -1;
+    }
+
+    log_msg( LOG_INFO, "[data] data directory %s\n", root_dir );
+    return 0;
+}
+
+const char * data_dir( void ) {
+
+    return root_dir;
+}
+
+const char * users_dir( void ) {
+
+    return users_path;
+}
+
+const char * history_dir( void ) {
+
+    return history_path;
+}
+
+const char * groups_dir( void ) {
+
+    return groups_path;
+}
@@ -8,10 +8,16 @@
 #include <limits.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <errno.h>
 
 
 #include "groups.h"
+#include "history.h"
+#include "data_dir.h"
+#include "metrics.h"
+#include "log.h"
 
 
 //#define GROUPS_DIR "data/groups/"
@@ -20,255 +26,485 @@
 #define GROUP_MCAST_START 1
 //#define HISTORY_DIR "data/history/"
 
-extern pthread_mutex_t groups_mutex;
+#define GROUP_FILE_LOCKS 16     /* mutexes shared out over group files by name */
+
+/* one group of the index - what its file says */
+typedef struct {
+    group_info_t info;
+    char      ( *members )[ MAX_USERNAME_LEN ];     /* creator first */
+    int          count;
+    int          cap;
+} group_entry_t;
+
+/*
+ * The groups directory is read once (groups_load()) and every lookup is
+ * answered from memory, under groups_lock and without touching the disk.
+ * A change updates the index first and then rewrites the group's file
+ * from it, under one of GROUP_FILE_LOCKS mutexes picked by name: the
+ * last writer of a file always writes what the index holds by then.
+ */
+static pthread_rwlock_t groups_lock = PTHREAD_RWLOCK_INITIALIZER;
+static group_entry_t *  groups;
+static int              group_count;
+static int              group_cap;
+static uint32_t         max_id;
+
+static pthread_mutex_t  file_locks[ GROUP_FILE_LOCKS ];
+static pthread_once_t   file_locks_once = PTHREAD_ONCE_INIT;
+
+static void file_locks_init( void ) {
+
+    for ( int i = 0; i < GROUP_FILE_LOCKS; ++i ){
+        pthread_mutex_init( &file_locks[i], NULL );
+    }
+}
 
+static pthread_mutex_t * file_lock( const char * groupname ) {
 
-int group_exists( const char *groupname ) {
+    uint32_t h = 2166136261u;   /* FNV-1a */
 
-    char path[256];
-    snprintf(path, sizeof(path), "%s%s", GROUPS_DIR, groupname);
+    while ( *groupname ){
+        h = ( h ^ ( uint8_t ) *groupname++ ) * 16777619u;
+    }
 
-    return access(path, F_OK) == 0;
+    pthread_once( &file_locks_once, file_locks_init );
+    return &file_locks[ h % GROUP_FILE_LOCKS ];
 }
 
-int groups_next_id(void)
-{
-    DIR *dir = opendir(GROUPS_DIR);
-    if (!dir) return 1;
-
-    struct dirent *de;
-    int max_id = 0;
-    char path[1024];
-    char line[256];
-    FILE *f;
-    int id;
-
-    while ((de = readdir(dir))) {
-        if (de->d_name[0] == '.') continue;
-
-        snprintf(path, sizeof(path), "%s%s",GROUPS_DIR, de->d_name);
-        f = fopen(path, "r");
-        if (!f) continue;
-
-        while (fgets(line, sizeof(line), f)) {
-            if (sscanf(line, "id=%d", &id) == 1) {
-                if (id > max_id)
-                    max_id = id;
-                break;
-            }
+static group_entry_t * find_locked( const char * groupname ) {
+
+    for ( int i = 0; i < group_count; ++i ) {
+        if ( strcmp( groups[i].info.name, groupname ) == 0 ){
+            return &groups[i];
         }
-        fclose(f);
     }
-
-    closedir(dir);
-    return max_id + 1;
+    return NULL;
 }
 
+static int member_index( const group_entry_t * g, const char * login ) {
 
-int group_create(
-    const char *groupname,
-    const char *creator_login,
-    group_info_t *out
-) {
-    char path[256];
-    FILE *f;
-    //printf( "[DEBUG] Group create function: \n");  
-
-    snprintf(path, sizeof(path), "%s%s",GROUPS_DIR, groupname);
- 
-    /* grupa już istnieje */
-    if (access(path, F_OK) == 0) {
-        return -1;
+    for ( int i = 0; i < g->count; ++i ) {
+        if ( strcmp( g->members[i], login ) == 0 ){
+            return i;
+        }
     }
-    
+    return -1;
+}
 
-    int id = groups_next_id();
+static int member_add( group_entry_t * g, const char * login ) {
 
-    snprintf(out->name, sizeof(out->name), "%s", groupname);
-    snprintf(out->mcast_ip, sizeof(out->mcast_ip),
-             GROUP_MCAST_BASE "%d",
-             GROUP_MCAST_START + id);
-    out->mcast_port = GROUP_MCAST_PORT+id;
-    out->id = id;
+    size_t len = strlen( login );
 
-    f = fopen(path, "w");
-    if (!f) {
-        return -1;
+    if ( len >= MAX_USERNAME_LEN ){
+        return -1;                                  // cut it would be another login
     }
-
-    fprintf(f,
-        "id=%u\n"
-        "mcast=%s\n"
-        "port=%u\n"
-        "%s\n",
-        out->id,
-        out->mcast_ip,
-        out->mcast_port,
-        creator_login
-    );
-    
-
-    fclose(f);
-    
+    if ( g->count == g->cap ) {
+        int cap = g->cap ? g->cap * 2 : 8;
+        void * m = realloc( g->members, cap * sizeof( *g->members ) );
+        if ( !m ){
+            return -1;
+        }
+        g->members = m;
+        g->cap     = cap;
+    }
+    memcpy( g->members[ g->count++ ], login, len + 1 );
     return 0;
 }
 
-int group_has_user(const char *groupname, const char *login) {
-    char path[256];
-    snprintf(path, sizeof(path), "%s%s", GROUPS_DIR, groupname);
+static void entries_free( group_entry_t * list, int count ) {
+
+    for ( int i = 0; i < count; ++i ){
+        free( list[i].members );
+    }
+    free( list );
+}
 
-    FILE *f = fopen(path, "r");
-    if (!f) return 0;
+/*
+ * @brief  Reads one group file: id, multicast address and port, members.
+ */
+static int group_read( const char * groupname, group_entry_t * g ) {
 
-    char line[256];
+    char path[ 512 ];
+    char line[ 256 ];
     int line_no = 0;
 
-    while (fgets(line, sizeof(line), f)) {
+    snprintf( path, sizeof( path ), "%s%s", groups_dir(), groupname );
+
+    FILE * f = fopen( path, "r" );
+    if ( !f ){
+        return -1;
+    }
+
+    memset( g, 0, sizeof( *g ) );
+    snprintf( g->info.name, sizeof( g->info.name ), "%s", groupname );
+
+    while ( fgets( line, sizeof( line ), f ) ) {
+
         line_no++;
+        size_t len = strcspn( line, "\n" );
+        int whole  = line[ len ] == '\n' || feof( f );
+        line[ len ] = '\0';
+
+        if ( !whole ) {                             // rest of an overlong line
+            int c;
+            while ( ( c = fgetc( f ) ) != EOF && c != '\n' ){
+                ;
+            }
+        }
 
         /* metadatas */
-        if (line_no <= 3)
+        if ( line_no <= 3 ) {
+            if ( sscanf( line, "id=%u", &g->info.id ) != 1 &&
+                 sscanf( line, "mcast=%15s", g->info.mcast_ip ) != 1 ){
+                sscanf( line, "port=%hu", &g->info.mcast_port );
+            }
             continue;
+        }
 
-        line[strcspn(line, "\n")] = '\0';
+        if ( !whole || len >= MAX_USERNAME_LEN ) {
+            log_msg( LOG_WARNING, "[group] %s: member line %d too long, skipped\n", groupname, line_no );
+            continue;
+        }
 
-        if (strcmp(line, login) == 0) {
-            fclose(f);
-            return 1;
+        if ( line[0] != '\0' && member_index( g, line ) < 0 && member_add( g, line ) < 0 ) {
+            fclose( f );
+            free( g->members );
+            return -1;
         }
     }
 
-    fclose(f);
+    fclose( f );
     return 0;
 }
 
+/*
+ * @brief  Rewrites the file of a group from the index (temporary file and
+ * rename - a reader never sees half of it).
+ */
+static int group_save( const char * groupname ) {
+
+    char path[ 512 ];
+    char tmp[ 512 ];
+    group_entry_t copy = { 0 };
+    int rc = -1;
+
+    snprintf( path, sizeof( path ), "%s%s", groups_dir(), groupname );
+    snprintf( tmp, sizeof( tmp ), "%s.%s.tmp", groups_dir(), groupname );   // hidden from groups_load()
+
+    pthread_mutex_t * lock = file_lock( groupname );
+    pthread_mutex_lock( lock );
+
+    /* a copy - the index is not held while the file is written */
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_rdlock( &groups_lock ) );
+    group_entry_t * g = find_locked( groupname );
+    if ( g ) {
+        copy.info    = g->info;
+        copy.members = malloc( ( g->count ? g->count : 1 ) * sizeof( *g->members ) );
+        if ( copy.members ) {
+            memcpy( copy.members, g->members, g->count * sizeof( *g->members ) );
+            copy.count = g->count;
+        }
+    }
+    pthread_rwlock_unlock( &groups_lock );
+
+    FILE * f = copy.members ? fopen( tmp, "w" ) : NULL;
+    if ( f ) {
+        fprintf( f, "id=%u\nmcast=%s\nport=%u\n",
+                 copy.info.id, copy.info.mcast_ip, copy.info.mcast_port );
+        for ( int i = 0; i < copy.count; ++i ){
+            fprintf( f, "%s\n", copy.members[i] );
+        }
+        rc = ( fclose( f ) == 0 && rename( tmp, path ) == 0 ) ? 0 : -1;
+        if ( rc < 0 ){
+            unlink( tmp );
+        }
+    }
 
-int group_get_info( const char *groupname, group_info_t *out ) {
-    char path[256];
-    snprintf(path, sizeof(path), "%s%s", GROUPS_DIR, groupname);
+    pthread_mutex_unlock( lock );
+    free( copy.members );
+    return rc;
+}
 
-    FILE *f = fopen(path, "r");
-    if (!f) return -1;
+int groups_load( void ) {
 
-    char line[128];
+    DIR * dir = opendir( groups_dir() );
+    if ( !dir ){
+        return -1;
+    }
 
-    while (fgets(line, sizeof(line), f)) {
-        if (sscanf(line, "id=%u", &out->id) == 1) 
-            continue;
-        if (sscanf(line, "mcast=%15s", out->mcast_ip) == 1)
-            continue;
-        if (sscanf(line, "port=%hu", &out->mcast_port) == 1)
+    group_entry_t * list = NULL;
+    int count = 0, cap = 0;
+    uint32_t top = 0;
+    struct dirent * de;
+
+    /* parsed before the index is locked - it is only swapped in */
+    while ( ( de = readdir( dir ) ) ) {
+
+        if ( de->d_name[0] == '.' ){
             continue;
+        }
+        if ( count == cap ) {
+            cap = cap ? cap * 2 : 16;
+            void * l = realloc( list, cap * sizeof( *list ) );
+            if ( !l ) {
+                closedir( dir );
+                entries_free( list, count );
+                return -1;
+            }
+            list = l;
+        }
+        if ( group_read( de->d_name, &list[ count ] ) == 0 ) {
+            if ( list[ count ].info.id > top ){
+                top = list[ count ].info.id;
+            }
+            count++;
+        }
+    }
+    closedir( dir );
+
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_wrlock( &groups_lock ) );
+    group_entry_t * old = groups;
+    int old_count = group_count;
+    groups      = list;
+    group_count = count;
+    group_cap   = cap;
+    max_id      = top;
+    pthread_rwlock_unlock( &groups_lock );
+
+    entries_free( old, old_count );
+    return count;
 }
-    strncpy( out->name, groupname, sizeof(out->name)-1 );
 
-    fclose( f );
+int group_exists( const char *groupname ) {
+
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_rdlock( &groups_lock ) );
+    int found = find_locked( groupname ) != NULL;
+    pthread_rwlock_unlock( &groups_lock );
+
+    return found;
+}
+
+
+int group_create(
+    const char *groupname,
+    const char *creator_login,
+    group_info_t *out
+) {
+    //printf( "[DEBUG] Group create function: \n");  
+
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_wrlock( &groups_lock ) );
+
+    /* grupa już istnieje */
+    if ( find_locked( groupname ) ) {
+        pthread_rwlock_unlock( &groups_lock );
+        return -1;
+    }
+
+    if ( group_count == group_cap ) {
+        int cap = group_cap ? group_cap * 2 : 16;
+        void * l = realloc( groups, cap * sizeof( *groups ) );
+        if ( !l ) {
+            pthread_rwlock_unlock( &groups_lock );
+            return -1;
+        }
+        groups    = l;
+        group_cap = cap;
+    }
+
+    group_entry_t * g = &groups[ group_count ];
+    memset( g, 0, sizeof( *g ) );
+
+    uint32_t id = max_id + 1;
+    snprintf(g->info.name, sizeof(g->info.name), "%s", groupname);
+    snprintf(g->info.mcast_ip, sizeof(g->info.mcast_ip),
+             GROUP_MCAST_BASE "%u",
+             GROUP_MCAST_START + id);
+    g->info.mcast_port = GROUP_MCAST_PORT+id;
+    g->info.id = id;
+
+    if ( member_add( g, creator_login ) < 0 ) {
+        pthread_rwlock_unlock( &groups_lock );
+        return -1;
+    }
+    max_id = id;
+    group_count++;
+    *out = g->info;
+
+    pthread_rwlock_unlock( &groups_lock );
+
+    if ( group_save( groupname ) < 0 ) {
+        /* not on disk - the group does not exist after all */
+        metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_wrlock( &groups_lock ) );
+        g = find_locked( groupname );
+        if ( g ) {
+            free( g->members );
+            *g = groups[ --group_count ];
+        }
+        pthread_rwlock_unlock( &groups_lock );
+        return -1;
+    }
+
     return 0;
 }
 
+int group_has_user(const char *groupname, const char *login) {
+
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_rdlock( &groups_lock ) );
+    group_entry_t * g = find_locked( groupname );
+    int found = g && member_index( g, login ) >= 0;
+    pthread_rwlock_unlock( &groups_lock );
+
+    return found;
+}
+
+
+int group_get_info( const char *groupname, group_info_t *out ) {
+
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_rdlock( &groups_lock ) );
+    group_entry_t * g = find_locked( groupname );
+    if ( g ){
+        *out = g->info;
+    }
+    pthread_rwlock_unlock( &groups_lock );
+
+    return g ? 0 : -1;
+}
+
 int group_add_user( const char *groupname, const char *login ) {
-    
-    char path[256];
-    snprintf( path, sizeof(path), "%s%s", GROUPS_DIR, groupname );
 
-    if (group_has_user(groupname, login)) {
-        //pthread_mutex_unlock(&groups_mutex);
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_wrlock( &groups_lock ) );
+
+    group_entry_t * g = find_locked( groupname );
+    if ( g && member_index( g, login ) >= 0 ) {
+        pthread_rwlock_unlock( &groups_lock );
         return 1;   // Already in group
     }
-
-    FILE *f = fopen(path, "a");
-    if (!f) {
-        //pthread_mutex_unlock( &groups_mutex );
+    if ( !g || member_add( g, login ) < 0 ) {
+        pthread_rwlock_unlock( &groups_lock );
         return -1;
     }
 
-    fprintf(f, "%s\n", login);
-    fclose(f);
+    pthread_rwlock_unlock( &groups_lock );
+
+    if ( group_save( groupname ) < 0 ) {
+        /* not on disk - take the member back out */
+        metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_wrlock( &groups_lock ) );
+        g = find_locked( groupname );
+        int i = g ? member_index( g, login ) : -1;
+        if ( i >= 0 ){
+            memmove( g->members[i], g->members[ i + 1 ], ( --g->count - i ) * sizeof( *g->members ) );
+        }
+        pthread_rwlock_unlock( &groups_lock );
+        return -1;
+    }
 
-    
     return 0;
 }
 
 int group_list(char *out) {
-    DIR *dir = opendir(GROUPS_DIR);
-    if (!dir) return -1;
 
-    struct dirent *ent;
     size_t used = 0;
 
-    while ((ent = readdir(dir))) {
-        if (ent->d_name[0] == '.')
-            continue;
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_rdlock( &groups_lock ) );
+
+    for ( int i = 0; i < group_count; ++i ) {
 
-        size_t len = strlen(ent->d_name);
+        size_t len = strlen( groups[i].info.name );
         if (used + len + 1 >= MAX_MESSAGE_LEN)
             break;
 
-        memcpy(out + used, ent->d_name, len);
+        memcpy(out + used, groups[i].info.name, len);
         used += len;
         out[used++] = '\n';
     }
 
-    closedir(dir);
+    pthread_rwlock_unlock( &groups_lock );
     return used;
 }
 
 
-int group_send_user_groups(int client_fd, const char *login)
+int group_send_user_groups(
+    tlv_batch_t *batch,
+    const char *login
+)
 {
-    DIR *dir = opendir(GROUPS_DIR);
-    if (!dir) return -1;
-
-    struct dirent *de;
-    group_info_t g;
-
-    //pthread_mutex_lock(&groups_mutex);
+    group_info_t *infos = NULL;
+    int n = 0, cap = 0;
 
-    while ((de = readdir(dir))) {
-        if (de->d_name[0] == '.') continue;
+    metrics_lock( METRIC_LOCK_GROUPS, pthread_rwlock_rdlock( &groups_lock ) );
 
-        if (group_has_user(de->d_name, login)) {
-            if (group_get_info(de->d_name, &g) == 0) {
-                send_tlv(
-                    client_fd,
-                    TLV_GROUP_INFO,
-                    &g,
-                    sizeof(g)
-                );
+    for ( int i = 0; i < group_count; ++i ) {
+        if ( member_index( &groups[i], login ) < 0 ){
+            continue;
+        }
+        if ( n == cap ) {
+            cap = cap ? cap * 2 : 16;
+            void *p = realloc( infos, cap * sizeof( *infos ) );
+            if ( !p ) {
+                pthread_rwlock_unlock( &groups_lock );
+                free( infos );
+                tlv_batch_flush( batch );
+                return -1;
             }
+            infos = p;
         }
+        infos[n++] = groups[i].info;
     }
 
-    //pthread_mutex_unlock(&groups_mutex);
-    closedir(dir);
-    return 0;
+    pthread_rwlock_unlock( &groups_lock );
+
+    /* batch only references payloads -> infos live until the last flush
+       (a full batch flushes on its own, so any number of groups fits) */
+    for ( int i = 0; i < n; ++i ){
+        tlv_batch_add( batch, TLV_GROUP_INFO, &infos[i], sizeof( infos[i] ) );
+    }
+    int rc = tlv_batch_flush( batch );
+
+    free( infos );
+    return rc < 0 ? -1 : n;
 }
 
 int group_multicast_send(
     group_info_t *g,
     const char *login,
     const char *username,
-    const char *msg
+    const msg_buf_t *msg
 ) {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return -1;
 
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(g->mcast_port);
     inet_pton(AF_INET, g->mcast_ip, &addr.sin_addr);
 
-    char buf[1024];
-    snprintf(buf, sizeof(buf),
-        "[%s] <%s> %s : %s",
+    /* only the prefix is formatted, the text goes out of the relay buffer */
+    char prefix[MAX_GROUP_NAME_LEN + 2 * MAX_USERNAME_LEN + 16];
+    int plen = snprintf(prefix, sizeof(prefix),
+        "[%s] <%s> %s : ",
         g->name,
         login,
-        username,
-        msg
+        username
     );
-
-    if ( sendto(sock, buf, strlen(buf), 0,
-           (struct sockaddr*)&addr, sizeof(addr)) < 0 ){
-        printf("DEBUG Multicast messange not sent"); 
+    if (plen < 0)
+        plen = 0;
+    if ((size_t)plen >= sizeof(prefix))
+        plen = sizeof(prefix) - 1;
+
+    struct iovec iov[2] = {
+        { prefix,              (size_t)plen },
+        { (void *)msg->data,   msg->len }
+    };
+    struct msghdr mh = {0};
+    mh.msg_name    = &addr;
+    mh.msg_namelen = sizeof(addr);
+    mh.msg_iov     = iov;
+    mh.msg_iovlen  = 2;
+
+    if ( sendmsg(sock, &mh, 0) < 0 ){
+        log_msg( LOG_WARNING, "[group] %s: multicast message not sent: %s\n", g->name, strerror( errno ) );
+        close(sock);
         return -1;
     }
 
@@ -280,7 +516,7 @@ int group_history_append(
     const char *groupname,
     const char *login_src,
     const char * username_src,
-    const char *message
+    const msg_buf_t *message
 ) {
 
     char path[512];
@@ -289,42 +525,52 @@ int group_history_append(
     snprintf(
         path,
         sizeof(path),
-        HISTORY_DIR "%s",
+        "%s%s",
+        history_dir(),
         groupname
     );
 
     /* ensure directory exists */
-    mkdir(HISTORY_DIR, 0755);
-
-    FILE *f = fopen(path, "a");
-    if (!f) {
-        perror("fopen group history");
-        return -1;
-    }
+    mkdir(history_dir(), 0755);
 
     /* timestamp */
     time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
+    struct tm tm;
+    localtime_r(&now, &tm);
 
     char timebuf[64];
     strftime(
         timebuf,
         sizeof(timebuf),
         "%Y-%m-%d %H:%M:%S",
-        tm
+        &tm
     );
 
+    pthread_mutex_t *lock = history_lock(groupname);
+    metrics_lock( METRIC_LOCK_HISTORY, pthread_mutex_lock(lock) );
+
+    uint64_t t0 = metrics_now();
+    FILE *f = fopen(path, "a");
+    if (!f) {
+        pthread_mutex_unlock(lock);
+        perror("fopen group history");
+        return -1;
+    }
+
     /* zapis */
     fprintf(
         f,
-        "%s <%s> %s : %s\n",
+        "%s <%s> %s : ",
         timebuf,
         login_src,
-        username_src,
-        message
+        username_src
     );
+    fwrite(message->data, 1, message->len, f);
+    fputc('\n', f);
 
     fclose(f);
+    metrics_record( METRIC_IO_HISTORY, metrics_now() - t0 );
+    pthread_mutex_unlock(lock);
     return 0;
 }
 
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>   // chmod
+
+#include "handoff.h"
+#include "log.h"
+
+typedef struct {
+    int    listen_fd;
+    void ( * request )( int ctl );
+} handoff_listener_t;
+
+static int unix_addr( const char * path, struct sockaddr_un * addr ) {
+
+    memset( addr, 0, sizeof( *addr ) );
+    addr->sun_family = AF_UNIX;
+
+    if ( strlen( path ) >= sizeof( addr->sun_path ) ) {
+        log_msg( LOG_ERR, "[handoff] socket path too long: %s\n", path );
+        return -1;
+    }
+    strcpy( addr->sun_path, path );
+    return 0;
+}
+
+/*
+ * @brief  Only a process of our own user may take the sockets over.
+ */
+static int peer_is_us( int ctl ) {
+
+    struct ucred cred;
+    socklen_t len = sizeof( cred );
+
+    if ( getsockopt( ctl, SOL_SOCKET, SO_PEERCRED, &cred, &len ) < 0 ) {
+        log_msg( LOG_ERR, "[handoff] SO_PEERCRED: %s\n", strerror( errno ) );
+        return 0;
+    }
+    if ( cred.uid != geteuid() ) {
+        log_msg( LOG_WARNING, "[handoff] refused pid %d of uid %u\n", ( int ) cred.pid,
+                 ( unsigned ) cred.uid );
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * @brief  Waits for the next server - only a matching hello starts the handoff.
+ */
+static void * handoff_thread( void * arg ) {
+
+    handoff_listener_t * l = arg;
+    handoff_record_t rec;
+    int fd;
+
+    for (;;) {
+
+        int ctl = accept4( l->listen_fd, NULL, NULL, SOCK_CLOEXEC );
+        if ( ctl < 0 ) {
+            if ( errno == EINTR || errno == ECONNABORTED ){
+                continue;
+            }
+            log_msg( LOG_ERR, "[handoff] accept: %s\n", strerror( errno ) );
+            break;
+        }
+
+        if ( !peer_is_us( ctl ) ) {
+            close( ctl );
+            continue;
+        }
+
+        if ( handoff_recv( ctl, &rec, &fd, NULL ) != HANDOFF_HELLO ) {
+            log_msg( LOG_WARNING, "[handoff] refused a successor (other version?)\n" );
+            if ( fd >= 0 ){
+                close( fd );
+            }
+            close( ctl );
+            continue;
+        }
+
+        log_msg( LOG_INFO, "[handoff] successor connected, handing over\n" );
+        close( l->listen_fd );
+        l->request( ctl );
+        break;
+    }
+
+    free( l );
+    return NULL;
+}
+
+int handoff_listen( const char * path, void ( * request )( int ctl ) ) {
+
+    struct sockaddr_un addr;
+    pthread_t tid;
+
+    if ( unix_addr( path, &addr ) < 0 ){
+        return -1;
+    }
+
+    handoff_listener_t * l = malloc( sizeof( *l ) );
+    if ( !l ){
+        return -1;
+    }
+    l->request   = request;
+    l->listen_fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+
+    /* the predecessor (if any) is gone from this path by now */
+    unlink( path );
+
+    /* the daemon runs with umask 0 - owner only before anyone can connect */
+    if ( l->listen_fd < 0 ||
+         bind( l->listen_fd, ( struct sockaddr * ) &addr, sizeof( addr ) ) < 0 ||
+         chmod( path, S_IRUSR | S_IWUSR ) < 0 ||
+         listen( l->listen_fd, 1 ) < 0 ||
+         pthread_create( &tid, NULL, handoff_thread, l ) != 0 ) {
+        log_msg( LOG_ERR, "[handoff] cannot listen on %s: %s\n", path, strerror( errno ) );
+        if ( l->listen_fd >= 0 ){
+            close( l->listen_fd );
+        }
+        free( l );
+        return -1;
+    }
+    pthread_detach( tid );
+
+    log_msg( LOG_INFO, "[handoff] live restart through %s\n", path );
+    return 0;
+}
+
+int handoff_connect( const char * path ) {
+
+    struct sockaddr_un addr;
+    handoff_record_t hello;
+
+    if ( unix_addr( path, &addr ) < 0 ){
+        return -1;
+    }
+
+    int ctl = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+    if ( ctl < 0 ){
+        return -1;
+    }
+
+    if ( connect( ctl, ( struct sockaddr * ) &addr, sizeof( addr ) ) < 0 ) {
+        close( ctl );                               // nobody there - a fresh start
+        return -1;
+    }
+
+    memset( &hello, 0, sizeof( hello ) );
+    hello.kind = HANDOFF_HELLO;
+    if ( handoff_send( ctl, &hello, -1, NULL ) < 0 ) {
+        close( ctl );
+        return -1;
+    }
+    return ctl;
+}
+
+int handoff_send( int ctl, handoff_record_t * rec, int fd, const void * input ) {
+
+    union {
+        struct cmsghdr hdr;
+        char           buf[ CMSG_SPACE( sizeof( int ) ) ];
+    } cm;
+    struct iovec iov[2];
+    struct msghdr mh;
+
+    rec->magic   = HANDOFF_MAGIC;
+    rec->version = HANDOFF_VERSION;
+
+    iov[0].iov_base = rec;
+    iov[0].iov_len  = sizeof( *rec );
+    iov[1].iov_base = ( void * ) input;
+    iov[1].iov_len  = input ? rec->input_len : 0;
+
+    memset( &mh, 0, sizeof( mh ) );
+    mh.msg_iov    = iov;
+    mh.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+    if ( fd >= 0 ) {
+        memset( &cm, 0, sizeof( cm ) );
+        mh.msg_control    = cm.buf;
+        mh.msg_controllen = sizeof( cm.buf );
+
+        struct cmsghdr * c = CMSG_FIRSTHDR( &mh );
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type  = SCM_RIGHTS;
+        c->cmsg_len   = CMSG_LEN( sizeof( int ) );
+        memcpy( CMSG_DATA( c ), &fd, sizeof( int ) );
+    }
+
+    ssize_t w;
+    do {
+        w = sendmsg( ctl, &mh, MSG_NOSIGNAL );
+    } while ( w < 0 && errno == EINTR );
+
+    return w < 0 ? -1 : 0;
+}
+
+int handoff_recv( int ctl, handoff_record_t * rec, int * fd, void * input ) {
+
+    union {
+        struct cmsghdr hdr;
+        char           buf[ CMSG_SPACE( sizeof( int ) ) ];
+    } cm;
+    struct iovec iov[2];
+    struct msghdr mh;
+
+    *fd = -1;
+
+    iov[0].iov_base = rec;
+    iov[0].iov_len  = sizeof( *rec );
+    iov[1].iov_base = input;
+    iov[1].iov_len  = input ? HANDOFF_MAX_INPUT : 0;
+
+    memset( &mh, 0, sizeof( mh ) );
+    mh.msg_iov        = iov;
+    mh.msg_iovlen     = input ? 2 : 1;
+    mh.msg_control    = cm.buf;
+    mh.msg_controllen = sizeof( cm.buf );
+
+    ssize_t n;
+    do {
+        n = recvmsg( ctl, &mh, MSG_CMSG_CLOEXEC );
+    } while ( n < 0 && errno == EINTR );
+
+    if ( n <= 0 ){
+        return -1;
+    }
+
+    for ( struct cmsghdr * c = CMSG_FIRSTHDR( &mh ); c; c = CMSG_NXTHDR( &mh, c ) ) {
+        if ( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS ){
+            memcpy( fd, CMSG_DATA( c ), sizeof( int ) );
+        }
+    }
+
+    if ( ( size_t ) n < sizeof( *rec ) || rec->magic != HANDOFF_MAGIC ||
+         rec->version != HANDOFF_VERSION || ( mh.msg_flags & MSG_TRUNC ) ||
+         rec->input_len != ( size_t ) n - sizeof( *rec ) ) {
+        return -1;                                  // fd (if any) is the caller's to close
+    }
+    return ( int ) rec->kind;
+}
@@ -5,6 +5,30 @@
 #include <pthread.h>
 
 #include "history.h"
+#include "data_dir.h"
+#include "metrics.h"
+
+static pthread_mutex_t locks[ HISTORY_LOCKS ];
+static pthread_once_t  locks_once = PTHREAD_ONCE_INIT;
+
+static void locks_init( void ) {
+
+    for ( int i = 0; i < HISTORY_LOCKS; ++i ){
+        pthread_mutex_init( &locks[i], NULL );
+    }
+}
+
+pthread_mutex_t * history_lock( const char * filename ) {
+
+    uint32_t h = 2166136261u;   /* FNV-1a */
+
+    while ( *filename ){
+        h = ( h ^ ( uint8_t ) *filename++ ) * 16777619u;
+    }
+
+    pthread_once( &locks_once, locks_init );
+    return &locks[ h % HISTORY_LOCKS ];
+}
 
 void make_history_filename(
     char * out,
@@ -23,7 +47,7 @@ int history_append_message(
     const char * login_src,
     const char * username_src,
     const char * login_dst,
-    const char * message
+    const msg_buf_t * message
 ) {
     char filename[ 256 ];
     char path[ 512 ];
@@ -38,41 +62,73 @@ int history_append_message(
     snprintf(
         path,
         sizeof( path ),
-        HISTORY_DIR "%s",
+        "%s%s",
+        history_dir(),
         filename
     );
 
     /* ensure directory exists */
-    mkdir( HISTORY_DIR, 0755 );
-
-    FILE * f = fopen( path, "a" );
-    if ( !f ) {
-        perror( "fopen history" );
-        return -1;
-    }
+    mkdir( history_dir(), 0755 );
 
     /* timestamp */
     time_t now = time( NULL );
-    struct tm * tm = localtime( &now );
+    struct tm tm;
+    localtime_r( &now, &tm );
 
     char timebuf[ 64 ];
     strftime(
         timebuf,
         sizeof( timebuf ),
         "%Y-%m-%d %H:%M:%S",
-        tm
+        &tm
     );
 
+    pthread_mutex_t * lock = history_lock( filename );
+    metrics_lock( METRIC_LOCK_HISTORY, pthread_mutex_lock( lock ) );
+
+    uint64_t t0 = metrics_now();
+    FILE * f = fopen( path, "a" );
+    if ( !f ) {
+        pthread_mutex_unlock( lock );
+        perror( "fopen history" );
+        return -1;
+    }
+
     fprintf(
         f,
-        "%s <%s> %s : %s\n",
+        "%s <%s> %s : ",
         timebuf,
         login_src,
-        username_src,
-        message
+        username_src
     );
+    fwrite( message->data, 1, message->len, f );
+    fputc( '\n', f );
 
     fclose( f );
+    metrics_record( METRIC_IO_HISTORY, metrics_now() - t0 );
+    pthread_mutex_unlock( lock );
     return 0;
 }
 
+
+void history_seek_tail( FILE * f, int max_lines ) {
+
+    long count = 0;
+    int c;
+
+    /* pass 1: count lines */
+    while ( ( c = getc( f ) ) != EOF ) {
+        if ( c == '\n' )
+            count++;
+    }
+    rewind( f );
+
+    if ( max_lines <= 0 || count <= max_lines )
+        return;
+
+    /* pass 2: skip the lines before the tail */
+    for ( long skip = count - max_lines; skip > 0 && ( c = getc( f ) ) != EOF; ) {
+        if ( c == '\n' )
+            skip--;
+    }
+}
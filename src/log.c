@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>    // strcasecmp
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define LOG_MASK_SLOTS ( LOG_SHARD_SLOTS - 1 )
+
+/*
+ * Bounded ring, many producers, one consumer (the drain, under drain_lock).
+ * `seq` of a slot says whose turn it is: == position -> free for the
+ * producer claiming that position, == position + 1 -> written, to drain.
+ */
+typedef struct {
+    atomic_size_t seq;
+    int           prio;
+    char          text[ LOG_LINE_MAX ];
+} log_slot_t;
+
+typedef struct {
+    _Alignas( 64 ) atomic_size_t head;              /* next position to claim */
+    _Alignas( 64 ) size_t        tail;              /* next position to drain */
+    log_slot_t                   slots[ LOG_SHARD_SLOTS ];
+} log_ring_t;
+
+atomic_int log_threshold = LOG_INFO;
+
+static struct {
+    log_ring_t       rings[ LOG_SHARDS ];
+    atomic_int       started;
+    atomic_int       sync;
+    atomic_uint      rate;
+    atomic_uint      sample;
+    atomic_uint      next_shard;
+    atomic_ullong    dropped;                       /* ring full */
+    atomic_ullong    limited;                       /* rate limit */
+    pthread_mutex_t  drain_lock;
+    uint64_t         reported_dropped;              /* under drain_lock */
+    uint64_t         reported_limited;
+    long long        reported_at;                   /* second of the last report */
+} lg = { .rate = LOG_DEFAULT_RATE, .sample = 1, .drain_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local int my_shard = -1;
+
+static long long now_sec( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ( long long ) ts.tv_sec;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                  Rings                                     */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * @brief  Claims a slot and formats the line into it.
+ *
+ * @return int 0 on success, -1 if the ring is full.
+ */
+static int ring_put( log_ring_t * r, int prio, const char * fmt, va_list ap ) {
+
+    size_t pos = atomic_load_explicit( &r->head, memory_order_relaxed );
+
+    for (;;) {
+
+        log_slot_t * s = &r->slots[ pos & LOG_MASK_SLOTS ];
+        size_t seq = atomic_load_explicit( &s->seq, memory_order_acquire );
+        intptr_t dif = ( intptr_t ) seq - ( intptr_t ) pos;
+
+        if ( dif == 0 ) {
+            if ( atomic_compare_exchange_weak_explicit( &r->head, &pos, pos + 1,
+                                                        memory_order_relaxed,
+                                                        memory_order_relaxed ) ) {
+                s->prio = prio;
+                vsnprintf( s->text, sizeof( s->text ), fmt, ap );
+                atomic_store_explicit( &s->seq, pos + 1, memory_order_release );
+                return 0;
+            }
+        } else if ( dif < 0 ) {
+            return -1;                              // drain is a whole ring behind
+        } else {
+            pos = atomic_load_explicit( &r->head, memory_order_relaxed );
+        }
+    }
+}
+
+/*
+ * @brief  Writes the lines of one ring up to the first one still being formatted.
+ */
+static void ring_drain( log_ring_t * r ) {
+
+    for (;;) {
+
+        log_slot_t * s = &r->slots[ r->tail & LOG_MASK_SLOTS ];
+
+        if ( atomic_load_explicit( &s->seq, memory_order_acquire ) != r->tail + 1 ){
+            return;
+        }
+        syslog( s->prio, "%s", s->text );
+        atomic_store_explicit( &s->seq, r->tail + LOG_SHARD_SLOTS, memory_order_release );
+        r->tail++;
+    }
+}
+
+/*
+ * @brief  Drains every ring and reports lost lines (at most once a second).
+ */
+static void drain_locked( void ) {
+
+    for ( int i = 0; i < LOG_SHARDS; ++i ){
+        ring_drain( &lg.rings[i] );
+    }
+
+    uint64_t dropped = atomic_load_explicit( &lg.dropped, memory_order_relaxed );
+    uint64_t limited = atomic_load_explicit( &lg.limited, memory_order_relaxed );
+    long long now = now_sec();
+
+    if ( ( dropped != lg.reported_dropped || limited != lg.reported_limited ) &&
+         now != lg.reported_at ) {
+        syslog( LOG_WARNING, "[log] %llu line(s) dropped (ring full), %llu rate limited\n",
+                ( unsigned long long ) ( dropped - lg.reported_dropped ),
+                ( unsigned long long ) ( limited - lg.reported_limited ) );
+        lg.reported_dropped = dropped;
+        lg.reported_limited = limited;
+        lg.reported_at      = now;
+    }
+}
+
+static void * drain_thread( void * arg ) {
+
+    ( void ) arg;
+    struct timespec delay = { 0, LOG_DRAIN_MS * 1000000L };
+
+    for (;;) {
+        nanosleep( &delay, NULL );
+        pthread_mutex_lock( &lg.drain_lock );
+        drain_locked();
+        pthread_mutex_unlock( &lg.drain_lock );
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                   API                                      */
+/* -------------------------------------------------------------------------- */
+
+int log_start( const log_config_t * cfg ) {
+
+    pthread_t tid;
+
+    log_set_level( cfg->level > 0 ? cfg->level : LOG_INFO );
+    atomic_store( &lg.rate, cfg->rate > 0 ? cfg->rate : LOG_DEFAULT_RATE );
+    atomic_store( &lg.sample, cfg->sample > 1 ? cfg->sample : 1 );
+    atomic_store( &lg.sync, cfg->sync );
+
+    if ( atomic_load( &lg.started ) ){
+        return 0;                                   // a server started before
+    }
+
+    for ( int i = 0; i < LOG_SHARDS; ++i ) {
+        atomic_init( &lg.rings[i].head, 0 );
+        lg.rings[i].tail = 0;
+        for ( size_t j = 0; j < LOG_SHARD_SLOTS; ++j ){
+            atomic_init( &lg.rings[i].slots[j].seq, j );
+        }
+    }
+
+    if ( pthread_create( &tid, NULL, drain_thread, NULL ) != 0 ) {
+        syslog( LOG_ERR, "[log] drain thread not started, logging stays synchronous\n" );
+        return -1;
+    }
+    pthread_detach( tid );
+
+    atomic_store_explicit( &lg.started, 1, memory_order_release );
+    return 0;
+}
+
+void log_set_level( int level ) {
+
+    atomic_store_explicit( &log_threshold, level, memory_order_relaxed );
+}
+
+int log_level_parse( const char * name ) {
+
+    static const struct { const char * name; int level; } levels[] = {
+        { "err", LOG_ERR }, { "error", LOG_ERR }, { "warning", LOG_WARNING },
+        { "notice", LOG_NOTICE }, { "info", LOG_INFO }, { "debug", LOG_DEBUG }
+    };
+
+    for ( size_t i = 0; i < sizeof( levels ) / sizeof( levels[0] ); ++i ){
+        if ( strcasecmp( name, levels[i].name ) == 0 ){
+            return levels[i].level;
+        }
+    }
+    return -1;
+}
+
+void log_flush( void ) {
+
+    if ( !atomic_load_explicit( &lg.started, memory_order_acquire ) ){
+        return;
+    }
+    pthread_mutex_lock( &lg.drain_lock );
+    drain_locked();
+    pthread_mutex_unlock( &lg.drain_lock );
+}
+
+void log_counters( uint64_t * dropped, uint64_t * limited ) {
+
+    *dropped = atomic_load_explicit( &lg.dropped, memory_order_relaxed );
+    *limited = atomic_load_explicit( &lg.limited, memory_order_relaxed );
+}
+
+int log_site_allow( log_site_t * site ) {
+
+    long long now  = now_sec();
+    long long last = atomic_load_explicit( &site->window, memory_order_relaxed );
+
+    /* a new second - whoever moves the window resets the count */
+    if ( now != last &&
+         atomic_compare_exchange_strong( &site->window, &last, now ) ){
+        atomic_store_explicit( &site->count, 0, memory_order_relaxed );
+    }
+
+    if ( atomic_fetch_add_explicit( &site->count, 1, memory_order_relaxed ) <
+         atomic_load_explicit( &lg.rate, memory_order_relaxed ) ){
+        return 1;
+    }
+    atomic_fetch_add_explicit( &lg.limited, 1, memory_order_relaxed );
+    return 0;
+}
+
+int log_site_sample( log_site_t * site ) {
+
+    unsigned n = atomic_load_explicit( &lg.sample, memory_order_relaxed );
+
+    return n <= 1 || atomic_fetch_add_explicit( &site->calls, 1, memory_order_relaxed ) % n == 0;
+}
+
+void log_write( int prio, const char * fmt, ... ) {
+
+    va_list ap;
+
+    va_start( ap, fmt );
+
+    if ( !atomic_load_explicit( &lg.started, memory_order_acquire ) ||
+         atomic_load_explicit( &lg.sync, memory_order_relaxed ) ) {
+        vsyslog( prio, fmt, ap );
+    } else {
+        if ( my_shard < 0 ){
+            my_shard = atomic_fetch_add( &lg.next_shard, 1 ) % LOG_SHARDS;
+        }
+        if ( ring_put( &lg.rings[ my_shard ], prio, fmt, ap ) < 0 ){
+            atomic_fetch_add_explicit( &lg.dropped, 1, memory_order_relaxed );
+        }
+    }
+
+    va_end( ap );
+}
@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+
+/* one slab of every metric, shared by the threads mapped to it */
+typedef struct {
+    _Alignas( 64 ) atomic_ullong counters[ METRIC_COUNTERS ];
+    atomic_ullong hist[ METRIC_HISTS ][ METRICS_HIST_BUCKETS ];
+    atomic_ullong sum[ METRIC_HISTS ];
+    atomic_ullong max[ METRIC_HISTS ];
+} metrics_shard_t;
+
+static metrics_shard_t shards[ METRICS_SHARDS ];
+static atomic_uint     next_shard;
+static _Thread_local metrics_shard_t * my_shard;
+
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    metrics_source_t fn;
+    void *           arg;
+} sources[ METRICS_MAX_SOURCES ];
+
+static const char * const counter_names[ METRIC_COUNTERS ] = {
+    [ METRIC_ACCEPTED ]          = "sessions_accepted",
+    [ METRIC_CLOSED ]            = "sessions_closed",
+    [ METRIC_REAPED ]            = "sessions_reaped",
+    [ METRIC_FRAMES ]            = "frames_in",
+    [ METRIC_COMMANDS ]          = "commands",
+    [ METRIC_BAD_COMMANDS ]      = "commands_rejected",
+    [ METRIC_LOGINS ]            = "logins",
+    [ METRIC_LOGIN_FAILURES ]    = "login_failures",
+    [ METRIC_MESSAGES ]          = "messages_delivered",
+    [ METRIC_GROUP_MESSAGES ]    = "group_messages",
+    [ METRIC_OUTQ_SLOW ]         = "outq_slow_consumers",
+    [ METRIC_OUTQ_DROPPED ]      = "outq_frames_dropped",
+    [ METRIC_OUTQ_DISCONNECTED ] = "outq_disconnected",
+    [ METRIC_OUTQ_SPILLED ]      = "outq_spilled_bytes"
+};
+
+static const char * const cmd_names[ METRICS_CMDS ] = {
+    [ 0 ]                    = "cmd.unknown",
+    [ CMD_LOGIN ]            = "cmd.login",
+    [ CMD_LOGOUT ]           = "cmd.logout",
+    [ CMD_CREATE_ACCOUNT ]   = "cmd.create_account",
+    [ CMD_CHANGE_USERNAME ]  = "cmd.change_username",
+    [ CMD_CHANGE_PASSWORD ]  = "cmd.change_password",
+    [ CMD_GET_ACTIVE_USERS ] = "cmd.get_active_users",
+    [ CMD_SEND_TO_USER ]     = "cmd.send_to_user",
+    [ CMD_GROUP_MSG ]        = "cmd.group_msg",
+    [ CMD_CREATE_GROUP ]     = "cmd.create_group",
+    [ CMD_LIST_GROUPS ]      = "cmd.list_groups",
+    [ CMD_JOIN_GROUP ]       = "cmd.join_group",
+    [ CMD_GET_HISTORY ]      = "cmd.get_history",
+    [ CMD_HELLO ]            = "cmd.hello",
+    [ CMD_GET_STATS ]        = "cmd.get_stats"
+};
+
+static const char * const other_hist_names[] = {
+    [ METRIC_LOCK_ACCOUNT - METRIC_LOCK_ACCOUNT ] = "lock.account",
+    [ METRIC_LOCK_USERS - METRIC_LOCK_ACCOUNT ]   = "lock.users",
+    [ METRIC_LOCK_GROUPS - METRIC_LOCK_ACCOUNT ]  = "lock.groups",
+    [ METRIC_LOCK_HISTORY - METRIC_LOCK_ACCOUNT ] = "lock.history",
+    [ METRIC_LOCK_OUTQ - METRIC_LOCK_ACCOUNT ]    = "lock.outq",
+    [ METRIC_IO_WRITE - METRIC_LOCK_ACCOUNT ]     = "io.write",
+    [ METRIC_IO_FLUSH - METRIC_LOCK_ACCOUNT ]     = "io.flush",
+    [ METRIC_IO_HISTORY - METRIC_LOCK_ACCOUNT ]   = "io.history_append",
+    [ METRIC_IO_ACCOUNT - METRIC_LOCK_ACCOUNT ]   = "io.account_read",
+    [ METRIC_IO_POOL_WAIT - METRIC_LOCK_ACCOUNT ] = "io.pool_wait"
+};
+
+static const char * hist_name( metric_hist_t h ) {
+
+    if ( h < METRIC_LOCK_ACCOUNT ){
+        return cmd_names[h] ? cmd_names[h] : "cmd.unknown";
+    }
+    return other_hist_names[ h - METRIC_LOCK_ACCOUNT ];
+}
+
+static metrics_shard_t * shard( void ) {
+
+    if ( !my_shard ){
+        my_shard = &shards[ atomic_fetch_add( &next_shard, 1 ) % METRICS_SHARDS ];
+    }
+    return my_shard;
+}
+
+/*
+ * @brief  Log-linear bucket: exact below METRICS_HIST_SUB, then
+ * METRICS_HIST_SUB buckets per power of two.
+ */
+static int bucket_of( uint64_t v ) {
+
+    if ( v < METRICS_HIST_SUB ){
+        return ( int ) v;
+    }
+
+    int msb = 63 - __builtin_clzll( v );
+    if ( msb >= METRICS_HIST_MAX_BITS ){
+        return METRICS_HIST_BUCKETS - 1;
+    }
+
+    int shift = msb - METRICS_HIST_SUB_BITS;
+    return ( shift + 1 ) * METRICS_HIST_SUB + ( int ) ( ( v >> shift ) & ( METRICS_HIST_SUB - 1 ) );
+}
+
+/*
+ * @brief  Middle of a bucket - what a percentile falling into it reports.
+ */
+static uint64_t bucket_mid( int b ) {
+
+    if ( b < METRICS_HIST_SUB ){
+        return ( uint64_t ) b;
+    }
+
+    int shift = b / METRICS_HIST_SUB - 1;
+    uint64_t low = ( uint64_t ) ( METRICS_HIST_SUB + b % METRICS_HIST_SUB ) << shift;
+    return low + ( ( 1ull << shift ) >> 1 );
+}
+
+uint64_t metrics_now( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t ) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void metrics_add( metric_counter_t c, uint64_t n ) {
+
+    atomic_fetch_add_explicit( &shard()->counters[ c ], n, memory_order_relaxed );
+}
+
+void metrics_record( metric_hist_t h, uint64_t ns ) {
+
+    metrics_shard_t * s = shard();
+
+    atomic_fetch_add_explicit( &s->hist[ h ][ bucket_of( ns ) ], 1, memory_order_relaxed );
+    atomic_fetch_add_explicit( &s->sum[ h ], ns, memory_order_relaxed );
+
+    uint64_t max = atomic_load_explicit( &s->max[ h ], memory_order_relaxed );
+    while ( ns > max &&
+            !atomic_compare_exchange_weak_explicit( &s->max[ h ], &max, ns,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed ) ){
+        ;
+    }
+
+    /* a traced request - every timed step is a span too */
+    if ( trace_active() ){
+        trace_event( hist_name( h ), metrics_now() - ns, ns, -1 );
+    }
+}
+
+uint64_t metrics_counter( metric_counter_t c ) {
+
+    uint64_t total = 0;
+
+    for ( int i = 0; i < METRICS_SHARDS; ++i ){
+        total += atomic_load_explicit( &shards[i].counters[ c ], memory_order_relaxed );
+    }
+    return total;
+}
+
+void metrics_summary( metric_hist_t h, metrics_summary_t * out ) {
+
+    static _Thread_local uint64_t merged[ METRICS_HIST_BUCKETS ];
+
+    memset( out, 0, sizeof( *out ) );
+    memset( merged, 0, sizeof( merged ) );
+
+    for ( int i = 0; i < METRICS_SHARDS; ++i ) {
+        for ( int b = 0; b < METRICS_HIST_BUCKETS; ++b ){
+            merged[b] += atomic_load_explicit( &shards[i].hist[ h ][ b ], memory_order_relaxed );
+        }
+        out->sum += atomic_load_explicit( &shards[i].sum[ h ], memory_order_relaxed );
+        uint64_t max = atomic_load_explicit( &shards[i].max[ h ], memory_order_relaxed );
+        if ( max > out->max ){
+            out->max = max;
+        }
+    }
+
+    for ( int b = 0; b < METRICS_HIST_BUCKETS; ++b ){
+        out->count += merged[b];
+    }
+    if ( out->count == 0 ){
+        return;
+    }
+
+    /* nearest rank of each percentile, in one pass */
+    uint64_t rank50  = ( out->count * 500 + 999 ) / 1000;
+    uint64_t rank99  = ( out->count * 990 + 999 ) / 1000;
+    uint64_t rank999 = ( out->count * 999 + 999 ) / 1000;
+    uint64_t seen = 0;
+
+    for ( int b = 0; b < METRICS_HIST_BUCKETS; ++b ) {
+        if ( merged[b] == 0 ){
+            continue;
+        }
+        seen += merged[b];
+        if ( !out->p50 && seen >= rank50 ){
+            out->p50 = bucket_mid( b );
+        }
+        if ( !out->p99 && seen >= rank99 ){
+            out->p99 = bucket_mid( b );
+        }
+        if ( !out->p999 && seen >= rank999 ) {
+            out->p999 = bucket_mid( b );
+            break;
+        }
+    }
+
+    /* a bucket midpoint may lie above the largest value seen */
+    if ( out->p50 > out->max ){
+        out->p50 = out->max;
+    }
+    if ( out->p99 > out->max ){
+        out->p99 = out->max;
+    }
+    if ( out->p999 > out->max ){
+        out->p999 = out->max;
+    }
+}
+
+int metrics_add_source( metrics_source_t fn, void * arg ) {
+
+    int rc = -1;
+
+    pthread_mutex_lock( &sources_lock );
+    for ( int i = 0; i < METRICS_MAX_SOURCES; ++i ) {
+        if ( !sources[i].fn ) {
+            sources[i].fn  = fn;
+            sources[i].arg = arg;
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &sources_lock );
+
+    if ( rc < 0 ){
+        log_msg( LOG_WARNING, "[metrics] no room for another source\n" );
+    }
+    return rc;
+}
+
+void metrics_remove_source( metrics_source_t fn, void * arg ) {
+
+    pthread_mutex_lock( &sources_lock );
+    for ( int i = 0; i < METRICS_MAX_SOURCES; ++i ) {
+        if ( sources[i].fn == fn && sources[i].arg == arg ) {
+            sources[i].fn  = NULL;
+            sources[i].arg = NULL;
+        }
+    }
+    pthread_mutex_unlock( &sources_lock );
+}
+
+void metrics_printf( metrics_text_t * out, const char * fmt, ... ) {
+
+    va_list ap;
+
+    if ( out->len + 1 >= out->cap ){
+        return;
+    }
+
+    va_start( ap, fmt );
+    int n = vsnprintf( out->buf + out->len, out->cap - out->len, fmt, ap );
+    va_end( ap );
+
+    if ( n > 0 ){
+        out->len += ( size_t ) n < out->cap - out->len ? ( size_t ) n : out->cap - out->len - 1;
+    }
+}
+
+static void format_hist( metrics_text_t * out, metric_hist_t h ) {
+
+    metrics_summary_t s;
+
+    metrics_summary( h, &s );
+    if ( s.count == 0 ){
+        return;                                     // never happened - keep the output short
+    }
+    metrics_printf( out, "%s count=%llu p50=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+                    hist_name( h ), ( unsigned long long ) s.count, s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3,
+                    s.max / 1e3 );
+}
+
+size_t metrics_format( char * buf, size_t cap ) {
+
+    metrics_text_t out = { buf, cap, 0 };
+
+    if ( cap == 0 ){
+        return 0;
+    }
+    buf[0] = '\0';
+
+    for ( int c = 0; c < METRIC_COUNTERS; ++c ){
+        metrics_printf( &out, "%s %llu\n", counter_names[c],
+                        ( unsigned long long ) metrics_counter( c ) );
+    }
+
+    uint64_t dropped, limited;
+    log_counters( &dropped, &limited );
+    metrics_printf( &out, "log_dropped %llu\nlog_rate_limited %llu\n",
+                    ( unsigned long long ) dropped, ( unsigned long long ) limited );
+
+    /* latencies in microseconds */
+    for ( int h = 0; h < METRIC_HISTS; ++h ){
+        format_hist( &out, h );
+    }
+
+    pthread_mutex_lock( &sources_lock );
+    for ( int i = 0; i < METRICS_MAX_SOURCES; ++i ){
+        if ( sources[i].fn ){
+            sources[i].fn( &out, sources[i].arg );
+        }
+    }
+    pthread_mutex_unlock( &sources_lock );
+
+    return out.len;
+}
@@ -0,0 +1,36 @@
+#include <stdlib.h>     // malloc, free
+#include <string.h>     // memcpy
+
+#include "msg_buf.h"
+
+msg_buf_t * msg_buf_new( const void * data, uint32_t len ) {
+
+    msg_buf_t * buf = malloc( sizeof( *buf ) + len );
+    if ( buf == NULL ){
+        return NULL;
+    }
+
+    atomic_init( &buf->refs, 1 );
+    buf->len = len;
+    memcpy( buf->data, data, len );
+
+    return buf;
+}
+
+msg_buf_t * msg_buf_ref( msg_buf_t * buf ) {
+
+    atomic_fetch_add_explicit( &buf->refs, 1, memory_order_relaxed );
+    return buf;
+}
+
+void msg_buf_unref( msg_buf_t * buf ) {
+
+    if ( buf == NULL ){
+        return;
+    }
+
+    /* acq_rel: writes of other holders are visible before free() */
+    if ( atomic_fetch_sub_explicit( &buf->refs, 1, memory_order_acq_rel ) == 1 ){
+        free( buf );
+    }
+}
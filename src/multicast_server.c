@@ -8,12 +8,14 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <syslog.h> 
 
 #include "protocol.h"
 #include "multicast_server.h"
+#include "log.h"
 
 
 int get_local_ip( char * ip_buf, size_t buf_len ) {
@@ -71,6 +73,10 @@ void * multicast_thread( void * arg ) {
         sizeof( reuse )
     );
 
+    /* Wake up now and then to see if the server is stopping */
+    struct timeval tick = { 0, MCAST_TICK_MS * 1000 };
+    setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof( tick ) );
+
     /* Prepare address structure*/
     memset( &addr, 0, sizeof( addr ) );
     addr.sin_family = AF_INET;
@@ -99,7 +105,7 @@ void * multicast_thread( void * arg ) {
         return NULL;
     }
 
-    syslog( LOG_INFO,
+    log_msg( LOG_INFO,
         "[multicast] listening on %s:%u\n",
         ctx->mcast_addr,
         ctx->mcast_port
@@ -111,8 +117,9 @@ void * multicast_thread( void * arg ) {
     uint8_t buf[ 256 ];
 
     /* Main loop - taking care of clients*/
-    while (1) {
+    while ( !ctx->running || *ctx->running ) {
 
+        client_len = sizeof( client_addr );
         ssize_t n = recvfrom(
             sock,
             buf,
@@ -163,7 +170,7 @@ void * multicast_thread( void * arg ) {
             client_len
         );
 
-        syslog( LOG_INFO,
+        log_msg( LOG_INFO,
             "[multicast] replied to %s:%u\n",
             inet_ntoa( client_addr.sin_addr ),
             ntohs( client_addr.sin_port )
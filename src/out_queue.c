@@ -0,0 +1,745 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>      // tmpfile
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "out_queue.h"
+#include "msg_buf.h"
+#include "log.h"
+#include "metrics.h"
+
+#define OUTQ_MAX_FDS    ( 1u << 20 )    /* largest descriptor table */
+#define OUTQ_TICK_MS    500
+#define OUTQ_MAX_EVENTS 64
+
+/* queued bytes; `off` of them are already written */
+typedef struct outq_frame {
+    struct outq_frame * next;
+    const uint8_t *     base;           /* `data`, or inside the payload of `ref` */
+    size_t              len;
+    size_t              off;
+    msg_buf_t *         ref;            /* referenced payload, NULL = own copy */
+    uint8_t             data[];
+} outq_frame_t;
+
+struct out_queue {
+    pthread_mutex_t      lock;
+    pthread_cond_t       drained;       /* backlog fell to the low watermark */
+    int                  fd;
+    outq_frame_t *       head;
+    outq_frame_t *       tail;
+    size_t               queued;        /* unwritten bytes in memory */
+    FILE *               spill;         /* created on first use */
+    off_t                spill_rd;
+    off_t                spill_wr;
+    int                  registered;    /* fd is in the flusher's epoll set */
+    int                  armed;         /* EPOLLOUT is waited for */
+    int                  slow;          /* above high, until back at low */
+    int                  closed;
+    uint64_t             dropped;       /* frames */
+    uint64_t             spilled;       /* bytes */
+    void              ( * wake )( void * );
+    void *               wake_arg;
+    struct out_queue *   zombie_next;
+};
+
+static struct {
+    outq_config_t              cfg;
+    int                        epfd;
+    _Atomic( out_queue_t * ) * table;   /* queue of every descriptor */
+    size_t                     table_size;
+    pthread_mutex_t            zlock;
+    out_queue_t *              zombies; /* destroyed, freed by the flusher */
+} flusher = { .epfd = -1, .zlock = PTHREAD_MUTEX_INITIALIZER };
+
+/* -------------------------------------------------------------------------- */
+/*                                 Helpers                                    */
+/* -------------------------------------------------------------------------- */
+
+static size_t iov_total( const struct iovec * iov, int cnt ) {
+
+    size_t len = 0;
+    for ( int i = 0; i < cnt; ++i ) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static size_t spill_pending( const out_queue_t * q ) {
+
+    return ( size_t ) ( q->spill_wr - q->spill_rd );
+}
+
+static size_t backlog( const out_queue_t * q ) {
+
+    return q->queued + spill_pending( q );
+}
+
+static void append( out_queue_t * q, outq_frame_t * f ) {
+
+    f->next = NULL;
+    if ( q->tail ){
+        q->tail->next = f;
+    } else {
+        q->head = f;
+    }
+    q->tail = f;
+    q->queued += f->len - f->off;
+}
+
+static void frame_free( outq_frame_t * f ) {
+
+    msg_buf_unref( f->ref );
+    free( f );
+}
+
+static int in_buf( const msg_buf_t * buf, const struct iovec * v ) {
+
+    const uint8_t * p = v->iov_base;
+    return buf && v->iov_len > 0 && p >= buf->data && p + v->iov_len <= buf->data + buf->len;
+}
+
+/*
+ * @brief  Turns the iovecs, without the first `skip` bytes, into a chain
+ * of frames: bytes inside `buf` are referenced, runs of anything else
+ * (headers) are copied into one frame each.
+ *
+ * @return outq_frame_t* First frame, NULL on allocation failure.
+ */
+static outq_frame_t * frames_new( const struct iovec * iov, int cnt, size_t skip, msg_buf_t * buf ) {
+
+    outq_frame_t * head = NULL;
+    outq_frame_t ** link = &head;
+    int i = 0;
+
+    while ( i < cnt ) {
+
+        if ( skip >= iov[i].iov_len ) {
+            skip -= iov[i].iov_len;
+            i++;
+            continue;
+        }
+
+        outq_frame_t * f;
+
+        if ( in_buf( buf, &iov[i] ) ) {
+            if ( !( f = malloc( sizeof( *f ) ) ) ){
+                goto fail;
+            }
+            f->base = ( const uint8_t * ) iov[i].iov_base + skip;
+            f->len  = iov[i].iov_len - skip;
+            f->ref  = msg_buf_ref( buf );
+            i++;
+        } else {
+            int end = i + 1;
+            size_t len = iov[i].iov_len - skip;
+            while ( end < cnt && !in_buf( buf, &iov[ end ] ) ){
+                len += iov[ end++ ].iov_len;
+            }
+            if ( !( f = malloc( sizeof( *f ) + len ) ) ){
+                goto fail;
+            }
+            size_t pos = 0;
+            for ( ; i < end; ++i ) {
+                memcpy( f->data + pos, ( const uint8_t * ) iov[i].iov_base + skip, iov[i].iov_len - skip );
+                pos += iov[i].iov_len - skip;
+                skip = 0;
+            }
+            f->base = f->data;
+            f->len  = len;
+            f->ref  = NULL;
+        }
+
+        skip    = 0;
+        f->off  = 0;
+        f->next = NULL;
+        *link   = f;
+        link    = &f->next;
+    }
+    return head;
+
+fail:
+    while ( head ) {
+        outq_frame_t * next = head->next;
+        frame_free( head );
+        head = next;
+    }
+    return NULL;
+}
+
+/*
+ * @brief  Ends the connection - the reading side sees EOF and cleans up.
+ */
+static void close_locked( out_queue_t * q ) {
+
+    if ( !q->closed ) {
+        q->closed = 1;
+        shutdown( q->fd, SHUT_RDWR );
+        pthread_cond_broadcast( &q->drained );
+    }
+}
+
+/*
+ * @brief  Asks the flusher for EPOLLOUT (not for owned queues).
+ */
+static void arm_locked( out_queue_t * q ) {
+
+    if ( q->wake || q->armed || q->closed || flusher.epfd < 0 ){
+        return;
+    }
+
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = q };
+    int op = q->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    if ( epoll_ctl( flusher.epfd, op, q->fd, &ev ) < 0 ) {
+        log_msg( LOG_ERR, "[outq] epoll_ctl fd=%d: %s\n", q->fd, strerror( errno ) );
+        close_locked( q );                          // nobody would ever write it
+        return;
+    }
+    q->registered = 1;
+    q->armed      = 1;
+}
+
+/*
+ * @brief  Moves spilled bytes back into memory, in order.
+ *
+ * @details While the spill file has data every new frame goes there too,
+ * so memory holds only bytes older than the file and a chunk cut in the
+ * middle of a frame is always followed by its rest.
+ */
+static void refill_locked( out_queue_t * q ) {
+
+    while ( spill_pending( q ) > 0 && ( q->queued < flusher.cfg.low || q->queued == 0 ) ) {
+
+        size_t n = spill_pending( q );
+        if ( n > OUTQ_REFILL_CHUNK ){
+            n = OUTQ_REFILL_CHUNK;
+        }
+
+        outq_frame_t * f = malloc( sizeof( *f ) + n );
+        if ( !f ){
+            return;
+        }
+
+        ssize_t r = pread( fileno( q->spill ), f->data, n, q->spill_rd );
+        if ( r <= 0 ) {
+            free( f );
+            close_locked( q );                      // lost bytes - stream is broken
+            return;
+        }
+
+        f->base = f->data;
+        f->len  = ( size_t ) r;
+        f->off  = 0;
+        f->ref  = NULL;
+        append( q, f );
+        q->spill_rd += r;
+    }
+
+    if ( q->spill && spill_pending( q ) == 0 && q->spill_wr > 0 ) {
+        q->spill_rd = q->spill_wr = 0;
+        if ( ftruncate( fileno( q->spill ), 0 ) < 0 ){
+            log_msg( LOG_WARNING, "[outq] spill truncate: %s\n", strerror( errno ) );
+        }
+    }
+}
+
+/*
+ * @brief  Refills from the spill file and leaves the slow state at low.
+ */
+static void settle_locked( out_queue_t * q ) {
+
+    refill_locked( q );
+
+    if ( backlog( q ) <= flusher.cfg.low ) {
+        if ( q->slow ){
+            log_msg( LOG_INFO, "[outq] fd=%d caught up (dropped %llu frames, spilled %llu bytes)\n",
+                    q->fd, ( unsigned long long ) q->dropped, ( unsigned long long ) q->spilled );
+        }
+        q->slow = 0;
+        pthread_cond_broadcast( &q->drained );
+    }
+}
+
+static void consume_locked( out_queue_t * q, size_t n ) {
+
+    while ( n > 0 && q->head ) {
+
+        outq_frame_t * f = q->head;
+        size_t take = f->len - f->off;
+        if ( take > n ){
+            take = n;
+        }
+
+        f->off    += take;
+        q->queued -= take;
+        n         -= take;
+
+        if ( f->off == f->len ) {
+            q->head = f->next;
+            if ( !q->head ){
+                q->tail = NULL;
+            }
+            frame_free( f );
+        }
+    }
+
+    settle_locked( q );
+}
+
+/*
+ * @brief  Writes as much of the queue as the socket takes, many frames per call.
+ *
+ * @return int 0 (empty or socket full), -1 on a socket error.
+ */
+static int flush_locked( out_queue_t * q ) {
+
+    for (;;) {
+
+        struct iovec iov[ OUTQ_IOV_MAX ];
+        size_t total = 0;
+        int n = 0;
+
+        for ( outq_frame_t * f = q->head; f && n < OUTQ_IOV_MAX; f = f->next, ++n ) {
+            iov[n].iov_base = ( void * ) ( f->base + f->off );
+            iov[n].iov_len  = f->len - f->off;
+            total += iov[n].iov_len;
+        }
+        if ( n == 0 ){
+            return 0;
+        }
+
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t w = sendmsg( q->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL );
+        if ( w < 0 ) {
+            if ( errno == EINTR ){
+                continue;
+            }
+            return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? 0 : -1;
+        }
+
+        consume_locked( q, ( size_t ) w );
+        if ( ( size_t ) w < total ){
+            return 0;                               // socket full
+        }
+    }
+}
+
+/*
+ * @brief  Appends a frame to the spill file.
+ *
+ * @return int 0 on success, -1 if it cannot be spilled (limit, disk).
+ */
+static int spill_locked( out_queue_t * q, const struct iovec * iov, int cnt, size_t len ) {
+
+    if ( spill_pending( q ) + len > flusher.cfg.spill_limit ){
+        return -1;
+    }
+    if ( !q->spill && !( q->spill = tmpfile() ) ) {
+        log_msg( LOG_ERR, "[outq] spill file: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    for ( int i = 0; i < cnt; ++i ) {
+        const uint8_t * p = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while ( left > 0 ) {
+            ssize_t w = pwrite( fileno( q->spill ), p, left, q->spill_wr );
+            if ( w <= 0 ){
+                return -1;
+            }
+            p += w;
+            left -= w;
+            q->spill_wr += w;
+        }
+    }
+
+    q->spilled += len;
+    metrics_add( METRIC_OUTQ_SPILLED, len );
+    return 0;
+}
+
+static void queue_free( out_queue_t * q ) {
+
+    while ( q->head ) {
+        outq_frame_t * f = q->head;
+        q->head = f->next;
+        frame_free( f );
+    }
+    if ( q->spill ){
+        fclose( q->spill );
+    }
+    pthread_cond_destroy( &q->drained );
+    pthread_mutex_destroy( &q->lock );
+    free( q );
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                 Flusher                                    */
+/* -------------------------------------------------------------------------- */
+
+static void * flusher_thread( void * arg ) {
+
+    struct epoll_event events[ OUTQ_MAX_EVENTS ];
+    ( void ) arg;
+
+    for (;;) {
+
+        int n = epoll_wait( flusher.epfd, events, OUTQ_MAX_EVENTS, OUTQ_TICK_MS );
+
+        for ( int i = 0; i < n; ++i ) {
+
+            out_queue_t * q = events[i].data.ptr;
+
+            pthread_mutex_lock( &q->lock );
+            q->armed = 0;
+            if ( !q->closed ) {
+                uint64_t t0 = metrics_now();
+                int rc = flush_locked( q );
+                metrics_record( METRIC_IO_FLUSH, metrics_now() - t0 );
+                if ( rc < 0 ){
+                    close_locked( q );
+                } else if ( q->head ){
+                    arm_locked( q );
+                }
+            }
+            pthread_mutex_unlock( &q->lock );
+        }
+
+        /* no event fetched from now on can name these */
+        pthread_mutex_lock( &flusher.zlock );
+        out_queue_t * dead = flusher.zombies;
+        flusher.zombies = NULL;
+        pthread_mutex_unlock( &flusher.zlock );
+
+        while ( dead ) {
+            out_queue_t * next = dead->zombie_next;
+            queue_free( dead );
+            dead = next;
+        }
+    }
+
+    return NULL;
+}
+
+int outq_init( const outq_config_t * cfg ) {
+
+    struct rlimit rl;
+    pthread_t tid;
+
+    flusher.cfg = *cfg;
+    if ( flusher.cfg.high == 0 ){
+        flusher.cfg.high = OUTQ_DEFAULT_HIGH;
+    }
+    if ( flusher.cfg.low == 0 || flusher.cfg.low >= flusher.cfg.high ){
+        flusher.cfg.low = flusher.cfg.high < OUTQ_DEFAULT_LOW * 4 ? flusher.cfg.high / 4
+                                                                   : OUTQ_DEFAULT_LOW;
+    }
+    if ( flusher.cfg.spill_limit == 0 ){
+        flusher.cfg.spill_limit = OUTQ_DEFAULT_SPILL;
+    }
+
+    static const char * const names[] = { "drop", "disconnect", "spill" };
+
+    /* a server started again in this process - only the watermarks change */
+    if ( flusher.table ) {
+        log_msg( LOG_INFO, "[outq] high %zu low %zu bytes, slow consumers: %s\n",
+                flusher.cfg.high, flusher.cfg.low, names[ flusher.cfg.policy ] );
+        return 0;
+    }
+
+    flusher.table_size = 1024;
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur != RLIM_INFINITY ){
+        flusher.table_size = rl.rlim_cur;
+    }
+    if ( flusher.table_size > OUTQ_MAX_FDS ){
+        flusher.table_size = OUTQ_MAX_FDS;
+    }
+
+    flusher.table = calloc( flusher.table_size, sizeof( *flusher.table ) );
+    flusher.epfd  = epoll_create1( EPOLL_CLOEXEC );
+    if ( !flusher.table || flusher.epfd < 0 ||
+         pthread_create( &tid, NULL, flusher_thread, NULL ) != 0 ) {
+        log_msg( LOG_ERR, "[outq] flusher not started, writes stay blocking\n" );
+        free( flusher.table );
+        flusher.table = NULL;
+        if ( flusher.epfd >= 0 ){
+            close( flusher.epfd );
+        }
+        flusher.epfd = -1;
+        return -1;
+    }
+    pthread_detach( tid );
+
+    log_msg( LOG_INFO, "[outq] high %zu low %zu bytes, slow consumers: %s\n",
+            flusher.cfg.high, flusher.cfg.low, names[ flusher.cfg.policy ] );
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                  Queues                                    */
+/* -------------------------------------------------------------------------- */
+
+out_queue_t * outq_create( int fd ) {
+
+    if ( !flusher.table || fd < 0 || ( size_t ) fd >= flusher.table_size ){
+        return NULL;
+    }
+
+    out_queue_t * q = calloc( 1, sizeof( *q ) );
+    if ( !q ){
+        return NULL;
+    }
+
+    pthread_mutex_init( &q->lock, NULL );
+    pthread_cond_init( &q->drained, NULL );
+    q->fd = fd;
+
+    atomic_store_explicit( &flusher.table[ fd ], q, memory_order_release );
+    return q;
+}
+
+void outq_destroy( out_queue_t * q ) {
+
+    if ( !q ){
+        return;
+    }
+
+    out_queue_t * expected = q;
+    atomic_compare_exchange_strong( &flusher.table[ q->fd ], &expected, NULL );
+
+    pthread_mutex_lock( &q->lock );
+    q->closed = 1;
+    int registered = q->registered;
+    pthread_cond_broadcast( &q->drained );
+    pthread_mutex_unlock( &q->lock );
+
+    if ( q->dropped || q->spilled ){
+        log_msg( LOG_INFO, "[outq] fd=%d closed, dropped %llu frames, spilled %llu bytes\n",
+                q->fd, ( unsigned long long ) q->dropped, ( unsigned long long ) q->spilled );
+    }
+
+    if ( !registered ) {
+        queue_free( q );
+        return;
+    }
+
+    /* an event for it may already be on its way - the flusher frees it */
+    epoll_ctl( flusher.epfd, EPOLL_CTL_DEL, q->fd, NULL );
+    pthread_mutex_lock( &flusher.zlock );
+    q->zombie_next  = flusher.zombies;
+    flusher.zombies = q;
+    pthread_mutex_unlock( &flusher.zlock );
+}
+
+out_queue_t * outq_lookup( int fd ) {
+
+    if ( !flusher.table || fd < 0 || ( size_t ) fd >= flusher.table_size ){
+        return NULL;
+    }
+    return atomic_load_explicit( &flusher.table[ fd ], memory_order_acquire );
+}
+
+int outq_send( out_queue_t * q, const struct iovec * iov, int cnt, int flags ) {
+
+    return outq_send_buf( q, iov, cnt, flags, NULL );
+}
+
+int outq_send_buf( out_queue_t * q, const struct iovec * iov, int cnt, int flags, msg_buf_t * buf ) {
+
+    size_t len = iov_total( iov, cnt );
+    int reply = flags & OUTQ_REPLY;
+    int over;                                       // the policy decides about this frame
+    int wake = 0;
+
+    metrics_lock( METRIC_LOCK_OUTQ, pthread_mutex_lock( &q->lock ) );
+
+    if ( reply && backlog( q ) > flusher.cfg.high && ( flags & OUTQ_WAIT ) && !q->wake ) {
+        /* own reply - backpressure on this connection only, for a while */
+        struct timespec until;
+        clock_gettime( CLOCK_REALTIME, &until );
+        until.tv_sec  += OUTQ_REPLY_WAIT_MS / 1000;
+        until.tv_nsec += ( OUTQ_REPLY_WAIT_MS % 1000 ) * 1000000L;
+        if ( until.tv_nsec >= 1000000000L ) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while ( !q->closed && backlog( q ) > flusher.cfg.low ){
+            if ( pthread_cond_timedwait( &q->drained, &q->lock, &until ) == ETIMEDOUT ){
+                break;
+            }
+        }
+    }
+
+    if ( !q->slow && backlog( q ) + ( reply ? 0 : len ) > flusher.cfg.high ) {
+        q->slow = 1;
+        metrics_inc( METRIC_OUTQ_SLOW );
+        log_msg( LOG_WARNING, "[outq] fd=%d is a slow consumer (%zu bytes queued)\n",
+                q->fd, backlog( q ) );
+    }
+    /* a reply still fits below high - it is what the client waits for */
+    over = reply ? backlog( q ) > flusher.cfg.high : q->slow;
+
+    if ( q->closed ) {
+        pthread_mutex_unlock( &q->lock );
+        return -1;
+    }
+
+    if ( over ) {
+        switch ( flusher.cfg.policy ) {
+        case OUTQ_DROP:
+            if ( reply ){
+                break;                              // never dropped - spilled below
+            }
+            q->dropped++;
+            metrics_inc( METRIC_OUTQ_DROPPED );
+            pthread_mutex_unlock( &q->lock );
+            return 0;
+        case OUTQ_DISCONNECT:
+            log_msg( LOG_WARNING, "[outq] fd=%d disconnected (slow consumer)\n", q->fd );
+            metrics_inc( METRIC_OUTQ_DISCONNECTED );
+            close_locked( q );
+            pthread_mutex_unlock( &q->lock );
+            return -1;
+        case OUTQ_SPILL:
+            break;                                  // below
+        }
+    }
+
+    if ( spill_pending( q ) > 0 || over ) {
+
+        /* keeps the byte order - see refill_locked() */
+        if ( spill_locked( q, iov, cnt, len ) < 0 ) {
+            log_msg( LOG_WARNING, "[outq] fd=%d disconnected (spill limit)\n", q->fd );
+            close_locked( q );
+            pthread_mutex_unlock( &q->lock );
+            return -1;
+        }
+        wake = q->head == NULL;
+        refill_locked( q );
+        wake = wake && q->head != NULL && q->wake;
+
+    } else {
+
+        size_t sent = 0;
+
+        /* nothing queued - straight to the socket */
+        if ( !q->head && !q->wake ) {
+            struct msghdr mh = { .msg_iov = ( struct iovec * ) iov, .msg_iovlen = cnt };
+            uint64_t t0 = metrics_now();
+            ssize_t w = sendmsg( q->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL );
+            metrics_record( METRIC_IO_WRITE, metrics_now() - t0 );
+            if ( w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                pthread_mutex_unlock( &q->lock );
+                return -1;
+            }
+            sent = w > 0 ? ( size_t ) w : 0;
+            if ( sent == len ) {
+                pthread_mutex_unlock( &q->lock );
+                return 0;
+            }
+        }
+
+        outq_frame_t * f = frames_new( iov, cnt, sent, buf );
+        if ( !f ) {
+            /* part of the frame may be out already - the stream is broken */
+            close_locked( q );
+            pthread_mutex_unlock( &q->lock );
+            return -1;
+        }
+
+        wake = q->head == NULL && q->wake;
+        while ( f ) {
+            outq_frame_t * next = f->next;
+            append( q, f );
+            f = next;
+        }
+    }
+
+    arm_locked( q );
+    pthread_mutex_unlock( &q->lock );
+
+    if ( wake ){
+        q->wake( q->wake_arg );
+    }
+    return 0;
+}
+
+void outq_set_owner( out_queue_t * q, void ( * wake )( void * ), void * arg ) {
+
+    pthread_mutex_lock( &q->lock );
+    q->wake     = wake;
+    q->wake_arg = arg;
+    pthread_mutex_unlock( &q->lock );
+}
+
+int outq_peek( out_queue_t * q, struct iovec * iov, int max ) {
+
+    int n = 0;
+
+    pthread_mutex_lock( &q->lock );
+    for ( outq_frame_t * f = q->head; f && n < max; f = f->next, ++n ) {
+        iov[n].iov_base = ( void * ) ( f->base + f->off );
+        iov[n].iov_len  = f->len - f->off;
+    }
+    pthread_mutex_unlock( &q->lock );
+
+    return n;
+}
+
+void outq_consume( out_queue_t * q, size_t n ) {
+
+    pthread_mutex_lock( &q->lock );
+    consume_locked( q, n );
+    pthread_mutex_unlock( &q->lock );
+}
+
+int outq_drain( out_queue_t * q, int timeout_ms ) {
+
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    long long end = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + timeout_ms;
+    int rc = -1;
+
+    pthread_mutex_lock( &q->lock );
+    q->wake     = NULL;
+    q->wake_arg = NULL;
+
+    for (;;) {
+
+        if ( q->closed || flush_locked( q ) < 0 ){
+            break;
+        }
+        refill_locked( q );
+        if ( backlog( q ) == 0 ) {
+            rc = 0;
+            break;
+        }
+
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        long long left = end - ( ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 );
+        if ( left <= 0 ){
+            break;
+        }
+
+        /* the flusher may want the lock meanwhile - it finds the same backlog */
+        pthread_mutex_unlock( &q->lock );
+        struct pollfd pfd = { .fd = q->fd, .events = POLLOUT };
+        poll( &pfd, 1, ( int ) left );
+        pthread_mutex_lock( &q->lock );
+    }
+
+    pthread_mutex_unlock( &q->lock );
+    return rc;
+}
@@ -1,41 +1,268 @@
 #include <stdlib.h>     // malloc, free
 #include <string.h>     // memcpy
-#include <unistd.h>     // write, read
+#include <unistd.h>     // read
+#include <sys/uio.h>    // writev
 #include <arpa/inet.h>  // htons, ntohs
 #include <errno.h>
 
 #include "protocol.h"
+#include "tlv_lz.h"
 
 
 
+static __thread tlv_send_hook_t send_hook;
+static __thread void * send_hook_arg;
+
+void tlv_set_send_hook( tlv_send_hook_t hook, void * arg ) {
+
+    send_hook     = hook;
+    send_hook_arg = arg;
+}
+
 /*
- * @brief  Writes all requested data to a file descriptor.
+ * @brief  Writes all data described by an iovec array to a file descriptor.
  *
- * @details Handles the "partial write" problem common in network programming.
- * It repeatedly calls write() until the entire buffer is transmitted
- * or an error occurs.
+ * @details Vectored version of the classic "write all" loop. writev() may
+ * transmit only a part of the data (socket buffer full), so the iovec array
+ * is advanced past the bytes already sent and the call is repeated until
+ * everything is out. The array is modified in place.
+ * A write hook of the thread (tlv_set_send_hook()) gets the data first.
  *
  * @param  fd   The socket file descriptor.
- * @param  buf  Pointer to the buffer containing data.
- * @param  len  The size of the data in bytes.
+ * @param  iov  Array of buffers to send (modified!).
+ * @param  cnt  Number of elements in the array.
  * @return int  Returns 0 on success, -1 if an error occurred.
  */
-static int write_all( int fd, const void *buf, size_t len ) {
+static int writev_all( int fd, struct iovec * iov, int cnt ) {
 
-    size_t offset = 0;           // actual byte to write
-    const uint8_t *p = buf;      // begin of datas
+    if ( send_hook ) {
+        int rc = send_hook( send_hook_arg, fd, iov, cnt );
+        if ( rc <= 0 ){
+            return rc;
+        }
+    }
 
-    while ( offset < len ) {       // do until all data are sent 
+    while ( cnt > 0 ) {              // do until all buffers are sent
 
-        ssize_t n = write( fd, p + offset, len - offset );    // actual sending
-        if ( n <= 0 ){             // success?
+        ssize_t n = writev( fd, iov, cnt );
+        if ( n < 0 && errno == EINTR ){
+            continue;
+        }
+        if ( n <= 0 ){
             return -1;
         }
 
-        offset += n;             // n is the count of sent bytes -> shift offset
+        /* skip buffers which are already sent */
+        while ( cnt > 0 && ( size_t ) n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+
+        /* part of the current buffer is sent -> shift its begin */
+        if ( cnt > 0 ) {
+            iov->iov_base = ( uint8_t * ) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+void tlv_batch_begin( tlv_batch_t * batch, int fd ) {
+
+    batch->fd        = fd;
+    batch->iov_count = 0;
+    batch->error     = 0;
+    batch->hdr_used  = 0;
+}
+
+/*
+ * @brief  Reserves header space and iovec slots in the batch.
+ *
+ * @details When the batch has no room left, everything collected so far is
+ * written out first and the reservation starts in an empty batch.
+ *
+ * @return uint8_t* Pointer to `hdr_len` bytes for encoded headers, NULL if
+ * the automatic flush failed or the item can never fit.
+ */
+static uint8_t * batch_reserve( tlv_batch_t * batch, size_t hdr_len, int iovs ) {
+
+    if ( hdr_len > sizeof( batch->hdr ) || iovs > 2 * TLV_BATCH_MAX ){
+        return NULL;
+    }
+
+    if ( ( batch->hdr_used + hdr_len > sizeof( batch->hdr ) ||
+           batch->iov_count + iovs > 2 * TLV_BATCH_MAX ) &&
+         tlv_batch_flush( batch ) < 0 ) {
+        return NULL;                        // batch full and flush failed
+    }
+
+    uint8_t * p = batch->hdr + batch->hdr_used;
+    batch->hdr_used += hdr_len;
+    return p;
+}
+
+static void batch_iov( tlv_batch_t * batch, const void * base, size_t len ) {
+
+    if ( len > 0 && base != NULL ) {        // payload is only referenced
+        batch->iov[ batch->iov_count ].iov_base = ( void * ) base;
+        batch->iov[ batch->iov_count ].iov_len  = len;
+        batch->iov_count++;
+    }
+}
+
+/*
+ * @brief  Encodes a TLV header.
+ *
+ * @details Payloads longer than 16 bits get the extended form: type with
+ * TLV_EXT_FLAG, length 0 and the real 32 bit length behind.
+ *
+ * @return size_t Header size (TLV_HEADER_LENGTH or TLV_EXT_HEADER_LENGTH).
+ */
+static size_t encode_tlv_header( uint8_t * p, uint16_t type, uint32_t len ) {
+
+    tlv_ext_header_t hdr;
+
+    if ( len <= UINT16_MAX ) {
+        hdr.header.type   = htons( type );  // network byte order
+        hdr.header.length = htons( ( uint16_t ) len );
+        memcpy( p, &hdr.header, TLV_HEADER_LENGTH );
+        return TLV_HEADER_LENGTH;
+    }
+
+    hdr.header.type   = htons( type | TLV_EXT_FLAG );
+    hdr.header.length = 0;
+    hdr.length        = htonl( len );
+    memcpy( p, &hdr, TLV_EXT_HEADER_LENGTH );
+    return TLV_EXT_HEADER_LENGTH;
+}
+
+static size_t tlv_header_size( uint32_t len ) {
+
+    return len <= UINT16_MAX ? TLV_HEADER_LENGTH : TLV_EXT_HEADER_LENGTH;
+}
+
+int tlv_batch_add( tlv_batch_t * batch, uint16_t type, const void * data, uint32_t len ) {
+
+    size_t hlen = tlv_header_size( len );
+    uint8_t * hdr = batch_reserve( batch, hlen, 2 );
+    if ( hdr == NULL ){
+        return -1;
     }
 
-    return 0;                   // sned 0 when done
+    encode_tlv_header( hdr, type, len );
+    batch_iov( batch, hdr, hlen );
+    batch_iov( batch, data, len );
+
+    return 0;
+}
+
+/*
+ * @brief Appends a compound frame to the batch.
+ *
+ * @details Outer TLV header, frame header and all nested field headers are
+ * encoded into the batch header space, field payloads are referenced.
+ * The frame always lands in a single writev() together with whatever else
+ * is in the batch.
+ *
+ * @param batch      The batch.
+ * @param type       TLV_FRAME (command) or TLV_RESPONSE (answer).
+ * @param command    Command identifier (command_t).
+ * @param request_id Correlation id (0 = none).
+ * @param flags      CMD_FRAME_FLAG_* bits.
+ * @param fields     Frame fields.
+ * @param count      Number of fields (max CMD_FRAME_MAX_FIELDS).
+ * @return           0 on success, -1 on failure.
+ */
+int tlv_batch_add_frame(
+    tlv_batch_t * batch,
+    uint16_t type,
+    uint16_t command,
+    uint32_t request_id,
+    uint8_t flags,
+    const tlv_vec_t * fields,
+    size_t count
+) {
+    size_t total = CMD_FRAME_HEADER_LENGTH;
+
+    if ( count > CMD_FRAME_MAX_FIELDS ){
+        return -1;
+    }
+
+    for ( size_t i = 0; i < count; ++i ) {
+        total += TLV_HEADER_LENGTH + ( size_t ) fields[i].len;
+    }
+
+    if ( total > UINT16_MAX ){                  // does not fit in one TLV
+        return -1;
+    }
+
+    size_t hdr_len = TLV_HEADER_LENGTH + CMD_FRAME_HEADER_LENGTH + count * TLV_HEADER_LENGTH;
+    uint8_t * p = batch_reserve( batch, hdr_len, 1 + 2 * ( int ) count );
+    if ( p == NULL ){
+        return -1;
+    }
+
+    cmd_frame_header_t fh;
+    fh.version    = CMD_FRAME_VERSION;
+    fh.flags      = flags;
+    fh.command    = htons( command );
+    fh.request_id = htonl( request_id );
+
+    encode_tlv_header( p, type, ( uint32_t ) total );
+    memcpy( p + TLV_HEADER_LENGTH, &fh, CMD_FRAME_HEADER_LENGTH );
+    batch_iov( batch, p, TLV_HEADER_LENGTH + CMD_FRAME_HEADER_LENGTH );
+    p += TLV_HEADER_LENGTH + CMD_FRAME_HEADER_LENGTH;
+
+    for ( size_t i = 0; i < count; ++i ) {
+        encode_tlv_header( p, fields[i].type, fields[i].len );
+        batch_iov( batch, p, TLV_HEADER_LENGTH );
+        batch_iov( batch, fields[i].data, fields[i].len );
+        p += TLV_HEADER_LENGTH;
+    }
+
+    return 0;
+}
+
+int tlv_batch_flush( tlv_batch_t * batch ) {
+
+    if ( batch->iov_count > 0 &&
+         writev_all( batch->fd, batch->iov, batch->iov_count ) < 0 ) {
+        batch->error = -1;
+    }
+
+    batch->iov_count = 0;
+    batch->hdr_used  = 0;
+
+    return batch->error;
+}
+
+/*
+ * @brief Sends several TLV packets with a single writev() call.
+ *
+ * @details All headers and payloads are collected in one iovec list, so a
+ * whole command (e.g. COMMAND + LOGIN + PASSWORD) costs one syscall and
+ * leaves the host as one TCP segment instead of a train of tiny ones.
+ *
+ * @param fd    Socket file descriptor.
+ * @param tlvs  Array of TLVs to send.
+ * @param count Number of TLVs in the array.
+ * @return      0 on success, -1 on failure.
+ */
+int send_tlvv( int fd, const tlv_vec_t * tlvs, size_t count ) {
+
+    tlv_batch_t batch;
+
+    tlv_batch_begin( &batch, fd );
+
+    for ( size_t i = 0; i < count; ++i ) {
+        if ( tlv_batch_add( &batch, tlvs[i].type, tlvs[i].data, tlvs[i].len ) < 0 ){
+            return -1;
+        }
+    }
+
+    return tlv_batch_flush( &batch );
 }
 
 /*
@@ -43,6 +270,7 @@ static int write_all( int fd, const void *buf, size_t len ) {
  *
  * @details This function handles byte-order conversion (Host to Network) ensuring
  * that integers are interpreted correctly regardless of the machine architecture.
+ * Header and payload go out together in one writev().
  *
  * @param fd   Socket file descriptor.
  * @param type The message type (e.g., TLV_LOGIN).
@@ -52,21 +280,113 @@ static int write_all( int fd, const void *buf, size_t len ) {
  */
 int send_tlv( int fd, uint16_t type, const void *data, uint16_t len ){
 
-    tlv_header_t hdr;               //header structure
+    tlv_vec_t tlv = { type, data, len };
+
+    return send_tlvv( fd, &tlv, 1 );
+}
+
+/*
+ * @brief Sends a compound command frame.
+ *
+ * @details The outer TLV header, frame header and every nested field
+ * (header + payload) are collected in one iovec list, so the whole command
+ * is written with a single syscall and can be validated by the server
+ * before anything is executed.
+ *
+ * @param fd         Socket file descriptor.
+ * @param command    Command identifier (command_t).
+ * @param request_id Correlation id copied into the TLV_RESPONSE (0 = none).
+ * @param fields     Command fields in the order expected by the command.
+ * @param count      Number of fields (max CMD_FRAME_MAX_FIELDS).
+ * @return           0 on success, -1 on failure.
+ */
+int send_cmd_frame(
+    int fd,
+    uint16_t command,
+    uint32_t request_id,
+    const tlv_vec_t * fields,
+    size_t count
+) {
+    tlv_batch_t batch;
+
+    tlv_batch_begin( &batch, fd );
+
+    if ( tlv_batch_add_frame( &batch, TLV_FRAME, command, request_id, 0, fields, count ) < 0 ){
+        return -1;
+    }
+
+    return tlv_batch_flush( &batch );
+}
 
-    hdr.type = htons( type );        // network byte order
-    hdr.length  = htons( len );
+/*
+ * @brief Parses the payload of a TLV_FRAME or TLV_RESPONSE.
+ *
+ * @details Single pass over the payload: the frame header is checked first
+ * (version 1 has a shorter header without request id),
+ * then every nested field header. A field is accepted only if its whole
+ * value lies inside the payload, so later code can use the views without
+ * any further length checks. Trailing garbage is treated as an error.
+ *
+ * @param payload Frame payload (after the outer TLV header).
+ * @param len     Payload length.
+ * @param frame   Output - decoded frame (views point into `payload`).
+ * @return        0 on success, -1 on malformed frame or unknown version.
+ */
+int cmd_frame_parse( const void * payload, size_t len, cmd_frame_t * frame ) {
+
+    const uint8_t * p = payload;
+    cmd_frame_header_t fh = { 0 };
+    size_t off;
+
+    if ( len < CMD_FRAME_V1_HEADER_LENGTH ){
+        return -1;
+    }
+
+    switch ( p[0] ) {                   // version
+    case 1:
+        off = CMD_FRAME_V1_HEADER_LENGTH;
+        break;
+    case CMD_FRAME_VERSION:
+        off = CMD_FRAME_HEADER_LENGTH;
+        break;
+    default:
+        return -1;
+    }
 
-    /* Send TLV Header */
-    if ( write_all( fd, &hdr, TLV_HEADER_LENGTH ) < 0 ){    
+    if ( len < off ){
         return -1;
     }
+    memcpy( &fh, p, off );
+
+    frame->version    = fh.version;
+    frame->flags      = fh.flags;
+    frame->command    = ntohs( fh.command );
+    frame->request_id = ntohl( fh.request_id );
+    frame->count      = 0;
 
-    /* Send TLV datas */
-    if ( len > 0 && data != NULL ) {                             // check if data exist 
-        if ( write_all( fd, data, len ) < 0){                    // if yes, send all
+    while ( off < len ) {
+
+        tlv_header_t hdr;
+
+        if ( frame->count == CMD_FRAME_MAX_FIELDS ||
+             len - off < TLV_HEADER_LENGTH ){
+            return -1;
+        }
+
+        memcpy( &hdr, p + off, TLV_HEADER_LENGTH );
+        off += TLV_HEADER_LENGTH;
+
+        tlv_view_t * f = &frame->fields[ frame->count ];
+        f->type = ntohs( hdr.type );
+        f->len  = ntohs( hdr.length );
+
+        if ( f->len > len - off ){              // field runs past the frame
             return -1;
         }
+
+        f->data = p + off;
+        off += f->len;
+        frame->count++;
     }
 
     return 0;
@@ -131,6 +451,10 @@ int recv_tlv( int fd, uint16_t *type, void **data, uint16_t *len ){
         return -1;
     }
 
+    if ( ntohs( hdr.type ) & TLV_EXT_FLAG ){
+        return -1;                  // length does not fit the 16 bit API
+    }
+
     *type = ntohs( hdr.type );  // host byte order
     *len  = ntohs( hdr.length );
 
@@ -153,4 +477,589 @@ int recv_tlv( int fd, uint16_t *type, void **data, uint16_t *len ){
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * @brief  Receives a TLV packet into a caller owned buffer.
+ *
+ * @details Allocation-free version of recv_tlv(). The payload is read
+ * directly into `buf`; bytes that do not fit are read and thrown away,
+ * so the next TLV still starts at the right place in the stream.
+ *
+ * @param  fd    The socket file descriptor.
+ * @param  type  Output - message type.
+ * @param  buf   Destination buffer.
+ * @param  cap   Size of the destination buffer.
+ * @param  len   Output - number of bytes stored in buf.
+ * @return int   Returns 0 on success, -1 on failure (error or disconnect).
+ */
+int recv_tlv_into( int fd, uint16_t * type, void * buf, size_t cap, uint16_t * len ) {
+
+    tlv_header_t hdr;
+    uint8_t      drop[ 256 ];
+
+    if ( read_all( fd, &hdr, TLV_HEADER_LENGTH ) < 0 ){
+        return -1;
+    }
+
+    *type = ntohs( hdr.type );  // host byte order
+    size_t total = ntohs( hdr.length );
+
+    if ( *type & TLV_EXT_FLAG ) {
+        uint32_t ext;
+        if ( read_all( fd, &ext, sizeof( ext ) ) < 0 ){
+            return -1;
+        }
+        *type &= ~TLV_EXT_FLAG;
+        total  = ntohl( ext );
+    }
+
+    if ( cap > UINT16_MAX ){
+        cap = UINT16_MAX;           // stored length is reported in 16 bits
+    }
+    size_t n = total < cap ? total : cap;
+
+    if ( n > 0 && read_all( fd, buf, n ) < 0 ){
+        return -1;
+    }
+
+    /* payload longer than buffer -> skip the rest */
+    for ( size_t left = total - n; left > 0; ) {
+        size_t chunk = left < sizeof( drop ) ? left : sizeof( drop );
+        if ( read_all( fd, drop, chunk ) < 0 ){
+            return -1;
+        }
+        left -= chunk;
+    }
+
+    *len = ( uint16_t ) n;
+    return 0;
+}
+
+int tlv_parser_init( tlv_parser_t * parser ) {
+
+    parser->head = 0;
+    parser->tail = 0;
+    parser->need = 0;
+    parser->cap  = TLV_READER_INIT_SIZE;
+    parser->buf  = malloc( parser->cap );
+
+    return parser->buf ? 0 : -1;
+}
+
+void tlv_parser_free( tlv_parser_t * parser ) {
+
+    free( parser->buf );
+    parser->buf = NULL;
+    parser->cap = parser->head = parser->tail = parser->need = 0;
+}
+
+/*
+ * @brief  Makes room for incoming bytes.
+ *
+ * @details Unparsed data is moved to the front of the buffer when the
+ * incomplete TLV would not fit behind head, and the buffer is enlarged when
+ * even the whole of it is too small. Asking for `want` more bytes than
+ * currently free compacts / grows as well (used by tlv_parser_feed()).
+ *
+ * @param  parser The parser.
+ * @param  want   Minimal free space requested by the caller (0 = any).
+ * @param  avail  Output - free bytes behind the returned pointer.
+ * @return uint8_t* Free space, NULL on allocation failure.
+ */
+static uint8_t * parser_reserve( tlv_parser_t * parser, size_t want, size_t * avail ) {
+
+    size_t pending = parser->tail - parser->head;
+    size_t need    = parser->need > pending + want ? parser->need : pending + want;
+
+    if ( need < pending + 1 ){
+        need = pending + 1;                         // always room for one byte
+    }
+
+    /* everything parsed (old views are dead now) -> start from the beginning */
+    if ( pending == 0 ) {
+        parser->head = parser->tail = 0;
+    }
+
+    /* not enough space behind head -> compact */
+    if ( parser->head + need > parser->cap && parser->head > 0 ) {
+        memmove( parser->buf, parser->buf + parser->head, pending );
+        parser->tail = pending;
+        parser->head = 0;
+    }
+
+    /* single TLV (or fed block) bigger than buffer -> grow */
+    if ( need > parser->cap ) {
+        size_t cap = parser->cap * 2 > need ? parser->cap * 2 : need;
+        uint8_t * p = realloc( parser->buf, cap );
+        if ( p == NULL ){
+            return NULL;
+        }
+        parser->buf = p;
+        parser->cap = cap;
+    }
+
+    *avail = parser->cap - parser->tail;
+    return parser->buf + parser->tail;
+}
+
+uint8_t * tlv_parser_space( tlv_parser_t * parser, size_t * avail ) {
+
+    return parser_reserve( parser, 0, avail );
+}
+
+void tlv_parser_commit( tlv_parser_t * parser, size_t n ) {
+
+    parser->tail += n;
+}
+
+int tlv_parser_feed( tlv_parser_t * parser, const void * data, size_t len ) {
+
+    size_t avail;
+    uint8_t * p = parser_reserve( parser, len, &avail );
+
+    if ( p == NULL ){
+        return -1;
+    }
+
+    memcpy( p, data, len );
+    parser->tail += len;
+    return 0;
+}
+
+ssize_t tlv_parser_read( tlv_parser_t * parser, int fd ) {
+
+    size_t avail;
+    uint8_t * p = tlv_parser_space( parser, &avail );
+
+    if ( p == NULL ){
+        return -1;
+    }
+
+    /* ask for all free space - a burst of small TLVs arrives with one syscall */
+    ssize_t n = read( fd, p, avail );
+    if ( n > 0 ){
+        parser->tail += n;
+    }
+    return n;
+}
+
+/*
+ * @brief  Cuts the next complete TLV out of the received bytes.
+ *
+ * @details The header (4 bytes, or 8 with TLV_EXT_FLAG) is decoded each time
+ * from the buffer, so an incomplete TLV needs no other state than `need`,
+ * which tells tlv_parser_space() how much room the TLV will take.
+ *
+ * @return int 1 - view filled, 0 - incomplete, -1 - protocol error.
+ */
+int tlv_parser_next( tlv_parser_t * parser, tlv_view_t * view ) {
+
+    const uint8_t * p = parser->buf + parser->head;
+    size_t avail = parser->tail - parser->head;
+    tlv_ext_header_t hdr;
+    size_t hlen = TLV_HEADER_LENGTH;
+
+    if ( avail < TLV_HEADER_LENGTH ) {
+        parser->need = TLV_HEADER_LENGTH;
+        return 0;
+    }
+
+    memcpy( &hdr.header, p, TLV_HEADER_LENGTH );
+    view->type = ntohs( hdr.header.type );  // host byte order
+    view->len  = ntohs( hdr.header.length );
+
+    if ( view->type & TLV_EXT_FLAG ) {      // 32 bit length follows
+        if ( avail < TLV_EXT_HEADER_LENGTH ) {
+            parser->need = TLV_EXT_HEADER_LENGTH;
+            return 0;
+        }
+        memcpy( &hdr, p, TLV_EXT_HEADER_LENGTH );
+
+        view->type &= ~TLV_EXT_FLAG;
+        view->len   = ntohl( hdr.length );
+        hlen        = TLV_EXT_HEADER_LENGTH;
+
+        if ( view->len > TLV_EXT_MAX_LENGTH ){  // do not let a peer make us allocate gigabytes
+            return -1;
+        }
+    }
+
+    /* whole TLV (header + datas) has to be in the buffer */
+    if ( avail < hlen + view->len ) {
+        parser->need = hlen + view->len;
+        return 0;
+    }
+
+    view->data    = p + hlen;                   // borrowed
+    parser->head += hlen + view->len;
+    parser->need  = 0;
+
+    return 1;
+}
+
+int tlv_reader_init( tlv_reader_t * reader, int fd ) {
+
+    reader->fd = fd;
+    return tlv_parser_init( &reader->parser );
+}
+
+void tlv_reader_free( tlv_reader_t * reader ) {
+
+    tlv_parser_free( &reader->parser );
+}
+
+int tlv_reader_next( tlv_reader_t * reader, tlv_view_t * view ) {
+
+    for (;;) {
+
+        int rc = tlv_parser_next( &reader->parser, view );
+        if ( rc != 0 ){
+            return rc > 0 ? 0 : -1;
+        }
+
+        /* incomplete -> block for more bytes */
+        ssize_t n = tlv_parser_read( &reader->parser, reader->fd );
+        if ( n < 0 && errno == EINTR ){
+            continue;
+        }
+        if ( n <= 0 ){
+            return -1;
+        }
+    }
+}
+
+/*
+ * @brief  Sends one record of a stream (BEGIN, CHUNK or END).
+ *
+ * @details TLV header, stream header and data leave in one writev(); the
+ * data is referenced, not copied. Chunks over 64 KiB use the extended
+ * header automatically.
+ */
+static int stream_send( tlv_stream_t * stream, uint16_t tlv_type, const void * data, size_t len ) {
+
+    uint8_t hdr[ TLV_EXT_HEADER_LENGTH ];
+    tlv_stream_header_t sh;
+    size_t total = sizeof( sh ) + len;
+
+    if ( total > UINT32_MAX ){
+        return -1;
+    }
+
+    sh.request_id = htonl( stream->request_id );
+    sh.type       = htons( stream->type );
+    sh.reserved   = 0;
+
+    /* compressed chunk: stream header and data packed together */
+    if ( stream->compress && len >= TLV_LZ_THRESHOLD && len <= TLV_STREAM_CHUNK_SIZE ) {
+
+        uint8_t raw[ sizeof( sh ) + TLV_STREAM_CHUNK_SIZE ];
+        uint8_t packed[ sizeof( raw ) ];
+
+        memcpy( raw, &sh, sizeof( sh ) );
+        memcpy( raw + sizeof( sh ), data, len );
+
+        tlv_vec_t tlv = { tlv_type, raw, ( uint32_t ) total };
+        if ( tlv_lz_pack( &tlv, packed, sizeof( packed ) ) > 0 ) {
+            struct iovec iov[2];
+            iov[0].iov_base = hdr;
+            iov[0].iov_len  = encode_tlv_header( hdr, tlv.type, tlv.len );
+            iov[1].iov_base = packed;
+            iov[1].iov_len  = tlv.len;
+            return writev_all( stream->fd, iov, 2 );
+        }
+    }
+
+    struct iovec iov[3];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len  = encode_tlv_header( hdr, tlv_type, ( uint32_t ) total );
+    iov[1].iov_base = &sh;
+    iov[1].iov_len  = sizeof( sh );
+    iov[2].iov_base = ( void * ) data;
+    iov[2].iov_len  = len;
+
+    return writev_all( stream->fd, iov, len > 0 ? 3 : 2 );
+}
+
+/*
+ * @brief  Opens a streamed answer.
+ *
+ * @param stream     Stream state (filled here).
+ * @param fd         Socket file descriptor.
+ * @param request_id Request id of the command being answered.
+ * @param type       Type of the streamed data (e.g. TLV_HISTORY).
+ * @param compress   Non-zero if the peer accepts compressed chunks.
+ * @return           0 on success, -1 on failure.
+ */
+int tlv_stream_begin(
+    tlv_stream_t * stream,
+    int fd,
+    uint32_t request_id,
+    uint16_t type,
+    int compress
+) {
+    stream->fd         = fd;
+    stream->request_id = request_id;
+    stream->type       = type;
+    stream->compress   = compress;
+
+    return stream_send( stream, TLV_STREAM_BEGIN, NULL, 0 );
+}
+
+int tlv_stream_write( tlv_stream_t * stream, const void * data, size_t len ) {
+
+    return stream_send( stream, TLV_STREAM_CHUNK, data, len );
+}
+
+int tlv_stream_end( tlv_stream_t * stream ) {
+
+    return stream_send( stream, TLV_STREAM_END, NULL, 0 );
+}
+
+int tlv_stream_parse( const tlv_view_t * tlv, tlv_stream_view_t * out ) {
+
+    tlv_stream_header_t sh;
+
+    if ( tlv->len < sizeof( sh ) ){
+        return -1;
+    }
+    memcpy( &sh, tlv->data, sizeof( sh ) );
+
+    out->request_id = ntohl( sh.request_id );
+    out->type       = ntohs( sh.type );
+    out->len        = tlv->len - sizeof( sh );
+    out->data       = tlv->data + sizeof( sh );
+    return 0;
+}
+
+static uint64_t hton64( uint64_t v ) {
+
+    uint8_t b[8];
+    for ( int i = 7; i >= 0; --i, v >>= 8 ) {
+        b[i] = ( uint8_t ) v;               // most significant byte first
+    }
+    memcpy( &v, b, sizeof( v ) );
+    return v;
+}
+
+static uint64_t ntoh64( uint64_t v ) {
+
+    uint8_t b[8];
+    uint64_t r = 0;
+    memcpy( b, &v, sizeof( b ) );
+    for ( int i = 0; i < 8; ++i ) {
+        r = ( r << 8 ) | b[i];
+    }
+    return r;
+}
+
+void delivery_header_init(
+    delivery_header_t * hdr,
+    const char * login,
+    const char * username,
+    uint64_t timestamp_ms
+) {
+    memset( hdr, 0, sizeof( *hdr ) );       // no stack garbage on the wire
+    strncpy( hdr->login, login, MAX_USERNAME_LEN - 1 );
+    strncpy( hdr->username, username, MAX_USERNAME_LEN - 1 );
+    hdr->timestamp_ms = hton64( timestamp_ms );
+}
+
+/*
+ * @brief  Pushes a direct message to its recipient.
+ *
+ * @details The header is encoded once by the caller (delivery_header_init)
+ * and the message is only referenced, so the record leaves in one writev()
+ * with no copy of the text.
+ *
+ * @param fd      Recipient socket.
+ * @param hdr     Encoded delivery header.
+ * @param message Message bytes (not terminated).
+ * @param len     Message length.
+ * @return        0 on success, -1 on failure.
+ */
+int send_delivery( int fd, const delivery_header_t * hdr, const void * message, uint32_t len ) {
+
+    uint8_t tlv_hdr[ TLV_EXT_HEADER_LENGTH ];
+    struct iovec iov[3];
+
+    if ( len > UINT32_MAX - sizeof( *hdr ) ){
+        return -1;
+    }
+
+    iov[0].iov_base = tlv_hdr;
+    iov[0].iov_len  = encode_tlv_header( tlv_hdr, TLV_DELIVERY, sizeof( *hdr ) + len );
+    iov[1].iov_base = ( void * ) hdr;
+    iov[1].iov_len  = sizeof( *hdr );
+    iov[2].iov_base = ( void * ) message;
+    iov[2].iov_len  = len;
+
+    return writev_all( fd, iov, len > 0 ? 3 : 2 );
+}
+
+int delivery_parse( const tlv_view_t * tlv, delivery_t * out ) {
+
+    delivery_header_t hdr;
+
+    if ( tlv->len < sizeof( hdr ) ){
+        return -1;
+    }
+    memcpy( &hdr, tlv->data, sizeof( hdr ) );
+
+    /* fields are padded, not necessarily terminated */
+    memcpy( out->login, hdr.login, MAX_USERNAME_LEN );
+    memcpy( out->username, hdr.username, MAX_USERNAME_LEN );
+    out->login[ MAX_USERNAME_LEN - 1 ]    = '\0';
+    out->username[ MAX_USERNAME_LEN - 1 ] = '\0';
+
+    out->timestamp_ms = ntoh64( hdr.timestamp_ms );
+    out->message      = ( const char * ) tlv->data + sizeof( hdr );
+    out->len          = tlv->len - sizeof( hdr );
+    return 0;
+}
+
+void hello_init( hello_t * hello, const proto_caps_t * caps ) {
+
+    memset( hello, 0, sizeof( *hello ) );
+    hello->version   = htons( caps->version );
+    hello->max_frame = htonl( caps->max_frame );
+    hello->features  = htonl( caps->features );
+}
+
+int hello_parse( const tlv_view_t * tlv, proto_caps_t * out ) {
+
+    hello_t hello;
+
+    /* newer peers may append fields - only the known prefix is read */
+    if ( tlv->len < sizeof( hello ) ){
+        return -1;
+    }
+    memcpy( &hello, tlv->data, sizeof( hello ) );
+
+    out->version   = ntohs( hello.version );
+    out->max_frame = ntohl( hello.max_frame );
+    out->features  = ntohl( hello.features );
+    return 0;
+}
+
+void proto_negotiate( const proto_caps_t * a, const proto_caps_t * b, proto_caps_t * out ) {
+
+    out->version   = a->version < b->version ? a->version : b->version;
+    out->max_frame = a->max_frame < b->max_frame ? a->max_frame : b->max_frame;
+    out->features  = a->features & b->features;
+}
+
+/*
+ * @brief  Replaces a TLV with its compressed form when that pays off.
+ *
+ * @details Payloads under TLV_LZ_THRESHOLD are left alone (header cost and
+ * CPU time are not worth it), and so is anything the codec cannot shrink.
+ *
+ * @param tlv     TLV to send (modified on success).
+ * @param scratch Memory for the compressed payload, must live until sent.
+ * @param cap     Size of scratch.
+ * @return size_t Bytes of scratch used, 0 if the TLV was not changed.
+ */
+size_t tlv_lz_pack( tlv_vec_t * tlv, void * scratch, size_t cap ) {
+
+    uint8_t * out = scratch;
+
+    if ( tlv->len < TLV_LZ_THRESHOLD || cap <= TLV_LZ_PREFIX_LENGTH ||
+         ( tlv->type & TLV_LZ_FLAG ) ){
+        return 0;
+    }
+
+    /* result must be smaller than the original, prefix included */
+    size_t limit = tlv->len - TLV_LZ_PREFIX_LENGTH - 1;
+    if ( limit > cap - TLV_LZ_PREFIX_LENGTH ){
+        limit = cap - TLV_LZ_PREFIX_LENGTH;
+    }
+
+    size_t n = tlv_lz_compress( tlv->data, tlv->len, out + TLV_LZ_PREFIX_LENGTH, limit );
+    if ( n == 0 ){
+        return 0;
+    }
+
+    uint32_t raw = htonl( tlv->len );
+    memcpy( out, &raw, TLV_LZ_PREFIX_LENGTH );
+
+    tlv->type |= TLV_LZ_FLAG;
+    tlv->data  = out;
+    tlv->len   = ( uint32_t ) ( n + TLV_LZ_PREFIX_LENGTH );
+    return tlv->len;
+}
+
+int tlv_view_inflate( tlv_view_t * tlv, uint8_t ** buf, size_t * cap ) {
+
+    uint32_t raw;
+
+    if ( !( tlv->type & TLV_LZ_FLAG ) ){
+        return 0;                                   // not compressed
+    }
+
+    if ( tlv->len < TLV_LZ_PREFIX_LENGTH ){
+        return -1;
+    }
+    memcpy( &raw, tlv->data, TLV_LZ_PREFIX_LENGTH );
+    raw = ntohl( raw );
+
+    if ( raw > TLV_EXT_MAX_LENGTH ){
+        return -1;
+    }
+
+    if ( *cap < raw || *buf == NULL ) {
+        uint8_t * p = realloc( *buf, raw ? raw : 1 );
+        if ( p == NULL ){
+            return -1;
+        }
+        *buf = p;
+        *cap = raw ? raw : 1;
+    }
+
+    long n = tlv_lz_decompress(
+        tlv->data + TLV_LZ_PREFIX_LENGTH,
+        tlv->len - TLV_LZ_PREFIX_LENGTH,
+        *buf,
+        raw
+    );
+    if ( n != ( long ) raw ){
+        return -1;
+    }
+
+    tlv->type &= ~TLV_LZ_FLAG;
+    tlv->data  = *buf;
+    tlv->len   = raw;
+    return 0;
+}
+
+void tlv_arena_reset( tlv_arena_t * arena ) {
+
+    arena->used = 0;
+}
+
+void * tlv_arena_alloc( tlv_arena_t * arena, size_t size ) {
+
+    size = ( size + 7 ) & ~( size_t ) 7;            // keep 8 byte alignment
+
+    if ( size > sizeof( arena->buf ) - arena->used ){
+        return NULL;
+    }
+
+    void * p = arena->buf + arena->used;
+    arena->used += size;
+    return p;
+}
+
+const char * tlv_arena_str( tlv_arena_t * arena, const tlv_view_t * view, size_t max ) {
+
+    size_t n = view->len < max - 1 ? view->len : max - 1;
+    char * s = tlv_arena_alloc( arena, n + 1 );
+
+    if ( s == NULL ){
+        return NULL;
+    }
+
+    memcpy( s, view->data, n );
+    s[n] = '\0';
+    return s;
+}
@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <stddef.h>     // offsetof
+
+#include "protocol.h"
+#include "tcp_server.h"
+#include "work_pool.h"
+#include "reactor.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+struct conn;
+
+typedef struct {
+    int            epfd;
+    int            listen_fd;
+    volatile int * running;
+    work_pool_t *  pool;                            /* NULL = commands run on the loop */
+    pthread_t      tid;
+    pthread_mutex_t conns_lock;                     /* attach on the loop, free on a worker */
+    struct conn *  conns;                           /* closed on stop */
+} reactor_loop_t;
+
+/* One received TLV waiting for its turn on the strand (payload copied,
+   the parser buffer is reused by the next read). */
+typedef struct cmd_job {
+    struct cmd_job * next;
+    uint64_t         queued_at;                     /* metrics_now(), METRIC_IO_POOL_WAIT */
+    tlv_view_t       tlv;
+    uint8_t          data[];
+} cmd_job_t;
+
+/*
+ * Connection as the reactor sees it: the session plus its strand - the
+ * queue of commands waiting to run on the pool. `scheduled` is set while
+ * the strand task is queued or running; the side that finds the strand
+ * idle after `closed` was set frees the connection.
+ */
+typedef struct conn {
+    client_ctx_t *   session;
+    reactor_loop_t * loop;
+    struct conn *    prev;                          /* loop->conns */
+    struct conn *    next;
+    work_task_t      task;
+    pthread_mutex_t  lock;
+    cmd_job_t *      head;
+    cmd_job_t *      tail;
+    int              scheduled;
+    int              closed;                        /* loop is done with the socket */
+    int              failed;                        /* a command dropped the connection */
+} conn_t;
+
+static void conn_free( conn_t * conn ) {
+
+    reactor_loop_t * loop = conn->loop;
+
+    pthread_mutex_lock( &loop->conns_lock );
+    if ( conn->prev ){
+        conn->prev->next = conn->next;
+    } else {
+        loop->conns = conn->next;
+    }
+    if ( conn->next ){
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock( &loop->conns_lock );
+
+    while ( conn->head ) {
+        cmd_job_t * job = conn->head;
+        conn->head = job->next;
+        free( job );
+    }
+
+    session_destroy( conn->session );
+    pthread_mutex_destroy( &conn->lock );
+    free( conn );
+}
+
+/*
+ * @brief  Drops a connection owned by the loop.
+ *
+ * @details With a strand still queued or running, freeing is left to it.
+ */
+static void conn_close( reactor_loop_t * loop, conn_t * conn ) {
+
+    epoll_ctl( loop->epfd, EPOLL_CTL_DEL, conn->session->client_fd, NULL );
+
+    pthread_mutex_lock( &conn->lock );
+    conn->closed = 1;
+    int busy = conn->scheduled;
+    pthread_mutex_unlock( &conn->lock );
+
+    if ( !busy ){
+        conn_free( conn );
+    }
+}
+
+/*
+ * @brief  Strand body - runs queued commands of one connection in order.
+ *
+ * @details After REACTOR_STRAND_BATCH commands the strand queues itself
+ * again, so one busy client cannot keep a worker forever.
+ */
+static void conn_run( work_task_t * task ) {
+
+    conn_t * conn = ( conn_t * ) ( ( char * ) task - offsetof( conn_t, task ) );
+
+    for ( int done = 0; ; ++done ) {
+
+        pthread_mutex_lock( &conn->lock );
+
+        cmd_job_t * job = conn->head;
+
+        if ( job && done == REACTOR_STRAND_BATCH ) {
+            pthread_mutex_unlock( &conn->lock );
+            if ( work_pool_submit( conn->loop->pool, task ) == 0 ){
+                return;                             // still scheduled
+            }
+            done = 0;                               // queues full - keep going here
+            continue;
+        }
+
+        if ( !job ) {
+            conn->scheduled = 0;
+            int dead = conn->closed;
+            pthread_mutex_unlock( &conn->lock );
+            if ( dead ){
+                conn_free( conn );
+            }
+            return;
+        }
+
+        conn->head = job->next;
+        if ( !conn->head ){
+            conn->tail = NULL;
+        }
+        pthread_mutex_unlock( &conn->lock );
+
+        /* decided here so a traced request shows its time in the queue */
+        int decided = trace_sample();
+        metrics_record( METRIC_IO_POOL_WAIT, metrics_now() - job->queued_at );
+
+        if ( !conn->failed && session_handle_tlv( conn->session, &job->tlv ) < 0 ) {
+            /* the loop sees the hang-up and closes the connection */
+            conn->failed = 1;
+            shutdown( conn->session->client_fd, SHUT_RDWR );
+        }
+        if ( decided ){
+            trace_done();
+        }
+        free( job );
+    }
+}
+
+/*
+ * @brief  Hands one received TLV over to the connection's strand.
+ *
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int conn_submit( conn_t * conn, const tlv_view_t * tlv ) {
+
+    cmd_job_t * job = malloc( sizeof( *job ) + tlv->len );
+    if ( !job ){
+        return -1;
+    }
+
+    memcpy( job->data, tlv->data, tlv->len );
+    job->tlv      = *tlv;
+    job->tlv.data = job->data;
+    job->next     = NULL;
+    job->queued_at = metrics_now();
+
+    pthread_mutex_lock( &conn->lock );
+    if ( conn->tail ){
+        conn->tail->next = job;
+    } else {
+        conn->head = job;
+    }
+    conn->tail = job;
+
+    int start = !conn->scheduled;
+    conn->scheduled = 1;
+    pthread_mutex_unlock( &conn->lock );
+
+    /* pool full -> run it here; nobody else runs this strand now */
+    if ( start && work_pool_submit( conn->loop->pool, &conn->task ) < 0 ){
+        conn_run( &conn->task );
+    }
+
+    return 0;
+}
+
+/*
+ * @brief  Handles one complete TLV - on the loop or through the strand.
+ *
+ * @return int 0 to keep the connection, -1 to drop it.
+ */
+static int conn_tlv( conn_t * conn, const tlv_view_t * tlv ) {
+
+    if ( conn->loop->pool == NULL ){
+        return session_handle_tlv( conn->session, tlv );
+    }
+
+    return conn_submit( conn, tlv );
+}
+
+/*
+ * @brief  Reads everything the socket has and handles complete TLVs.
+ *
+ * @details Edge-triggered: the socket is drained until EAGAIN, otherwise
+ * no further event would come for the bytes left behind. TLVs are handled
+ * after every read, so the parser buffer only holds one partial TLV.
+ */
+static void conn_readable( reactor_loop_t * loop, conn_t * conn ) {
+
+    client_ctx_t * ctx = conn->session;
+    tlv_parser_t * parser = &ctx->reader.parser;
+    tlv_view_t tlv;
+    int rc;
+
+    for (;;) {
+
+        size_t avail;
+        uint8_t * p = tlv_parser_space( parser, &avail );
+        if ( p == NULL ) {
+            break;                                  // out of memory -> drop
+        }
+
+        ssize_t n = recv( ctx->client_fd, p, avail, MSG_DONTWAIT );
+
+        if ( n > 0 ) {
+            tlv_parser_commit( parser, n );
+
+            while ( ( rc = session_next_tlv( ctx, &tlv ) ) == 1 ) {
+                if ( conn_tlv( conn, &tlv ) < 0 ){
+                    goto drop;
+                }
+            }
+            if ( rc < 0 ){
+                break;                              // protocol error
+            }
+            continue;
+        }
+
+        if ( n < 0 && errno == EINTR ){
+            continue;
+        }
+        if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ){
+            return;                                 // drained, wait for the next edge
+        }
+        break;                                      // 0 = peer closed, or error
+    }
+
+drop:
+    conn_close( loop, conn );
+}
+
+/*
+ * @brief  Adds a session to the loop's epoll set (from any thread).
+ */
+static void conn_attach( reactor_loop_t * loop, client_ctx_t * session ) {
+
+    conn_t * conn = calloc( 1, sizeof( *conn ) );
+    if ( !conn ) {
+        session_destroy( session );
+        return;
+    }
+    conn->session = session;
+    conn->loop    = loop;
+    conn->task.fn = conn_run;
+    pthread_mutex_init( &conn->lock, NULL );
+
+    pthread_mutex_lock( &loop->conns_lock );
+    conn->next = loop->conns;
+    if ( loop->conns ){
+        loop->conns->prev = conn;
+    }
+    loop->conns = conn;
+    pthread_mutex_unlock( &loop->conns_lock );
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+        .data.ptr = conn
+    };
+    if ( epoll_ctl( loop->epfd, EPOLL_CTL_ADD, session->client_fd, &ev ) < 0 ) {
+        log_msg( LOG_ERR, "[reactor] epoll_ctl: %s\n", strerror( errno ) );
+        conn_free( conn );
+    }
+}
+
+/*
+ * @brief  Accepts every pending connection and adds it to this loop.
+ */
+static void accept_ready( reactor_loop_t * loop ) {
+
+    for (;;) {
+
+        int client_fd = accept_client( loop->listen_fd );
+        if ( client_fd < 0 ) {
+            if ( errno == EINTR || errno == ECONNABORTED ){
+                continue;
+            }
+            if ( errno != EAGAIN && errno != EWOULDBLOCK ){
+                log_msg( LOG_ERR, "[reactor] accept: %s\n", strerror( errno ) );
+            }
+            return;
+        }
+
+        /* the session first - it decides if the client is admitted at all */
+        client_ctx_t * session = session_create( client_fd );
+        if ( !session ) {
+            close( client_fd );
+            continue;
+        }
+        conn_attach( loop, session );
+    }
+}
+
+/*
+ * @brief  Several loops may wait on one socket - none may block in accept().
+ */
+static int listen_nonblock( int fd ) {
+
+    int fl = fcntl( fd, F_GETFL );
+    if ( fl < 0 || fcntl( fd, F_SETFL, fl | O_NONBLOCK ) < 0 ){
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Closes the epoll set and the loop's own shard (not the caller's socket).
+ */
+static void loop_release( reactor_loop_t * loop, int listen_fd ) {
+
+    if ( loop->epfd >= 0 ){
+        close( loop->epfd );
+    }
+    if ( loop->listen_fd != listen_fd ){
+        close( loop->listen_fd );
+    }
+}
+
+/* worker pool gauges for metrics_format() */
+static void pool_metrics( metrics_text_t * out, void * arg ) {
+
+    work_pool_stats_t st;
+
+    work_pool_stats( arg, &st );
+    metrics_printf( out, "pool_workers %d\npool_submitted %llu\npool_rejected %llu\n"
+                    "pool_executed %llu\npool_stolen %llu\npool_queued %zu\npool_inject_high %zu\n",
+                    st.workers, ( unsigned long long ) st.submitted,
+                    ( unsigned long long ) st.rejected, ( unsigned long long ) st.executed,
+                    ( unsigned long long ) st.stolen, st.queued, st.inject_high );
+}
+
+static void * loop_thread( void * arg ) {
+
+    reactor_loop_t * loop = arg;
+    struct epoll_event events[ REACTOR_MAX_EVENTS ];
+
+    while ( *loop->running ) {
+
+        int n = epoll_wait( loop->epfd, events, REACTOR_MAX_EVENTS, REACTOR_TICK_MS );
+        if ( n < 0 ) {
+            if ( errno == EINTR ){
+                continue;
+            }
+            log_msg( LOG_ERR, "[reactor] epoll_wait: %s\n", strerror( errno ) );
+            break;
+        }
+
+        for ( int i = 0; i < n; ++i ) {
+            if ( events[i].data.ptr == NULL ) {     // listening socket
+                accept_ready( loop );
+            } else {
+                conn_readable( loop, events[i].data.ptr );
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int reactor_run( int listen_fd, const server_config_t * cfg, volatile int * running ) {
+
+    int threads = cfg->threads;
+    work_pool_t * pool = NULL;
+
+    if ( threads <= 0 ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        threads = cpus > 0 ? ( int ) cpus : 1;
+    }
+
+    raise_fd_limit();
+
+    if ( cfg->workers >= 0 ) {
+        work_pool_config_t pcfg = {
+            .workers        = cfg->workers,
+            .deque_depth    = cfg->deque_depth,
+            .inject_depth   = cfg->queue_depth,
+            .stats_interval = cfg->stats_interval
+        };
+        pool = work_pool_create( &pcfg );
+        if ( !pool ){
+            return -1;
+        }
+        metrics_add_source( pool_metrics, pool );
+    }
+
+    reactor_loop_t * loops = calloc( threads, sizeof( *loops ) );
+    if ( !loops ) {
+        metrics_remove_source( pool_metrics, pool );
+        work_pool_destroy( pool );
+        return -1;
+    }
+
+    for ( int i = 0; i < threads; ++i ){
+        pthread_mutex_init( &loops[i].conns_lock, NULL );
+    }
+
+    int started = 0;
+    for ( ; started < threads; ++started ) {
+
+        reactor_loop_t * loop = &loops[ started ];
+        loop->running   = running;
+        loop->pool      = pool;
+        loop->listen_fd = listen_fd;
+        if ( cfg->reuse_port && started > 0 ) {
+            loop->listen_fd = start_tcp_shard( listen_fd, cfg->backlog );
+            if ( loop->listen_fd < 0 ){
+                break;
+            }
+        }
+
+        loop->epfd = epoll_create1( EPOLL_CLOEXEC );
+        if ( loop->epfd < 0 || listen_nonblock( loop->listen_fd ) < 0 ) {
+            loop_release( loop, listen_fd );
+            break;
+        }
+
+        /* data.ptr NULL marks the listening socket; a shared one wakes one loop */
+        struct epoll_event ev = {
+            .events = EPOLLIN | ( cfg->reuse_port ? 0 : EPOLLEXCLUSIVE ),
+            .data.ptr = NULL
+        };
+        if ( epoll_ctl( loop->epfd, EPOLL_CTL_ADD, loop->listen_fd, &ev ) < 0 ||
+             pthread_create( &loop->tid, NULL, loop_thread, loop ) != 0 ) {
+            loop_release( loop, listen_fd );
+            break;
+        }
+
+        if ( cfg->pin ){
+            pin_thread( loop->tid, started );
+        }
+    }
+
+    if ( started < threads ) {
+        log_msg( LOG_ERR, "[reactor] could not start loop %d\n", started );
+        *running = 0;                               // stop the ones already running
+    } else {
+        log_msg( LOG_INFO, "[reactor] %d event loops running (%s listener%s)\n", threads,
+                cfg->reuse_port ? "SO_REUSEPORT" : "shared",
+                cfg->pin ? ", pinned" : "" );
+    }
+
+    /* clients taken over from the previous server, spread over the loops */
+    int count;
+    client_ctx_t ** adopted = sessions_adopted( &count );
+    for ( int i = 0; i < count; ++i ) {
+        if ( started < threads ) {
+            session_destroy( adopted[i] );
+        } else {
+            conn_attach( &loops[ i % threads ], adopted[i] );
+        }
+    }
+    free( adopted );
+
+    for ( int i = 0; i < started; ++i ) {
+        pthread_join( loops[i].tid, NULL );
+        loop_release( &loops[i], listen_fd );
+    }
+    metrics_remove_source( pool_metrics, pool );
+    work_pool_destroy( pool );                      // runs what is still queued
+
+    /* stopped for good - a live restart hands the sessions over instead */
+    for ( int i = 0; i < threads; ++i ) {
+        while ( !sessions_frozen() && loops[i].conns ){
+            conn_free( loops[i].conns );
+        }
+        pthread_mutex_destroy( &loops[i].conns_lock );
+    }
+
+    free( loops );
+    return started < threads ? -1 : 0;
+}
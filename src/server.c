@@ -8,6 +8,7 @@
 #include <sys/types.h>  // Definicje typów systemowych
 #include <sys/socket.h> // socket(), bind(), connect()
 #include <netinet/in.h> // struct sockaddr_in, IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <arpa/inet.h>  // inet_ntop, htons
 #include <netdb.h>      // getaddrinfo (DNS)
 #include <pthread.h>    // pthread_create, pthread_mutex        https://en.wikipedia.org/wiki/Pthreads
@@ -17,38 +18,16 @@
 #include <syslog.h>     // syslog() (demona)
 #include <fcntl.h>
 #include <signal.h>
+#include <getopt.h>     // getopt_long
+#include <limits.h>     // PATH_MAX
 
 // It is only usefull set of includes - it should be verified through work time if all of them are needed
 
 #include "protocol.h"
 #include "tcp_server.h"
-#include "multicast_server.h"
-#include "groups.h"
-
-
-#define MCAST_ADDR          "239.0.0.1"      // multicast addres
-#define MCAST_PORT          5000            // multicast port
-#define BUF_SIZE            256
-#define SERVER_TCP_PORT     6000            // tcp port
-
-void ensure_directories(void)
-{
-    if (mkdir("/var/lib/chat_server", 0755) < 0 && errno != EEXIST){
-        perror("mkdir chat_server");
-    }
-
-    if (mkdir("/var/lib/chat_server/users", 0755) < 0 && errno != EEXIST){
-        perror("mkdir users");
-    }
-
-    if (mkdir("/var/lib/chat_server/history", 0755) < 0 && errno != EEXIST){
-        perror("mkdir history");
-    }
-
-    if (mkdir("/var/lib/chat_server/groups", 0755) < 0 && errno != EEXIST){
-        perror("mkdir groups");
-    }
-}
+#include "work_pool.h"
+#include "data_dir.h"
+#include "chat_server.h"
 
 
 void daemonize(void)
@@ -90,103 +69,353 @@ void daemonize(void)
 }
 
 
-static volatile int running = 1;
+static chat_server_t * server;
+static int log_level = LOG_INFO;    // --log-level, SIGUSR1 switches to LOG_DEBUG and back
 
 void handle_sig(int sig)
 {
-    running = 0;
+    ( void ) sig;
+    chat_server_shutdown( server );
 }
 
-int main( void ){  
-
-    daemonize();
-    openlog("chat_server", LOG_PID | LOG_NDELAY, LOG_DAEMON);
-
-    signal(SIGTERM, handle_sig);
-    signal(SIGINT, handle_sig);
-
-    ensure_directories();
-
-    pthread_t mcast_tid;
-
-    multicast_ctx_t mcast_ctx = {   //configuration for multicast server
-        .mcast_addr = MCAST_ADDR,
-        .mcast_port = MCAST_PORT,
-        .tcp_port   = SERVER_TCP_PORT
-    };
+void handle_debug_sig(int sig)
+{
+    ( void ) sig;
+    log_set_level( log_enabled( LOG_DEBUG ) ? log_level : LOG_DEBUG );
+}
 
-    
+void handle_trace_sig(int sig)
+{
+    ( void ) sig;
+    trace_dump_async();
+}
 
-    if ( pthread_create(        //create a POSIX tread for multicast server
-            &mcast_tid,
-            NULL,
-            multicast_thread,
-            &mcast_ctx
-        ) != 0 ) {
-        perror( "pthread_create multicast" );
-        exit( EXIT_FAILURE );
+/*
+ * @brief  daemonize() moves to "/" - relative paths from the command line
+ * are made absolute first.
+ *
+ * @details A path that cannot be made absolute is an error: kept relative
+ * it would silently resolve against "/" after daemonize().
+ *
+ * @return int 0 with *path unchanged or pointing to `buf`, -1 if the
+ * working directory is unknown or the result does not fit in `buf`.
+ */
+static int absolute_path( const char ** path, char * buf, size_t len ) {
+
+    char cwd[ PATH_MAX ];
+
+    if ( !*path || ( *path )[0] == '/' ){
+        return 0;
     }
-
-    pthread_detach( mcast_tid ); //give him his own live 
-
-    int tcp_sock = start_tcp_server( SERVER_TCP_PORT ); //make tcp socket
-    if ( tcp_sock < 0 ) {
-        exit( EXIT_FAILURE );
+    if ( !getcwd( cwd, sizeof( cwd ) ) ) {
+        fprintf( stderr, "%s: cannot get the working directory: %s\n", *path, strerror( errno ) );
+        return -1;
     }
 
-   
-
-    while (running) {
-
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof( client_addr );
+    int n = snprintf( buf, len, "%s/%s", cwd, *path );
+    if ( n < 0 || ( size_t ) n >= len ) {
+        fprintf( stderr, "%s/%s: path too long (max %zu)\n", cwd, *path, len - 1 );
+        return -1;
+    }
+    *path = buf;
+    return 0;
+}
 
-        int client_fd = accept(
-            tcp_sock,
-            ( struct sockaddr * ) &client_addr,
-            &client_len
-        );
+static void usage( const char * prog ) {
+
+    fprintf( stderr,
+        "Usage: %s [options]\n"
+        "      --port N              TCP port (default %d, 0 = any free one)\n"
+        "      --data-dir PATH       accounts, histories and groups (default %s)\n"
+        "  -m, --mode MODE           connection model: threads, epoll or uring\n"
+        "                            (default threads)\n"
+        "  -t, --threads N           event loops in epoll/uring mode, acceptors in threads mode\n"
+        "                            with --reuse-port (default: one per CPU)\n"
+        "  -b, --backlog N           accept queue of each listening socket (default %d)\n"
+        "  -r, --reuse-port          one SO_REUSEPORT listener per event loop / acceptor\n"
+        "  -p, --pin                 pin event loops / acceptors to CPUs\n"
+        "  -w, --workers N           command workers in epoll mode (default: one per CPU,\n"
+        "                            -1 = run commands on the event loops)\n"
+        "      --queue-depth N       worker pool injector slots (default %d)\n"
+        "      --deque-depth N       per-worker deque slots (default %d)\n"
+        "      --stats-interval S    log pool statistics every S seconds (default off)\n"
+        "      --out-high BYTES      outbound backlog making a client slow (default %u)\n"
+        "      --out-low BYTES       backlog at which it is normal again (default %u)\n"
+        "      --slow-policy P       slow clients: drop, disconnect or spill\n"
+        "                            (default disconnect)\n"
+        "      --max-conns N         open client connections (default: descriptor limit\n"
+        "                            - %d, -1 = no limit)\n"
+        "      --max-per-ip N        connections from one address (default no limit)\n"
+        "      --max-pending N       connections not logged in yet (default %d,\n"
+        "                            -1 = no limit)\n"
+        "      --login-timeout S     close connections not logged in after S seconds\n"
+        "                            (default %d, 0 = never)\n"
+        "      --command-timeout S   close connections stuck in a command for S seconds\n"
+        "                            (default %d, 0 = never)\n"
+        "      --idle-timeout S      close logged in clients silent for S seconds\n"
+        "                            (default never)\n"
+        "      --keepalive S         TCP keepalive probes after S idle seconds (default off)\n"
+        "      --handoff PATH        live restart: take over the server listening on\n"
+        "                            the UNIX socket PATH, then listen there for the next\n"
+        "                            restart (default off)\n"
+        "      --log-level L         err, warning, notice, info or debug (default info,\n"
+        "                            SIGUSR1 switches debug on and off)\n"
+        "      --log-rate N          lines a second from one place in the code\n"
+        "                            (default %d)\n"
+        "      --log-sample N        keep 1 of N sampled lines (default: all)\n"
+        "      --stats-port N        serve metrics as text on 127.0.0.1:N (default off),\n"
+        "                            the request trace as JSON on 127.0.0.1:N/trace\n"
+        "      --trace FILE          trace requests, written to FILE as Chrome trace\n"
+        "                            JSON on SIGHUP and on stop (default off)\n"
+        "      --trace-sample N      trace 1 request in N (default every one)\n"
+        "  -f, --foreground          do not daemonize\n"
+        "  -h, --help                show this help\n",
+        prog,
+        CHAT_DEFAULT_PORT,
+        DATA_DIR_DEFAULT,
+        BACKLOG,
+        WORK_POOL_DEFAULT_INJECT,
+        WORK_POOL_DEFAULT_DEQUE,
+        OUTQ_DEFAULT_HIGH,
+        OUTQ_DEFAULT_LOW,
+        ADMIT_FD_RESERVE,
+        ADMIT_DEFAULT_PENDING,
+        SESSION_LOGIN_TIMEOUT,
+        SESSION_CMD_TIMEOUT,
+        LOG_DEFAULT_RATE
+    );
+}
 
-        if ( client_fd < 0 ) {
-            perror( "accept" );
-            continue;
+/*
+ * @brief  Reads startup options.
+ *
+ * @return int 0 to start, 1 to exit successfully (help), -1 on bad usage.
+ */
+static int parse_args( int argc, char ** argv, server_config_t * cfg ) {
+
+    static const struct option opts[] = {
+        { "port",       required_argument, NULL, 'R' },
+        { "data-dir",   required_argument, NULL, 'A' },
+        { "mode",       required_argument, NULL, 'm' },
+        { "threads",    required_argument, NULL, 't' },
+        { "workers",    required_argument, NULL, 'w' },
+        { "queue-depth", required_argument, NULL, 'Q' },
+        { "deque-depth", required_argument, NULL, 'D' },
+        { "stats-interval", required_argument, NULL, 'S' },
+        { "out-high",   required_argument, NULL, 'H' },
+        { "out-low",    required_argument, NULL, 'L' },
+        { "slow-policy", required_argument, NULL, 'P' },
+        { "max-conns",  required_argument, NULL, 'C' },
+        { "max-per-ip", required_argument, NULL, 'I' },
+        { "max-pending", required_argument, NULL, 'N' },
+        { "login-timeout", required_argument, NULL, 'G' },
+        { "command-timeout", required_argument, NULL, 'T' },
+        { "idle-timeout", required_argument, NULL, 'E' },
+        { "keepalive",  required_argument, NULL, 'K' },
+        { "handoff",    required_argument, NULL, 'O' },
+        { "log-level",  required_argument, NULL, 'V' },
+        { "log-rate",   required_argument, NULL, 'Y' },
+        { "log-sample", required_argument, NULL, 'Z' },
+        { "stats-port", required_argument, NULL, 'M' },
+        { "trace",      required_argument, NULL, 'X' },
+        { "trace-sample", required_argument, NULL, 'W' },
+        { "backlog",    required_argument, NULL, 'b' },
+        { "reuse-port", no_argument,       NULL, 'r' },
+        { "pin",        no_argument,       NULL, 'p' },
+        { "foreground", no_argument,       NULL, 'f' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+
+    while ( ( c = getopt_long( argc, argv, "m:t:w:b:rpfh", opts, NULL ) ) != -1 ) {
+        switch ( c ) {
+        case 'R':
+            cfg->port = ( uint16_t ) atoi( optarg );
+            break;
+        case 'A':
+            cfg->data_dir = optarg;
+            break;
+        case 'm':
+            if ( strcmp( optarg, "threads" ) == 0 ) {
+                cfg->mode = SERVER_MODE_THREADS;
+            } else if ( strcmp( optarg, "epoll" ) == 0 ) {
+                cfg->mode = SERVER_MODE_EPOLL;
+            } else if ( strcmp( optarg, "uring" ) == 0 ) {
+                cfg->mode = SERVER_MODE_URING;
+            } else {
+                fprintf( stderr, "Unknown mode '%s'\n", optarg );
+                return -1;
+            }
+            break;
+        case 't':
+            cfg->threads = atoi( optarg );
+            break;
+        case 'w':
+            cfg->workers = atoi( optarg );
+            break;
+        case 'Q':
+            cfg->queue_depth = strtoul( optarg, NULL, 10 );
+            break;
+        case 'D':
+            cfg->deque_depth = strtoul( optarg, NULL, 10 );
+            break;
+        case 'S':
+            cfg->stats_interval = atoi( optarg );
+            break;
+        case 'H':
+            cfg->outq.high = strtoul( optarg, NULL, 10 );
+            break;
+        case 'L':
+            cfg->outq.low = strtoul( optarg, NULL, 10 );
+            break;
+        case 'P':
+            if ( strcmp( optarg, "drop" ) == 0 ) {
+                cfg->outq.policy = OUTQ_DROP;
+            } else if ( strcmp( optarg, "disconnect" ) == 0 ) {
+                cfg->outq.policy = OUTQ_DISCONNECT;
+            } else if ( strcmp( optarg, "spill" ) == 0 ) {
+                cfg->outq.policy = OUTQ_SPILL;
+            } else {
+                fprintf( stderr, "Unknown slow consumer policy '%s'\n", optarg );
+                return -1;
+            }
+            break;
+        case 'C':
+            cfg->admit.max_conns = atoi( optarg );
+            break;
+        case 'I':
+            cfg->admit.max_per_ip = atoi( optarg );
+            break;
+        case 'N':
+            cfg->admit.max_pending = atoi( optarg );
+            break;
+        case 'G':
+            cfg->login_timeout = atoi( optarg );
+            break;
+        case 'T':
+            cfg->cmd_timeout = atoi( optarg );
+            break;
+        case 'E':
+            cfg->idle_timeout = atoi( optarg );
+            break;
+        case 'K':
+            cfg->keepalive = atoi( optarg );
+            break;
+        case 'O':
+            cfg->handoff_path = optarg;
+            break;
+        case 'V':
+            cfg->log.level = log_level_parse( optarg );
+            if ( cfg->log.level < 0 ) {
+                fprintf( stderr, "Unknown log level '%s'\n", optarg );
+                return -1;
+            }
+            break;
+        case 'Y':
+            cfg->log.rate = strtoul( optarg, NULL, 10 );
+            break;
+        case 'Z':
+            cfg->log.sample = strtoul( optarg, NULL, 10 );
+            break;
+        case 'M':
+            cfg->stats_port = ( uint16_t ) atoi( optarg );
+            break;
+        case 'X':
+            cfg->trace.path = optarg;
+            break;
+        case 'W':
+            cfg->trace.sample = strtoul( optarg, NULL, 10 );
+            break;
+        case 'b':
+            cfg->backlog = atoi( optarg );
+            break;
+        case 'r':
+            cfg->reuse_port = 1;
+            break;
+        case 'p':
+            cfg->pin = 1;
+            break;
+        case 'f':
+            cfg->foreground = 1;
+            break;
+        case 'h':
+            usage( argv[0] );
+            return 1;
+        default:
+            usage( argv[0] );
+            return -1;
         }
+    }
 
-        syslog(LOG_INFO,
-            "Accepted TCP client from %s:%d\n",
-            inet_ntoa( client_addr.sin_addr ),
-            ntohs( client_addr.sin_port )
-        );
+    return 0;
+}
 
-        /* Create a thread to deal with client and retun to listening. */
-        pthread_t tid;
+int main( int argc, char ** argv ){  
+
+    server_config_t cfg = {
+        .mode       = SERVER_MODE_THREADS,
+        .threads    = 0,
+        .foreground = 0,
+        .workers    = 0,
+        .queue_depth = 0,
+        .deque_depth = 0,
+        .stats_interval = 0,
+        .backlog    = 0,
+        .reuse_port = 0,
+        .pin        = 0,
+        .outq       = { .policy = OUTQ_DISCONNECT },
+        .admit      = { .max_conns = 0, .max_per_ip = 0, .max_pending = 0 },
+        .login_timeout = SESSION_LOGIN_TIMEOUT,
+        .cmd_timeout = SESSION_CMD_TIMEOUT,
+        .idle_timeout = SESSION_IDLE_TIMEOUT,
+        .keepalive  = 0,
+        .handoff_path = NULL,
+        .port       = CHAT_DEFAULT_PORT,
+        .data_dir   = NULL,
+        .discovery  = 1,
+        .log        = { .level = LOG_INFO },
+        .stats_port = 0,
+        .trace      = { .path = NULL, .sample = 0 }
+    };
+    char data_buf[ DATA_PATH_MAX ];
+    char handoff_buf[ DATA_PATH_MAX ];
+    char trace_buf[ DATA_PATH_MAX ];
 
-        client_ctx_t * ctx = malloc( sizeof( client_ctx_t ) );
-        if ( !ctx ) {
-            close( client_fd );
-            continue;
-        }
+    int rc = parse_args( argc, argv, &cfg );
+    if ( rc != 0 ) {
+        return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
-        ctx->client_fd = client_fd;
-
-        if ( pthread_create(
-                &tid,
-                NULL,
-                client_thread,
-                ctx
-            ) != 0 ) {
-            
-            perror( "pthread_create client" );
-            close( client_fd );
-            free( ctx );
-            continue;
+    if ( !cfg.foreground ) {
+        if ( absolute_path( &cfg.data_dir, data_buf, sizeof( data_buf ) ) < 0 ||
+             absolute_path( &cfg.handoff_path, handoff_buf, sizeof( handoff_buf ) ) < 0 ||
+             absolute_path( &cfg.trace.path, trace_buf, sizeof( trace_buf ) ) < 0 ){
+            return EXIT_FAILURE;
         }
+        daemonize();
+    }
+    openlog("chat_server", LOG_PID | LOG_NDELAY, LOG_DAEMON);
 
-        pthread_detach( tid );
-
+    log_level = cfg.log.level;
+    server = chat_server_start( &cfg );
+    if ( !server ) {
+        return EXIT_FAILURE;
     }
 
+    /* no SA_RESTART - blocking calls have to return and see the stop */
+    struct sigaction sa;
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_handler = handle_sig;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGTERM, &sa, NULL );
+    sigaction( SIGINT, &sa, NULL );
+    sa.sa_handler = handle_debug_sig;
+    sigaction( SIGUSR1, &sa, NULL );
+    if ( cfg.trace.path ) {
+        sa.sa_handler = handle_trace_sig;
+        sigaction( SIGHUP, &sa, NULL );
+    }
 
-    
-    return 0;
+    return chat_server_wait( server ) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -10,23 +10,37 @@
 #include <sys/socket.h> /* For socket, connect, getsockname */
 #include <netinet/in.h> /* For struct sockaddr_in, htons */
 #include <arpa/inet.h>  /* For inet_pton, inet_ntop */
+#include <netinet/tcp.h> /* For TCP_NODELAY */
 #include <syslog.h> 
+#include <time.h>       /* For clock_gettime */
+#include <sched.h>      /* For cpu_set_t */
+#include <sys/resource.h> /* For setrlimit */
+#include <errno.h>
+#include <signal.h>
 #include "protocol.h"
 #include "tcp_server.h"
 #include "user_account.h"
 #include "history.h"
 #include "groups.h"
+#include "msg_buf.h"
+#include "admission.h"
+#include "handoff.h"
+#include "data_dir.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
 
-pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t groups_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-int start_tcp_server( uint16_t port ) {
+int start_tcp_server( uint16_t port, int backlog, int reuse_port ) {
 
     int sock;
     struct sockaddr_in addr;
     int reuse = 1;
 
+    if ( backlog <= 0 ){
+        backlog = BACKLOG;
+    }
+
     /* 1. Create the socket endpoint */
     sock = socket( AF_INET, SOCK_STREAM, 0 );
     if ( sock < 0 ) {
@@ -42,6 +56,14 @@ int start_tcp_server( uint16_t port ) {
         return -1;
     }
 
+    /* 2a. Several sockets on one port - the kernel spreads connections by hash */
+    if ( reuse_port && setsockopt( sock, SOL_SOCKET, SO_REUSEPORT,
+                                   &reuse, sizeof( reuse ) ) < 0 ) {
+        perror( "setsockopt SO_REUSEPORT" );
+        close( sock );
+        return -1;
+    }
+
     /* 3. Configure the address struct */
     memset( &addr, 0, sizeof( addr ) );
     addr.sin_family = AF_INET;
@@ -56,691 +78,1733 @@ int start_tcp_server( uint16_t port ) {
     }
 
     /* 5. Start listening for incoming connections */
-    if ( listen( sock, BACKLOG ) < 0 ) {
+    if ( listen( sock, backlog ) < 0 ) {
         perror( "listen" );
         close( sock );
         return -1;
     }
 
-    syslog( LOG_INFO, "TCP server listening on port %u\n", port );
+    /* port 0 - the kernel picked one */
+    socklen_t len = sizeof( addr );
+    if ( port == 0 && getsockname( sock, ( struct sockaddr * ) &addr, &len ) == 0 ){
+        port = ntohs( addr.sin_port );
+    }
+
+    log_msg( LOG_INFO, "TCP server listening on port %u (backlog %d%s)\n",
+            port, backlog, reuse_port ? ", SO_REUSEPORT" : "" );
     return sock;
 }
 
+int start_tcp_shard( int listen_fd, int backlog ) {
 
+    struct sockaddr_in addr;
+    socklen_t len = sizeof( addr );
 
-void * client_thread( void * arg ) {
+    if ( getsockname( listen_fd, ( struct sockaddr * ) &addr, &len ) < 0 ) {
+        perror( "getsockname" );
+        return -1;
+    }
 
-    client_ctx_t * ctx = ( client_ctx_t * ) arg;
-    int client_fd = ctx->client_fd;
+    return start_tcp_server( ntohs( addr.sin_port ), backlog, 1 );
+}
+
+int pin_thread( pthread_t tid, int index ) {
+
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( cpus <= 0 ){
+        return -1;
+    }
 
-    uint16_t type;
-    uint16_t len;
-    void * data = NULL;
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( index % cpus, &set );
+
+    int rc = pthread_setaffinity_np( tid, sizeof( set ), &set );
+    if ( rc != 0 ) {
+        log_msg( LOG_WARNING, "Could not pin thread to CPU %ld: %s\n",
+                index % cpus, strerror( rc ) );
+        return -1;
+    }
 
-    char login[ MAX_USERNAME_LEN ] = {0};
-    char password[ MAX_PASSWORD_LEN ] = {0};
-    char username[ MAX_USERNAME_LEN ] = {0};
+    return 0;
+}
 
-    syslog( LOG_INFO,"[tcp] client connected (fd=%d)\n", client_fd );
 
-    while (1) {
 
-        /* ---- receive TLV ---- */
-        if ( recv_tlv( client_fd, &type, &data, &len ) < 0 ) {
-            syslog( LOG_INFO, "[tcp] client disconnected (fd=%d)\n", client_fd );
-            break;
+/* -------------------------------------------------------------------------- */
+/*                              Command handlers                              */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Every handler gets a fully received and validated command (fields are
+ * already checked against cmd_specs[] below), so it never reads from the
+ * socket. Returns 0 to keep the connection, -1 to drop it.
+ */
+typedef int ( * cmd_handler_t )( client_ctx_t * ctx, const cmd_frame_t * frame );
+
+/*
+ * @brief  Returns a command field as a null-terminated string.
+ *
+ * @details The field is copied once into the per-command arena (views are
+ * not terminated and may point into the receive buffer). Strings are
+ * truncated to max - 1 characters.
+ *
+ * @param  ctx   Client context (owner of the arena).
+ * @param  frame Received command.
+ * @param  i     Field index.
+ * @param  max   Size of the field (e.g. MAX_USERNAME_LEN).
+ * @return const char* Field string, NULL if the arena is exhausted.
+ */
+static const char * field_str(
+    client_ctx_t * ctx,
+    const cmd_frame_t * frame,
+    int i,
+    size_t max
+) {
+    return tlv_arena_str( &ctx->arena, &frame->fields[i], max );
+}
+
+/*
+ * @brief  Takes a message field out of the receive buffer for relaying.
+ *
+ * @details The only copy of the text on the relay path: recipients,
+ * multicast and history all reference the returned buffer. The length is
+ * limited to MAX_MESSAGE_LEN - 1 like every other string field.
+ *
+ * @return msg_buf_t* Buffer with one reference (caller unrefs), NULL on
+ * allocation failure.
+ */
+static msg_buf_t * field_msg( const cmd_frame_t * frame, int i ) {
+
+    const tlv_view_t * v = &frame->fields[i];
+    uint32_t len = v->len < MAX_MESSAGE_LEN - 1 ? v->len : MAX_MESSAGE_LEN - 1;
+
+    return msg_buf_new( v->data, len );
+}
+
+/*
+ * @brief  Adds the answer to a command to a batch.
+ *
+ * @details Commands sent with a request id are answered with one
+ * TLV_RESPONSE frame carrying the id, so the client can match it no matter
+ * in which order answers arrive. Uncorrelated (version 1 / legacy) commands
+ * get the reply TLVs bare, as before.
+ */
+static void reply_batch(
+    client_ctx_t * ctx,
+    tlv_batch_t * batch,
+    const cmd_frame_t * frame,
+    const tlv_vec_t * fields,
+    size_t count
+) {
+    if ( frame->request_id == 0 || !( ctx->caps.features & PROTO_FEAT_REQUEST_ID ) ) {
+        for ( size_t i = 0; i < count; ++i ) {
+            tlv_batch_add( batch, fields[i].type, fields[i].data, fields[i].len );
         }
-        syslog( LOG_INFO, "[TLV] received TLV type=%u len=%u\n", type, len);
-        /* ---- handle TLV ---- */
-        switch ( type ) {
+        return;
+    }
 
-        case TLV_COMMAND: {
-            syslog( LOG_INFO, "[TLV] TLV_COMMAND:\n");
-            
-            command_t cmd;
+    tlv_batch_add_frame( batch, TLV_RESPONSE, frame->command, frame->request_id, 0, fields, count );
+}
 
-            if ( len != sizeof( command_t ) ) {
-                free( data );
-                break;
-            }
+/* text answers worth compressing */
+static int compressible( uint16_t type ) {
 
-            memcpy( &cmd, data, sizeof( cmd ) );
-             free( data );
-            data = NULL;
-            syslog( LOG_INFO, "[CMD] received command=%u\n", cmd);
-            switch ( cmd ) {
-
-            case CMD_LOGIN: {       // to login client has to send a sequence of messages
-                syslog( LOG_INFO, "[CMD] CMD_LOGIN:\n");
-                
-                user_t user;
-                status_t status;
-
-                /* expect LOGIN and PASSWORD */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 ){
-                    goto cleanup;
-                }
-
-                if ( type != TLV_LOGIN ) {
-                    free( data );
-                    goto cleanup;;
-                }
-
-                size_t n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
-                memcpy( login, data, n );
-                login[n] = '\0';
-
-                free( data );
-
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 ){
-                    goto cleanup;
-                }
-
-                if ( type != TLV_PASSWORD ) {
-                    free( data );
-                    goto cleanup;;
-                }
-
-                // strncpy( password, data, MAX_PASSWORD_LEN - 1 );
-
-                n = len < MAX_PASSWORD_LEN - 1 ? len : MAX_PASSWORD_LEN - 1;
-                memcpy( password, data, n );
-                password[n] = '\0';
-
-                free( data );
-
-                /* ---- authentication ---- */
-                pthread_mutex_lock( &server_mutex );
-                
-                if ( is_user_logged_in( login ) ) {
-
-                    status = STATUS_ALREADY_LOGGED_IN;   // already logged in -> it blocks login in from two computers in the same time
-
-                } else if ( user_authenticate( login, password, &user ) == 0 ) {
-                
-                    add_active_user(
-                        user.login,
-                        user.username,
-                        client_fd
-                    );
-                    status = STATUS_OK;
-                
-                } else {
-                
-                    status = STATUS_AUTHENTICATION_ERROR;
-                }
-                pthread_mutex_unlock( &server_mutex );
-
-                send_tlv(
-                    client_fd,
-                    TLV_STATUS,
-                    &status,
-                    sizeof( status )
-                );
-
-                pthread_mutex_lock(&groups_mutex);
-                if (status == STATUS_OK) {
-                    group_send_user_groups(client_fd, login);
-                }
-                pthread_mutex_unlock(&groups_mutex);
+    return type == TLV_HISTORY || type == TLV_ACTIVE_USERS || type == TLV_GROUP_LIST ||
+           type == TLV_STATS;
+}
 
-                break;
+/*
+ * @brief  Sends the answer to a command.
+ *
+ * @details When the connection runs with PROTO_FEAT_LZ, large text fields
+ * are compressed first; everything else goes out unchanged.
+ */
+static int reply(
+    client_ctx_t * ctx,
+    const cmd_frame_t * frame,
+    const tlv_vec_t * fields,
+    size_t count
+) {
+    tlv_batch_t batch;
+    tlv_vec_t packed[ CMD_FRAME_MAX_FIELDS ];
+    uint8_t scratch[ HISTORY_OUT_MAX ];
+    size_t used = 0;
+
+    if ( ( ctx->caps.features & PROTO_FEAT_LZ ) && count <= CMD_FRAME_MAX_FIELDS ) {
+        for ( size_t i = 0; i < count; ++i ) {
+            packed[i] = fields[i];
+            if ( compressible( fields[i].type ) ){
+                used += tlv_lz_pack( &packed[i], scratch + used, sizeof( scratch ) - used );
             }
+        }
+        fields = packed;
+    }
 
-            case CMD_CREATE_ACCOUNT: {
-                status_t status;
-                syslog( LOG_INFO, "[CMD] CMD_CREATE_ACCOUNT\n");
-
-                /* LOGIN */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_LOGIN )
-                    goto create_fail;
-
-                // strncpy( login, data, MAX_USERNAME_LEN - 1 );
-                
-                size_t n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
-                memcpy( login, data, n );
-                login[n] = '\0';
-                
-                free( data );
-
-                /* PASSWORD */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_PASSWORD )
-                    goto create_fail;
-
-                // strncpy( password, data, MAX_PASSWORD_LEN - 1 );
-                
-                n = len < MAX_PASSWORD_LEN - 1 ? len : MAX_PASSWORD_LEN - 1;
-                memcpy( password, data, n );
-                password[n] = '\0';
-
-                free( data );
-
-                /* USERNAME */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_USERNAME )
-                    goto create_fail;
-
-                // strncpy( username, data, MAX_USERNAME_LEN - 1 );
-
-                n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
-                memcpy( username, data, n );
-                username[n] = '\0';
-
-                free( data );
-
-                
-
-                pthread_mutex_lock( &server_mutex );
-                syslog( LOG_INFO,
-                    "[tcp] create_account login='%s' password='%s' username='%s'\n",
-                    login,
-                    password,
-                    username
-                );
-                if ( user_create( login, password, username ) == 0 )
-                    status = STATUS_OK;
-                else
-                    status = STATUS_ERROR;
-
-                pthread_mutex_unlock( &server_mutex );
-
-                send_tlv(
-                    client_fd,
-                    TLV_STATUS,
-                    &status,
-                    sizeof( status )
-                );
-                break;
-                
-            create_fail:
-                status = STATUS_ERROR;
-                send_tlv( client_fd, TLV_STATUS, &status, sizeof( status ) );
-                break;
-            }
+    tlv_batch_begin( &batch, ctx->client_fd );
+    reply_batch( ctx, &batch, frame, fields, count );
+    return tlv_batch_flush( &batch );
+}
 
-            case CMD_CHANGE_PASSWORD: {
-                syslog( LOG_INFO, "[CMD] CMD_CHANGE_PASSWORD:\n");
-
-                status_t status;
-                char old_pass[ MAX_PASSWORD_LEN ] = {0};
-                char new_pass[ MAX_PASSWORD_LEN ] = {0};
-                user_t user;
-                        
-                /* old password */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_PASSWORD )
-                    goto cleanup;
-                        
-                // strncpy( old_pass, data, MAX_PASSWORD_LEN - 1 );
-
-                size_t n = len < MAX_PASSWORD_LEN - 1 ? len : MAX_PASSWORD_LEN - 1;
-                memcpy( old_pass, data, n );
-                old_pass[n] = '\0';
-
-                free( data );
-                        
-                /* new password */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_PASSWORD )
-                    goto cleanup;
-                        
-                // strncpy( new_pass, data, MAX_PASSWORD_LEN - 1 );
-
-                n = len < MAX_PASSWORD_LEN - 1 ? len : MAX_PASSWORD_LEN - 1;
-                memcpy( new_pass, data, n );
-                new_pass[n] = '\0';
-
-                free( data );
-                        
-                pthread_mutex_lock( &server_mutex );
-                        
-                if ( user_authenticate( login, old_pass, &user ) != 0 ) {
-                    status = STATUS_AUTHENTICATION_ERROR;
-                } else if ( user_change_password( login, new_pass ) == 0 ) {
-                    status = STATUS_OK;
-                } else {
-                    status = STATUS_ERROR;
-                }
-            
-                pthread_mutex_unlock( &server_mutex );
-            
-                send_tlv( client_fd, TLV_STATUS, &status, sizeof( status ) );
-                break;
-            }
+static void reply_status( client_ctx_t * ctx, const cmd_frame_t * frame, status_t status ) {
 
+    tlv_vec_t st = { TLV_STATUS, &status, sizeof( status ) };
+    reply( ctx, frame, &st, 1 );
+}
 
-            case CMD_CHANGE_USERNAME: {
-                syslog( LOG_INFO, "[CMD] CMD_CHANGE_USERNAME:\n");
+/*
+ * @brief  Largest stream chunk the client takes.
+ *
+ * @details TLV_STREAM_CHUNK_SIZE unless the client announced a smaller
+ * max_frame in CMD_HELLO (never below PROTO_MIN_FRAME_SIZE).
+ */
+static size_t stream_chunk_size( const client_ctx_t * ctx ) {
 
-                status_t status;
-                        
-                /* expect new username */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 ||
-                     type != TLV_USERNAME ) {
-                    status = STATUS_ERROR;
-                    send_tlv( client_fd, TLV_STATUS, &status, sizeof( status ) );
-                    break;
-                }
-            
-                char new_username[ MAX_USERNAME_LEN ] = {0};
+    size_t max = ctx->caps.max_frame - sizeof( tlv_stream_header_t );
+    return max < TLV_STREAM_CHUNK_SIZE ? max : TLV_STREAM_CHUNK_SIZE;
+}
 
-                //strncpy( new_username, data, MAX_USERNAME_LEN - 1 );
+/* streamed answers need both an id to tag them and a client that knows them */
+static int use_stream( const client_ctx_t * ctx, const cmd_frame_t * frame ) {
 
-                size_t n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
-                memcpy( new_username, data, n );
-                new_username[n] = '\0';
+    return frame->request_id != 0 &&
+           ( ctx->caps.features & ( PROTO_FEAT_REQUEST_ID | PROTO_FEAT_STREAM ) ) ==
+           ( PROTO_FEAT_REQUEST_ID | PROTO_FEAT_STREAM );
+}
 
-                free( data );
-                data = NULL;
-            
-                pthread_mutex_lock( &server_mutex );
-            
-                if ( user_change_username( login, new_username ) == 0 )
-                    status = STATUS_OK;
-                else
-                    status = STATUS_ERROR;
-            
-                pthread_mutex_unlock( &server_mutex );
-
-                active_user_t * this = find_active_user_by_fd( client_fd );
-                strcpy( this->username, new_username );
-                            
-                send_tlv(
-                    client_fd,
-                    TLV_STATUS,
-                    &status,
-                    sizeof( status )
-                );
-                break;
-            }
-            
+static int cmd_hello( client_ctx_t * ctx, const cmd_frame_t * frame ) {
 
-            case CMD_GET_ACTIVE_USERS: {
-                syslog( LOG_INFO, "[CMD] CMD_GET_ACTIVE_USERS:\n");
+    log_msg( LOG_DEBUG, "[CMD] CMD_HELLO:\n");
 
-                pthread_mutex_lock( &server_mutex );
-                send_active_users( client_fd );
-                pthread_mutex_unlock( &server_mutex );
-                        
-                break;
-            }
+    proto_caps_t peer;
+    proto_caps_t self = { PROTO_VERSION, TLV_EXT_MAX_LENGTH, SERVER_FEATURES };
 
-            case CMD_SEND_TO_USER: {
-                syslog( LOG_INFO, "[CMD] CMD_SEND_TO_USER:\n");
-                char target[ MAX_USERNAME_LEN ] = {0};
-                char message[ MAX_MESSAGE_LEN ] = {0};
-                active_user_t * dst = NULL;
-                active_user_t * src = NULL;
+    if ( hello_parse( &frame->fields[0], &peer ) < 0 || peer.max_frame < PROTO_MIN_FRAME_SIZE ) {
+        reply_status( ctx, frame, STATUS_ERROR );   // client falls back to the implied mode
+        return 0;
+    }
 
-                /* recipient */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_LOGIN )
-                    goto cleanup;
+    proto_negotiate( &self, &peer, &ctx->caps );
+    ctx->negotiated = 1;
 
-                // strncpy( target, data, MAX_USERNAME_LEN - 1 );
+    /* hello after login (reconnect logic) - pushes follow the new mode */
+    active_user_update( ctx->login, ctx->client_fd, NULL, &ctx->caps.features );
 
-                size_t n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
-                memcpy( target, data, n );
-                target[n] = '\0';
+    log_msg( LOG_INFO, "[tcp] fd=%d version=%u max_frame=%u features=0x%x\n",
+            ctx->client_fd, ctx->caps.version, ctx->caps.max_frame, ctx->caps.features );
 
-                free( data );
+    /* the answer itself is never compressed - the client learns the mode from it */
+    status_t status = STATUS_OK;
+    hello_t hello;
+    hello_init( &hello, &ctx->caps );
 
-                /* message */
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_MESSAGE )
-                    goto cleanup;
+    tlv_vec_t out[] = {
+        { TLV_STATUS, &status, sizeof( status ) },
+        { TLV_HELLO,  &hello,  sizeof( hello ) }
+    };
+    tlv_batch_t batch;
+    tlv_batch_begin( &batch, ctx->client_fd );
+    reply_batch( ctx, &batch, frame, out, 2 );
+    return tlv_batch_flush( &batch );
+}
 
-                n = len < MAX_MESSAGE_LEN - 1 ? len : MAX_MESSAGE_LEN - 1;
-                memcpy( message, data, n );
-                message[n] = '\0';
+static int cmd_login( client_ctx_t * ctx, const cmd_frame_t * frame ) {
 
-                free( data );
+    log_msg( LOG_DEBUG, "[CMD] CMD_LOGIN:\n");
 
-                pthread_mutex_lock( &server_mutex );
+    user_t user;
+    status_t status;
 
-                dst = find_active_user_by_login( target );
+    const char * login    = field_str( ctx, frame, 0, MAX_USERNAME_LEN );
+    const char * password = field_str( ctx, frame, 1, MAX_PASSWORD_LEN );
+    if ( !login || !password ){
+        return -1;
+    }
 
-                if ( !dst ) {
-                    status_t st = STATUS_USER_NOT_FOUND;
-                    send_tlv( client_fd, TLV_STATUS, &st, sizeof( st ) );
-                    pthread_mutex_unlock( &server_mutex );
-                    break;
-                }
-            
-                src = find_active_user_by_fd( client_fd );
-
-                if ( !src ) {
-                    pthread_mutex_unlock( &server_mutex );
-                    break;
-                }
-
-                /* send message to recipient */
-                send_tlv(
-                    dst->client_fd,
-                    TLV_LOGIN,
-                    src->login,                   // sender
-                    strlen( src->login )
-                );
-                send_tlv(
-                    dst->client_fd,
-                    TLV_USERNAME,
-                    src->username,
-                    strlen( src->username )
-                );
-                send_tlv(
-                    dst->client_fd,
-                    TLV_MESSAGE,
-                    message,
-                    strlen( message )
-                );
-            
-                status_t st = STATUS_OK;
-                send_tlv( client_fd, TLV_STATUS, &st, sizeof( st ) );
-
-                pthread_mutex_lock(&history_mutex);
-
-                history_append_message(
-                    src->login,
-                    src->username,
-                    dst->login,
-                    message
-                );
-                
-                pthread_mutex_unlock(&history_mutex);
-            
-                pthread_mutex_unlock( &server_mutex );
-                break;
-            }
-            case CMD_GET_HISTORY: {
-                syslog( LOG_INFO, "[CMD] CMD_GET_HISTORY:\n");
-
-                char target[ MAX_USERNAME_LEN ] = {0};
-                int max_lines = 0;
-
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 || type != TLV_LOGIN ){
-                    if ( data ) {
-                        free ( data );
-                    }
-                    break;
-                }
-
-                // strncpy( target, data, MAX_USERNAME_LEN - 1 );
-
-                size_t n = len < MAX_USERNAME_LEN - 1 ? len : MAX_USERNAME_LEN - 1;
-                memcpy( target, data, n );
-                target[n] = '\0';
-
-                free( data );
-                
-                if ( recv_tlv( client_fd, &type, &data, &len ) < 0 ||
-                     type != TLV_UINT16 ||
-                     len != sizeof( uint16_t ) ) {
-                    if ( data ) {
-                        free( data );
-                    }
-                    break;
-                }
-
-                uint16_t tmp;
-                memcpy( &tmp, data, sizeof( tmp ) );
-                max_lines = ntohs( tmp );
-                free( data );
-
-                active_user_t * src = find_active_user_by_fd( client_fd );
-                if ( !src ) {
-                    break;
-                }
-
-                
-                char path[ 512 ];
-
-                pthread_mutex_lock(&history_mutex);
-
-                /* ======= HISTORIA GRUPOWA ======= */
-                if (group_exists(target)) {
-                    syslog( LOG_INFO, "Group history read.");
-                    snprintf(
-                        path,
-                        sizeof(path),
-                        HISTORY_DIR "%s",
-                        target
-                    );
-                
-                /* ======= HISTORIA 1vs1 ======= */
-                } else {
-                    syslog( LOG_INFO, "Hisotry read.");
-                    char filename[256];
-                    make_history_filename(
-                        filename,
-                        sizeof(filename),
-                        src->login,
-                        target
-                    );
-                
-                    snprintf(
-                        path,
-                        sizeof(path),
-                        HISTORY_DIR "%s",
-                        filename
-                    );
-                }
-
-                FILE *f = fopen(path, "r");
-                if (!f) {
-                    pthread_mutex_unlock(&history_mutex);
-                    status_t st = STATUS_ERROR;
-                    send_tlv(client_fd, TLV_STATUS, &st, sizeof(st));
-                    break;
-                }
-            
-                /* read all lines */
-                char * lines[1024];
-                int count = 0;
-                char buf[1024];
-
-                while ( fgets( buf, sizeof(buf), f ) && count < 1024 ) {
-                    lines[count++] = strdup( buf );
-                }
-                fclose( f );
-            
-                pthread_mutex_unlock( &history_mutex );
-            
-                int start = 0;
-                if ( max_lines > 0 && count > max_lines ){
-                    start = count - max_lines;
-                } 
-            
-                /* build output */
-                char out[ HISTORY_OUT_MAX ];
-                size_t out_len = 0;
-                out[0] = '\0';
-
-                for ( int i = start; i < count; ++i ) {
-                    size_t l = strlen( lines[i] );
-                    if ( out_len + l >= HISTORY_OUT_MAX - 1 ){
-                        break;
-                    }
-                
-                    memcpy( out + out_len, lines[i], l );
-                    out_len += l;
-                    out[out_len] = '\0';
-                    free( lines[i] );
-                }
-            
-                send_tlv( client_fd, TLV_HISTORY, out, out_len );
-                break;
-            }
-        
-            case CMD_CREATE_GROUP: {
-
-                syslog( LOG_INFO, "[CMD] CMD_CREATE_GROUP:\n");
-                char groupname[MAX_GROUP_NAME_LEN] = {0};
-                group_info_t g;
-                status_t st;
-                        
-                if (recv_tlv(client_fd, &type, &data, &len) < 0 || type != TLV_GROUPNAME){
-                    syslog( LOG_INFO, "[CMD] Unexpected TLV or nothing at all:\n");
-                    break;
-                }
-                syslog( LOG_INFO, "[CMD] Received TLV_GROUPNAME:\n");  
-
-                size_t n = len < sizeof(groupname)-1 ? len : sizeof(groupname)-1;
-                memcpy(groupname, data, n);
-                groupname[n] = '\0';
-                free(data);
-
-                syslog( LOG_INFO, "Creating group: %s:\n",groupname);   
-                
-                pthread_mutex_lock( &groups_mutex );
-                
-                if (group_create(groupname, login, &g) == 0) {
-                    st = STATUS_OK;
-                } else {
-                    st = STATUS_ERROR;
-                }
-                
-                pthread_mutex_unlock( &groups_mutex );
-
-                send_tlv(client_fd, TLV_STATUS, &st, sizeof(st));
-            
-                if (st == STATUS_OK) {
-                    send_tlv(client_fd, TLV_GROUP_INFO, &g, sizeof(g));
-                    syslog( LOG_INFO, "[group] Group created\n");  
-                }
-                
+    int first = ctx->login[0] == '\0';    // not logged in on this connection yet
 
-                break;
-            }
+    /* ---- authentication ---- */
+    account_lock( login );              // the file is not rewritten meanwhile
+    
+    if ( is_user_logged_in( login ) ) {
 
-            case CMD_LIST_GROUPS: {
-                char buffer[MAX_MESSAGE_LEN] = {0};
+        status = STATUS_ALREADY_LOGGED_IN;   // already logged in -> it blocks login in from two computers in the same time
 
-                pthread_mutex_lock(&groups_mutex);
-                int n = group_list(buffer);
-                pthread_mutex_unlock(&groups_mutex);
+    } else if ( user_authenticate( login, password, &user ) == 0 ) {
+    
+        /* features decide how DMs are pushed to us */
+        switch ( add_active_user( user.login, user.username, ctx->client_fd, ctx->caps.features ) ) {
+        case 0:
+            status = STATUS_OK;
+            break;
+        case 1:
+            status = STATUS_ALREADY_LOGGED_IN;      // the same login raced us
+            break;
+        default:
+            status = STATUS_ERROR;
+            break;
+        }
+    
+    } else {
+    
+        status = STATUS_AUTHENTICATION_ERROR;
+    }
+    account_unlock( login );
 
-                if (n < 0) {
-                    status_t st = STATUS_ERROR;
-                    send_tlv(client_fd, TLV_STATUS, &st, sizeof(st));
-                    break;
-                }
-            
-                send_tlv(client_fd, TLV_GROUP_LIST, buffer, n);
-                break;
-            }
+    metrics_inc( status == STATUS_OK ? METRIC_LOGINS : METRIC_LOGIN_FAILURES );
 
-            case CMD_JOIN_GROUP: {
-                char groupname[MAX_GROUP_NAME_LEN] = {0};
-                status_t st;
-                group_info_t g;
-
-                syslog( LOG_INFO, "[CMD] CMD_JOIN_GROUP" );
-                if (recv_tlv(client_fd, &type, &data, &len) < 0 || type != TLV_GROUPNAME)
-                    break;
-
-                size_t n = len < sizeof(groupname)-1 ? len : sizeof(groupname)-1;
-                memcpy(groupname, data, n);
-                groupname[n] = '\0';
-                free(data);
-
-                pthread_mutex_lock(&groups_mutex);
-
-                 if (!group_exists(groupname)) {
-                    st = STATUS_GROUP_NOT_FOUND;
-                } else if (group_add_user(groupname, login) == 1) {
-                    st = STATUS_ALREADY_IN_GROUP;
-                } else if (group_get_info(groupname, &g) == 0) {
-                    st = STATUS_OK;
-                } else {
-                    st = STATUS_ERROR;
-                }
-            
-                pthread_mutex_unlock(&groups_mutex);
-            
-                send_tlv(client_fd, TLV_STATUS, &st, sizeof(st));
-                if (st == STATUS_OK) {
-                    send_tlv(client_fd, TLV_GROUP_INFO, &g, sizeof(g)); //multicast infos
-                }
-                syslog( LOG_INFO, "[group] Group joined" );
+    /* only an authenticated login names the session (logout, groups, changes) */
+    if ( status == STATUS_OK ) {
+        strcpy( ctx->login, login );
+        if ( first ){
+            admission_login();                      // leaves the pending budget
+        }
+    }
 
-                break;
-            }
+    /* status and group infos leave in one write; group infos are pushed
+       bare (like a later join) so their number is not limited by the frame */
+    tlv_batch_t batch;
+    tlv_vec_t st = { TLV_STATUS, &status, sizeof( status ) };
+    tlv_batch_begin( &batch, ctx->client_fd );
+    reply_batch( ctx, &batch, frame, &st, 1 );
+
+    if (status == STATUS_OK) {
+        group_send_user_groups(&batch, login);      // flushes the batch
+    } else {
+        tlv_batch_flush( &batch );
+    }
+    return 0;
+}
 
-            case CMD_GROUP_MSG: {
+static int cmd_create_account( client_ctx_t * ctx, const cmd_frame_t * frame ) {
 
-                char groupname[MAX_GROUP_NAME_LEN] = {0};
-                char message[MAX_MESSAGE_LEN] = {0};
-                status_t st;
-                syslog( LOG_INFO, "[CMD] CMD_GROUP_MSG" );
+    status_t status;
+    log_msg( LOG_DEBUG, "[CMD] CMD_CREATE_ACCOUNT\n");
 
-                active_user_t * src = NULL;
-                src = find_active_user_by_fd( client_fd );
-                /* group name */
-                if (recv_tlv(client_fd, &type, &data, &len) < 0 ||
-                    type != TLV_GROUPNAME)
-                    break;
+    const char * login    = field_str( ctx, frame, 0, MAX_USERNAME_LEN );
+    const char * password = field_str( ctx, frame, 1, MAX_PASSWORD_LEN );
+    const char * username = field_str( ctx, frame, 2, MAX_USERNAME_LEN );
 
-                memcpy(groupname, data, len);
-                free(data);
+    if ( !login || !password || !username ) {
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
 
-                /* message */
-                if (recv_tlv(client_fd, &type, &data, &len) < 0 ||
-                    type != TLV_MESSAGE)
-                    break;
+    log_msg( LOG_INFO,
+        "[tcp] create_account login='%s' password='%s' username='%s'\n",
+        login,
+        password,
+        username
+    );
 
-                memcpy(message, data, len);
-                free(data);
+    account_lock( login );              // existence check and creation in one step
+    if ( user_create( login, password, username ) == 0 )
+        status = STATUS_OK;
+    else
+        status = STATUS_ERROR;
 
-                pthread_mutex_lock(&groups_mutex);
+    account_unlock( login );
 
-                if (!group_exists(groupname) ||
-                    !group_has_user(groupname, src->login)) {
-                    st = STATUS_ERROR;
-                    pthread_mutex_unlock(&groups_mutex);
-                    send_tlv(client_fd, TLV_STATUS, &st, sizeof(st));
-                    break;
-                }
-            
-                group_info_t g;
-                group_get_info(groupname, &g);
-            
-                pthread_mutex_unlock(&groups_mutex);
-            
-                /* --- MULTICAST SEND --- */
-                group_multicast_send(&g, src->login, src->username, message);
+    reply_status( ctx, frame, status );
+    return 0;
+}
+
+static int cmd_change_password( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    log_msg( LOG_DEBUG, "[CMD] CMD_CHANGE_PASSWORD:\n");
+
+    status_t status;
+    user_t user;
+
+    const char * old_pass = field_str( ctx, frame, 0, MAX_PASSWORD_LEN );
+    const char * new_pass = field_str( ctx, frame, 1, MAX_PASSWORD_LEN );
+    if ( !old_pass || !new_pass ){
+        return -1;
+    }
             
-                /* --- HISTORY --- */
-                group_history_append(groupname, src->login, src->username, message);
+    account_lock( ctx->login );
             
-                st = STATUS_OK;
-                send_tlv(client_fd, TLV_STATUS, &st, sizeof(st));
-                break;
-            }
+    if ( user_authenticate( ctx->login, old_pass, &user ) != 0 ) {
+        status = STATUS_AUTHENTICATION_ERROR;
+    } else if ( user_change_password( ctx->login, new_pass ) == 0 ) {
+        status = STATUS_OK;
+    } else {
+        status = STATUS_ERROR;
+    }
 
+    account_unlock( ctx->login );
 
+    reply_status( ctx, frame, status );
+    return 0;
+}
 
-            
+static int cmd_change_username( client_ctx_t * ctx, const cmd_frame_t * frame ) {
 
-            default:
-                /* unsupported command */
-                syslog( LOG_INFO, "Unsupported COMMAND" );
-                break;
-            }
+    log_msg( LOG_DEBUG, "[CMD] CMD_CHANGE_USERNAME:\n");
 
-            break;
+    status_t status;
+
+    const char * new_username = field_str( ctx, frame, 0, MAX_USERNAME_LEN );
+    if ( !new_username ) {
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    account_lock( ctx->login );
+
+    if ( user_change_username( ctx->login, new_username ) == 0 )
+        status = STATUS_OK;
+    else
+        status = STATUS_ERROR;
+
+    account_unlock( ctx->login );
+
+    if ( status == STATUS_OK ){
+        active_user_update( ctx->login, ctx->client_fd, new_username, NULL );
+    }
+
+    reply_status( ctx, frame, status );
+    return 0;
+}
+
+static int cmd_get_active_users( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    log_msg( LOG_DEBUG, "[CMD] CMD_GET_ACTIVE_USERS:\n");
+
+    size_t cursor = 0;
+    size_t len;
+
+    /* client without streams -> one TLV, truncated as before */
+    if ( !use_stream( ctx, frame ) ) {
+        char buf[ MAX_MESSAGE_LEN ];
+
+        len = format_active_users( buf, sizeof( buf ), &cursor );
+
+        tlv_vec_t users = { TLV_ACTIVE_USERS, buf, len };
+        reply( ctx, frame, &users, 1 );
+        return 0;
+    }
+
+    /* streamed - the table is read per chunk, never locked during a write */
+    char chunk[ TLV_STREAM_CHUNK_SIZE ];
+    size_t limit = stream_chunk_size( ctx );
+    tlv_stream_t stream;
+
+    if ( tlv_stream_begin( &stream, ctx->client_fd, frame->request_id, TLV_ACTIVE_USERS,
+                           ctx->caps.features & PROTO_FEAT_LZ ) < 0 ){
+        return -1;
+    }
+
+    do {
+        len = format_active_users( chunk, limit, &cursor );
+
+        if ( len > 0 && tlv_stream_write( &stream, chunk, len ) < 0 ){
+            return -1;
         }
+    } while ( len > 0 );
 
-        default:
-            /* unexpected TLV */
-            syslog( LOG_INFO,  "Unexpected TLV");
-            free( data );
+    return tlv_stream_end( &stream );
+}
+
+/* what relay_to() pushes to the recipient */
+typedef struct {
+    const active_user_t * src;
+    msg_buf_t *           message;
+} relay_t;
+
+/* payload being relayed by this thread - queued by reference (session_send_hook()) */
+static _Thread_local msg_buf_t * relay_payload;
+
+/*
+ * @brief  Pushes a DM to its recipient (active_user_with() callback).
+ *
+ * @details Runs with the recipient's bucket read locked, so it cannot log
+ * out meanwhile; the write only queues (out_queue.h) and never waits for
+ * the recipient's socket.
+ */
+static void relay_to( const active_user_t * dst, void * arg ) {
+
+    const relay_t * r = arg;
+
+    if ( dst->features & PROTO_FEAT_DELIVERY ) {
+        /* one delivery record - cannot interleave with the recipient's answers */
+        delivery_header_t hdr;
+        struct timespec now;
+        clock_gettime( CLOCK_REALTIME, &now );
+        delivery_header_init(
+            &hdr,
+            r->src->login,
+            r->src->username,
+            ( uint64_t ) now.tv_sec * 1000 + now.tv_nsec / 1000000
+        );
+        relay_payload = r->message;
+        send_delivery( dst->client_fd, &hdr, r->message->data, r->message->len );
+        relay_payload = NULL;
+    } else {
+        /* old client - whole triplet in one write */
+        tlv_vec_t relay[] = {
+            { TLV_LOGIN,    r->src->login,    strlen( r->src->login ) },     // sender
+            { TLV_USERNAME, r->src->username, strlen( r->src->username ) },
+            { TLV_MESSAGE,  r->message->data, r->message->len }
+        };
+        relay_payload = r->message;
+        send_tlvv( dst->client_fd, relay, 3 );
+        relay_payload = NULL;
+    }
+}
+
+static int cmd_send_to_user( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    log_msg( LOG_DEBUG, "[CMD] CMD_SEND_TO_USER:\n");
+    active_user_t src;
+
+    const char * target  = field_str( ctx, frame, 0, MAX_USERNAME_LEN );   // recipient
+    if ( !target ){
+        return -1;
+    }
+
+    msg_buf_t * message = field_msg( frame, 1 );
+    if ( !message ){
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    /* a copy - the sender's bucket is not kept locked */
+    if ( active_user_get( ctx->login, ctx->client_fd, &src ) < 0 ) {
+        msg_buf_unref( message );
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    relay_t relay = { &src, message };
+    if ( active_user_with( target, relay_to, &relay ) < 0 ) {
+        msg_buf_unref( message );
+        reply_status( ctx, frame, STATUS_USER_NOT_FOUND );
+        return 0;
+    }
+
+    metrics_inc( METRIC_MESSAGES );
+    reply_status( ctx, frame, STATUS_OK );
+
+    /* disk I/O last, under the lock of this conversation only */
+    history_append_message(
+        src.login,
+        src.username,
+        target,
+        message
+    );
+
+    msg_buf_unref( message );
+    return 0;
+}
+
+/*
+ * @brief  Sends history as one TLV_HISTORY (uncorrelated / old clients).
+ *
+ * @details Whole lines are collected while they fit in HISTORY_OUT_MAX,
+ * the rest is dropped - old clients cannot take anything longer.
+ */
+static int send_history( client_ctx_t * ctx, const cmd_frame_t * frame, FILE * f,
+                         pthread_mutex_t * lock ) {
+
+    char out[ HISTORY_OUT_MAX ];
+    char line[ 1024 ];
+    size_t out_len = 0;
+
+    pthread_mutex_lock( lock );
+    while ( fgets( line, sizeof( line ), f ) ) {
+        size_t l = strlen( line );
+        if ( out_len + l >= HISTORY_OUT_MAX - 1 ){
             break;
         }
+        memcpy( out + out_len, line, l );
+        out_len += l;
+    }
+    pthread_mutex_unlock( lock );
+
+    tlv_vec_t history = { TLV_HISTORY, out, out_len };
+    reply( ctx, frame, &history, 1 );
+    return 0;
+}
 
-        data = NULL;
+/*
+ * @brief  Streams history in line aligned TLV_STREAM_CHUNKs.
+ *
+ * @details Memory use is one chunk no matter how long the history is.
+ * The file's history_lock() is held only around each fread() (appends always write
+ * whole lines under it), never while the socket is written.
+ *
+ * @return int 0 to keep the connection, -1 to drop it.
+ */
+static int stream_history( client_ctx_t * ctx, const cmd_frame_t * frame, FILE * f,
+                           pthread_mutex_t * lock ) {
+
+    char chunk[ TLV_STREAM_CHUNK_SIZE ];
+    size_t limit = stream_chunk_size( ctx );
+    size_t used = 0;
+    tlv_stream_t stream;
+
+    if ( tlv_stream_begin( &stream, ctx->client_fd, frame->request_id, TLV_HISTORY,
+                           ctx->caps.features & PROTO_FEAT_LZ ) < 0 ){
+        return -1;
     }
 
-cleanup:
-    pthread_mutex_lock( &server_mutex );
-    remove_active_user_by_fd( client_fd );
-    dump_active_users();      /* DEBUG – na razie */
-    pthread_mutex_unlock( &server_mutex );
-    close( client_fd );
-    free( ctx );
-    return NULL;
-}
\ No newline at end of file
+    for (;;) {
+
+        pthread_mutex_lock( lock );
+        size_t n = fread( chunk + used, 1, limit - used, f );
+        pthread_mutex_unlock( lock );
+
+        used += n;
+        if ( n == 0 ){
+            break;                                  // end of file
+        }
+
+        /* cut after the last complete line */
+        size_t cut = used;
+        while ( cut > 0 && chunk[ cut - 1 ] != '\n' ){
+            cut--;
+        }
+        if ( cut == 0 ) {
+            if ( used < limit ){
+                continue;                           // line not complete yet
+            }
+            cut = used;                             // line longer than a chunk
+        }
+
+        if ( tlv_stream_write( &stream, chunk, cut ) < 0 ){
+            return -1;
+        }
+
+        memmove( chunk, chunk + cut, used - cut );
+        used -= cut;
+    }
+
+    if ( used > 0 && tlv_stream_write( &stream, chunk, used ) < 0 ){
+        return -1;
+    }
+
+    return tlv_stream_end( &stream );
+}
+
+static int cmd_get_history( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    log_msg( LOG_DEBUG, "[CMD] CMD_GET_HISTORY:\n");
+
+    int max_lines = 0;
+
+    const char * target = field_str( ctx, frame, 0, MAX_USERNAME_LEN );
+    if ( !target ){
+        return 0;
+    }
+
+    uint16_t tmp;
+    memcpy( &tmp, frame->fields[1].data, sizeof( tmp ) );
+    max_lines = ntohs( tmp );
+
+    active_user_t src;
+    if ( active_user_get( ctx->login, ctx->client_fd, &src ) < 0 ) {
+        return 0;
+    }
+
+    
+    char filename[ 256 ];
+    char path[ 512 ];
+
+    /* ======= HISTORIA GRUPOWA ======= */
+    if ( group_exists( target ) ) {
+        log_msg( LOG_DEBUG, "Group history read.");
+        snprintf( filename, sizeof( filename ), "%s", target );
+    
+    /* ======= HISTORIA 1vs1 ======= */
+    } else {
+        log_msg( LOG_DEBUG, "Hisotry read.");
+        make_history_filename(
+            filename,
+            sizeof(filename),
+            src.login,
+            target
+        );
+    }
+
+    snprintf(
+        path,
+        sizeof(path),
+        "%s%s",
+        history_dir(),
+        filename
+    );
+
+    pthread_mutex_t * lock = history_lock( filename );
+    metrics_lock( METRIC_LOCK_HISTORY, pthread_mutex_lock( lock ) );
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        pthread_mutex_unlock( lock );
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    history_seek_tail( f, max_lines );
+
+    pthread_mutex_unlock( lock );
+
+    int rc = use_stream( ctx, frame ) ? stream_history( ctx, frame, f, lock )
+                                      : send_history( ctx, frame, f, lock );
+    fclose( f );
+    return rc;
+}
+
+static int cmd_create_group( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    log_msg( LOG_DEBUG, "[CMD] CMD_CREATE_GROUP:\n");
+    group_info_t g;
+    status_t st;
+            
+    const char *groupname = field_str(ctx, frame, 0, MAX_GROUP_NAME_LEN);
+    if (!groupname){
+        return 0;
+    }
+
+    log_msg( LOG_DEBUG, "Creating group: %s:\n",groupname);   
+    
+    if (group_create(groupname, ctx->login, &g) == 0) {
+        st = STATUS_OK;
+    } else {
+        st = STATUS_ERROR;
+    }
+
+    tlv_vec_t out[] = {
+        { TLV_STATUS,     &st, sizeof(st) },
+        { TLV_GROUP_INFO, &g,  sizeof(g) }
+    };
+    reply(ctx, frame, out, st == STATUS_OK ? 2 : 1);
+
+    if (st == STATUS_OK) {
+        log_msg( LOG_DEBUG, "[group] Group created\n");  
+    }
+    return 0;
+}
+
+static int cmd_list_groups( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    char buffer[MAX_MESSAGE_LEN] = {0};
+
+    int n = group_list(buffer);
+
+    if (n < 0) {
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    tlv_vec_t list = { TLV_GROUP_LIST, buffer, n };
+    reply(ctx, frame, &list, 1);
+    return 0;
+}
+
+static int cmd_join_group( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    status_t st;
+    group_info_t g;
+
+    log_msg( LOG_DEBUG, "[CMD] CMD_JOIN_GROUP" );
+    const char *groupname = field_str(ctx, frame, 0, MAX_GROUP_NAME_LEN);
+    if (!groupname)
+        return 0;
+
+    if (!group_exists(groupname)) {
+        st = STATUS_GROUP_NOT_FOUND;
+    } else if (group_add_user(groupname, ctx->login) == 1) {
+        st = STATUS_ALREADY_IN_GROUP;
+    } else if (group_get_info(groupname, &g) == 0) {
+        st = STATUS_OK;
+    } else {
+        st = STATUS_ERROR;
+    }
+
+    tlv_vec_t out[] = {
+        { TLV_STATUS,     &st, sizeof(st) },
+        { TLV_GROUP_INFO, &g,  sizeof(g) }              //multicast infos
+    };
+    reply(ctx, frame, out, st == STATUS_OK ? 2 : 1);
+    log_msg( LOG_DEBUG, "[group] Group joined" );
+
+    return 0;
+}
+
+static int cmd_group_msg( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    status_t st;
+    log_msg( LOG_DEBUG, "[CMD] CMD_GROUP_MSG" );
+
+    const char *groupname = field_str(ctx, frame, 0, MAX_GROUP_NAME_LEN);
+    if (!groupname)
+        return 0;
+
+    active_user_t src;
+    if ( active_user_get( ctx->login, ctx->client_fd, &src ) < 0 ) {
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    group_info_t g;
+    if (!group_has_user(groupname, src.login) ||
+        group_get_info(groupname, &g) < 0) {
+        st = STATUS_ERROR;
+        reply_status( ctx, frame, st );
+        return 0;
+    }
+
+    msg_buf_t *message = field_msg(frame, 1);
+    if (!message) {
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    /* --- MULTICAST SEND --- */
+    group_multicast_send(&g, src.login, src.username, message);
+
+    /* --- HISTORY --- */
+    group_history_append(groupname, src.login, src.username, message);
+
+    msg_buf_unref(message);
+
+    metrics_inc( METRIC_GROUP_MESSAGES );
+    reply_status( ctx, frame, STATUS_OK );
+    return 0;
+}
+
+/*
+ * @brief  Server metrics as text (metrics.h).
+ *
+ * @details Only for clients on the loopback - the numbers tell a lot about
+ * the users. Clients without streams get the first MAX_MESSAGE_LEN bytes.
+ */
+static int cmd_get_stats( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    log_msg( LOG_DEBUG, "[CMD] CMD_GET_STATS:\n");
+
+    if ( ( ntohl( ctx->peer_ip ) >> 24 ) != 127 ) {
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    char * text = malloc( METRICS_TEXT_MAX );
+    if ( !text ) {
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+    size_t len = metrics_format( text, METRICS_TEXT_MAX );
+    int rc = 0;
+
+    if ( !use_stream( ctx, frame ) ) {
+        tlv_vec_t stats = { TLV_STATS, text, len < MAX_MESSAGE_LEN ? len : MAX_MESSAGE_LEN };
+        reply( ctx, frame, &stats, 1 );
+    } else {
+        size_t limit = stream_chunk_size( ctx );
+        tlv_stream_t stream;
+
+        rc = tlv_stream_begin( &stream, ctx->client_fd, frame->request_id, TLV_STATS,
+                               ctx->caps.features & PROTO_FEAT_LZ );
+        for ( size_t off = 0; rc == 0 && off < len; off += limit ){
+            rc = tlv_stream_write( &stream, text + off, len - off < limit ? len - off : limit );
+        }
+        if ( rc == 0 ){
+            rc = tlv_stream_end( &stream );
+        }
+    }
+
+    free( text );
+    return rc;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                              Command dispatch                              */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Description of every command: handler and the exact list of fields
+ * (TLV types in order). The same table validates compound frames and tells
+ * the legacy path how many loose TLVs follow a TLV_COMMAND.
+ */
+typedef struct {
+    cmd_handler_t handler;
+    int           count;
+    uint16_t      fields[ CMD_FRAME_MAX_FIELDS ];
+} cmd_spec_t;
+
+static const cmd_spec_t cmd_specs[] = {
+    [ CMD_LOGIN ]            = { cmd_login,            2, { TLV_LOGIN, TLV_PASSWORD } },
+    [ CMD_CREATE_ACCOUNT ]   = { cmd_create_account,   3, { TLV_LOGIN, TLV_PASSWORD, TLV_USERNAME } },
+    [ CMD_CHANGE_USERNAME ]  = { cmd_change_username,  1, { TLV_USERNAME } },
+    [ CMD_CHANGE_PASSWORD ]  = { cmd_change_password,  2, { TLV_PASSWORD, TLV_PASSWORD } },
+    [ CMD_GET_ACTIVE_USERS ] = { cmd_get_active_users, 0, { 0 } },
+    [ CMD_SEND_TO_USER ]     = { cmd_send_to_user,     2, { TLV_LOGIN, TLV_MESSAGE } },
+    [ CMD_GROUP_MSG ]        = { cmd_group_msg,        2, { TLV_GROUPNAME, TLV_MESSAGE } },
+    [ CMD_CREATE_GROUP ]     = { cmd_create_group,     1, { TLV_GROUPNAME } },
+    [ CMD_LIST_GROUPS ]      = { cmd_list_groups,      0, { 0 } },
+    [ CMD_JOIN_GROUP ]       = { cmd_join_group,       1, { TLV_GROUPNAME } },
+    [ CMD_GET_HISTORY ]      = { cmd_get_history,      2, { TLV_LOGIN, TLV_UINT16 } },
+    [ CMD_HELLO ]            = { cmd_hello,            1, { TLV_HELLO } },
+    [ CMD_GET_STATS ]        = { cmd_get_stats,        0, { 0 } }
+};
+
+static const cmd_spec_t * cmd_spec( uint16_t command ) {
+
+    if ( command >= sizeof( cmd_specs ) / sizeof( cmd_specs[0] ) ||
+         cmd_specs[ command ].handler == NULL ){
+        return NULL;
+    }
+    return &cmd_specs[ command ];
+}
+
+/*
+ * @brief  Checks a received command against its spec and runs it.
+ *
+ * @details Field count and types have to match exactly (UINT16 fields also
+ * their size). Nothing is executed for a malformed command, it is answered
+ * with STATUS_ERROR instead.
+ *
+ * @return int 0 to keep the connection, -1 to drop it.
+ */
+static int dispatch_command( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    const cmd_spec_t * spec = cmd_spec( frame->command );
+
+    log_msg( LOG_DEBUG, "[CMD] received command=%u\n", frame->command );
+    metrics_inc( METRIC_COMMANDS );
+
+    if ( !spec ) {
+        /* unsupported command - answered, so a newer client probing for it
+           (e.g. CMD_HELLO against an old build) does not wait in vain */
+        log_msg( LOG_INFO, "Unsupported COMMAND" );
+        metrics_inc( METRIC_BAD_COMMANDS );
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    int valid = frame->count == spec->count;
+    for ( int i = 0; valid && i < spec->count; ++i ) {
+        valid = frame->fields[i].type == spec->fields[i] &&
+                ( spec->fields[i] != TLV_UINT16 || frame->fields[i].len == sizeof( uint16_t ) );
+    }
+
+    if ( !valid ) {
+        log_msg( LOG_NOTICE, "[CMD] malformed command=%u\n", frame->command );
+        metrics_inc( METRIC_BAD_COMMANDS );
+        reply_status( ctx, frame, STATUS_ERROR );
+        return 0;
+    }
+
+    /* handler time, answer writes included (they only queue, see out_queue.h) */
+    uint64_t t0 = metrics_now();
+    int rc = spec->handler( ctx, frame );
+    metrics_record( METRIC_HIST_OF_CMD( frame->command ), metrics_now() - t0 );
+
+    return rc;
+}
+
+/*
+ * @brief  Mode of a client that did not send CMD_HELLO.
+ *
+ * @details Guessed from each command the way it worked before the
+ * handshake: legacy TLV_COMMAND and version 1 frames get plain answers,
+ * version 2 frames everything, compression when the frame asks for it.
+ */
+static void implied_caps( const cmd_frame_t * frame, proto_caps_t * caps ) {
+
+    caps->version   = 0;
+    caps->max_frame = TLV_EXT_MAX_LENGTH;
+    caps->features  = 0;
+
+    if ( frame->version >= 2 ) {
+        caps->features = PROTO_FEAT_FRAME_V2;
+    }
+    if ( frame->flags & CMD_FRAME_FLAG_LZ ) {
+        caps->features |= PROTO_FEAT_LZ;
+    }
+}
+
+/*
+ * @brief  Starts a legacy command (TLV_COMMAND followed by loose TLVs).
+ *
+ * @details Old clients send the fields one by one. They are collected in
+ * ctx->legacy as they arrive (see legacy_field()) according to cmd_specs[],
+ * so the result is the same cmd_frame_t a compound frame gives and goes
+ * through the same dispatch. Nothing here reads from the socket, which keeps
+ * the session usable from an event loop.
+ *
+ * @return int 0 on success, -1 on protocol violation.
+ */
+static int legacy_begin( client_ctx_t * ctx, const tlv_view_t * tlv ) {
+
+    command_t cmd;
+    cmd_frame_t * frame = &ctx->legacy;
+
+    if ( tlv->len != sizeof( command_t ) ) {
+        return -1;
+    }
+    memcpy( &cmd, tlv->data, sizeof( cmd ) );
+
+    frame->version    = 0;
+    frame->flags      = 0;
+    frame->command    = ( uint16_t ) cmd;
+    frame->request_id = 0;                      // answered bare, in order
+    frame->count      = 0;
+
+    const cmd_spec_t * spec = cmd_spec( frame->command );
+    ctx->legacy_left = spec ? spec->count : 0;  // unknown -> dispatch reports it
+
+    return 0;
+}
+
+/*
+ * @brief  Adds the next loose field to the legacy command being collected.
+ *
+ * @return int 0 on success, -1 on wrong field type or full arena.
+ */
+static int legacy_field( client_ctx_t * ctx, const tlv_view_t * tlv ) {
+
+    cmd_frame_t * frame = &ctx->legacy;
+    const cmd_spec_t * spec = cmd_spec( frame->command );
+    tlv_view_t v = *tlv;
+
+    if ( v.type != spec->fields[ frame->count ] ){
+        return -1;
+    }
+
+    /* the view dies with the next read -> keep a copy in the arena */
+    uint8_t * copy = tlv_arena_alloc( &ctx->arena, v.len );
+    if ( v.len > 0 && !copy ){
+        return -1;
+    }
+    memcpy( copy, v.data, v.len );
+    v.data = copy;
+
+    frame->fields[ frame->count++ ] = v;
+    ctx->legacy_left--;
+    return 0;
+}
+
+static int run_command( client_ctx_t * ctx, const cmd_frame_t * frame ) {
+
+    if ( !ctx->negotiated ) {
+        implied_caps( frame, &ctx->caps );
+    }
+
+    return dispatch_command( ctx, frame );
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                  Sessions                                  */
+/* -------------------------------------------------------------------------- */
+
+/* session deadlines in ms (sessions_init), 0 = never */
+static unsigned login_ms = SESSION_LOGIN_TIMEOUT * 1000;
+static unsigned cmd_ms   = SESSION_CMD_TIMEOUT * 1000;
+static unsigned idle_ms  = SESSION_IDLE_TIMEOUT * 1000;
+static int      keepalive_s;
+
+enum { WAIT_NONE, WAIT_LOGIN, WAIT_COMMAND, WAIT_IDLE };
+
+static const char * wait_name[] = { "none", "login", "command", "idle" };
+
+/* every live session - walked by a live restart and on stop */
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static client_ctx_t *  sessions;
+static atomic_int      frozen;
+
+/* taken over from the previous server, not yet given to the model */
+static client_ctx_t ** adopted;
+static int             adopted_count;
+
+/* SESSION_KICK_SIGNAL only has to interrupt a read() */
+static void session_kick( int sig ) {
+
+    ( void ) sig;
+}
+
+int sessions_init( const server_config_t * cfg ) {
+
+    login_ms    = cfg->login_timeout > 0 ? ( unsigned ) cfg->login_timeout * 1000 : 0;
+    cmd_ms      = cfg->cmd_timeout   > 0 ? ( unsigned ) cfg->cmd_timeout   * 1000 : 0;
+    idle_ms     = cfg->idle_timeout  > 0 ? ( unsigned ) cfg->idle_timeout  * 1000 : 0;
+    keepalive_s = cfg->keepalive > 0 ? cfg->keepalive : 0;
+    atomic_store( &frozen, 0 );                     // a server started again after a handoff
+
+    /* no SA_RESTART - the read() of a client thread has to return */
+    struct sigaction sa;
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_handler = session_kick;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SESSION_KICK_SIGNAL, &sa, NULL );
+
+    log_msg( LOG_INFO, "[tcp] deadlines: login %us, command %us, idle %us, keepalive %ds (0 = off)\n",
+            login_ms / 1000, cmd_ms / 1000, idle_ms / 1000, keepalive_s );
+
+    if ( login_ms == 0 && cmd_ms == 0 && idle_ms == 0 ) {
+        return 0;
+    }
+    return timer_wheel_start();
+}
+
+/*
+ * @brief  Timer callback - reaps the session once its deadline has passed.
+ *
+ * @details Runs on the wheel thread. The session is only shut down, not
+ * freed: its reader gets end of file and session_destroy() (which cancels
+ * this timer first) runs on the owner's thread.
+ */
+static unsigned session_expire( void * arg ) {
+
+    client_ctx_t * ctx = arg;
+    uint64_t deadline = atomic_load_explicit( &ctx->deadline, memory_order_relaxed );
+    uint64_t now = timer_now_ms();
+
+    if ( deadline == 0 ) {
+        atomic_store( &ctx->armed_for, 0 );
+        deadline = atomic_load( &ctx->deadline );  // pairs with session_touch(): one of us arms
+        if ( deadline == 0 ) {
+            return 0;
+        }
+        atomic_store( &ctx->armed_for, deadline );
+        return deadline > now ? ( unsigned ) ( deadline - now ) : 1;
+    }
+    if ( deadline > now ) {                         // moved on meanwhile - check again then
+        atomic_store_explicit( &ctx->armed_for, deadline, memory_order_relaxed );
+        return ( unsigned ) ( deadline - now );
+    }
+
+    log_msg( LOG_NOTICE, "[tcp] reaping fd=%d: %s deadline passed\n", ctx->client_fd,
+            wait_name[ atomic_load_explicit( &ctx->waiting_for, memory_order_relaxed ) ] );
+
+    atomic_store_explicit( &ctx->armed_for, 0, memory_order_relaxed );
+    metrics_inc( METRIC_REAPED );
+    shutdown( ctx->client_fd, SHUT_RDWR );
+    return 0;
+}
+
+/*
+ * @brief  Moves the deadline of the session before and after it handles a TLV.
+ *
+ * @details Usually a single atomic store - the timer finds the later
+ * deadline when it fires. It is re-armed only when the deadline got closer
+ * (a command started) or the timer is not armed at all.
+ *
+ * @param busy A command is about to run - it gets the command deadline, so
+ * a handler stuck on its client (e.g. a reply nobody reads) is reaped too.
+ */
+static void session_touch( client_ctx_t * ctx, int busy ) {
+
+    int waiting;
+    unsigned ms;
+
+    if ( busy || ctx->legacy_left > 0 ||
+         atomic_load_explicit( &ctx->input_pending, memory_order_relaxed ) ) {
+        waiting = WAIT_COMMAND;
+        ms = cmd_ms;
+    } else if ( ctx->login[0] != '\0' ) {
+        waiting = WAIT_IDLE;
+        ms = idle_ms;
+    } else {
+        waiting = WAIT_LOGIN;
+        ms = login_ms;
+    }
+
+    atomic_store_explicit( &ctx->waiting_for, waiting, memory_order_relaxed );
+
+    if ( ms == 0 ) {
+        atomic_store_explicit( &ctx->deadline, 0, memory_order_relaxed );   // timer stops by itself
+        return;
+    }
+
+    uint64_t deadline = timer_now_ms() + ms;
+
+    atomic_store( &ctx->deadline, deadline );
+    uint64_t armed = atomic_load( &ctx->armed_for );
+
+    if ( armed == 0 || deadline < armed ) {
+        atomic_store_explicit( &ctx->armed_for, deadline, memory_order_relaxed );
+        timer_arm( &ctx->timer, ms );
+    }
+}
+
+/*
+ * @brief  Refuses a connection - one bare TLV_STATUS, never waiting for the socket.
+ */
+static void reject_client( int client_fd, status_t status ) {
+
+    uint8_t out[ sizeof( tlv_header_t ) + sizeof( status ) ];
+    tlv_header_t hdr = { htons( TLV_STATUS ), htons( sizeof( status ) ) };
+
+    memcpy( out, &hdr, sizeof( hdr ) );
+    memcpy( out + sizeof( hdr ), &status, sizeof( status ) );
+    send( client_fd, out, sizeof( out ), MSG_DONTWAIT | MSG_NOSIGNAL );
+}
+
+/*
+ * @brief  Allocates a session, budgets already taken (or adopted).
+ *
+ * @details The deadline is not started yet - the caller may still restore
+ * a login.
+ */
+static client_ctx_t * session_new( int client_fd, uint32_t peer_ip ) {
+
+    client_ctx_t * ctx = malloc( sizeof( client_ctx_t ) );
+    if ( !ctx ) {
+        return NULL;
+    }
+
+    ctx->client_fd   = client_fd;
+    ctx->peer_ip     = peer_ip;
+    ctx->login[0]    = '\0';
+    ctx->negotiated  = 0;
+    ctx->caps        = ( proto_caps_t ){ 0, TLV_EXT_MAX_LENGTH, 0 };   // legacy until told otherwise
+    ctx->legacy_left = 0;
+    tlv_arena_reset( &ctx->arena );
+
+    if ( tlv_reader_init( &ctx->reader, client_fd ) < 0 ) {
+        free( ctx );
+        return NULL;
+    }
+
+    ctx->outq = outq_create( client_fd );          // NULL = plain blocking writes
+
+    atomic_init( &ctx->deadline, 0 );
+    atomic_init( &ctx->armed_for, 0 );
+    atomic_init( &ctx->waiting_for, WAIT_NONE );
+    atomic_init( &ctx->input_pending, 0 );
+    atomic_init( &ctx->thread_state, SESSION_THREAD_NONE );
+    timer_init( &ctx->timer, session_expire, ctx );
+
+    pthread_mutex_lock( &sessions_lock );
+    ctx->prev = NULL;
+    ctx->next = sessions;
+    if ( sessions ){
+        sessions->prev = ctx;
+    }
+    sessions = ctx;
+    pthread_mutex_unlock( &sessions_lock );
+
+    return ctx;
+}
+
+client_ctx_t * session_create( int client_fd ) {
+
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof( peer );
+
+    /* budgets first - nothing is allocated for a refused client */
+    memset( &peer, 0, sizeof( peer ) );
+    getpeername( client_fd, ( struct sockaddr * ) &peer, &peer_len );
+
+    if ( admission_enter( peer.sin_addr.s_addr ) != ADMIT_OK ) {
+        reject_client( client_fd, STATUS_BUSY );
+        return NULL;
+    }
+
+    client_ctx_t * ctx = session_new( client_fd, peer.sin_addr.s_addr );
+    if ( !ctx ) {
+        admission_leave( peer.sin_addr.s_addr, 0 );
+        return NULL;
+    }
+
+    session_touch( ctx, 0 );                        // login deadline
+
+    metrics_inc( METRIC_ACCEPTED );
+    log_msg( LOG_INFO,"[tcp] client connected (fd=%d)\n", client_fd );
+    return ctx;
+}
+
+/*
+ * @brief  Write hook of a thread running a command - every write goes
+ * through the outbound queue of its connection.
+ *
+ * @details Other sockets are only written to for deliveries, from
+ * active_user_with() - the recipient cannot log out, so its queue is alive.
+ */
+static int session_send_hook( void * arg, int fd, const struct iovec * iov, int cnt ) {
+
+    client_ctx_t * ctx = arg;
+
+    if ( fd == ctx->client_fd ) {
+        /* only a thread of its own may wait for the client to read */
+        int flags = atomic_load( &ctx->thread_state ) == SESSION_THREAD_NONE ? OUTQ_REPLY
+                                                                             : OUTQ_REPLY | OUTQ_WAIT;
+        return ctx->outq ? outq_send_buf( ctx->outq, iov, cnt, flags, relay_payload ) : 1;
+    }
+
+    out_queue_t * q = outq_lookup( fd );
+    return q ? outq_send_buf( q, iov, cnt, 0, relay_payload ) : 1;
+}
+
+static int session_dispatch( client_ctx_t * ctx, const tlv_view_t * tlv ) {
+
+    cmd_frame_t frame;
+
+    log_frame( "[TLV] received TLV type=%u len=%u\n", tlv->type, tlv->len );
+
+    /* fields of a legacy command are still coming */
+    if ( ctx->legacy_left > 0 ) {
+        if ( legacy_field( ctx, tlv ) < 0 ) {
+            return -1;
+        }
+        return ctx->legacy_left > 0 ? 0 : run_command( ctx, &ctx->legacy );
+    }
+
+    tlv_arena_reset( &ctx->arena );
+
+    /* ---- handle TLV ---- */
+    switch ( tlv->type ) {
+
+    case TLV_FRAME: {                   // whole command in one record
+        uint64_t t0 = trace_active() ? metrics_now() : 0;
+        int parsed = cmd_frame_parse( tlv->data, tlv->len, &frame );
+        if ( trace_active() ){
+            trace_event( "parse", t0, metrics_now() - t0, ctx->client_fd );
+        }
+        if ( parsed < 0 ) {
+            log_msg( LOG_INFO, "[TLV] malformed TLV_FRAME\n" );
+            frame.request_id = 0;               // id unknown -> bare status
+            reply_status( ctx, &frame, STATUS_ERROR );
+            return 0;
+        }
+        return run_command( ctx, &frame );
+    }
+
+    case TLV_COMMAND:                   // legacy - fields follow as loose TLVs
+        if ( legacy_begin( ctx, tlv ) < 0 ) {
+            return -1;
+        }
+        return ctx->legacy_left > 0 ? 0 : run_command( ctx, &ctx->legacy );
+
+    default:
+        /* unexpected TLV */
+        log_msg( LOG_INFO,  "Unexpected TLV");
+        return 0;
+    }
+}
+
+/* for session_touch(), which may run on another thread than the parser's */
+static void note_input( client_ctx_t * ctx ) {
+
+    const tlv_parser_t * parser = &ctx->reader.parser;
+
+    atomic_store_explicit( &ctx->input_pending, parser->tail > parser->head, memory_order_relaxed );
+}
+
+int session_next_tlv( client_ctx_t * ctx, tlv_view_t * tlv ) {
+
+    int rc = tlv_parser_next( &ctx->reader.parser, tlv );
+
+    note_input( ctx );
+    return rc;
+}
+
+int session_handle_tlv( client_ctx_t * ctx, const tlv_view_t * tlv ) {
+
+    metrics_inc( METRIC_FRAMES );
+
+    int decided = trace_sample();
+    uint64_t t0 = trace_active() ? metrics_now() : 0;
+
+    session_touch( ctx, 1 );                        // command deadline while it runs
+
+    tlv_set_send_hook( session_send_hook, ctx );
+    int rc = session_dispatch( ctx, tlv );
+    tlv_set_send_hook( NULL, NULL );
+
+    session_touch( ctx, 0 );                        // idle (or login) deadline again
+
+    /* the whole TLV - command, relays and file I/O nest inside */
+    if ( trace_active() ){
+        trace_event( "tlv", t0, metrics_now() - t0, ctx->client_fd );
+    }
+    if ( decided ){
+        trace_done();
+    }
+
+    return rc;
+}
+
+void session_destroy( client_ctx_t * ctx ) {
+
+    log_msg( LOG_INFO, "[tcp] client disconnected (fd=%d)\n", ctx->client_fd );
+    metrics_inc( METRIC_CLOSED );
+
+    timer_cancel( &ctx->timer );                    // the wheel no longer touches ctx
+
+    pthread_mutex_lock( &sessions_lock );
+    if ( ctx->prev ){
+        ctx->prev->next = ctx->next;
+    } else {
+        sessions = ctx->next;
+    }
+    if ( ctx->next ){
+        ctx->next->prev = ctx->prev;
+    }
+    pthread_mutex_unlock( &sessions_lock );
+
+    remove_active_user( ctx->login, ctx->client_fd );
+    admission_leave( ctx->peer_ip, ctx->login[0] != '\0' );
+    outq_destroy( ctx->outq );                      // nobody can deliver to it any more
+    tlv_reader_free( &ctx->reader );
+    close( ctx->client_fd );
+    free( ctx );
+}
+
+int accept_client( int listen_fd ) {
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof( client_addr );
+
+    int client_fd = accept4(
+        listen_fd,
+        ( struct sockaddr * ) &client_addr,
+        &client_len,
+        SOCK_CLOEXEC
+    );
+
+    if ( client_fd < 0 ) {
+        return -1;
+    }
+
+    client_socket_init( client_fd, &client_addr );
+    return client_fd;
+}
+
+void client_socket_init( int client_fd, const struct sockaddr_in * addr ) {
+
+    struct sockaddr_in peer;
+    socklen_t len = sizeof( peer );
+
+    /* replies are coalesced (send_tlvv) -> disable Nagle */
+    int one = 1;
+    setsockopt( client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+
+    /* dead peers (unplugged, no FIN) are found by the kernel */
+    if ( keepalive_s > 0 ) {
+        int idle  = keepalive_s;
+        int intvl = keepalive_s / 3 > 0 ? keepalive_s / 3 : 1;
+        int cnt   = 3;
+        unsigned user_timeout = ( unsigned ) ( idle + intvl * cnt ) * 1000;   // unacked data too
+
+        setsockopt( client_fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof( one ) );
+        setsockopt( client_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof( idle ) );
+        setsockopt( client_fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof( intvl ) );
+        setsockopt( client_fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof( cnt ) );
+        setsockopt( client_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof( user_timeout ) );
+    }
+
+    if ( addr == NULL ) {
+        memset( &peer, 0, sizeof( peer ) );
+        getpeername( client_fd, ( struct sockaddr * ) &peer, &len );
+        addr = &peer;
+    }
+
+    log_msg(LOG_INFO,
+        "Accepted TCP client from %s:%d\n",
+        inet_ntoa( addr->sin_addr ),
+        ntohs( addr->sin_port )
+    );
+}
+
+void raise_fd_limit( void ) {
+
+    struct rlimit rl;
+
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur < rl.rlim_max ) {
+        rl.rlim_cur = rl.rlim_max;
+        if ( setrlimit( RLIMIT_NOFILE, &rl ) == 0 ){
+            log_msg( LOG_INFO, "fd limit raised to %llu\n",
+                    ( unsigned long long ) rl.rlim_cur );
+        }
+    }
+}
+
+void * client_thread( void * arg ) {
+
+    client_ctx_t * ctx = ( client_ctx_t * ) arg;
+    tlv_view_t tlv;
+
+    ctx->thread = pthread_self();
+    atomic_store( &ctx->thread_state, SESSION_THREAD_RUNNING );
+
+    /* blocking reads - one thread per connection (tlv_reader_next() that
+       looks at `frozen` before every read) */
+    for (;;) {
+
+        int rc = session_next_tlv( ctx, &tlv );
+        if ( rc < 0 ){
+            break;
+        }
+        if ( rc > 0 ) {
+            if ( session_handle_tlv( ctx, &tlv ) < 0 ){
+                break;
+            }
+            continue;
+        }
+
+        /* between commands and nothing complete buffered - a safe place to stop */
+        if ( atomic_load( &frozen ) ) {
+            atomic_store( &ctx->thread_state, SESSION_THREAD_PARKED );
+            for (;;){
+                pause();                            // until this process exits
+            }
+        }
+
+        ssize_t n = tlv_parser_read( &ctx->reader.parser, ctx->client_fd );
+        if ( n < 0 && errno == EINTR ){
+            continue;
+        }
+        if ( n <= 0 ){
+            break;
+        }
+    }
+
+    session_destroy( ctx );
+    return NULL;
+}
+
+int session_start_thread( client_ctx_t * ctx ) {
+
+    pthread_t tid;
+
+    atomic_store( &ctx->thread_state, SESSION_THREAD_STARTING );
+
+    if ( pthread_create( &tid, NULL, client_thread, ctx ) != 0 ) {
+        perror( "pthread_create client" );
+        session_destroy( ctx );
+        return -1;
+    }
+
+    pthread_detach( tid );
+    return 0;
+}
+
+int sessions_close( int timeout_ms ) {
+
+    uint64_t end = timer_now_ms() + timeout_ms;
+    struct timespec pause_ts = { 0, 10 * 1000000L };
+    int left;
+
+    for (;;) {
+
+        left = 0;
+
+        /* owners see end of file and destroy their sessions as usual */
+        pthread_mutex_lock( &sessions_lock );
+        for ( client_ctx_t * ctx = sessions; ctx; ctx = ctx->next ) {
+            shutdown( ctx->client_fd, SHUT_RDWR );
+            left++;
+        }
+        pthread_mutex_unlock( &sessions_lock );
+
+        if ( left == 0 || timer_now_ms() >= end ){
+            break;
+        }
+        nanosleep( &pause_ts, NULL );
+    }
+
+    if ( left > 0 ){
+        log_msg( LOG_WARNING, "[tcp] %d session(s) still open on stop\n", left );
+    }
+    return left;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                               Live restart                                 */
+/* -------------------------------------------------------------------------- */
+
+void sessions_freeze( void ) {
+
+    atomic_store( &frozen, 1 );
+}
+
+int sessions_frozen( void ) {
+
+    return atomic_load( &frozen );
+}
+
+int sessions_quiesce( int timeout_ms ) {
+
+    uint64_t end = timer_now_ms() + timeout_ms;
+    struct timespec pause_ts = { 0, 10 * 1000000L };
+    int busy;
+
+    for (;;) {
+
+        busy = 0;
+
+        /* a thread that is in the list is alive: it would wait here to leave it */
+        pthread_mutex_lock( &sessions_lock );
+        for ( client_ctx_t * ctx = sessions; ctx; ctx = ctx->next ) {
+            int st = atomic_load( &ctx->thread_state );
+            if ( st == SESSION_THREAD_STARTING ) {
+                busy++;
+            } else if ( st == SESSION_THREAD_RUNNING ) {
+                busy++;
+                pthread_kill( ctx->thread, SESSION_KICK_SIGNAL );   // out of read(), again if missed
+            }
+        }
+        pthread_mutex_unlock( &sessions_lock );
+
+        if ( busy == 0 || timer_now_ms() >= end ){
+            break;
+        }
+        nanosleep( &pause_ts, NULL );
+    }
+
+    if ( busy > 0 ){
+        log_msg( LOG_WARNING, "[handoff] %d client thread(s) did not stop in time\n", busy );
+    }
+    return busy;
+}
+
+int sessions_handoff( int ctl, int listen_fd ) {
+
+    handoff_record_t rec;
+    uint64_t end = timer_now_ms() + HANDOFF_DRAIN_MS;
+    int sent = 0, left = 0;
+
+    memset( &rec, 0, sizeof( rec ) );
+    rec.kind = HANDOFF_LISTENER;
+    if ( handoff_send( ctl, &rec, listen_fd, NULL ) < 0 ) {
+        log_msg( LOG_ERR, "[handoff] successor is gone: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    pthread_mutex_lock( &sessions_lock );
+    for ( client_ctx_t * ctx = sessions; ctx; ctx = ctx->next ) {
+
+        tlv_parser_t * p = &ctx->reader.parser;
+        size_t input = p->tail - p->head;
+        uint64_t now = timer_now_ms();
+
+        /* from now on nothing here may shut the socket down */
+        timer_cancel( &ctx->timer );
+
+        if ( atomic_load( &ctx->thread_state ) == SESSION_THREAD_STARTING ||
+             atomic_load( &ctx->thread_state ) == SESSION_THREAD_RUNNING ||
+             ctx->legacy_left > 0 || input > HANDOFF_MAX_INPUT ||
+             ( ctx->outq && outq_drain( ctx->outq, now < end ? ( int ) ( end - now ) : 0 ) < 0 ) ) {
+            left++;
+            continue;
+        }
+
+        memset( &rec, 0, sizeof( rec ) );
+        rec.kind       = HANDOFF_SESSION;
+        rec.peer_ip    = ctx->peer_ip;
+        rec.caps       = ctx->caps;
+        rec.negotiated = ctx->negotiated;
+        rec.input_len  = ( uint32_t ) input;
+
+        active_user_t user;
+        if ( ctx->login[0] != '\0' && active_user_get( ctx->login, ctx->client_fd, &user ) == 0 ) {
+            memcpy( rec.login, user.login, sizeof( rec.login ) );
+            memcpy( rec.username, user.username, sizeof( rec.username ) );
+            rec.features = user.features;
+        }
+
+        if ( handoff_send( ctl, &rec, ctx->client_fd, p->buf + p->head ) < 0 ) {
+            log_msg( LOG_ERR, "[handoff] successor is gone: %s\n", strerror( errno ) );
+            pthread_mutex_unlock( &sessions_lock );
+            return -1;
+        }
+        sent++;
+    }
+    pthread_mutex_unlock( &sessions_lock );
+
+    memset( &rec, 0, sizeof( rec ) );
+    rec.kind = HANDOFF_END;
+    handoff_send( ctl, &rec, -1, NULL );
+
+    log_msg( LOG_INFO, "[handoff] %d session(s) handed over, %d closed\n", sent, left );
+    return sent;
+}
+
+/*
+ * @brief  Rebuilds one session sent by the previous server.
+ */
+static int session_adopt( const handoff_record_t * rec, int fd, const void * input ) {
+
+    int logged_in = rec->login[0] != '\0';
+
+    admission_adopt( rec->peer_ip, logged_in );
+
+    client_ctx_t * ctx = session_new( fd, rec->peer_ip );
+    if ( !ctx ) {
+        admission_leave( rec->peer_ip, logged_in );
+        return -1;
+    }
+
+    ctx->caps       = rec->caps;
+    ctx->negotiated = rec->negotiated;
+
+    if ( logged_in ) {
+        memcpy( ctx->login, rec->login, sizeof( ctx->login ) );
+        ctx->login[ sizeof( ctx->login ) - 1 ] = '\0';
+        if ( add_active_user( ctx->login, rec->username, fd, rec->features ) != 0 ){
+            log_msg( LOG_WARNING, "[handoff] %s not restored as active\n", ctx->login );
+        }
+    }
+
+    if ( rec->input_len > 0 && tlv_parser_feed( &ctx->reader.parser, input, rec->input_len ) < 0 ) {
+        session_destroy( ctx );
+        return 0;                                   // fd is gone with it
+    }
+
+    note_input( ctx );
+    session_touch( ctx, 0 );
+
+    client_ctx_t ** grown = realloc( adopted, ( adopted_count + 1 ) * sizeof( *adopted ) );
+    if ( !grown ) {
+        session_destroy( ctx );
+        return 0;
+    }
+    adopted = grown;
+    adopted[ adopted_count++ ] = ctx;
+    return 0;
+}
+
+int sessions_adopt( int ctl ) {
+
+    static uint8_t input[ HANDOFF_MAX_INPUT ];
+    handoff_record_t rec;
+    int listen_fd = -1;
+    int fd;
+
+    for (;;) {
+
+        int kind = handoff_recv( ctl, &rec, &fd, input );
+
+        if ( kind == HANDOFF_LISTENER && fd >= 0 && listen_fd < 0 ) {
+            listen_fd = fd;
+        } else if ( kind == HANDOFF_SESSION && fd >= 0 ) {
+            if ( session_adopt( &rec, fd, input ) < 0 ){
+                close( fd );
+            }
+        } else {
+            if ( fd >= 0 ){
+                close( fd );
+            }
+            if ( kind == HANDOFF_END || kind < 0 ){
+                break;
+            }
+        }
+    }
+
+    log_msg( LOG_INFO, "[handoff] took over %d session(s)%s\n", adopted_count,
+            listen_fd >= 0 ? " and the listening socket" : ", no listening socket" );
+    return listen_fd;
+}
+
+client_ctx_t ** sessions_adopted( int * count ) {
+
+    client_ctx_t ** list = adopted;
+
+    *count = adopted_count;
+    adopted = NULL;
+    adopted_count = 0;
+    return list;
+}
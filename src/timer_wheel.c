@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "timer_wheel.h"
+#include "log.h"
+
+#define TIMER_MASK ( TIMER_SLOTS - 1 )
+
+static struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   done;                          /* a callback returned */
+    wheel_timer_t    slots[ TIMER_LEVELS ][ TIMER_SLOTS ];    /* list heads (circular) */
+    uint64_t         tick;                          /* last processed tick */
+    wheel_timer_t *  running;                       /* callback in progress */
+    int              started;
+} wheel = { .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+uint64_t timer_now_ms( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ( uint64_t ) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_tick( void ) {
+
+    return timer_now_ms() / TIMER_TICK_MS;
+}
+
+static void unlink_locked( wheel_timer_t * t ) {
+
+    if ( t->linked ) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->linked = 0;
+    }
+}
+
+/*
+ * @brief  Puts the timer in the slot of the lowest level that reaches it.
+ */
+static void link_locked( wheel_timer_t * t ) {
+
+    uint64_t delta = t->expires > wheel.tick ? t->expires - wheel.tick : 0;
+    int level = 0;
+
+    while ( level < TIMER_LEVELS - 1 && delta >= ( 1ull << ( ( level + 1 ) * TIMER_BITS ) ) ){
+        level++;
+    }
+
+    uint64_t when = t->expires;
+    if ( level == TIMER_LEVELS - 1 && delta >= ( 1ull << ( TIMER_LEVELS * TIMER_BITS ) ) ){
+        when = wheel.tick + ( 1ull << ( TIMER_LEVELS * TIMER_BITS ) ) - 1;   // re-spread later
+    }
+
+    wheel_timer_t * head = &wheel.slots[ level ][ ( when >> ( level * TIMER_BITS ) ) & TIMER_MASK ];
+
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    t->linked = 1;
+}
+
+/*
+ * @brief  Moves every timer of a higher level slot one level down.
+ */
+static void cascade_locked( int level ) {
+
+    wheel_timer_t * head = &wheel.slots[ level ][ ( wheel.tick >> ( level * TIMER_BITS ) ) & TIMER_MASK ];
+    wheel_timer_t * t = head->next;
+
+    head->next = head->prev = head;
+    while ( t != head ) {
+        wheel_timer_t * next = t->next;
+        t->linked = 0;
+        link_locked( t );
+        t = next;
+    }
+}
+
+/*
+ * @brief  Runs the expired timers of the current tick, one at a time.
+ *
+ * @details The lock is dropped around each callback; timer_cancel() of the
+ * running timer waits on `done`.
+ */
+static void expire_locked( void ) {
+
+    wheel_timer_t * head = &wheel.slots[0][ wheel.tick & TIMER_MASK ];
+
+    while ( head->next != head ) {
+
+        wheel_timer_t * t = head->next;
+        unlink_locked( t );
+
+        wheel.running = t;
+        pthread_mutex_unlock( &wheel.lock );
+        unsigned again = t->fn( t->arg );
+        pthread_mutex_lock( &wheel.lock );
+        wheel.running = NULL;
+
+        /* re-armed by its owner meanwhile - that one stands */
+        if ( again > 0 && !t->linked ) {
+            t->expires = wheel.tick + ( again + TIMER_TICK_MS - 1 ) / TIMER_TICK_MS;
+            link_locked( t );
+        }
+        pthread_cond_broadcast( &wheel.done );
+    }
+}
+
+static void * wheel_thread( void * arg ) {
+
+    ( void ) arg;
+    struct timespec delay = { 0, TIMER_TICK_MS * 1000000L };
+
+    for (;;) {
+
+        nanosleep( &delay, NULL );
+
+        uint64_t target = now_tick();
+
+        pthread_mutex_lock( &wheel.lock );
+        while ( wheel.tick < target ) {
+
+            wheel.tick++;
+            for ( int level = 1; level < TIMER_LEVELS; ++level ) {
+                if ( ( wheel.tick & ( ( 1ull << ( level * TIMER_BITS ) ) - 1 ) ) != 0 ){
+                    break;
+                }
+                cascade_locked( level );
+            }
+            expire_locked();
+        }
+        pthread_mutex_unlock( &wheel.lock );
+    }
+
+    return NULL;
+}
+
+int timer_wheel_start( void ) {
+
+    pthread_t tid;
+
+    pthread_mutex_lock( &wheel.lock );
+    int started = wheel.started;
+    pthread_mutex_unlock( &wheel.lock );
+    if ( started ){
+        return 0;                                   // a server started before
+    }
+
+    for ( int l = 0; l < TIMER_LEVELS; ++l ){
+        for ( int i = 0; i < TIMER_SLOTS; ++i ){
+            wheel.slots[l][i].next = wheel.slots[l][i].prev = &wheel.slots[l][i];
+        }
+    }
+    wheel.tick = now_tick();
+
+    if ( pthread_create( &tid, NULL, wheel_thread, NULL ) != 0 ) {
+        log_msg( LOG_ERR, "[timer] wheel thread not started, no deadlines\n" );
+        return -1;
+    }
+    pthread_detach( tid );
+
+    pthread_mutex_lock( &wheel.lock );
+    wheel.started = 1;
+    pthread_mutex_unlock( &wheel.lock );
+    return 0;
+}
+
+void timer_init( wheel_timer_t * t, unsigned ( * fn )( void * ), void * arg ) {
+
+    memset( t, 0, sizeof( *t ) );
+    t->fn  = fn;
+    t->arg = arg;
+}
+
+void timer_arm( wheel_timer_t * t, unsigned ms ) {
+
+    uint64_t ticks = ( ms + TIMER_TICK_MS - 1 ) / TIMER_TICK_MS;
+
+    pthread_mutex_lock( &wheel.lock );
+    if ( wheel.started ) {
+        unlink_locked( t );
+        t->expires = wheel.tick + ( ticks > 0 ? ticks : 1 );
+        link_locked( t );
+    }
+    pthread_mutex_unlock( &wheel.lock );
+}
+
+void timer_cancel( wheel_timer_t * t ) {
+
+    pthread_mutex_lock( &wheel.lock );
+    unlink_locked( t );
+    while ( wheel.running == t ) {
+        pthread_cond_wait( &wheel.done, &wheel.lock );
+        unlink_locked( t );                         // it may have re-armed itself
+    }
+    pthread_mutex_unlock( &wheel.lock );
+}
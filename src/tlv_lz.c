@@ -0,0 +1,225 @@
+#include <string.h>     // memcpy, memset
+
+#include "tlv_lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5     /* tail is always sent as literals */
+
+static uint32_t read32( const uint8_t * p ) {
+
+    uint32_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+static uint32_t lz_hash( uint32_t seq ) {
+
+    return ( seq * 2654435761u ) >> ( 32 - LZ_HASH_BITS );     // Knuth multiplicative
+}
+
+/*
+ * @brief  Writes the extra bytes of a length that did not fit in its nibble.
+ *
+ * @return uint8_t* Position after the written bytes, NULL if out of space.
+ */
+static uint8_t * put_length( uint8_t * op, const uint8_t * oend, size_t len ) {
+
+    for ( ; len >= 255; len -= 255 ) {
+        if ( op >= oend ){
+            return NULL;
+        }
+        *op++ = 255;
+    }
+
+    if ( op >= oend ){
+        return NULL;
+    }
+    *op++ = ( uint8_t ) len;
+    return op;
+}
+
+/*
+ * @brief  Emits one sequence: literals and (optionally) a match.
+ *
+ * @param mlen Match length, 0 for the last, literal only, sequence.
+ * @return uint8_t* Position after the sequence, NULL if out of space.
+ */
+static uint8_t * put_sequence(
+    uint8_t * op,
+    const uint8_t * oend,
+    const uint8_t * lit,
+    size_t lit_len,
+    size_t offset,
+    size_t mlen
+) {
+    uint8_t * token = op++;
+    size_t ml = mlen ? mlen - TLV_LZ_MIN_MATCH : 0;
+
+    if ( token >= oend ){
+        return NULL;
+    }
+
+    *token = ( uint8_t ) ( ( lit_len < 15 ? lit_len : 15 ) << 4 );
+    if ( lit_len >= 15 && ( op = put_length( op, oend, lit_len - 15 ) ) == NULL ){
+        return NULL;
+    }
+
+    if ( ( size_t ) ( oend - op ) < lit_len ){
+        return NULL;
+    }
+    memcpy( op, lit, lit_len );
+    op += lit_len;
+
+    if ( mlen == 0 ){
+        return op;                              // last sequence
+    }
+
+    if ( oend - op < 2 ){
+        return NULL;
+    }
+    *op++ = ( uint8_t ) ( offset & 0xFF );
+    *op++ = ( uint8_t ) ( offset >> 8 );
+
+    *token |= ( uint8_t ) ( ml < 15 ? ml : 15 );
+    if ( ml >= 15 && ( op = put_length( op, oend, ml - 15 ) ) == NULL ){
+        return NULL;
+    }
+
+    return op;
+}
+
+size_t tlv_lz_compress( const void * src, size_t n, void * dst, size_t cap ) {
+
+    const uint8_t * in     = src;
+    const uint8_t * ip     = in;
+    const uint8_t * anchor = in;
+    const uint8_t * end    = in + n;
+    uint8_t * op           = dst;
+    const uint8_t * oend   = op + cap;
+    uint32_t table[ 1 << LZ_HASH_BITS ];    /* position + 1, 0 = empty */
+
+    memset( table, 0, sizeof( table ) );
+
+    /* positions are kept in 32 bits */
+    if ( n > UINT32_MAX - 1 ){
+        return 0;
+    }
+
+    while ( n >= LZ_LAST_LITERALS + TLV_LZ_MIN_MATCH &&
+            ip <= end - LZ_LAST_LITERALS - TLV_LZ_MIN_MATCH ) {
+
+        uint32_t seq = read32( ip );
+        uint32_t h   = lz_hash( seq );
+        uint32_t pos = table[h];
+
+        table[h] = ( uint32_t ) ( ip - in ) + 1;
+
+        if ( pos == 0 ||
+             ( size_t ) ( ip - ( in + pos - 1 ) ) > TLV_LZ_MAX_OFFSET ||
+             read32( in + pos - 1 ) != seq ) {
+            ip++;
+            continue;
+        }
+
+        /* extend the match, keeping the tail for literals */
+        const uint8_t * ref  = in + pos - 1;
+        const uint8_t * m    = ip + TLV_LZ_MIN_MATCH;
+        const uint8_t * r    = ref + TLV_LZ_MIN_MATCH;
+        const uint8_t * mend = end - LZ_LAST_LITERALS;
+
+        while ( m < mend && *m == *r ) {
+            m++;
+            r++;
+        }
+
+        op = put_sequence( op, oend, anchor, ip - anchor, ip - ref, m - ip );
+        if ( op == NULL ){
+            return 0;
+        }
+
+        ip = anchor = m;
+    }
+
+    op = put_sequence( op, oend, anchor, end - anchor, 0, 0 );
+    if ( op == NULL ){
+        return 0;
+    }
+
+    return op - ( uint8_t * ) dst;
+}
+
+/*
+ * @brief  Reads the extra bytes of a length.
+ *
+ * @return int 0 on success, -1 if the input ends in the middle.
+ */
+static int get_length( const uint8_t ** ip, const uint8_t * iend, size_t * len ) {
+
+    uint8_t b;
+
+    do {
+        if ( *ip >= iend ){
+            return -1;
+        }
+        b = *( *ip )++;
+        *len += b;
+    } while ( b == 255 );
+
+    return 0;
+}
+
+long tlv_lz_decompress( const void * src, size_t n, void * dst, size_t cap ) {
+
+    const uint8_t * ip   = src;
+    const uint8_t * iend = ip + n;
+    uint8_t * out        = dst;
+    uint8_t * op         = out;
+    const uint8_t * oend = out + cap;
+
+    while ( ip < iend ) {
+
+        uint8_t token = *ip++;
+
+        /* literals */
+        size_t lit = token >> 4;
+        if ( lit == 15 && get_length( &ip, iend, &lit ) < 0 ){
+            return -1;
+        }
+        if ( ( size_t ) ( iend - ip ) < lit || ( size_t ) ( oend - op ) < lit ){
+            return -1;
+        }
+        memcpy( op, ip, lit );
+        ip += lit;
+        op += lit;
+
+        if ( ip == iend ){
+            break;                              // last sequence has no match
+        }
+
+        /* match */
+        if ( iend - ip < 2 ){
+            return -1;
+        }
+        size_t offset = ip[0] | ( ( size_t ) ip[1] << 8 );
+        ip += 2;
+
+        size_t mlen = token & 0x0F;
+        if ( mlen == 15 && get_length( &ip, iend, &mlen ) < 0 ){
+            return -1;
+        }
+        mlen += TLV_LZ_MIN_MATCH;
+
+        if ( offset == 0 || offset > ( size_t ) ( op - out ) ||
+             ( size_t ) ( oend - op ) < mlen ){
+            return -1;
+        }
+
+        /* byte by byte - source and destination may overlap (runs) */
+        const uint8_t * ref = op - offset;
+        while ( mlen-- ) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - out;
+}
@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+#include "log.h"
+
+typedef struct {
+    const char * name;
+    uint64_t     start;                             /* ns, CLOCK_MONOTONIC */
+    uint64_t     dur;
+    int32_t      tid;
+    int32_t      arg;
+} trace_span_t;
+
+typedef struct trace_buf {
+    struct trace_buf * next;                        /* every buffer, never freed */
+    pthread_mutex_t    lock;                        /* owner and trace_write() */
+    int                owned;                       /* under list_lock */
+    int                tid;                         /* of the current owner */
+    uint64_t           head;                        /* spans written, the ring keeps the last ones */
+    trace_span_t       spans[ TRACE_BUF_EVENTS ];
+} trace_buf_t;
+
+_Thread_local int trace_on;
+
+static struct {
+    atomic_int      enabled;
+    atomic_uint     sample;
+    atomic_uint     requests;
+    char            path[ 4096 ];
+    pthread_mutex_t list_lock;
+    trace_buf_t *   bufs;
+    pthread_key_t   key;                            /* releases the buffer of a thread */
+    sem_t           dump_sem;
+    int             started;
+} tr = { .sample = TRACE_DEFAULT_SAMPLE, .list_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local trace_buf_t * my_buf;
+
+/* thread exit - the buffer goes to the next thread that traces */
+static void buf_release( void * arg ) {
+
+    trace_buf_t * b = arg;
+
+    pthread_mutex_lock( &tr.list_lock );
+    b->owned = 0;
+    pthread_mutex_unlock( &tr.list_lock );
+}
+
+/*
+ * @brief  Buffer of the calling thread - a released one or a new one.
+ */
+static trace_buf_t * buf_get( void ) {
+
+    if ( my_buf ){
+        return my_buf;
+    }
+
+    pthread_mutex_lock( &tr.list_lock );
+
+    trace_buf_t * b = tr.bufs;
+    while ( b && b->owned ){
+        b = b->next;
+    }
+    if ( !b && ( b = calloc( 1, sizeof( *b ) ) ) ) {
+        pthread_mutex_init( &b->lock, NULL );
+        b->next = tr.bufs;
+        tr.bufs = b;
+    }
+    if ( b ){
+        b->owned = 1;
+    }
+
+    pthread_mutex_unlock( &tr.list_lock );
+
+    if ( b ) {
+        b->tid = gettid();
+        pthread_setspecific( tr.key, b );
+        my_buf = b;
+    }
+    return b;
+}
+
+static void * dump_thread( void * arg ) {
+
+    ( void ) arg;
+
+    for (;;) {
+        while ( sem_wait( &tr.dump_sem ) < 0 && errno == EINTR ){
+            ;
+        }
+        trace_dump();
+    }
+    return NULL;
+}
+
+int trace_start( const trace_config_t * cfg ) {
+
+    pthread_t tid;
+
+    atomic_store( &tr.sample, cfg->sample > 0 ? cfg->sample : TRACE_DEFAULT_SAMPLE );
+    if ( !cfg->path ) {
+        atomic_store( &tr.enabled, 0 );
+        return 0;
+    }
+
+    pthread_mutex_lock( &tr.list_lock );
+    snprintf( tr.path, sizeof( tr.path ), "%s", cfg->path );
+
+    int first = !tr.started;
+    if ( first ) {
+        tr.started = 1;
+        pthread_key_create( &tr.key, buf_release );
+        sem_init( &tr.dump_sem, 0, 0 );
+    }
+    pthread_mutex_unlock( &tr.list_lock );
+
+    atomic_store( &tr.enabled, 1 );
+    log_msg( LOG_INFO, "[trace] 1 request in %u traced, written to %s\n",
+             atomic_load( &tr.sample ), cfg->path );
+
+    if ( first ) {
+        if ( pthread_create( &tid, NULL, dump_thread, NULL ) != 0 ) {
+            log_msg( LOG_WARNING, "[trace] no dump thread, the trace is written on stop only\n" );
+            return -1;
+        }
+        pthread_detach( tid );
+    }
+    return 0;
+}
+
+int trace_sample( void ) {
+
+    if ( trace_on != 0 || !atomic_load_explicit( &tr.enabled, memory_order_relaxed ) ){
+        return 0;
+    }
+
+    unsigned n = atomic_load_explicit( &tr.sample, memory_order_relaxed );
+    int traced = n <= 1 ||
+                 atomic_fetch_add_explicit( &tr.requests, 1, memory_order_relaxed ) % n == 0;
+    trace_on = traced ? 1 : -1;
+    return 1;
+}
+
+void trace_done( void ) {
+
+    trace_on = 0;
+}
+
+void trace_event( const char * name, uint64_t start, uint64_t dur, int arg ) {
+
+    trace_buf_t * b;
+
+    if ( trace_on <= 0 || !( b = buf_get() ) ){
+        return;
+    }
+
+    pthread_mutex_lock( &b->lock );
+    trace_span_t * s = &b->spans[ b->head++ % TRACE_BUF_EVENTS ];
+    s->name  = name;
+    s->start = start;
+    s->dur   = dur;
+    s->tid   = b->tid;
+    s->arg   = arg;
+    pthread_mutex_unlock( &b->lock );
+}
+
+int trace_write( FILE * f ) {
+
+    trace_span_t * copy = malloc( sizeof( trace_span_t ) * TRACE_BUF_EVENTS );
+    int pid = getpid();
+    int sep = 0;
+
+    if ( !copy ){
+        return -1;
+    }
+
+    fprintf( f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+
+    /* buffers are never freed - the list can be walked without its lock */
+    pthread_mutex_lock( &tr.list_lock );
+    trace_buf_t * first = tr.bufs;
+    pthread_mutex_unlock( &tr.list_lock );
+
+    for ( trace_buf_t * b = first; b; b = b->next ) {
+
+        /* copy out - the owner is not held up by the file */
+        pthread_mutex_lock( &b->lock );
+        uint64_t count = b->head < TRACE_BUF_EVENTS ? b->head : TRACE_BUF_EVENTS;
+        for ( uint64_t i = 0; i < count; ++i ){
+            copy[i] = b->spans[ ( b->head - count + i ) % TRACE_BUF_EVENTS ];
+        }
+        pthread_mutex_unlock( &b->lock );
+
+        for ( uint64_t i = 0; i < count; ++i ) {
+            const trace_span_t * s = &copy[i];
+            fprintf( f, "%s{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+                     sep ? ",\n" : "", s->name, pid, s->tid,
+                     ( unsigned long long ) ( s->start / 1000 ), ( unsigned ) ( s->start % 1000 ),
+                     ( unsigned long long ) ( s->dur / 1000 ), ( unsigned ) ( s->dur % 1000 ) );
+            if ( s->arg >= 0 ){
+                fprintf( f, ",\"args\":{\"fd\":%d}", s->arg );
+            }
+            fputc( '}', f );
+            sep = 1;
+        }
+    }
+
+    fprintf( f, "\n]}\n" );
+    free( copy );
+    return ferror( f ) ? -1 : 0;
+}
+
+int trace_dump( void ) {
+
+    char path[ sizeof( tr.path ) ];
+    char tmp[ sizeof( tr.path ) + 8 ];
+
+    if ( !atomic_load( &tr.enabled ) ){
+        return -1;
+    }
+
+    pthread_mutex_lock( &tr.list_lock );
+    snprintf( path, sizeof( path ), "%s", tr.path );
+    pthread_mutex_unlock( &tr.list_lock );
+    snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+
+    FILE * f = fopen( tmp, "w" );
+    if ( !f ) {
+        log_msg( LOG_ERR, "[trace] %s: %s\n", tmp, strerror( errno ) );
+        return -1;
+    }
+
+    int rc = trace_write( f );
+    if ( fclose( f ) != 0 || rc < 0 || rename( tmp, path ) < 0 ) {
+        log_msg( LOG_ERR, "[trace] %s not written: %s\n", path, strerror( errno ) );
+        unlink( tmp );
+        return -1;
+    }
+
+    log_msg( LOG_INFO, "[trace] written to %s\n", path );
+    return 0;
+}
+
+void trace_dump_async( void ) {
+
+    if ( tr.started ){
+        sem_post( &tr.dump_sem );
+    }
+}
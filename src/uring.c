@@ -0,0 +1,924 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "protocol.h"
+#include "tcp_server.h"
+#include "uring.h"
+#include "log.h"
+
+/* low bits of user_data - connections are at least 8 byte aligned */
+#define UD_RECV   0u
+#define UD_SEND   1u
+#define UD_ACCEPT 2u
+#define UD_CANCEL 3u
+#define UD_WAKE   7u                        /* eventfd of the loop (no pointer) */
+#define UD_MASK   3u
+
+#define URING_BUF_GROUP 0
+
+/* a longer chain would never find room in the SQ and wait forever */
+_Static_assert( URING_MAX_CHAIN <= URING_ENTRIES, "URING_MAX_CHAIN must fit in the SQ" );
+
+typedef struct uring_conn {
+    client_ctx_t *       session;
+    struct uring_loop *  loop;
+    struct uring_conn *  prev;              /* all connections of the loop */
+    struct uring_conn *  next;
+    struct uring_conn *  dirty_next;        /* queue to look at */
+    struct uring_conn *  wake_next;         /* woken by another thread */
+    uint32_t             fly_len[ URING_MAX_CHAIN ];  /* sends in flight, in order */
+    int                  fly_done;
+    int                  in_flight;
+    int                  recv_armed;
+    int                  dirty;
+    int                  woken;
+    int                  closing;
+    int                  handoff;           /* kept open for the next server, no new requests */
+} uring_conn_t;
+
+/* the mmapped rings, raw io_uring ABI */
+typedef struct {
+    int                   fd;
+    unsigned              sq_entries;
+    _Atomic unsigned *    sq_head;
+    _Atomic unsigned *    sq_tail;
+    unsigned              sq_mask;
+    unsigned *            sq_array;
+    struct io_uring_sqe * sqes;
+    _Atomic unsigned *    cq_head;
+    _Atomic unsigned *    cq_tail;
+    unsigned              cq_mask;
+    struct io_uring_cqe * cqes;
+    unsigned              sqe_tail;         /* prepared, not yet published */
+    unsigned              submitted;        /* published and taken by the kernel */
+    void *                ring_ptr;
+    size_t                ring_len;
+    size_t                sqes_len;
+
+    /* provided receive buffers */
+    struct io_uring_buf_ring * br;
+    size_t                br_len;
+    uint8_t *             bufs;
+    uint16_t              br_tail;
+} ring_t;
+
+typedef struct uring_loop {
+    ring_t          ring;
+    int             listen_fd;
+    int             accept_armed;
+    volatile int *  running;
+    uring_conn_t *  conns;
+    uring_conn_t *  dirty;
+    int             wake_fd;                /* eventfd, other threads queued data */
+    pthread_mutex_t wake_lock;
+    uring_conn_t *  woken;
+    pthread_t       tid;
+} uring_loop_t;
+
+/* -------------------------------------------------------------------------- */
+/*                              Ring plumbing                                 */
+/* -------------------------------------------------------------------------- */
+
+static int sys_setup( unsigned entries, struct io_uring_params * p ) {
+
+    return ( int ) syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int sys_enter( int fd, unsigned submit, unsigned wait, unsigned flags, void * arg, size_t sz ) {
+
+    return ( int ) syscall( __NR_io_uring_enter, fd, submit, wait, flags, arg, sz );
+}
+
+static int sys_register( int fd, unsigned op, void * arg, unsigned n ) {
+
+    return ( int ) syscall( __NR_io_uring_register, fd, op, arg, n );
+}
+
+static void ring_exit( ring_t * r ) {
+
+    if ( r->sqes && r->sqes != MAP_FAILED ){
+        munmap( r->sqes, r->sqes_len );
+    }
+    if ( r->ring_ptr && r->ring_ptr != MAP_FAILED ){
+        munmap( r->ring_ptr, r->ring_len );
+    }
+    if ( r->fd >= 0 ){
+        close( r->fd );                             // cancels whatever is left
+    }
+    if ( r->br && r->br != MAP_FAILED ){
+        munmap( r->br, r->br_len );
+    }
+    free( r->bufs );
+    memset( r, 0, sizeof( *r ) );
+    r->fd = -1;
+}
+
+/*
+ * @brief  Hands receive buffer `bid` (back) to the kernel.
+ *
+ * @details Only addr/len/bid are written - the resv field of entry 0 is
+ * the ring tail.
+ */
+static void buf_put( ring_t * r, uint16_t bid ) {
+
+    struct io_uring_buf * b = &r->br->bufs[ r->br_tail & ( URING_BUF_COUNT - 1 ) ];
+
+    b->addr = ( uint64_t ) ( uintptr_t ) ( r->bufs + ( size_t ) bid * URING_BUF_SIZE );
+    b->len  = URING_BUF_SIZE;
+    b->bid  = bid;
+    r->br_tail++;
+}
+
+static void buf_publish( ring_t * r ) {
+
+    atomic_store_explicit( ( _Atomic uint16_t * ) &r->br->tail, r->br_tail, memory_order_release );
+}
+
+/*
+ * @brief  Creates the rings and registers the provided buffers.
+ *
+ * @return int 0 on success, -1 (errno set) if the kernel lacks a feature.
+ */
+static int ring_init( ring_t * r ) {
+
+    struct io_uring_params p;
+
+    memset( r, 0, sizeof( *r ) );
+    r->fd = -1;
+
+    memset( &p, 0, sizeof( p ) );
+    p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+
+    r->fd = sys_setup( URING_ENTRIES, &p );
+    if ( r->fd < 0 && errno == EINVAL ) {          // older kernel - plain ring
+        memset( &p, 0, sizeof( p ) );
+        p.flags      = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        r->fd = sys_setup( URING_ENTRIES, &p );
+    }
+    if ( r->fd < 0 ){
+        return -1;
+    }
+
+    if ( !( p.features & IORING_FEAT_SINGLE_MMAP ) || !( p.features & IORING_FEAT_EXT_ARG ) ) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    /* SQ and CQ rings share one mapping */
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r->ring_ptr = mmap( NULL, r->ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING );
+    if ( r->ring_ptr == MAP_FAILED ){
+        goto fail;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof( struct io_uring_sqe );
+    r->sqes = mmap( NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES );
+    if ( r->sqes == MAP_FAILED ){
+        goto fail;
+    }
+
+    uint8_t * base = r->ring_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_head    = ( _Atomic unsigned * ) ( base + p.sq_off.head );
+    r->sq_tail    = ( _Atomic unsigned * ) ( base + p.sq_off.tail );
+    r->sq_mask    = *( unsigned * ) ( base + p.sq_off.ring_mask );
+    r->sq_array   = ( unsigned * ) ( base + p.sq_off.array );
+    r->cq_head    = ( _Atomic unsigned * ) ( base + p.cq_off.head );
+    r->cq_tail    = ( _Atomic unsigned * ) ( base + p.cq_off.tail );
+    r->cq_mask    = *( unsigned * ) ( base + p.cq_off.ring_mask );
+    r->cqes       = ( struct io_uring_cqe * ) ( base + p.cq_off.cqes );
+
+    /* slot i always carries sqe i */
+    for ( unsigned i = 0; i < r->sq_entries; ++i ) {
+        r->sq_array[i] = i;
+    }
+    r->sqe_tail = r->submitted = atomic_load_explicit( r->sq_tail, memory_order_relaxed );
+
+    /* provided buffer ring */
+    r->br_len = URING_BUF_COUNT * sizeof( struct io_uring_buf );
+    r->br = mmap( NULL, r->br_len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    r->bufs = malloc( ( size_t ) URING_BUF_COUNT * URING_BUF_SIZE );
+    if ( r->br == MAP_FAILED || !r->bufs ){
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.ring_addr    = ( uint64_t ) ( uintptr_t ) r->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid         = URING_BUF_GROUP;
+    if ( sys_register( r->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ){
+        goto fail;
+    }
+
+    for ( uint16_t i = 0; i < URING_BUF_COUNT; ++i ) {
+        buf_put( r, i );
+    }
+    buf_publish( r );
+
+    return 0;
+
+fail:
+    {
+        int e = errno;
+        ring_exit( r );
+        errno = e;
+    }
+    return -1;
+}
+
+static unsigned sq_space( ring_t * r ) {
+
+    return r->sq_entries - ( r->sqe_tail - atomic_load_explicit( r->sq_head, memory_order_acquire ) );
+}
+
+/*
+ * @brief  Publishes prepared SQEs and optionally waits for a completion.
+ *
+ * @return int 0 on success or timeout/signal, -1 on a real error.
+ */
+static int ring_enter( ring_t * r, int wait_ms ) {
+
+    struct __kernel_timespec ts = { wait_ms / 1000, ( wait_ms % 1000 ) * 1000000L };
+    struct io_uring_getevents_arg arg;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+
+    memset( &arg, 0, sizeof( arg ) );
+    arg.ts = ( uint64_t ) ( uintptr_t ) &ts;
+    if ( wait_ms > 0 ){
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    atomic_store_explicit( r->sq_tail, r->sqe_tail, memory_order_release );
+
+    int n = sys_enter( r->fd, r->sqe_tail - r->submitted, wait_ms > 0 ? 1 : 0,
+                       flags, &arg, sizeof( arg ) );
+    if ( n < 0 ) {
+        return ( errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY ) ? 0 : -1;
+    }
+
+    r->submitted += ( unsigned ) n;
+    return 0;
+}
+
+/*
+ * @brief  Next free SQE, submitting what is queued if the ring is full.
+ */
+static struct io_uring_sqe * sqe_get( ring_t * r ) {
+
+    while ( sq_space( r ) == 0 ) {
+        if ( ring_enter( r, 0 ) < 0 ){
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe * sqe = &r->sqes[ r->sqe_tail & r->sq_mask ];
+    memset( sqe, 0, sizeof( *sqe ) );
+    r->sqe_tail++;
+    return sqe;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                               Connections                                  */
+/* -------------------------------------------------------------------------- */
+
+static void arm_accept( uring_loop_t * loop ) {
+
+    struct io_uring_sqe * sqe = sqe_get( &loop->ring );
+    if ( !sqe ){
+        return;
+    }
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = loop->listen_fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data    = UD_ACCEPT;
+    loop->accept_armed = 1;
+}
+
+static void arm_recv( uring_loop_t * loop, uring_conn_t * conn ) {
+
+    struct io_uring_sqe * sqe = sqe_get( &loop->ring );
+    if ( !sqe ){
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->session->client_fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = ( uintptr_t ) conn | UD_RECV;
+    conn->recv_armed = 1;
+}
+
+static void arm_wake( uring_loop_t * loop ) {
+
+    struct io_uring_sqe * sqe = sqe_get( &loop->ring );
+    if ( !sqe ){
+        return;
+    }
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = loop->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+    sqe->user_data     = UD_WAKE;
+}
+
+static void mark_dirty( uring_loop_t * loop, uring_conn_t * conn ) {
+
+    if ( !conn->dirty ) {
+        conn->dirty      = 1;
+        conn->dirty_next = loop->dirty;
+        loop->dirty      = conn;
+    }
+}
+
+static void conn_link( uring_loop_t * loop, uring_conn_t * conn ) {
+
+    conn->prev = NULL;
+    conn->next = loop->conns;
+    if ( loop->conns ){
+        loop->conns->prev = conn;
+    }
+    loop->conns = conn;
+}
+
+/*
+ * @brief  Takes the connection off the loop and frees it, its session
+ * must not wake it any more.
+ */
+static void conn_release( uring_loop_t * loop, uring_conn_t * conn ) {
+
+    if ( conn->prev ){
+        conn->prev->next = conn->next;
+    } else {
+        loop->conns = conn->next;
+    }
+    if ( conn->next ){
+        conn->next->prev = conn->prev;
+    }
+
+    pthread_mutex_lock( &loop->wake_lock );
+    if ( conn->woken ) {
+        uring_conn_t ** p = &loop->woken;
+        while ( *p != conn ){
+            p = &( *p )->wake_next;
+        }
+        *p = conn->wake_next;
+    }
+    pthread_mutex_unlock( &loop->wake_lock );
+
+    free( conn );
+}
+
+/*
+ * @brief  Frees the connection once the kernel holds no request of it.
+ */
+static void conn_maybe_free( uring_loop_t * loop, uring_conn_t * conn ) {
+
+    if ( !conn->closing || conn->recv_armed || conn->in_flight || conn->dirty ){
+        return;
+    }
+
+    session_destroy( conn->session );               // logged out - no more wakes
+    conn_release( loop, conn );
+}
+
+/*
+ * @brief  Starts closing: shutdown() ends the multishot recv and fails the
+ * sends in flight, their completions let conn_maybe_free() finish.
+ */
+static void conn_close( uring_conn_t * conn ) {
+
+    if ( conn->closing ){
+        return;
+    }
+
+    conn->closing = 1;
+    shutdown( conn->session->client_fd, SHUT_RDWR );
+}
+
+/*
+ * @brief  The connection's outbound queue got data (outq_set_owner()).
+ *
+ * @details On the loop's own thread (replies) the connection is simply
+ * marked; other threads (deliveries) hand it over through the eventfd.
+ */
+static void conn_wake( void * arg ) {
+
+    uring_conn_t * conn = arg;
+    uring_loop_t * loop = conn->loop;
+
+    if ( pthread_equal( pthread_self(), loop->tid ) ) {
+        mark_dirty( loop, conn );
+        return;
+    }
+
+    pthread_mutex_lock( &loop->wake_lock );
+    int first = !conn->woken;
+    if ( first ) {
+        conn->woken     = 1;
+        conn->wake_next = loop->woken;
+        loop->woken     = conn;
+    }
+    pthread_mutex_unlock( &loop->wake_lock );
+
+    if ( first ){
+        eventfd_write( loop->wake_fd, 1 );
+    }
+}
+
+/*
+ * @brief  Runs every complete TLV buffered for the connection.
+ *
+ * @return int 0 to keep the connection, -1 to drop it.
+ */
+static int conn_dispatch( uring_loop_t * loop, uring_conn_t * conn ) {
+
+    client_ctx_t * ctx = conn->session;
+    tlv_view_t tlv;
+    int rc;
+
+    ( void ) loop;
+
+    /* replies land in the outbound queue, conn_wake() marks the connection */
+    while ( ( rc = session_next_tlv( ctx, &tlv ) ) == 1 ) {
+        if ( session_handle_tlv( ctx, &tlv ) < 0 ) {
+            rc = -1;
+            break;
+        }
+    }
+
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * @brief  Submits the head of the outbound queue as a chain of linked sends.
+ *
+ * @details A chain must not be split between two submissions (the link
+ * would end there), so it is only started when the SQ has room for it -
+ * otherwise the connection stays dirty for the next round. Only one chain
+ * per connection is in flight; the queue keeps the frames until their
+ * sends complete (outq_consume()) and the next chain starts from the
+ * completion of the last send.
+ */
+static void conn_flush( uring_loop_t * loop, uring_conn_t * conn ) {
+
+    ring_t * r = &loop->ring;
+    struct iovec iov[ URING_MAX_CHAIN ];
+
+    if ( conn->in_flight || conn->handoff || !conn->session->outq ){
+        return;                                     // a handoff writes the rest itself
+    }
+
+    int n = outq_peek( conn->session->outq, iov, URING_MAX_CHAIN );
+    if ( n == 0 ){
+        return;
+    }
+    if ( sq_space( r ) < ( unsigned ) n ) {
+        /* ring_enter() also returns 0 when the kernel took nothing (EAGAIN, EBUSY) */
+        if ( ring_enter( r, 0 ) < 0 || sq_space( r ) < ( unsigned ) n ) {
+            mark_dirty( loop, conn );               // tried again next round
+            return;
+        }
+    }
+
+    conn->fly_done = 0;
+    for ( int i = 0; i < n; ++i ) {
+
+        struct io_uring_sqe * sqe = &r->sqes[ r->sqe_tail & r->sq_mask ];
+        memset( sqe, 0, sizeof( *sqe ) );
+        r->sqe_tail++;
+
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = conn->session->client_fd;
+        sqe->addr      = ( uint64_t ) ( uintptr_t ) iov[i].iov_base;
+        sqe->len       = ( uint32_t ) iov[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags     = i + 1 < n ? IOSQE_IO_LINK : 0;
+        sqe->user_data = ( uintptr_t ) conn | UD_SEND;
+        conn->fly_len[i] = sqe->len;
+        conn->in_flight++;
+    }
+}
+
+static void flush_dirty( uring_loop_t * loop ) {
+
+    /* taken whole - a connection marked again (SQ full) waits for the next round */
+    uring_conn_t * list = loop->dirty;
+    loop->dirty = NULL;
+
+    while ( list ) {
+
+        uring_conn_t * conn = list;
+        list = conn->dirty_next;
+        conn->dirty = 0;
+
+        if ( conn->closing ){
+            conn_maybe_free( loop, conn );
+        } else {
+            conn_flush( loop, conn );
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                               Completions                                  */
+/* -------------------------------------------------------------------------- */
+
+static void on_accept( uring_loop_t * loop, const struct io_uring_cqe * cqe ) {
+
+    if ( !( cqe->flags & IORING_CQE_F_MORE ) ){
+        loop->accept_armed = 0;
+    }
+
+    if ( cqe->res < 0 ) {
+        if ( cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED ){
+            log_msg( LOG_ERR, "[uring] accept: %s\n", strerror( -cqe->res ) );
+        }
+    } else {
+        int client_fd = cqe->res;
+        client_socket_init( client_fd, NULL );
+
+        /* the session first - it decides if the client is admitted at all */
+        client_ctx_t * session = session_create( client_fd );
+        uring_conn_t * conn = session ? calloc( 1, sizeof( *conn ) ) : NULL;
+
+        if ( !session ) {
+            close( client_fd );
+        } else if ( !conn ) {
+            session_destroy( session );
+        } else {
+            conn->session = session;
+            conn->loop = loop;
+            if ( conn->session->outq ){
+                outq_set_owner( conn->session->outq, conn_wake, conn );
+            }
+            conn_link( loop, conn );
+            arm_recv( loop, conn );
+        }
+    }
+
+    if ( !loop->accept_armed && *loop->running ){
+        arm_accept( loop );
+    }
+}
+
+static void on_recv( uring_loop_t * loop, uring_conn_t * conn, const struct io_uring_cqe * cqe ) {
+
+    if ( !( cqe->flags & IORING_CQE_F_MORE ) ){
+        conn->recv_armed = 0;
+    }
+
+    if ( cqe->res > 0 && ( cqe->flags & IORING_CQE_F_BUFFER ) ) {
+
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if ( !conn->closing ) {
+            const uint8_t * data = loop->ring.bufs + ( size_t ) bid * URING_BUF_SIZE;
+            if ( tlv_parser_feed( &conn->session->reader.parser, data, cqe->res ) < 0 ||
+                 conn_dispatch( loop, conn ) < 0 ){
+                conn_close( conn );
+            }
+        }
+        buf_put( &loop->ring, bid );
+
+    } else if ( cqe->res == -ECANCELED && conn->handoff ) {
+        /* stopped for the next server - the socket stays open */
+    } else if ( cqe->res != -ENOBUFS ) {
+        conn_close( conn );                         // EOF or error
+    }
+    /* -ENOBUFS: all buffers busy, recv is re-armed below */
+
+    if ( !conn->recv_armed && !conn->closing && !conn->handoff ){
+        arm_recv( loop, conn );
+    }
+    conn_maybe_free( loop, conn );
+}
+
+static void on_send( uring_loop_t * loop, uring_conn_t * conn, const struct io_uring_cqe * cqe ) {
+
+    uint32_t len = conn->fly_len[ conn->fly_done++ ];
+
+    conn->in_flight--;
+
+    /* a failed send cancels the rest of its chain (-ECANCELED) */
+    if ( cqe->res < 0 || ( uint32_t ) cqe->res < len ){
+        conn_close( conn );
+    } else if ( !conn->closing ){
+        outq_consume( conn->session->outq, len );
+    }
+
+    if ( conn->in_flight == 0 && !conn->closing ){
+        mark_dirty( loop, conn );               // more may have been queued meanwhile
+    }
+    conn_maybe_free( loop, conn );
+}
+
+/*
+ * @brief  Other threads queued data - picks up the connections they woke.
+ */
+static void on_wake( uring_loop_t * loop, const struct io_uring_cqe * cqe ) {
+
+    eventfd_t value;
+
+    if ( !( cqe->flags & IORING_CQE_F_MORE ) ){
+        arm_wake( loop );
+    }
+    eventfd_read( loop->wake_fd, &value );
+
+    pthread_mutex_lock( &loop->wake_lock );
+    uring_conn_t * conn = loop->woken;
+    loop->woken = NULL;
+    for ( uring_conn_t * c = conn; c; c = c->wake_next ){
+        c->woken = 0;
+    }
+    pthread_mutex_unlock( &loop->wake_lock );
+
+    while ( conn ) {
+        uring_conn_t * next = conn->wake_next;
+        mark_dirty( loop, conn );
+        conn = next;
+    }
+}
+
+/*
+ * @brief  Handles every completion in the CQ.
+ */
+static void reap( uring_loop_t * loop ) {
+
+    ring_t * r = &loop->ring;
+    unsigned head = atomic_load_explicit( r->cq_head, memory_order_relaxed );
+    unsigned tail = atomic_load_explicit( r->cq_tail, memory_order_acquire );
+
+    for ( ; head != tail; ++head ) {
+
+        const struct io_uring_cqe * cqe = &r->cqes[ head & r->cq_mask ];
+        uint64_t ud = cqe->user_data;
+        uring_conn_t * conn = ( uring_conn_t * ) ( uintptr_t ) ( ud & ~( uint64_t ) UD_MASK );
+
+        if ( ud == UD_WAKE ) {
+            on_wake( loop, cqe );
+            continue;
+        }
+
+        switch ( ud & UD_MASK ) {
+        case UD_ACCEPT:
+            on_accept( loop, cqe );
+            break;
+        case UD_RECV:
+            on_recv( loop, conn, cqe );
+            break;
+        case UD_SEND:
+            on_send( loop, conn, cqe );
+            break;
+        default:                                    // UD_CANCEL - nothing to do
+            break;
+        }
+    }
+
+    atomic_store_explicit( r->cq_head, head, memory_order_release );
+    buf_publish( r );
+}
+
+/*
+ * @brief  The kernel still holds requests of a connection being stopped.
+ */
+static int loop_busy( uring_loop_t * loop ) {
+
+    for ( uring_conn_t * c = loop->conns; c; c = c->next ) {
+        if ( !c->handoff || c->closing || c->recv_armed || c->in_flight ){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void * loop_thread( void * arg ) {
+
+    uring_loop_t * loop = arg;
+
+    arm_accept( loop );
+    arm_wake( loop );
+    for ( uring_conn_t * c = loop->conns; c; c = c->next ){
+        arm_recv( loop, c );                        // taken over from the previous server
+    }
+
+    while ( *loop->running ) {
+        flush_dirty( loop );
+        /* a chain left for the next round (SQ full) must not wait for a tick */
+        if ( ring_enter( &loop->ring, loop->dirty ? 0 : URING_TICK_MS ) < 0 ) {
+            log_msg( LOG_ERR, "[uring] io_uring_enter: %s\n", strerror( errno ) );
+            break;
+        }
+        reap( loop );
+    }
+
+    /* let the kernel finish with the accept and every connection before the memory goes */
+    struct io_uring_sqe * sqe = loop->accept_armed ? sqe_get( &loop->ring ) : NULL;
+    if ( sqe ) {
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = UD_ACCEPT;
+        sqe->user_data = UD_CANCEL;
+    }
+    int keep = sessions_frozen();                   // live restart - the sockets stay open
+    for ( uring_conn_t * c = loop->conns; c; c = c->next ) {
+        if ( !keep || c->closing ) {
+            conn_close( c );
+            continue;
+        }
+        c->handoff = 1;
+        if ( c->recv_armed && ( sqe = sqe_get( &loop->ring ) ) ) {
+            sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+            sqe->addr      = ( uintptr_t ) c | UD_RECV;
+            sqe->user_data = UD_CANCEL;
+        }
+    }
+    for ( int t = 0; ( loop_busy( loop ) || loop->accept_armed ) && t < URING_DRAIN_TICKS; ++t ) {
+        flush_dirty( loop );
+        ring_enter( &loop->ring, loop->dirty ? 0 : URING_TICK_MS );
+        reap( loop );
+    }
+    flush_dirty( loop );
+
+    /* quiet ones go on without the loop (sessions_handoff()), the rest is closed */
+    uring_conn_t * next;
+    for ( uring_conn_t * c = loop->conns; c; c = next ) {
+        next = c->next;
+        if ( !c->handoff || c->closing ){
+            continue;
+        }
+        if ( c->recv_armed || c->in_flight ) {
+            conn_close( c );                        // destroyed by uring_run()
+            continue;
+        }
+        if ( c->session->outq ){
+            outq_set_owner( c->session->outq, NULL, NULL );
+        }
+        conn_release( loop, c );
+    }
+
+    return NULL;
+}
+
+/*
+ * @brief  Destroys the sessions the loop still has (it is not running).
+ */
+static void loop_drop_conns( uring_loop_t * loop ) {
+
+    while ( loop->conns ) {
+        uring_conn_t * c = loop->conns;
+        loop->conns = c->next;
+        session_destroy( c->session );
+        free( c );
+    }
+}
+
+/*
+ * @brief  Gives the loop, before it starts, the adopted sessions number
+ * index, index + step, ...
+ */
+static void loop_adopt( uring_loop_t * loop, client_ctx_t ** adopted, int count, int index, int step ) {
+
+    for ( int i = index; i < count; i += step ) {
+
+        uring_conn_t * conn = calloc( 1, sizeof( *conn ) );
+        if ( !conn ) {
+            session_destroy( adopted[i] );
+            continue;
+        }
+        conn->session = adopted[i];
+        conn->loop    = loop;
+        if ( conn->session->outq ){
+            outq_set_owner( conn->session->outq, conn_wake, conn );
+        }
+        conn_link( loop, conn );
+    }
+}
+
+int uring_run( int listen_fd, const server_config_t * cfg, volatile int * running ) {
+
+    int threads = cfg->threads;
+    int count;
+
+    if ( threads <= 0 ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        threads = cpus > 0 ? ( int ) cpus : 1;
+    }
+
+    raise_fd_limit();
+
+    /* clients taken over from the previous server, spread over the loops */
+    client_ctx_t ** adopted = sessions_adopted( &count );
+
+    uring_loop_t * loops = calloc( threads, sizeof( *loops ) );
+    if ( !loops ){
+        for ( int i = 0; i < count; ++i ){
+            session_destroy( adopted[i] );
+        }
+        free( adopted );
+        return -1;
+    }
+
+    int started = 0;
+    for ( ; started < threads; ++started ) {
+
+        uring_loop_t * loop = &loops[ started ];
+        loop->running   = running;
+        loop->listen_fd = listen_fd;
+
+        loop->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if ( loop->wake_fd < 0 ) {
+            log_msg( LOG_ERR, "[uring] eventfd: %s\n", strerror( errno ) );
+            break;
+        }
+        pthread_mutex_init( &loop->wake_lock, NULL );
+
+        if ( ring_init( &loop->ring ) < 0 ) {
+            log_msg( LOG_ERR, "[uring] io_uring not usable (needs Linux 6.0): %s\n",
+                    strerror( errno ) );
+            close( loop->wake_fd );
+            break;
+        }
+
+        if ( cfg->reuse_port && started > 0 ) {
+            loop->listen_fd = start_tcp_shard( listen_fd, cfg->backlog );
+            if ( loop->listen_fd < 0 ) {
+                ring_exit( &loop->ring );
+                close( loop->wake_fd );
+                break;
+            }
+        }
+
+        loop_adopt( loop, adopted, count, started, threads );
+
+        if ( pthread_create( &loop->tid, NULL, loop_thread, loop ) != 0 ) {
+            while ( loop->conns ) {                 // their sessions go below
+                uring_conn_t * c = loop->conns;
+                loop->conns = c->next;
+                free( c );
+            }
+            ring_exit( &loop->ring );
+            close( loop->wake_fd );
+            if ( loop->listen_fd != listen_fd ){
+                close( loop->listen_fd );
+            }
+            break;
+        }
+
+        if ( cfg->pin ){
+            pin_thread( loop->tid, started );
+        }
+    }
+
+    if ( started < threads ) {
+        *running = 0;                               // stop the ones already running
+        for ( int i = 0; i < count; ++i ){
+            if ( i % threads >= started ){          // their loop never came
+                session_destroy( adopted[i] );
+            }
+        }
+    } else {
+        log_msg( LOG_INFO, "[uring] %d loops running (%s listener%s)\n", threads,
+                cfg->reuse_port ? "SO_REUSEPORT" : "shared",
+                cfg->pin ? ", pinned" : "" );
+    }
+
+    for ( int i = 0; i < started; ++i ) {
+        pthread_join( loops[i].tid, NULL );
+        ring_exit( &loops[i].ring );                // kernel lets go of the buffers
+        loop_drop_conns( &loops[i] );               // did not finish in time
+        if ( loops[i].listen_fd != listen_fd ){
+            close( loops[i].listen_fd );
+        }
+        close( loops[i].wake_fd );
+        pthread_mutex_destroy( &loops[i].wake_lock );
+    }
+
+    free( loops );
+    free( adopted );
+    return started < threads ? -1 : 0;
+}
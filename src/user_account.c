@@ -9,20 +9,96 @@
 
 #include "protocol.h"
 #include "user_account.h"
+#include "data_dir.h"
+#include "metrics.h"
+
+/* <root>/users/<login> with the longest root */
+#define USER_PATH_MAX ( DATA_PATH_MAX + DATA_SUBDIR_LEN + MAX_USERNAME_LEN )
 
 /* GLOBAL STATE (serwer) */
-static active_user_t * active_users = NULL;
 
-/* mutex - global in tcp_server.c */
-extern pthread_mutex_t server_mutex;
+/* one bucket of the active user table, lists users whose login hashes here */
+typedef struct {
+    pthread_rwlock_t lock;
+    active_user_t *  head;
+} user_shard_t;
+
+static user_shard_t    shards[ ACTIVE_USER_SHARDS ];
+static pthread_mutex_t account_locks[ ACCOUNT_LOCK_STRIPES ];
+static pthread_once_t  tables_once = PTHREAD_ONCE_INIT;
+
+static void tables_init( void ) {
+
+    for ( int i = 0; i < ACTIVE_USER_SHARDS; ++i ){
+        pthread_rwlock_init( &shards[i].lock, NULL );
+    }
+    for ( int i = 0; i < ACCOUNT_LOCK_STRIPES; ++i ){
+        pthread_mutex_init( &account_locks[i], NULL );
+    }
+}
+
+/* FNV-1a - logins are short, anything spreading them evenly will do */
+static uint32_t login_hash( const char * login ) {
+
+    uint32_t h = 2166136261u;
+
+    while ( *login ){
+        h = ( h ^ ( uint8_t ) *login++ ) * 16777619u;
+    }
+    return h;
+}
+
+static user_shard_t * shard_of( const char * login ) {
+
+    pthread_once( &tables_once, tables_init );
+    return &shards[ login_hash( login ) % ACTIVE_USER_SHARDS ];
+}
+
+/*
+ * @brief  Node of `login` in its (locked) shard; fd < 0 matches any session.
+ */
+static active_user_t * shard_find( user_shard_t * sh, const char * login, int fd ) {
+
+    for ( active_user_t * u = sh->head; u; u = u->next ) {
+        if ( strcmp( u->login, login ) == 0 && ( fd < 0 || u->client_fd == fd ) ){
+            return u;
+        }
+    }
+    return NULL;
+}
+
+void account_lock( const char * login ) {
+
+    pthread_once( &tables_once, tables_init );
+    metrics_lock( METRIC_LOCK_ACCOUNT,
+                  pthread_mutex_lock( &account_locks[ login_hash( login ) % ACCOUNT_LOCK_STRIPES ] ) );
+}
+
+void account_unlock( const char * login ) {
+
+    pthread_mutex_unlock( &account_locks[ login_hash( login ) % ACCOUNT_LOCK_STRIPES ] );
+}
+
+/*
+ * @brief  Account file of `login`.
+ * @return 0, -1 if the path does not fit (never a cut name - it would be
+ *         the file of another login).
+ */
+static int user_path( char * path, size_t size, const char * login ) {
+
+    int n = snprintf( path, size, "%s%s", users_dir(), login );
+    return n < 0 || ( size_t ) n >= size ? -1 : 0;
+}
 
 int user_exists( const char * login ) {
-    char path[ 256 ];
+    char path[ USER_PATH_MAX ];
 
     if ( !login )
         return 0;
 
-    snprintf( path, sizeof( path ), "%s%s", USER_DIR, login );
+    if ( user_path( path, sizeof( path ), login ) < 0 )
+        return 0;
+
     return access( path, F_OK ) == 0;
 }
 
@@ -31,7 +107,7 @@ int user_authenticate(
     const char * password,
     user_t * out_user
 ) {
-    char path[ 256 ];
+    char path[ USER_PATH_MAX ];
     char line[ 128 ];
     FILE * f;
 
@@ -41,7 +117,10 @@ int user_authenticate(
     if ( !login || !password || !out_user )
         return -1;
 
-    snprintf( path, sizeof( path ), "%s%s", USER_DIR, login );
+    if ( user_path( path, sizeof( path ), login ) < 0 )
+        return -1;
+
+    uint64_t t0 = metrics_now();
 
     f = fopen( path, "r" );
     if ( !f )
@@ -57,6 +136,7 @@ int user_authenticate(
     }
 
     fclose( f );
+    metrics_record( METRIC_IO_ACCOUNT, metrics_now() - t0 );
 
     if ( stored_pass[0] == '\0' || stored_username[0] == '\0' )
         return -1;
@@ -79,7 +159,7 @@ int user_create(
     const char * password,
     const char * username
 ) {
-    char path[ 256 ];
+    char path[ USER_PATH_MAX ];
     FILE * f;
 
     /* basic validation */
@@ -100,7 +180,9 @@ int user_create(
     }
 
     /* build file path */
-    snprintf( path, sizeof( path ), "%s%s", USER_DIR, login );
+    if ( user_path( path, sizeof( path ), login ) < 0 ){
+        return -1;
+    }
 
     /* do not overwrite existing user */
     if ( access( path, F_OK ) == 0 ){
@@ -129,7 +211,7 @@ int user_change_password(
     const char * login,
     const char * new_password
 ) {
-    char path[ 256 ];
+    char path[ USER_PATH_MAX ];
     char line[ 256 ];
     char stored_username[ MAX_USERNAME_LEN ] = "";
     FILE * f;
@@ -141,7 +223,8 @@ int user_change_password(
          strlen( new_password ) >= MAX_PASSWORD_LEN )
         return -1;
 
-    snprintf( path, sizeof( path ), "%s%s", USER_DIR, login );
+    if ( user_path( path, sizeof( path ), login ) < 0 )
+        return -1;
 
     /* open existing user file */
     f = fopen( path, "r" );
@@ -174,7 +257,7 @@ int user_change_username(
     const char * login,
     const char * new_username
 ) {
-    char path[ 256 ];
+    char path[ USER_PATH_MAX ];
     char line[ 256 ];
     char stored_password[ MAX_PASSWORD_LEN ] = "";
     FILE * f;
@@ -186,7 +269,8 @@ int user_change_username(
          strlen( new_username ) >= MAX_USERNAME_LEN )
         return -1;
 
-    snprintf( path, sizeof( path ), "%s%s", USER_DIR, login );
+    if ( user_path( path, sizeof( path ), login ) < 0 )
+        return -1;
 
     /* open existing user file */
     f = fopen( path, "r" );
@@ -217,14 +301,17 @@ int user_change_username(
 
 
 
-void add_active_user(
+int add_active_user(
     const char * login,
     const char * username,
-    int client_fd
+    int client_fd,
+    uint32_t features
 ) {
+    user_shard_t * sh = shard_of( login );
+
     active_user_t * u = malloc( sizeof( *u ) );
     if ( !u )
-        return;
+        return -1;
 
     strncpy( u->login, login, MAX_USERNAME_LEN - 1 );
     strncpy( u->username, username, MAX_USERNAME_LEN - 1 );
@@ -232,24 +319,39 @@ void add_active_user(
     u->username[ MAX_USERNAME_LEN - 1 ] = '\0';
 
     u->client_fd = client_fd;
-    u->next = active_users;
-    active_users = u;
+    u->features = features;
+
+    /* check and insert under one lock - two logins cannot both get in */
+    metrics_lock( METRIC_LOCK_USERS, pthread_rwlock_wrlock( &sh->lock ) );
+    if ( shard_find( sh, u->login, -1 ) ) {
+        pthread_rwlock_unlock( &sh->lock );
+        free( u );
+        return 1;
+    }
+    u->next = sh->head;
+    sh->head = u;
+    pthread_rwlock_unlock( &sh->lock );
 
     printf(
         "[users] added login='%s' fd=%d\n",
         u->login,
-        u->client_fd
+        client_fd
     );
+    return 0;
 }
 
-void remove_active_user_by_fd( int client_fd ) {
-    active_user_t ** pp = &active_users;
+void remove_active_user( const char * login, int client_fd ) {
+    user_shard_t * sh = shard_of( login );
+    active_user_t ** pp = &sh->head;
     active_user_t *  cur;
 
+    metrics_lock( METRIC_LOCK_USERS, pthread_rwlock_wrlock( &sh->lock ) );
+
     while ( ( cur = *pp ) != NULL ) {
 
-        if ( cur->client_fd == client_fd ) {
+        if ( cur->client_fd == client_fd && strcmp( cur->login, login ) == 0 ) {
             *pp = cur->next;
+            pthread_rwlock_unlock( &sh->lock );
 
             printf(
                 "[users] removed login='%s' fd=%d\n",
@@ -263,94 +365,133 @@ void remove_active_user_by_fd( int client_fd ) {
 
         pp = &cur->next;
     }
+
+    pthread_rwlock_unlock( &sh->lock );
 }
 
 void dump_active_users( void ) {
-    active_user_t * u = active_users;
 
     printf( "[users] active users:\n" );
 
-    while ( u ) {
-        printf(
-            "  login='%s' username='%s' fd=%d\n",
-            u->login,
-            u->username,
-            u->client_fd
-        );
-        u = u->next;
+    pthread_once( &tables_once, tables_init );
+    for ( int i = 0; i < ACTIVE_USER_SHARDS; ++i ) {
+
+        pthread_rwlock_rdlock( &shards[i].lock );
+        for ( active_user_t * u = shards[i].head; u; u = u->next ) {
+            printf(
+                "  login='%s' username='%s' fd=%d\n",
+                u->login,
+                u->username,
+                u->client_fd
+            );
+        }
+        pthread_rwlock_unlock( &shards[i].lock );
     }
 }
 
-void send_active_users( int client_fd ) {
-    char buf[ MAX_MESSAGE_LEN ];
+size_t format_active_users( char * buf, size_t cap, size_t * cursor ) {
     size_t off = 0;
-    active_user_t * u = active_users;
+    size_t index = 0;   /* position of the user in shard order */
+
+    if ( cap == 0 )
+        return 0;
 
     buf[0] = '\0';
 
-    while ( u ) {
-        int n = snprintf(
-            buf + off,
-            sizeof( buf ) - off,
-            "<%s> %s\n",
-            u->login,
-            u->username
-        );
+    pthread_once( &tables_once, tables_init );
+    for ( int i = 0; i < ACTIVE_USER_SHARDS; ++i ) {
+
+        pthread_rwlock_rdlock( &shards[i].lock );
+
+        for ( active_user_t * u = shards[i].head; u; u = u->next, ++index ) {
+
+            /* skip users sent by earlier calls */
+            if ( index < *cursor )
+                continue;
+
+            int n = snprintf(
+                buf + off,
+                cap - off,
+                "<%s> %s\n",
+                u->login,
+                u->username
+            );
+
+            if ( n < 0 || off + n >= cap ) {
+                buf[ off ] = '\0';
+                pthread_rwlock_unlock( &shards[i].lock );
+                return off;
+            }
 
-        if ( n < 0 || off + n >= sizeof( buf ) )
-            break;
+            off += n;
+            ( *cursor )++;
+        }
 
-        off += n;
-        u = u->next;
+        pthread_rwlock_unlock( &shards[i].lock );
     }
 
-    send_tlv(
-        client_fd,
-        TLV_ACTIVE_USERS,
-        buf,
-        off
-    );
+    return off;
 }
 
 int is_user_logged_in( const char * login ) {
-    active_user_t * u = active_users;
+    user_shard_t * sh = shard_of( login );
+
+    metrics_lock( METRIC_LOCK_USERS, pthread_rwlock_rdlock( &sh->lock ) );
+    int found = shard_find( sh, login, -1 ) != NULL;
+    pthread_rwlock_unlock( &sh->lock );
 
-    while ( u ) {
-        if ( strcmp( u->login, login ) == 0 )
-            return 1;
-        u = u->next;
+    return found;
+}
+
+int active_user_get( const char * login, int client_fd, active_user_t * out ) {
+    user_shard_t * sh = shard_of( login );
+
+    metrics_lock( METRIC_LOCK_USERS, pthread_rwlock_rdlock( &sh->lock ) );
+    active_user_t * u = shard_find( sh, login, client_fd );
+    if ( u ) {
+        *out = *u;
+        out->next = NULL;
     }
+    pthread_rwlock_unlock( &sh->lock );
 
-    return 0;
+    return u ? 0 : -1;
 }
 
-active_user_t * find_active_user_by_login(
-    const char * login
+int active_user_update(
+    const char * login,
+    int client_fd,
+    const char * username,
+    const uint32_t * features
 ) {
-    active_user_t * u = active_users;
+    user_shard_t * sh = shard_of( login );
 
-    while ( u ) {
-        if ( strcmp( u->login, login ) == 0 ){
-            return u;
-        }
-        u = u->next;
+    metrics_lock( METRIC_LOCK_USERS, pthread_rwlock_wrlock( &sh->lock ) );
+    active_user_t * u = shard_find( sh, login, client_fd );
+    if ( u && username ) {
+        strncpy( u->username, username, MAX_USERNAME_LEN - 1 );
+        u->username[ MAX_USERNAME_LEN - 1 ] = '\0';
+    }
+    if ( u && features ){
+        u->features = *features;
     }
+    pthread_rwlock_unlock( &sh->lock );
 
-    return NULL;    //if not found return NULL pointer
+    return u ? 0 : -1;
 }
 
-active_user_t * find_active_user_by_fd(
-    int fd
+int active_user_with(
+    const char * login,
+    void ( * fn )( const active_user_t * user, void * arg ),
+    void * arg
 ) {
-    active_user_t * u = active_users;
+    user_shard_t * sh = shard_of( login );
 
-    while ( u ) {
-        if ( u->client_fd == fd ){
-            return u;
-        }
-        u = u->next;
+    metrics_lock( METRIC_LOCK_USERS, pthread_rwlock_rdlock( &sh->lock ) );
+    active_user_t * u = shard_find( sh, login, -1 );
+    if ( u ){
+        fn( u, arg );
     }
+    pthread_rwlock_unlock( &sh->lock );
 
-    return NULL; 
+    return u ? 0 : -1;
 }
-
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
+
+#include "work_pool.h"
+#include "log.h"
+
+/* -------------------------------------------------------------------------- */
+/*                   Chase-Lev deque (bounded, no resizing)                   */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Owner pushes and pops at `bottom`, thieves take from `top`. Only the
+ * last element is contended (owner pop vs. steal), decided by one CAS on
+ * `top`. Memory orders follow Le, Pop, Cohen, Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP'13).
+ */
+typedef struct {
+    _Atomic int64_t top;
+    char pad[ 64 - sizeof( int64_t ) ];             /* thieves and owner on different lines */
+    _Atomic int64_t bottom;
+    int64_t mask;
+    _Atomic( work_task_t * ) * slots;
+} deque_t;
+
+static int deque_init( deque_t * dq, size_t depth ) {
+
+    size_t cap = 1;
+    while ( cap < depth ){
+        cap <<= 1;
+    }
+
+    dq->slots = calloc( cap, sizeof( *dq->slots ) );
+    if ( !dq->slots ){
+        return -1;
+    }
+
+    atomic_init( &dq->top, 0 );
+    atomic_init( &dq->bottom, 0 );
+    dq->mask = ( int64_t ) cap - 1;
+    return 0;
+}
+
+/* owner only - returns -1 when full */
+static int deque_push( deque_t * dq, work_task_t * task ) {
+
+    int64_t b = atomic_load_explicit( &dq->bottom, memory_order_relaxed );
+    int64_t t = atomic_load_explicit( &dq->top, memory_order_acquire );
+
+    if ( b - t > dq->mask ){
+        return -1;
+    }
+
+    atomic_store_explicit( &dq->slots[ b & dq->mask ], task, memory_order_relaxed );
+    atomic_thread_fence( memory_order_release );
+    atomic_store_explicit( &dq->bottom, b + 1, memory_order_relaxed );
+    return 0;
+}
+
+/* owner only - newest task, NULL when empty */
+static work_task_t * deque_pop( deque_t * dq ) {
+
+    int64_t b = atomic_load_explicit( &dq->bottom, memory_order_relaxed ) - 1;
+    atomic_store_explicit( &dq->bottom, b, memory_order_relaxed );
+    atomic_thread_fence( memory_order_seq_cst );
+    int64_t t = atomic_load_explicit( &dq->top, memory_order_relaxed );
+
+    if ( t > b ) {                                  // empty
+        atomic_store_explicit( &dq->bottom, b + 1, memory_order_relaxed );
+        return NULL;
+    }
+
+    work_task_t * task = atomic_load_explicit( &dq->slots[ b & dq->mask ], memory_order_relaxed );
+
+    if ( t == b ) {                                 // last one - race with thieves
+        if ( !atomic_compare_exchange_strong_explicit( &dq->top, &t, t + 1,
+                 memory_order_seq_cst, memory_order_relaxed ) ){
+            task = NULL;
+        }
+        atomic_store_explicit( &dq->bottom, b + 1, memory_order_relaxed );
+    }
+
+    return task;
+}
+
+/* any thread - oldest task, NULL when empty or lost the race */
+static work_task_t * deque_steal( deque_t * dq ) {
+
+    int64_t t = atomic_load_explicit( &dq->top, memory_order_acquire );
+    atomic_thread_fence( memory_order_seq_cst );
+    int64_t b = atomic_load_explicit( &dq->bottom, memory_order_acquire );
+
+    if ( t >= b ){
+        return NULL;
+    }
+
+    work_task_t * task = atomic_load_explicit( &dq->slots[ t & dq->mask ], memory_order_relaxed );
+
+    if ( !atomic_compare_exchange_strong_explicit( &dq->top, &t, t + 1,
+             memory_order_seq_cst, memory_order_relaxed ) ){
+        return NULL;
+    }
+
+    return task;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                    Pool                                    */
+/* -------------------------------------------------------------------------- */
+
+typedef struct {
+    work_pool_t * pool;
+    int           index;
+    pthread_t     tid;
+    deque_t       deque;
+    unsigned      seed;                             /* victim selection */
+    _Atomic uint64_t executed;
+    _Atomic uint64_t stolen;
+    _Atomic uint64_t injected;
+} worker_t;
+
+struct work_pool {
+    int       nworkers;
+    worker_t * workers;
+    int       stats_interval;
+
+    /* injector - bounded ring under `lock` */
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    work_task_t **  inject;
+    size_t          inject_cap;
+    size_t          inject_head;
+    size_t          inject_count;
+    size_t          inject_high;
+
+    _Atomic size_t   pending;                       /* tasks in all queues */
+    _Atomic int      idle;                          /* workers waiting on `wake` */
+    _Atomic int      stop;
+    _Atomic uint64_t submitted;
+    _Atomic uint64_t rejected;
+};
+
+/* worker the current thread is, NULL outside the pool */
+static _Thread_local worker_t * current_worker;
+
+/*
+ * @brief  Wakes one sleeping worker, if any.
+ *
+ * @details `pending` is raised before `idle` is read and a worker raises
+ * `idle` before it reads `pending` (both seq_cst), so either the submitter
+ * sees the sleeper or the sleeper sees the task.
+ */
+static void wake_one( work_pool_t * pool ) {
+
+    if ( atomic_load( &pool->idle ) > 0 ) {
+        pthread_mutex_lock( &pool->lock );
+        pthread_cond_signal( &pool->wake );
+        pthread_mutex_unlock( &pool->lock );
+    }
+}
+
+int work_pool_submit( work_pool_t * pool, work_task_t * task ) {
+
+    worker_t * self = current_worker;
+
+    /* from inside the pool - own deque, no lock */
+    if ( self && self->pool == pool && deque_push( &self->deque, task ) == 0 ) {
+        atomic_fetch_add( &pool->pending, 1 );
+        atomic_fetch_add_explicit( &pool->submitted, 1, memory_order_relaxed );
+        wake_one( pool );
+        return 0;
+    }
+
+    pthread_mutex_lock( &pool->lock );
+
+    if ( pool->inject_count == pool->inject_cap ) {
+        pthread_mutex_unlock( &pool->lock );
+        atomic_fetch_add_explicit( &pool->rejected, 1, memory_order_relaxed );
+        return -1;
+    }
+
+    pool->inject[ ( pool->inject_head + pool->inject_count ) % pool->inject_cap ] = task;
+    pool->inject_count++;
+    if ( pool->inject_count > pool->inject_high ){
+        pool->inject_high = pool->inject_count;
+    }
+
+    atomic_fetch_add( &pool->pending, 1 );
+    if ( atomic_load( &pool->idle ) > 0 ){
+        pthread_cond_signal( &pool->wake );
+    }
+
+    pthread_mutex_unlock( &pool->lock );
+
+    atomic_fetch_add_explicit( &pool->submitted, 1, memory_order_relaxed );
+    return 0;
+}
+
+/*
+ * @brief  Takes one task from the injector and moves a few more into the
+ * worker's deque, where idle workers can steal them.
+ */
+static work_task_t * take_injected( worker_t * self ) {
+
+    work_pool_t * pool = self->pool;
+    work_task_t * task = NULL;
+
+    pthread_mutex_lock( &pool->lock );
+
+    for ( int i = 0; i < WORK_POOL_INJECT_BATCH && pool->inject_count > 0; ++i ) {
+
+        work_task_t * t = pool->inject[ pool->inject_head ];
+
+        if ( task && deque_push( &self->deque, t ) < 0 ){
+            break;                                  // deque full - leave the rest
+        }
+        if ( !task ){
+            task = t;
+        }
+
+        pool->inject_head = ( pool->inject_head + 1 ) % pool->inject_cap;
+        pool->inject_count--;
+        atomic_fetch_add_explicit( &self->injected, 1, memory_order_relaxed );
+    }
+
+    pthread_mutex_unlock( &pool->lock );
+    return task;
+}
+
+static work_task_t * steal_task( worker_t * self ) {
+
+    work_pool_t * pool = self->pool;
+    int n = pool->nworkers;
+
+    if ( n < 2 ){
+        return NULL;
+    }
+
+    int start = rand_r( &self->seed ) % n;
+
+    for ( int i = 0; i < n; ++i ) {
+        worker_t * victim = &pool->workers[ ( start + i ) % n ];
+        if ( victim == self ){
+            continue;
+        }
+        work_task_t * task = deque_steal( &victim->deque );
+        if ( task ) {
+            atomic_fetch_add_explicit( &self->stolen, 1, memory_order_relaxed );
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static void log_stats( work_pool_t * pool ) {
+
+    work_pool_stats_t st;
+    work_pool_stats( pool, &st );
+
+    log_msg( LOG_INFO,
+        "[pool] workers=%d submitted=%llu executed=%llu stolen=%llu injected=%llu "
+        "rejected=%llu queued=%zu inject=%zu inject_high=%zu\n",
+        st.workers,
+        ( unsigned long long ) st.submitted,
+        ( unsigned long long ) st.executed,
+        ( unsigned long long ) st.stolen,
+        ( unsigned long long ) st.injected,
+        ( unsigned long long ) st.rejected,
+        st.queued,
+        st.inject_depth,
+        st.inject_high
+    );
+}
+
+static void * worker_thread( void * arg ) {
+
+    worker_t * self = arg;
+    work_pool_t * pool = self->pool;
+    time_t last_stats = time( NULL );
+
+    current_worker = self;
+
+    for (;;) {
+
+        if ( self->index == 0 && pool->stats_interval > 0 &&
+             time( NULL ) - last_stats >= pool->stats_interval ) {
+            last_stats = time( NULL );
+            log_stats( pool );
+        }
+
+        work_task_t * task = deque_pop( &self->deque );
+        if ( !task ){
+            task = take_injected( self );
+        }
+        if ( !task ){
+            task = steal_task( self );
+        }
+
+        if ( task ) {
+            atomic_fetch_sub( &pool->pending, 1 );
+            task->fn( task );
+            atomic_fetch_add_explicit( &self->executed, 1, memory_order_relaxed );
+            continue;
+        }
+
+        /* nothing anywhere - sleep until a submit (or the stats tick) */
+        pthread_mutex_lock( &pool->lock );
+        atomic_fetch_add( &pool->idle, 1 );
+
+        if ( atomic_load( &pool->pending ) == 0 && !atomic_load( &pool->stop ) ) {
+            struct timespec until;
+            clock_gettime( CLOCK_REALTIME, &until );
+            until.tv_sec += pool->stats_interval > 0 ? pool->stats_interval : 1;
+            pthread_cond_timedwait( &pool->wake, &pool->lock, &until );
+        }
+
+        atomic_fetch_sub( &pool->idle, 1 );
+        pthread_mutex_unlock( &pool->lock );
+
+        if ( atomic_load( &pool->stop ) && atomic_load( &pool->pending ) == 0 ){
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+work_pool_t * work_pool_create( const work_pool_config_t * cfg ) {
+
+    work_pool_t * pool = calloc( 1, sizeof( *pool ) );
+    if ( !pool ){
+        return NULL;
+    }
+
+    int n = cfg->workers;
+    if ( n <= 0 ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        n = cpus > 0 ? ( int ) cpus : 1;
+    }
+
+    pool->nworkers       = n;
+    pool->stats_interval = cfg->stats_interval;
+    pool->inject_cap     = cfg->inject_depth > 0 ? cfg->inject_depth : WORK_POOL_DEFAULT_INJECT;
+    pool->inject         = calloc( pool->inject_cap, sizeof( *pool->inject ) );
+    pool->workers        = calloc( n, sizeof( *pool->workers ) );
+
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->wake, NULL );
+
+    if ( !pool->inject || !pool->workers ){
+        goto fail;
+    }
+
+    size_t depth = cfg->deque_depth > 0 ? cfg->deque_depth : WORK_POOL_DEFAULT_DEQUE;
+    for ( int i = 0; i < n; ++i ) {
+        pool->workers[i].pool  = pool;
+        pool->workers[i].index = i;
+        pool->workers[i].seed  = ( unsigned ) i * 2654435761u + 1;
+        if ( deque_init( &pool->workers[i].deque, depth ) < 0 ){
+            goto fail;
+        }
+    }
+
+    int started = 0;
+    for ( ; started < n; ++started ) {
+        if ( pthread_create( &pool->workers[ started ].tid, NULL,
+                             worker_thread, &pool->workers[ started ] ) != 0 ){
+            break;
+        }
+    }
+
+    if ( started < n ) {
+        atomic_store( &pool->stop, 1 );
+        pthread_mutex_lock( &pool->lock );
+        pthread_cond_broadcast( &pool->wake );
+        pthread_mutex_unlock( &pool->lock );
+        for ( int i = 0; i < started; ++i ){
+            pthread_join( pool->workers[i].tid, NULL );
+        }
+        goto fail;
+    }
+
+    log_msg( LOG_INFO, "[pool] %d workers, deque=%zu, injector=%zu\n",
+            n, ( size_t ) pool->workers[0].deque.mask + 1, pool->inject_cap );
+    return pool;
+
+fail:
+    if ( pool->workers ) {
+        for ( int i = 0; i < n; ++i ){
+            free( pool->workers[i].deque.slots );
+        }
+    }
+    free( pool->workers );
+    free( pool->inject );
+    pthread_mutex_destroy( &pool->lock );
+    pthread_cond_destroy( &pool->wake );
+    free( pool );
+    return NULL;
+}
+
+void work_pool_stats( work_pool_t * pool, work_pool_stats_t * out ) {
+
+    memset( out, 0, sizeof( *out ) );
+    out->workers   = pool->nworkers;
+    out->submitted = atomic_load_explicit( &pool->submitted, memory_order_relaxed );
+    out->rejected  = atomic_load_explicit( &pool->rejected, memory_order_relaxed );
+    out->queued    = atomic_load( &pool->pending );
+
+    for ( int i = 0; i < pool->nworkers; ++i ) {
+        worker_t * w = &pool->workers[i];
+        out->executed += atomic_load_explicit( &w->executed, memory_order_relaxed );
+        out->stolen   += atomic_load_explicit( &w->stolen, memory_order_relaxed );
+        out->injected += atomic_load_explicit( &w->injected, memory_order_relaxed );
+    }
+
+    pthread_mutex_lock( &pool->lock );
+    out->inject_depth = pool->inject_count;
+    out->inject_high  = pool->inject_high;
+    pthread_mutex_unlock( &pool->lock );
+}
+
+void work_pool_destroy( work_pool_t * pool ) {
+
+    if ( !pool ){
+        return;
+    }
+
+    /* workers leave only once every queue is empty */
+    atomic_store( &pool->stop, 1 );
+    pthread_mutex_lock( &pool->lock );
+    pthread_cond_broadcast( &pool->wake );
+    pthread_mutex_unlock( &pool->lock );
+
+    for ( int i = 0; i < pool->nworkers; ++i ){
+        pthread_join( pool->workers[i].tid, NULL );
+    }
+
+    if ( pool->stats_interval > 0 ){
+        log_stats( pool );
+    }
+
+    for ( int i = 0; i < pool->nworkers; ++i ){
+        free( pool->workers[i].deque.slots );
+    }
+    free( pool->workers );
+    free( pool->inject );
+    pthread_mutex_destroy( &pool->lock );
+    pthread_cond_destroy( &pool->wake );
+    free( pool );
+}
@@ -0,0 +1,581 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>      // printf, fprintf
+#include <stdlib.h>     // malloc, free, rand
+#include <string.h>     // memcpy, memcmp, memset
+#include <arpa/inet.h>  // htons, htonl
+
+#include "protocol.h"
+#include "tlv_lz.h"
+
+/*
+ * Protocol layer tests: tlv_lz round trips and hostile blocks, the push
+ * parser fed the same stream cut at every byte boundary, and the decoders
+ * of untrusted payloads (command frames, TLV_HELLO, TLV_STREAM_*,
+ * TLV_DELIVERY) given truncated, oversized and mis-counted input.
+ *
+ *   test_protocol          (exit status 0 = every check passed)
+ *
+ * Inputs are copied into buffers of their exact size, so a build with
+ * -fsanitize=address also catches a read past the end of a block.
+ */
+
+static int failures;
+
+#define CHECK( cond ) do {                                                  \
+    if ( !( cond ) ) {                                                      \
+        fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); \
+        ++failures;                                                         \
+    }                                                                       \
+} while ( 0 )
+
+/* decompresses a copy of src[0..n) that has no bytes after it */
+static long decompress_exact( const uint8_t * src, size_t n, uint8_t * dst, size_t cap ) {
+
+    uint8_t * copy = malloc( n ? n : 1 );
+    long      r;
+
+    memcpy( copy, src, n );
+    r = tlv_lz_decompress( copy, n, dst, cap );
+    free( copy );
+    return r;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                   tlv_lz                                   */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * @brief  Compresses, decompresses and compares; then checks that a block
+ *         one byte short of room fails and that every truncated block fails
+ *         or gives a strict prefix of the input.
+ */
+static void lz_round_trip( const char * name, const uint8_t * in, size_t n ) {
+
+    size_t    cap  = n + n / 255 + 16;
+    uint8_t * comp = malloc( cap );
+    uint8_t * out  = malloc( n + 1 );
+
+    size_t clen = tlv_lz_compress( in, n, comp, cap );
+    CHECK( clen > 0 || n == 0 );
+
+    long r = decompress_exact( comp, clen, out, n );
+    CHECK( r == ( long ) n );
+    CHECK( r != ( long ) n || memcmp( in, out, n ) == 0 );
+
+    if ( n > 0 ){
+        CHECK( decompress_exact( comp, clen, out, n - 1 ) == -1 );
+    }
+
+    for ( size_t cut = 0; cut < clen; ++cut ) {
+        r = decompress_exact( comp, cut, out, n );
+        CHECK( r < ( long ) n || ( n == 0 && r == 0 ) );
+        CHECK( r < 0 || memcmp( in, out, r ) == 0 );
+    }
+
+    printf( "lz %-10s %6zu -> %6zu bytes\n", name, n, clen );
+    free( comp );
+    free( out );
+}
+
+static void test_lz_round_trip( void ) {
+
+    size_t    n   = 70000;                  /* longer than TLV_LZ_MAX_OFFSET */
+    uint8_t * buf = malloc( n );
+    const char * line = "[12:00:01] <login> alice : hello everyone\n";
+
+    lz_round_trip( "empty", ( const uint8_t * ) "", 0 );
+    lz_round_trip( "short", ( const uint8_t * ) "abc", 3 );
+
+    memset( buf, 'x', n );
+    lz_round_trip( "run", buf, n );
+
+    for ( size_t i = 0; i < n; ++i ){
+        buf[i] = line[ i % strlen( line ) ];
+    }
+    lz_round_trip( "text", buf, 4096 );
+    lz_round_trip( "text-long", buf, n );
+
+    srand( 1 );
+    for ( size_t i = 0; i < n; ++i ){
+        buf[i] = ( uint8_t ) rand();
+    }
+    lz_round_trip( "random", buf, 4096 );
+
+    free( buf );
+}
+
+/* hand made blocks: one literal 'a', then a match with the given offset */
+static void test_lz_bad_offsets( void ) {
+
+    uint8_t out[ 64 ];
+
+    const uint8_t ok[]     = { 0x10, 'a', 0x01, 0x00 };        /* "aaaaa" */
+    const uint8_t zero[]   = { 0x10, 'a', 0x00, 0x00 };
+    const uint8_t behind[] = { 0x10, 'a', 0x02, 0x00 };        /* 1 byte out so far */
+    const uint8_t far[]    = { 0x10, 'a', 0xFF, 0xFF };
+    const uint8_t half[]   = { 0x10, 'a', 0x01 };              /* offset cut in half */
+    const uint8_t length[] = { 0x1F, 'a', 0x01, 0x00, 0xFF };  /* length bytes cut */
+    const uint8_t lits[]   = { 0xF0, 0xFF };                   /* literal count cut */
+    const uint8_t more[]   = { 0x30, 'a', 'b' };               /* 3 literals, 2 sent */
+
+    CHECK( decompress_exact( ok, sizeof( ok ), out, sizeof( out ) ) == 5 );
+    CHECK( memcmp( out, "aaaaa", 5 ) == 0 );
+    CHECK( decompress_exact( ok, sizeof( ok ), out, 4 ) == -1 );
+
+    CHECK( decompress_exact( zero, sizeof( zero ), out, sizeof( out ) ) == -1 );
+    CHECK( decompress_exact( behind, sizeof( behind ), out, sizeof( out ) ) == -1 );
+    CHECK( decompress_exact( far, sizeof( far ), out, sizeof( out ) ) == -1 );
+    CHECK( decompress_exact( half, sizeof( half ), out, sizeof( out ) ) == -1 );
+    CHECK( decompress_exact( length, sizeof( length ), out, sizeof( out ) ) == -1 );
+    CHECK( decompress_exact( lits, sizeof( lits ), out, sizeof( out ) ) == -1 );
+    CHECK( decompress_exact( more, sizeof( more ), out, sizeof( out ) ) == -1 );
+
+    printf( "lz bad offsets and truncated fields\n" );
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                   Parser                                   */
+/* -------------------------------------------------------------------------- */
+
+typedef struct {
+    uint16_t  type;
+    uint32_t  len;
+    int       ext;                          /* sent with TLV_EXT_FLAG */
+} tlv_case_t;
+
+/* appends one TLV with payload bytes (i + len) & 0xFF */
+static size_t put_tlv( uint8_t * p, const tlv_case_t * c ) {
+
+    size_t   off  = 0;
+    uint16_t type = htons( c->type | ( c->ext ? TLV_EXT_FLAG : 0 ) );
+    uint16_t len  = htons( c->ext ? 0 : ( uint16_t ) c->len );
+
+    memcpy( p + off, &type, 2 );
+    memcpy( p + off + 2, &len, 2 );
+    off += TLV_HEADER_LENGTH;
+    if ( c->ext ) {
+        uint32_t ext = htonl( c->len );
+        memcpy( p + off, &ext, 4 );
+        off += 4;
+    }
+    for ( uint32_t i = 0; i < c->len; ++i ){
+        p[ off++ ] = ( uint8_t ) ( i + c->len );
+    }
+    return off;
+}
+
+static int view_matches( const tlv_view_t * v, const tlv_case_t * c ) {
+
+    if ( v->type != c->type || v->len != c->len ){
+        return 0;
+    }
+    for ( uint32_t i = 0; i < c->len; ++i ){
+        if ( v->data[i] != ( uint8_t ) ( i + c->len ) ){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* hands out every complete TLV and checks it against the next case */
+static void drain( tlv_parser_t * p, const tlv_case_t * cases, size_t count, size_t * got ) {
+
+    tlv_view_t v;
+    int        r;
+
+    while ( ( r = tlv_parser_next( p, &v ) ) == 1 ) {
+        CHECK( *got < count );
+        if ( *got < count ){
+            CHECK( view_matches( &v, &cases[ *got ] ) );
+        }
+        ++*got;
+    }
+    CHECK( r == 0 );
+}
+
+/*
+ * @brief  Feeds `stream` in the chunks given by `cuts` (ascending offsets)
+ *         and checks that exactly `cases` come out, in order.
+ */
+static void parse_in_chunks( const uint8_t * stream, size_t n, const size_t * cuts, size_t ncuts,
+                             const tlv_case_t * cases, size_t count ) {
+
+    tlv_parser_t p;
+    size_t       got  = 0;
+    size_t       from = 0;
+
+    CHECK( tlv_parser_init( &p ) == 0 );
+
+    for ( size_t i = 0; i <= ncuts; ++i ) {
+        size_t to = i < ncuts ? cuts[i] : n;
+        CHECK( tlv_parser_feed( &p, stream + from, to - from ) == 0 );
+        drain( &p, cases, count, &got );
+        from = to;
+    }
+
+    CHECK( got == count );
+    CHECK( p.head == p.tail );              /* nothing left over */
+    tlv_parser_free( &p );
+}
+
+static void test_parser_splits( void ) {
+
+    const tlv_case_t cases[] = {
+        { TLV_COMMAND,   4,   0 },
+        { TLV_MESSAGE,   0,   0 },          /* empty payload */
+        { TLV_USERNAME,  300, 1 },          /* extended length, small payload */
+        { TLV_MESSAGE,   1,   0 },
+        { TLV_GROUPNAME, 17,  0 },
+    };
+    size_t  count = sizeof( cases ) / sizeof( cases[0] );
+    uint8_t stream[ 1024 ];
+    size_t  n = 0;
+
+    for ( size_t i = 0; i < count; ++i ){
+        n += put_tlv( stream + n, &cases[i] );
+    }
+
+    /* one cut at every boundary, and two cuts at every pair of boundaries */
+    for ( size_t a = 0; a <= n; ++a ) {
+        parse_in_chunks( stream, n, &a, 1, cases, count );
+        for ( size_t b = a; b <= n; ++b ) {
+            size_t cuts[2] = { a, b };
+            parse_in_chunks( stream, n, cuts, 2, cases, count );
+        }
+    }
+
+    printf( "parser %zu byte stream split at every boundary\n", n );
+}
+
+/* a TLV over 64 KiB fed one byte at a time, between two small ones */
+static void test_parser_bytewise_ext( void ) {
+
+    const tlv_case_t cases[] = {
+        { TLV_COMMAND, 2,      0 },
+        { TLV_MESSAGE, 100000, 1 },
+        { TLV_STATUS,  4,      0 },
+    };
+    size_t    count  = sizeof( cases ) / sizeof( cases[0] );
+    uint8_t * stream = malloc( 100100 );
+    size_t    n      = 0;
+    size_t    got    = 0;
+    tlv_parser_t p;
+
+    for ( size_t i = 0; i < count; ++i ){
+        n += put_tlv( stream + n, &cases[i] );
+    }
+
+    CHECK( tlv_parser_init( &p ) == 0 );
+    for ( size_t i = 0; i < n; ++i ) {
+        CHECK( tlv_parser_feed( &p, stream + i, 1 ) == 0 );
+        drain( &p, cases, count, &got );
+    }
+    CHECK( got == count );
+    tlv_parser_free( &p );
+
+    printf( "parser %zu byte stream fed byte by byte\n", n );
+    free( stream );
+}
+
+/* a declared length over TLV_EXT_MAX_LENGTH is an error, not an allocation */
+static void test_parser_too_long( void ) {
+
+    uint8_t      hdr[ TLV_EXT_HEADER_LENGTH ];
+    uint16_t     type = htons( TLV_MESSAGE | TLV_EXT_FLAG );
+    uint16_t     len  = 0;
+    uint32_t     ext  = htonl( TLV_EXT_MAX_LENGTH + 1 );
+    tlv_parser_t p;
+    tlv_view_t   v;
+
+    memcpy( hdr, &type, 2 );
+    memcpy( hdr + 2, &len, 2 );
+    memcpy( hdr + 4, &ext, 4 );
+
+    CHECK( tlv_parser_init( &p ) == 0 );
+    CHECK( tlv_parser_feed( &p, hdr, sizeof( hdr ) ) == 0 );
+    CHECK( tlv_parser_next( &p, &v ) == -1 );
+    tlv_parser_free( &p );
+
+    printf( "parser rejects a TLV over TLV_EXT_MAX_LENGTH\n" );
+}
+
+/* -------------------------------------------------------------------------- */
+/*                               Command frames                               */
+/* -------------------------------------------------------------------------- */
+
+/* appends a v1 or v2 frame header and the fields as nested TLVs */
+static size_t put_frame( uint8_t * p, uint8_t version, uint16_t command, uint32_t request_id,
+                         const tlv_vec_t * fields, size_t count ) {
+
+    cmd_frame_header_t fh = { version, CMD_FRAME_FLAG_LZ, htons( command ), htonl( request_id ) };
+    size_t off = version == 1 ? CMD_FRAME_V1_HEADER_LENGTH : CMD_FRAME_HEADER_LENGTH;
+
+    memcpy( p, &fh, off );
+    for ( size_t i = 0; i < count; ++i ) {
+        tlv_header_t hdr = { htons( fields[i].type ), htons( ( uint16_t ) fields[i].len ) };
+        memcpy( p + off, &hdr, TLV_HEADER_LENGTH );
+        memcpy( p + off + TLV_HEADER_LENGTH, fields[i].data, fields[i].len );
+        off += TLV_HEADER_LENGTH + fields[i].len;
+    }
+    return off;
+}
+
+/*
+ * @brief  cmd_frame_parse() on a copy of src[0..n) that has no bytes after
+ *         it; on success every field view has to lie inside the copy and
+ *         hold the bytes found at the same offset of `src`.
+ */
+static int frame_parse_exact( const uint8_t * src, size_t n, cmd_frame_t * frame ) {
+
+    uint8_t * copy = malloc( n ? n : 1 );
+
+    memcpy( copy, src, n );
+    int r = cmd_frame_parse( copy, n, frame );
+
+    for ( int i = 0; r == 0 && i < frame->count; ++i ) {
+        const tlv_view_t * f = &frame->fields[i];
+        size_t at = ( size_t ) ( f->data - copy );
+        CHECK( f->data >= copy && at + f->len <= n );
+        CHECK( at + f->len > n || memcmp( f->data, src + at, f->len ) == 0 );
+        frame->fields[i].data = src + at;           // the copy goes away
+    }
+    free( copy );
+    return r;
+}
+
+static void test_frame_headers( void ) {
+
+    const tlv_vec_t fields[] = {
+        { TLV_LOGIN,    "alice",  5 },
+        { TLV_PASSWORD, "secret", 6 },
+        { TLV_MESSAGE,  "",       0 },
+    };
+    uint8_t     buf[ 256 ];
+    cmd_frame_t f;
+    size_t      n;
+
+    /* version 2 - request id and flags come through */
+    n = put_frame( buf, CMD_FRAME_VERSION, CMD_LOGIN, 0xA1B2C3D4u, fields, 3 );
+    CHECK( frame_parse_exact( buf, n, &f ) == 0 );
+    CHECK( f.version == CMD_FRAME_VERSION && f.flags == CMD_FRAME_FLAG_LZ );
+    CHECK( f.command == CMD_LOGIN && f.request_id == 0xA1B2C3D4u );
+    CHECK( f.count == 3 );
+    for ( int i = 0; i < f.count && i < 3; ++i ) {
+        CHECK( f.fields[i].type == fields[i].type && f.fields[i].len == fields[i].len );
+        CHECK( memcmp( f.fields[i].data, fields[i].data, fields[i].len ) == 0 );
+    }
+
+    /* version 1 - no request id, fields start right after the command */
+    n = put_frame( buf, 1, CMD_LOGIN, 0, fields, 2 );
+    CHECK( frame_parse_exact( buf, n, &f ) == 0 );
+    CHECK( f.version == 1 && f.request_id == 0 && f.count == 2 );
+    CHECK( f.count < 2 || memcmp( f.fields[1].data, "secret", 6 ) == 0 );
+
+    /* bare headers are frames without fields */
+    CHECK( frame_parse_exact( buf, CMD_FRAME_V1_HEADER_LENGTH, &f ) == 0 && f.count == 0 );
+    n = put_frame( buf, CMD_FRAME_VERSION, CMD_HELLO, 7, NULL, 0 );
+    CHECK( frame_parse_exact( buf, n, &f ) == 0 && f.count == 0 && f.request_id == 7 );
+
+    /* unknown versions */
+    for ( int v = 0; v < 256; ++v ) {
+        if ( v == 1 || v == CMD_FRAME_VERSION ){
+            continue;
+        }
+        buf[0] = ( uint8_t ) v;
+        CHECK( frame_parse_exact( buf, n, &f ) == -1 );
+    }
+
+    printf( "frame v1 and v2 headers with request ids\n" );
+}
+
+/* a frame cut anywhere is rejected unless the cut falls between two fields */
+static void test_frame_truncated( void ) {
+
+    const tlv_vec_t fields[] = {
+        { TLV_USERNAME,  "bob",        3 },
+        { TLV_GROUPNAME, "developers", 10 },
+        { TLV_MESSAGE,   "hi",         2 },
+    };
+    size_t      ends[] = { 8, 8 + 4 + 3, 8 + 4 + 3 + 4 + 10, 8 + 4 + 3 + 4 + 10 + 4 + 2 };
+    uint8_t     buf[ 256 ];
+    cmd_frame_t f;
+
+    size_t n = put_frame( buf, CMD_FRAME_VERSION, CMD_SEND_TO_USER, 42, fields, 3 );
+    CHECK( n == ends[3] );
+
+    for ( size_t cut = 0; cut <= n; ++cut ) {
+        int at_end = -1;
+        for ( int i = 0; i < 4; ++i ){
+            if ( ends[i] == cut ){
+                at_end = i;
+            }
+        }
+        int r = frame_parse_exact( buf, cut, &f );
+        CHECK( r == ( at_end >= 0 ? 0 : -1 ) );
+        CHECK( r < 0 || f.count == at_end );
+    }
+
+    printf( "frame cut at every length\n" );
+}
+
+static void test_frame_bad_fields( void ) {
+
+    uint8_t     buf[ 512 ];
+    cmd_frame_t f;
+    tlv_vec_t   fields[ CMD_FRAME_MAX_FIELDS + 1 ];
+    size_t      n;
+
+    /* field length one past the frame, and the largest one a header holds */
+    tlv_vec_t msg = { TLV_MESSAGE, "0123456789", 10 };
+    n = put_frame( buf, CMD_FRAME_VERSION, CMD_SEND_TO_USER, 1, &msg, 1 );
+    uint16_t len = htons( 11 );
+    memcpy( buf + CMD_FRAME_HEADER_LENGTH + 2, &len, 2 );
+    CHECK( frame_parse_exact( buf, n, &f ) == -1 );
+    len = htons( 0xFFFF );
+    memcpy( buf + CMD_FRAME_HEADER_LENGTH + 2, &len, 2 );
+    CHECK( frame_parse_exact( buf, n, &f ) == -1 );
+
+    /* field length one short - the rest is a broken field header */
+    len = htons( 9 );
+    memcpy( buf + CMD_FRAME_HEADER_LENGTH + 2, &len, 2 );
+    CHECK( frame_parse_exact( buf, n, &f ) == -1 );
+
+    /* CMD_FRAME_MAX_FIELDS fit, one more does not */
+    for ( int i = 0; i <= CMD_FRAME_MAX_FIELDS; ++i ){
+        fields[i] = ( tlv_vec_t ){ TLV_MESSAGE, "x", 1 };
+    }
+    n = put_frame( buf, CMD_FRAME_VERSION, CMD_SEND_TO_USER, 1, fields, CMD_FRAME_MAX_FIELDS );
+    CHECK( frame_parse_exact( buf, n, &f ) == 0 && f.count == CMD_FRAME_MAX_FIELDS );
+    n = put_frame( buf, CMD_FRAME_VERSION, CMD_SEND_TO_USER, 1, fields, CMD_FRAME_MAX_FIELDS + 1 );
+    CHECK( frame_parse_exact( buf, n, &f ) == -1 );
+
+    /* empty fields still count */
+    for ( int i = 0; i <= CMD_FRAME_MAX_FIELDS; ++i ){
+        fields[i].len = 0;
+    }
+    n = put_frame( buf, 1, CMD_SEND_TO_USER, 0, fields, CMD_FRAME_MAX_FIELDS + 1 );
+    CHECK( frame_parse_exact( buf, n, &f ) == -1 );
+
+    printf( "frame fields past the end, mis-counted and too many\n" );
+}
+
+/* -------------------------------------------------------------------------- */
+/*                        TLV_HELLO, TLV_STREAM_*, TLV_DELIVERY               */
+/* -------------------------------------------------------------------------- */
+
+/* view of a copy of src[0..n) that has no bytes after it (free view->data) */
+static tlv_view_t view_exact( uint16_t type, const void * src, size_t n ) {
+
+    uint8_t * copy = malloc( n ? n : 1 );
+
+    memcpy( copy, src, n );
+    return ( tlv_view_t ){ type, ( uint32_t ) n, copy };
+}
+
+static void test_hello( void ) {
+
+    proto_caps_t caps = { PROTO_VERSION, 123456, PROTO_FEAT_FRAME_V2 | PROTO_FEAT_LZ };
+    proto_caps_t out;
+    uint8_t      buf[ sizeof( hello_t ) + 8 ];
+    hello_t      hello;
+
+    hello_init( &hello, &caps );
+    memcpy( buf, &hello, sizeof( hello ) );
+    memset( buf + sizeof( hello ), 0xEE, 8 );        // fields of a newer peer
+
+    for ( size_t n = 0; n <= sizeof( buf ); ++n ) {
+        tlv_view_t v = view_exact( TLV_HELLO, buf, n );
+        memset( &out, 0, sizeof( out ) );
+        int r = hello_parse( &v, &out );
+        CHECK( r == ( n < sizeof( hello_t ) ? -1 : 0 ) );
+        CHECK( r < 0 || ( out.version == caps.version && out.max_frame == caps.max_frame &&
+                          out.features == caps.features ) );
+        free( ( void * ) v.data );
+    }
+
+    printf( "hello short, exact and longer payloads\n" );
+}
+
+static void test_stream( void ) {
+
+    tlv_stream_header_t sh = { htonl( 0xDEADBEEFu ), htons( TLV_HISTORY ), 0 };
+    tlv_stream_view_t   out;
+    uint8_t             buf[ sizeof( sh ) + 5 ];
+
+    memcpy( buf, &sh, sizeof( sh ) );
+    memcpy( buf + sizeof( sh ), "lines", 5 );
+
+    for ( size_t n = 0; n <= sizeof( buf ); ++n ) {
+        tlv_view_t v = view_exact( TLV_STREAM_CHUNK, buf, n );
+        int r = tlv_stream_parse( &v, &out );
+        CHECK( r == ( n < sizeof( sh ) ? -1 : 0 ) );
+        CHECK( r < 0 || ( out.request_id == 0xDEADBEEFu && out.type == TLV_HISTORY &&
+                          out.len == n - sizeof( sh ) && out.data == v.data + sizeof( sh ) ) );
+        CHECK( r < 0 || memcmp( out.data, "lines", out.len ) == 0 );
+        free( ( void * ) v.data );
+    }
+
+    printf( "stream records up to and past the header\n" );
+}
+
+static void test_delivery( void ) {
+
+    delivery_header_t hdr;
+    delivery_t        out;
+    uint8_t           buf[ sizeof( hdr ) + 4 ];
+    const char *      long_login = "a_login_longer_than_max_username_len_allows";
+
+    /* layout: two padded name fields, then the 64 bit time */
+    CHECK( sizeof( hdr ) == 2 * MAX_USERNAME_LEN + 8 );
+
+    delivery_header_init( &hdr, long_login, "Alice", 0x0102030405060708ull );
+    memcpy( buf, &hdr, sizeof( hdr ) );
+    memcpy( buf + sizeof( hdr ), "ping", 4 );
+    CHECK( buf[ 2 * MAX_USERNAME_LEN ] == 0x01 && buf[ 2 * MAX_USERNAME_LEN + 7 ] == 0x08 );
+
+    for ( size_t n = 0; n <= sizeof( buf ); ++n ) {
+        tlv_view_t v = view_exact( TLV_DELIVERY, buf, n );
+        int r = delivery_parse( &v, &out );
+        CHECK( r == ( n < sizeof( hdr ) ? -1 : 0 ) );
+        CHECK( r < 0 || ( strlen( out.login ) == MAX_USERNAME_LEN - 1 &&
+                          strncmp( out.login, long_login, MAX_USERNAME_LEN - 1 ) == 0 ) );
+        CHECK( r < 0 || ( strcmp( out.username, "Alice" ) == 0 &&
+                          out.timestamp_ms == 0x0102030405060708ull ) );
+        CHECK( r < 0 || ( out.len == n - sizeof( hdr ) &&
+                          out.message == ( const char * ) v.data + sizeof( hdr ) ) );
+        free( ( void * ) v.data );
+    }
+
+    /* names filling their whole field (no terminator on the wire) */
+    memset( buf, 'z', 2 * MAX_USERNAME_LEN );
+    tlv_view_t v = view_exact( TLV_DELIVERY, buf, sizeof( hdr ) );
+    CHECK( delivery_parse( &v, &out ) == 0 );
+    CHECK( strlen( out.login ) == MAX_USERNAME_LEN - 1 && strlen( out.username ) == MAX_USERNAME_LEN - 1 );
+    CHECK( out.len == 0 );
+    free( ( void * ) v.data );
+
+    printf( "delivery layout, short payloads and unterminated names\n" );
+}
+
+int main( void ) {
+
+    test_lz_round_trip();
+    test_lz_bad_offsets();
+    test_parser_splits();
+    test_parser_bytewise_ext();
+    test_parser_too_long();
+    test_frame_headers();
+    test_frame_truncated();
+    test_frame_bad_fields();
+    test_hello();
+    test_stream();
+    test_delivery();
+
+    if ( failures ) {
+        fprintf( stderr, "%d check(s) failed\n", failures );
+        return 1;
+    }
+    printf( "all checks passed\n" );
+    return 0;
+}